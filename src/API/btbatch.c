@@ -0,0 +1,389 @@
+/***********************************************************************************************************************
+ *
+ * 	Batched direct commands for the EV3 BT library. See btbatch.h
+ *
+ * 	The opcode encodings are the same as in the single-command functions in btcomm.c, only the global
+ * 	variable offsets for sensor reads differ since each read gets its own slot in global memory.
+ *
+ * ********************************************************************************************************************/
+#include "btbatch.h"
+
+static int batch_append(struct BT_batch *b, const unsigned char *bytes, int n)
+{
+ // Append opcode bytes to the command string, fails if the batch is full
+ if (b->len+n>1024)
+ {
+  fprintf(stderr,"BT_batch: Command string full\n");
+  return(-1);
+ }
+ memcpy(&b->cmd[b->len],bytes,n);
+ b->len+=n;
+ return(0);
+}
+
+static int batch_add_read(struct BT_batch *b, int type, int size, const unsigned char *op, int n_op, int n_values)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Reserve global memory for a sensor read and append its opcode followed by the global
+ // variable references for each returned value. Values are 4 byte aligned, the EV3 writes
+ // DATA32 results for raw reads. Returns the read handle, or -1 if the batch is full.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char gv[12];
+ int offset, n_gv, vsize;
+
+ if (b->n_reads>=BT_BATCH_MAX_READS)
+ {
+  fprintf(stderr,"BT_batch: Too many sensor reads in one batch\n");
+  return(-1);
+ }
+ offset=(b->global_size+3)&~3;
+ if (offset+size>1019)
+ {
+  fprintf(stderr,"BT_batch: Out of global memory for replies\n");
+  return(-1);
+ }
+
+ vsize=size/n_values;
+ n_gv=0;
+ for (int i=0; i<n_values; i++)
+ {
+  if (offset+i*vsize<32) gv[n_gv++]=GV0(offset+i*vsize);
+  else
+  {
+   gv[n_gv++]=PRIMPAR_LONG|PRIMPAR_VARIABEL|PRIMPAR_GLOBAL|PRIMPAR_2_BYTES;
+   gv[n_gv++]=(offset+i*vsize)&0xFF;
+   gv[n_gv++]=((offset+i*vsize)>>8)&0xFF;
+  }
+ }
+ if (b->len+n_op+n_gv>1024)
+ {
+  fprintf(stderr,"BT_batch: Command string full\n");
+  return(-1);
+ }
+ batch_append(b,op,n_op);
+ batch_append(b,gv,n_gv);
+
+ b->read_type[b->n_reads]=type;
+ b->read_offset[b->n_reads]=offset;
+ b->global_size=offset+size;
+ return(b->n_reads++);
+}
+
+static int le32(const unsigned char *p)
+{
+ return((int)((uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24)));
+}
+
+void BT_batch_begin(struct BT_batch *b)
+{
+ // Start an empty batch. The first 7 bytes are the length, counter, type and header fields.
+ memset(&b->cmd[0],0,7);
+ b->len=7;
+ b->global_size=0;
+ b->n_reads=0;
+ b->status=-1;
+}
+
+int BT_batch_empty(struct BT_batch *b)
+{
+ // Returns 1 if no opcodes have been added to the batch
+ return(b->len==7);
+}
+
+int BT_batch_motor_power(struct BT_batch *b, char port_ids, char power)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Add a set power + start for the specified motor ports (ORed MOTOR_A..MOTOR_D) to the
+ // batch. Same as BT_motor_port_start().
+ //
+ // Inputs: The port identifiers
+ //         Desired power value in [-100,100]
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char op[8]={opOUTPUT_POWER, 0x00, 0x00, 0x81,0x00, opOUTPUT_START, 0x00, 0x00};
+ //                  |set power|     |layer| |port ids| |power|  |start|     |layer| |port ids|
+
+ if (power>100||power<-100)
+ {
+  fprintf(stderr,"BT_batch_motor_power: Power must be in [-100, 100]\n");
+  return(-1);
+ }
+ if (port_ids>15)
+ {
+  fprintf(stderr,"BT_batch_motor_power: Invalid port id value\n");
+  return(-1);
+ }
+ op[2]=port_ids;
+ op[4]=power;
+ op[7]=port_ids;
+ return(batch_append(b,op,8));
+}
+
+int BT_batch_motor_stop(struct BT_batch *b, char port_ids, int brake_mode)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Add a stop for the specified motor ports to the batch. Same as BT_motor_port_stop().
+ //
+ // Inputs: Port ids of the motors that should be stopped
+ //         brake_mode: 0 -> roll to stop, 1 -> active brake
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char op[4]={opOUTPUT_STOP, 0x00, 0x00, 0x00};
+ //                  |stop|         |layer| |port ids| |brake|
+
+ if (port_ids>15)
+ {
+  fprintf(stderr,"BT_batch_motor_stop: Invalid port id value\n");
+  return(-1);
+ }
+ op[2]=port_ids;
+ op[3]=brake_mode;
+ return(batch_append(b,op,4));
+}
+
+int BT_batch_motor_sync(struct BT_batch *b, char port_ids, char speed, int turn)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Add a synchronised run for two motor ports (see BT_steer_params() for speed and turn),
+ // both motors are updated by the same opcode. Same as BT_steer().
+ //
+ // Inputs: The two port identifiers ORed together
+ //         Speed in [-100,100], turn ratio in [-200,200]
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char op[10]={opOUTPUT_TIME_SYNC, 0x00, 0x00, 0x81,0x00, 0x82,0x00,0x00, LC0(0), 0x00};
+ //                   |time sync|         |layer| |ports| |speed|   |turn|          |time|  |brake|
+
+ if (speed>100||speed<-100||turn>200||turn<-200)
+ {
+  fprintf(stderr,"BT_batch_motor_sync: Speed or turn out of range\n");
+  return(-1);
+ }
+ if (port_ids>15)
+ {
+  fprintf(stderr,"BT_batch_motor_sync: Invalid port id value\n");
+  return(-1);
+ }
+ op[2]=port_ids;
+ op[4]=speed;
+ op[6]=turn&0xFF;
+ op[7]=(turn>>8)&0xFF;
+ return(batch_append(b,op,10));
+}
+
+int BT_batch_motor_timed(struct BT_batch *b, char port_ids, char power, int run_ms, int brake_mode)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Add a timed run for the specified motor ports to the batch, the EV3 stops them with the
+ // given brake mode once run_ms is up. Like BT_timed_motor_port_start() without ramps, but
+ // for several ports at once and with the final brake mode.
+ //
+ // Inputs: The port identifiers
+ //         Power in [-100,100], run time in ms
+ //         brake_mode: 0 -> roll to stop, 1 -> active brake
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char op[13]={opOUTPUT_TIME_POWER, 0x00, 0x00, 0x81,0x00, LC0(0), 0x83,0x00,0x00,0x00,0x00, LC0(0), 0x00};
+ //                   |time power|         |layer| |ports| |power|  |ramp up| |run|                  |ramp down| |brake|
+
+ if (power>100||power<-100||run_ms<0)
+ {
+  fprintf(stderr,"BT_batch_motor_timed: Power or run time out of range\n");
+  return(-1);
+ }
+ if (port_ids>15)
+ {
+  fprintf(stderr,"BT_batch_motor_timed: Invalid port id value\n");
+  return(-1);
+ }
+ op[2]=port_ids;
+ op[4]=power;
+ op[7]=LX_byte1(run_ms);
+ op[8]=LX_byte2(run_ms);
+ op[9]=LX_byte3(run_ms);
+ op[10]=LX_byte4(run_ms);
+ op[12]=brake_mode;
+ return(batch_append(b,op,13));
+}
+
+int BT_batch_read_touch(struct BT_batch *b, char sensor_port)
+{
+ // Add a touch sensor read. Returns the handle for BT_batch_result(), or -1 on error
+ unsigned char op[7]={opINPUT_DEVICE, LC0(READY_PCT), 0x00, 0x00, LC0(0x10), 0x00, LC0(0x01)};
+ //                  |cmd|           |sensor cmd|     |layer| |port| |type|    |mode| |data set|
+
+ if (sensor_port>8)
+ {
+  fprintf(stderr,"BT_batch_read_touch: Invalid port id value\n");
+  return(-1);
+ }
+ op[3]=sensor_port;
+ return(batch_add_read(b,BT_BATCH_TOUCH,1,op,7,1));
+}
+
+int BT_batch_read_colour_RGB(struct BT_batch *b, char sensor_port)
+{
+ // Add a colour sensor RGB read. Returns the handle for BT_batch_result(), or -1 on error
+ unsigned char op[7]={opINPUT_DEVICE, LC0(READY_RAW), 0x00, 0x00, LC0(29), LC0(0x04), LC0(3)};
+ //                  |cmd|           |sensor cmd|     |layer| |port| |type|  |mode|     |data set|
+
+ if (sensor_port>8)
+ {
+  fprintf(stderr,"BT_batch_read_colour_RGB: Invalid port id value\n");
+  return(-1);
+ }
+ op[3]=sensor_port;
+ return(batch_add_read(b,BT_BATCH_COLOUR_RGB,12,op,7,3));
+}
+
+int BT_batch_read_ultrasonic(struct BT_batch *b, char sensor_port)
+{
+ // Add an ultrasonic sensor read. Returns the handle for BT_batch_result(), or -1 on error
+ unsigned char op[7]={opINPUT_DEVICE, LC0(READY_RAW), 0x00, 0x00, LC0(30), 0x00, LC0(0x01)};
+ //                  |cmd|           |sensor cmd|     |layer| |port| |type|  |mode| |data set|
+
+ if (sensor_port>8)
+ {
+  fprintf(stderr,"BT_batch_read_ultrasonic: Invalid port id value\n");
+  return(-1);
+ }
+ op[3]=sensor_port;
+ return(batch_add_read(b,BT_BATCH_ULTRASONIC,4,op,7,1));
+}
+
+int BT_batch_read_gyro(struct BT_batch *b, char sensor_port)
+{
+ // Add a gyro sensor (angle) read. Returns the handle for BT_batch_result(), or -1 on error
+ unsigned char op[7]={opINPUT_READEXT, 0x00, 0x00, LC0(0), LC0(-1), LC0(DATA_RAW), LC0(0x01)};
+ //                  |cmd|            |layer| |port| |type| |mode|   |format|       |# vals|
+
+ if (sensor_port>8)
+ {
+  fprintf(stderr,"BT_batch_read_gyro: Invalid port id value\n");
+  return(-1);
+ }
+ op[2]=sensor_port;
+ return(batch_add_read(b,BT_BATCH_GYRO,4,op,7,1));
+}
+
+int BT_batch_read_tacho(struct BT_batch *b, char port_id)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Add a motor tacho count read (degrees turned since the count was last cleared).
+ //
+ // Inputs: port_id - a single motor port, MOTOR_A to MOTOR_D
+ // Returns: the handle for BT_batch_result(), or -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char op[3]={opOUTPUT_GET_COUNT, LC0(0), LC0(0)};
+ //                  |cmd|               |layer| |port no.|
+
+ switch(port_id)
+ {
+  case MOTOR_A: op[2]=LC0(0); break;
+  case MOTOR_B: op[2]=LC0(1); break;
+  case MOTOR_C: op[2]=LC0(2); break;
+  case MOTOR_D: op[2]=LC0(3); break;
+  default:
+   fprintf(stderr,"BT_batch_read_tacho: Invalid port id value\n");
+   return(-1);
+ }
+ return(batch_add_read(b,BT_BATCH_TACHO,4,op,3,1));
+}
+
+void BT_batch_finish(struct BT_batch *b)
+{
+ // Fill in the length, type and header fields. The batch can then be sent as a regular
+ // command string, e.g. with BT_send_async(&b->cmd[0],b->len). BT_batch_send() does this.
+ b->cmd[0]=(b->len-2)&0xFF;
+ b->cmd[1]=((b->len-2)>>8)&0xFF;
+ b->cmd[4]=(b->n_reads>0)?0x00:0x80;
+ b->cmd[5]=b->global_size&0xFF;			// Global memory size, 10 bits, no locals
+ b->cmd[6]=(b->global_size>>8)&0x03;
+}
+
+int BT_batch_send(struct BT_batch *b)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Send the batch as a single direct command. If the batch contains sensor reads we wait for
+ // the reply and keep it for BT_batch_result(), otherwise it is sent as a no-reply command.
+ // An empty batch is not sent.
+ //
+ // Returns: 0 on success
+ //          -1 if the command failed or the EV3 returned an error response
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ if (BT_batch_empty(b))
+ {
+  b->status=0;
+  return(0);
+ }
+
+ BT_batch_finish(b);
+
+#ifdef __BT_debug
+ fprintf(stderr,"BT_batch_send command string:\n");
+ for(int i=0; i<b->len; i++)
+ {
+  fprintf(stderr,"%X, ",b->cmd[i]&0xff);
+ }
+ fprintf(stderr,"\n");
+#endif
+
+ b->status=-1;
+ if (b->n_reads==0)
+ {
+  if (BT_send_command(&b->cmd[0],b->len,NULL,0)<0) return(-1);
+ }
+ else
+ {
+  if (BT_send_command(&b->cmd[0],b->len,&b->reply[0],1023)<0) return(-1);
+  if (b->reply[4]!=0x02)
+  {
+   fprintf(stderr,"BT_batch_send(): Command failed\n");
+   return(-1);
+  }
+ }
+ b->status=0;
+ return(0);
+}
+
+int BT_batch_result(struct BT_batch *b, int handle, int value[3])
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Decode the result of a sensor read from a batch that was sent successfully.
+ //
+ // Inputs: handle returned when the read was added, value - where the result goes:
+ //          touch: value[0] is 1 if pushed, 0 otherwise
+ //          colour RGB: value[0..2] are R,G,B in [0,255]
+ //          ultrasonic: value[0] is the distance reading
+ //          gyro: value[0] is the angle
+ //          tacho: value[0] is the motor count in degrees
+ // Returns: 0 on success
+ //          -1 if the batch failed or the handle is invalid
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char *data;
+
+ if (b->status<0||handle<0||handle>=b->n_reads) return(-1);
+ data=&b->reply[5+b->read_offset[handle]];
+
+ value[0]=value[1]=value[2]=0;
+ switch(b->read_type[handle])
+ {
+  case BT_BATCH_TOUCH:
+   value[0]=(data[0]!=0);
+   break;
+  case BT_BATCH_COLOUR_RGB:
+   for (int i=0; i<3; i++)
+    value[i]=(int)((float)(le32(data+4*i)&0xFFFF)/1020*255);
+   break;
+  case BT_BATCH_ULTRASONIC:
+  case BT_BATCH_GYRO:
+  case BT_BATCH_TACHO:
+   value[0]=le32(data);
+   break;
+ }
+ return(0);
+}
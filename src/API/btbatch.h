@@ -0,0 +1,58 @@
+/***********************************************************************************************************************
+ *
+ * 	Batched direct commands for the EV3 BT library - A single direct command can carry several opcodes. The
+ * 	functions here accumulate motor power/stop/sync opcodes and sensor reads into one command string, send it as
+ * 	one packet (one round-trip if any sensor is read, none otherwise), and decode the values the EV3 writes
+ * 	into global memory for each read.
+ *
+ * 	Usage:
+ * 	  struct BT_batch b;
+ * 	  BT_batch_begin(&b);
+ * 	  BT_batch_motor_power(&b, MOTOR_A, 30);
+ * 	  BT_batch_motor_stop(&b, MOTOR_D, 1);
+ * 	  h=BT_batch_read_touch(&b, PORT_1);
+ * 	  if (BT_batch_send(&b)==0) BT_batch_result(&b, h, value);
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btbatch_header
+#define __btbatch_header
+
+#include "btcomm.h"
+
+#define BT_BATCH_MAX_READS 8		// Max. number of sensor reads in one batch
+
+// Sensor read types (what BT_batch_result() decodes)
+#define BT_BATCH_TOUCH 0
+#define BT_BATCH_COLOUR_RGB 1
+#define BT_BATCH_ULTRASONIC 2
+#define BT_BATCH_GYRO 3
+#define BT_BATCH_TACHO 4
+
+struct BT_batch{
+ unsigned char cmd[1024];		// Command string being built (length, counter, header filled in on send)
+ int len;				// Bytes used in cmd
+ int global_size;			// Bytes of EV3 global memory reserved for read results
+ int n_reads;
+ int read_type[BT_BATCH_MAX_READS];
+ int read_offset[BT_BATCH_MAX_READS];	// Offset of each read's result in global memory
+ unsigned char reply[1024];
+ int status;				// 0 once sent successfully, -1 otherwise
+};
+
+void BT_batch_begin(struct BT_batch *b);
+int BT_batch_empty(struct BT_batch *b);
+int BT_batch_motor_power(struct BT_batch *b, char port_ids, char power);
+int BT_batch_motor_stop(struct BT_batch *b, char port_ids, int brake_mode);
+int BT_batch_motor_sync(struct BT_batch *b, char port_ids, char speed, int turn);
+int BT_batch_motor_timed(struct BT_batch *b, char port_ids, char power, int run_ms, int brake_mode);
+int BT_batch_read_touch(struct BT_batch *b, char sensor_port);
+int BT_batch_read_colour_RGB(struct BT_batch *b, char sensor_port);
+int BT_batch_read_ultrasonic(struct BT_batch *b, char sensor_port);
+int BT_batch_read_gyro(struct BT_batch *b, char sensor_port);
+int BT_batch_read_tacho(struct BT_batch *b, char port_id);
+void BT_batch_finish(struct BT_batch *b);
+int BT_batch_send(struct BT_batch *b);
+int BT_batch_result(struct BT_batch *b, int handle, int value[3]);
+
+#endif
@@ -11,40 +11,856 @@
 #include "btcomm.h"
 int message_id_counter=1;
 int *socket_id;
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Asynchronous command pipeline
+//
+// Commands are not written to the socket by the caller. They are copied into a BT_future and appended
+// to an outbound queue that a writer thread drains in order. Commands that expect a reply are registered
+// in a pending table indexed by their message counter *before* they are written, and a reader thread
+// parses the framed replies coming back from the EV3 (2 byte length prefix, then counter, status, data)
+// and completes whichever future owns that counter. This allows several queries to be in flight at once
+// and makes the reply matching independent of the order in which different threads issue commands.
+//
+// Everything below is protected by BT_async_mutex, futures are completed under the lock and waiters
+// sleep on a single condition variable.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+struct BT_future{
+ unsigned char cmd[1024];		// Command string (counter already stamped)
+ int cmd_len;
+ unsigned char reply[1024];		// Full reply frame, including the length field
+ int reply_len;				// Bytes in reply, or -1 if the command failed
+ int counter;				// Message counter, or -1 if no reply is expected
+ int done;
+ int detached;				// Library frees the future once complete (callbacks, released futures)
+ int flags;				// BT_SEND_* flags the command was queued with
+ long long sent;			// Time (ms) at which the command was queued
+ long long t_queued;			// Time (us) queued, only set while stats are enabled
+ long long t_written;			// Time (us) taken by the writer, for stats or commands expecting a reply
+ BT_reply_callback callback;
+ void *cb_arg;
+ struct BT_future *next;
+};
+
+static pthread_mutex_t BT_async_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t BT_async_cond=PTHREAD_COND_INITIALIZER;
+static struct BT_future *BT_pending[BT_MAX_PENDING];
+static struct BT_future *BT_out_head=NULL, *BT_out_tail=NULL;
+static int BT_async_running=0;
+static unsigned int BT_urgent_count=0;
+static long long BT_rtt_avg=0;				// Smoothed write->reply time (us), see BT_round_trip_us()
+static pthread_t BT_writer_thread, BT_reader_thread;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+//
+// Commands are accounted under the first opcode in the command string (for batches that is whatever
+// was added first). Everything is recorded with relaxed atomics into lock-free histograms, so dumping
+// never stalls the pipeline. BT_stats_enabled is the only thing the pipeline looks at while stats
+// are off.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+struct BT_op_stats{
+ struct perf_hist rtt;			// Written -> reply matched (us), link plus brick time
+ struct perf_hist call;			// Queued -> completed (us), what a blocking BT_* caller waits
+ long long commands;			// Written to the socket
+ long long replies;
+ long long bytes_out;
+ long long bytes_in;
+ long long failures;			// Write failed, dropped by an urgent command, or connection lost
+ long long errors;			// Reply status was not 0x02 (the 'Command failed' paths)
+ long long timeouts;			// Caller gave up waiting for the reply
+};
+
+int BT_stats_enabled=0;
+static struct BT_op_stats *BT_stats=NULL;		// [256], indexed by opcode
+static long long BT_stats_start=0;
+
+static long long BT_now_ms(void)
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000LL+ts.tv_nsec/1000000);
+}
+
+static void BT_timed_wait(long long deadline_ms)
+{
+ // Wait on the async condition until signaled or until the (monotonic, ms) deadline, lock must be held
+ struct timespec ts;
+ long long wait_ms;
+
+ wait_ms=deadline_ms-BT_now_ms();
+ if (wait_ms<=0) return;
+ clock_gettime(CLOCK_REALTIME,&ts);
+ ts.tv_sec+=wait_ms/1000;
+ ts.tv_nsec+=(wait_ms%1000)*1000000;
+ if (ts.tv_nsec>=1000000000){ts.tv_sec++; ts.tv_nsec-=1000000000;}
+ pthread_cond_timedwait(&BT_async_cond,&BT_async_mutex,&ts);
+}
+
+static int BT_opcode(const unsigned char *cmd, int len)
+{
+ // First opcode in a command string, used as the statistics key
+ return(len>7?cmd[7]:0);
+}
+
+static const char *BT_opcode_name(int op);
+
+static const char *BT_trace_name(struct BT_future *f)
+{
+ // Event name for a command in the trace (a string literal, as perf_trace_* requires)
+ const char *name=BT_opcode_name(BT_opcode(&f->cmd[0],f->cmd_len));
+ return(name!=NULL?name:"BT command");
+}
+
+static void BT_stats_add(long long *counter, long long n)
+{
+ __atomic_fetch_add(counter,n,__ATOMIC_RELAXED);
+}
+
+static void BT_stats_complete(struct BT_future *f, int reply_len)
+{
+ // Account for a completed command, see BT_complete()
+ struct BT_op_stats *s=&BT_stats[BT_opcode(&f->cmd[0],f->cmd_len)];
+ long long now=perf_time_us();
+
+ perf_hist_record(&s->call,now-f->t_queued);
+ if (reply_len<0)
+ {
+  BT_stats_add(&s->failures,1);
+  return;
+ }
+ if (f->counter<0) return;
+ BT_stats_add(&s->replies,1);
+ BT_stats_add(&s->bytes_in,reply_len);
+ if (f->t_written!=0) perf_hist_record(&s->rtt,now-f->t_written);
+ if (reply_len<5||f->reply[4]!=0x02) BT_stats_add(&s->errors,1);
+}
+
+static struct BT_future *BT_complete(struct BT_future *f, int reply_len)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Mark a future as complete (lock must be held). Returns the future if the caller must run
+ // its callback and/or free it *after* releasing the lock, NULL if a waiter owns it.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (__builtin_expect(BT_stats_enabled,0)&&f->t_queued!=0) BT_stats_complete(f,reply_len);
+ if (reply_len>0&&f->counter>=0&&f->t_written!=0)
+ {
+  // Exponential average over the last ~8 replies
+  long long rtt=perf_time_us()-f->t_written, avg=BT_rtt_avg;
+  avg=(avg==0)?rtt:avg+(rtt-avg)/8;
+  __atomic_store_n(&BT_rtt_avg,avg,__ATOMIC_RELAXED);
+ }
+ if (__builtin_expect(perf_trace_enabled,0)&&f->counter>=0)
+  perf_trace_async_end(BT_trace_name(f),"bt reply",f->counter,perf_time_us());
+ f->reply_len=reply_len;
+ f->done=1;
+ pthread_cond_broadcast(&BT_async_cond);
+ if (f->detached) return(f);
+ return(NULL);
+}
+
+static void BT_finish(struct BT_future *f)
+{
+ // Run the callback for a detached future (without the lock held) and free it
+ if (f==NULL) return;
+ if (f->callback!=NULL)
+ {
+  if (f->reply_len>0) f->callback(&f->reply[0],f->reply_len,f->cb_arg);
+  else f->callback(NULL,-1,f->cb_arg);
+ }
+ free(f);
+}
+
+static int BT_read_full(int fd, unsigned char *buf, int len)
+{
+ // Read exactly len bytes from the socket. Returns 0 on success, -1 if the connection went away
+ int n, got=0;
+ while (got<len)
+ {
+  n=read(fd,buf+got,len-got);
+  if (n<0&&errno==EINTR) continue;
+  if (n<=0) return(-1);
+  got+=n;
+ }
+ return(0);
+}
+
+static void *BT_writer_loop(void *arg)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Writer thread. Drains the outbound queue in order. No-reply commands complete as soon as
+ // they are on the wire, commands expecting a reply wait in the pending table for the reader.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_future *f, *fin;
+ long long t_write=0;
+ int ok;
+
+ perf_trace_thread_name("BT writer");
+ pthread_mutex_lock(&BT_async_mutex);
+ while (1)
+ {
+  while (BT_async_running&&BT_out_head==NULL)
+   pthread_cond_wait(&BT_async_cond,&BT_async_mutex);
+  if (BT_out_head==NULL) break;		// Stopped, and everything queued has been sent
+
+  f=BT_out_head;
+  BT_out_head=f->next;
+  if (BT_out_head==NULL) BT_out_tail=NULL;
+  f->next=NULL;
+  // Set before the write (and under the lock) so the reader can never see the reply first
+  if (f->counter>=0||(__builtin_expect(BT_stats_enabled,0)&&f->t_queued!=0)) f->t_written=perf_time_us();
+  if (__builtin_expect(BT_stats_enabled,0)&&f->t_queued!=0)
+  {
+   BT_stats_add(&BT_stats[BT_opcode(&f->cmd[0],f->cmd_len)].commands,1);
+   BT_stats_add(&BT_stats[BT_opcode(&f->cmd[0],f->cmd_len)].bytes_out,f->cmd_len);
+  }
+  if (__builtin_expect(perf_trace_enabled,0))
+  {
+   // Round trips overlap (several commands in flight), so they are async spans keyed on the counter
+   t_write=perf_time_us();
+   if (f->counter>=0) perf_trace_async_begin(BT_trace_name(f),"bt reply",f->counter,t_write);
+  }
+  pthread_mutex_unlock(&BT_async_mutex);
+
+  ok=(write(*socket_id,&f->cmd[0],f->cmd_len)==f->cmd_len);
+  if (__builtin_expect(perf_trace_enabled,0)&&t_write!=0)
+   perf_trace_complete(BT_trace_name(f),"bt write",t_write,perf_time_us()-t_write,f->cmd_len);
+  t_write=0;
+
+  pthread_mutex_lock(&BT_async_mutex);
+  fin=NULL;
+  if (!ok)
+  {
+   fprintf(stderr,"BT_writer_loop(): Write to EV3 failed\n");
+   if (f->counter>=0&&BT_pending[f->counter%BT_MAX_PENDING]==f) BT_pending[f->counter%BT_MAX_PENDING]=NULL;
+   fin=BT_complete(f,-1);
+  }
+  else if (f->counter<0) fin=BT_complete(f,0);
+  if (fin!=NULL)
+  {
+   pthread_mutex_unlock(&BT_async_mutex);
+   BT_finish(fin);
+   pthread_mutex_lock(&BT_async_mutex);
+  }
+ }
+ pthread_mutex_unlock(&BT_async_mutex);
+ return(NULL);
+}
+
+static void *BT_reader_loop(void *arg)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Reader thread. Parses reply frames from the EV3 and hands each one to the future that
+ // owns its message counter. Replies nobody is waiting for (e.g. for a future that timed out
+ // and was released) are dropped.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char frame[1024], drain[256];
+ struct BT_future *f, *fin;
+ int len, counter, extra;
+
+ perf_trace_thread_name("BT reader");
+ while (1)
+ {
+  if (BT_read_full(*socket_id,&frame[0],2)<0) break;
+  len=frame[0]|(frame[1]<<8);
+  extra=0;
+  if (len>1022)
+  {
+   extra=len-1022;
+   len=1022;
+  }
+  if (BT_read_full(*socket_id,&frame[2],len)<0) break;
+  while (extra>0)
+  {
+   if (BT_read_full(*socket_id,&drain[0],MIN(extra,256))<0) break;
+   extra-=MIN(extra,256);
+  }
+  if (len<3) continue;		// Not even a counter and status, garbage
+  counter=frame[2]|(frame[3]<<8);
+
+  pthread_mutex_lock(&BT_async_mutex);
+  fin=NULL;
+  f=BT_pending[counter%BT_MAX_PENDING];
+  if (f!=NULL&&f->counter==counter)
+  {
+   BT_pending[counter%BT_MAX_PENDING]=NULL;
+   memcpy(&f->reply[0],&frame[0],len+2);
+   fin=BT_complete(f,len+2);
+  }
+#ifdef __BT_debug
+  else fprintf(stderr,"BT_reader_loop(): Dropped reply for message %d\n",counter);
+#endif
+  pthread_mutex_unlock(&BT_async_mutex);
+  BT_finish(fin);
+ }
+
+ // Connection is gone, fail everything still waiting for a reply
+ pthread_mutex_lock(&BT_async_mutex);
+ for (int i=0; i<BT_MAX_PENDING; i++)
+  if (BT_pending[i]!=NULL)
+  {
+   f=BT_pending[i];
+   BT_pending[i]=NULL;
+   fin=BT_complete(f,-1);
+   if (fin!=NULL)
+   {
+    pthread_mutex_unlock(&BT_async_mutex);
+    BT_finish(fin);
+    pthread_mutex_lock(&BT_async_mutex);
+   }
+  }
+ pthread_mutex_unlock(&BT_async_mutex);
+ return(NULL);
+}
+
+static int BT_async_start(void)
+{
+ // Start the writer and reader threads, called by BT_open() once the socket is connected.
+ // On failure no thread is left running
+ BT_async_running=1;
+ if (pthread_create(&BT_writer_thread,NULL,BT_writer_loop,NULL)!=0)
+ {
+  BT_async_running=0;
+  return(-1);
+ }
+ if (pthread_create(&BT_reader_thread,NULL,BT_reader_loop,NULL)!=0)
+ {
+  pthread_mutex_lock(&BT_async_mutex);
+  BT_async_running=0;
+  pthread_cond_broadcast(&BT_async_cond);
+  pthread_mutex_unlock(&BT_async_mutex);
+  pthread_join(BT_writer_thread,NULL);
+  return(-1);
+ }
+ return(0);
+}
+
+static void BT_async_stop(void)
+{
+ // Stop the writer once it has drained the queue, and unblock the reader by shutting down the socket
+ struct BT_future *f, *fin;
+
+ pthread_mutex_lock(&BT_async_mutex);
+ if (!BT_async_running)
+ {
+  pthread_mutex_unlock(&BT_async_mutex);
+  return;
+ }
+ BT_async_running=0;
+ pthread_cond_broadcast(&BT_async_cond);
+ pthread_mutex_unlock(&BT_async_mutex);
+ pthread_join(BT_writer_thread,NULL);
+ shutdown(*socket_id,SHUT_RDWR);
+ pthread_join(BT_reader_thread,NULL);
+
+ // Anything that never made it out fails
+ pthread_mutex_lock(&BT_async_mutex);
+ while (BT_out_head!=NULL)
+ {
+  f=BT_out_head;
+  BT_out_head=f->next;
+  fin=BT_complete(f,-1);
+  pthread_mutex_unlock(&BT_async_mutex);
+  BT_finish(fin);
+  pthread_mutex_lock(&BT_async_mutex);
+ }
+ BT_out_tail=NULL;
+ pthread_mutex_unlock(&BT_async_mutex);
+}
+
+static struct BT_future *BT_enqueue(void *cmd, int len, BT_reply_callback callback, void *cb_arg, int detached, int flags, unsigned int epoch)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Copy a command into a new future, stamp its message counter, register it for a reply
+ // if the command type asks for one, and append it to the outbound queue.
+ //
+ // Urgent commands go to the front of the queue and drop any cancellable commands still
+ // waiting to be written (see BT_send_async_flags()).
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_future *f, *old, *fin, *q, *prev, *dropped;
+ int slot;
+
+ if (len<5||len>1024)
+ {
+  fprintf(stderr,"BT_enqueue(): Invalid command length %d\n",len);
+  return(NULL);
+ }
+ f=(struct BT_future *)calloc(1,sizeof(struct BT_future));
+ if (f==NULL) return(NULL);
+ memcpy(&f->cmd[0],cmd,len);
+ f->cmd_len=len;
+ f->callback=callback;
+ f->cb_arg=cb_arg;
+ f->detached=detached;
+ f->flags=flags;
+ f->counter=-1;
+
+ pthread_mutex_lock(&BT_async_mutex);
+ if (!BT_async_running||((flags&BT_SEND_CANCELLABLE)&&epoch!=BT_urgent_count))
+ {
+  // Not connected, or a cancellable command that an urgent command has already overtaken
+  pthread_mutex_unlock(&BT_async_mutex);
+  free(f);
+  return(NULL);
+ }
+
+ if (!(f->cmd[4]&0x80))
+ {
+  // Needs a reply, wait for its pending slot to free up. A slot held by a released future
+  // whose reply never arrived is reclaimed once it is older than the reply timeout.
+  slot=message_id_counter%BT_MAX_PENDING;
+  while ((old=BT_pending[slot])!=NULL)
+  {
+   if (old->detached&&BT_now_ms()-old->sent>BT_REPLY_TIMEOUT_MS)
+   {
+    BT_pending[slot]=NULL;
+    fin=BT_complete(old,-1);
+    pthread_mutex_unlock(&BT_async_mutex);
+    BT_finish(fin);
+    pthread_mutex_lock(&BT_async_mutex);
+   }
+   else BT_timed_wait(BT_now_ms()+10);
+   slot=message_id_counter%BT_MAX_PENDING;
+  }
+  f->counter=message_id_counter&0xFFFF;
+  BT_pending[slot]=f;
+ }
+ f->cmd[2]=message_id_counter&0xFF;
+ f->cmd[3]=(message_id_counter>>8)&0xFF;
+ message_id_counter=(message_id_counter+1)&0xFFFF;
+ f->sent=BT_now_ms();
+ if (__builtin_expect(BT_stats_enabled,0)) f->t_queued=perf_time_us();
+
+ dropped=NULL;
+ if (flags&BT_SEND_URGENT)
+ {
+  // Pull out everything that is cancellable, then jump the queue
+  prev=NULL;
+  q=BT_out_head;
+  while (q!=NULL)
+  {
+   old=q;
+   q=q->next;
+   if (!(old->flags&BT_SEND_CANCELLABLE))
+   {
+    prev=old;
+    continue;
+   }
+   if (prev==NULL) BT_out_head=q;
+   else prev->next=q;
+   if (old->counter>=0&&BT_pending[old->counter%BT_MAX_PENDING]==old) BT_pending[old->counter%BT_MAX_PENDING]=NULL;
+   old->next=dropped;
+   dropped=old;
+  }
+  BT_out_tail=prev;
+  f->next=BT_out_head;
+  BT_out_head=f;
+  if (BT_out_tail==NULL) BT_out_tail=f;
+  BT_urgent_count++;
+ }
+ else
+ {
+  if (BT_out_tail==NULL) BT_out_head=f;
+  else BT_out_tail->next=f;
+  BT_out_tail=f;
+ }
+ pthread_cond_broadcast(&BT_async_cond);
+
+ // Complete the dropped commands as failed
+ while (dropped!=NULL)
+ {
+  old=dropped;
+  dropped=dropped->next;
+  old->next=NULL;
+  fin=BT_complete(old,-1);
+  if (fin!=NULL)
+  {
+   pthread_mutex_unlock(&BT_async_mutex);
+   BT_finish(fin);
+   pthread_mutex_lock(&BT_async_mutex);
+  }
+ }
+ pthread_mutex_unlock(&BT_async_mutex);
+ return(f);
+}
+
+struct BT_future *BT_send_async(void *cmd, int len)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Queue a pre-formatted direct command and return immediately. The message counter is
+ // stamped by the library. Use BT_future_ready()/BT_future_wait() to get the reply, and
+ // BT_future_release() once done with the future (even if it failed or timed out).
+ //
+ // Inputs: cmd - command string, len - total length in bytes (including the length field)
+ // Returns: A future for the reply, NULL if the command could not be queued
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ return(BT_enqueue(cmd,len,NULL,NULL,0,0,0));
+}
+
+struct BT_future *BT_send_async_flags(void *cmd, int len, int flags, unsigned int epoch)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Same as BT_send_async() but with queueing flags:
+ //   BT_SEND_URGENT - the command is placed at the front of the outbound queue, and any
+ //                    cancellable commands not yet written are dropped (they fail)
+ //   BT_SEND_CANCELLABLE - the command may be dropped by a later urgent command, used for
+ //                    motor updates that would be stale once a stop has been issued
+ //
+ // For cancellable commands epoch must be the value of BT_urgent_epoch() at the time the
+ // command was decided on. If an urgent command was queued since then the command is
+ // refused (NULL is returned), otherwise epoch is ignored.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ return(BT_enqueue(cmd,len,NULL,NULL,0,flags,epoch));
+}
+
+unsigned int BT_urgent_epoch(void)
+{
+ // Number of urgent commands queued so far. Lets code that holds commands back (e.g. the
+ // motor sender) tell whether a stop was issued after a command was requested.
+ unsigned int n;
+ pthread_mutex_lock(&BT_async_mutex);
+ n=BT_urgent_count;
+ pthread_mutex_unlock(&BT_async_mutex);
+ return(n);
+}
+
+int BT_send_callback(void *cmd, int len, BT_reply_callback callback, void *arg)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Queue a pre-formatted direct command, callback(reply,reply_len,arg) is called from the
+ // reader thread when the reply arrives, or with (NULL,-1,arg) if the command fails. For
+ // no-reply commands it is called with (reply,0,arg) once the command has been written.
+ // Callbacks must be short and must not block waiting on other BT commands.
+ //
+ // Returns: 0 if the command was queued
+ //          -1 otherwise (the callback is not called)
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (BT_enqueue(cmd,len,callback,arg,1,0,0)==NULL) return(-1);
+ return(0);
+}
+
+int BT_future_ready(struct BT_future *f)
+{
+ // Returns 1 if the future has completed (successfully or not), 0 otherwise. Does not block.
+ int done;
+ pthread_mutex_lock(&BT_async_mutex);
+ done=f->done;
+ pthread_mutex_unlock(&BT_async_mutex);
+ return(done);
+}
+
+int BT_future_wait(struct BT_future *f, void *reply, int reply_len, int timeout_ms)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Wait for a future to complete and copy its reply frame into the provided buffer.
+ //
+ // Inputs: f - future returned by BT_send_async()
+ //         reply - buffer for the reply frame (may be NULL), reply_len - its size
+ //         timeout_ms - how long to wait, <0 waits forever
+ // Returns: Number of bytes copied into reply (0 for no-reply commands)
+ //          -1 if the command failed or timed out (the reply buffer is zeroed in that case)
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ long long deadline;
+ int rv;
+
+ deadline=BT_now_ms()+timeout_ms;
+ pthread_mutex_lock(&BT_async_mutex);
+ while (!f->done)
+ {
+  if (timeout_ms<0) pthread_cond_wait(&BT_async_cond,&BT_async_mutex);
+  else if (BT_now_ms()>=deadline) break;
+  else BT_timed_wait(deadline);
+ }
+ if (!f->done&&__builtin_expect(BT_stats_enabled,0))
+  BT_stats_add(&BT_stats[BT_opcode(&f->cmd[0],f->cmd_len)].timeouts,1);
+ rv=-1;
+ if (f->done&&f->reply_len>=0)
+ {
+  rv=MIN(f->reply_len,reply_len);
+  if (reply!=NULL) memcpy(reply,&f->reply[0],rv);
+ }
+ pthread_mutex_unlock(&BT_async_mutex);
+
+ if (reply!=NULL&&rv<0) memset(reply,0,reply_len);
+ return(rv);
+}
+
+void BT_future_release(struct BT_future *f)
+{
+ // Free a future. If it is still in flight the library frees it when it completes.
+ if (f==NULL) return;
+ pthread_mutex_lock(&BT_async_mutex);
+ if (!f->done)
+ {
+  f->detached=1;
+  f=NULL;
+ }
+ pthread_mutex_unlock(&BT_async_mutex);
+ if (f!=NULL) free(f);
+}
+
+int BT_send_command(void *cmd, int len, void *reply, int reply_len)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Blocking wrapper around the async pipeline used by all the BT_* functions below.
+ //
+ // Returns once the command is on the wire (no-reply commands) or once its reply has been
+ // matched to it, waiting at most BT_REPLY_TIMEOUT_MS. Other threads can have their own
+ // commands in flight at the same time.
+ //
+ // Inputs: cmd - command string, len - total length in bytes (including the length field)
+ //         reply - buffer for the reply, or NULL for commands that don't expect one
+ //         reply_len - size of the reply buffer
+ // Returns: Number of bytes read into reply (0 if no reply was requested)
+ //          -1 if the command failed or timed out (the reply buffer is zeroed in that case)
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_future *f;
+ int rv;
+
+ f=BT_send_async(cmd,len);
+ if (f==NULL)
+ {
+  if (reply!=NULL) memset(reply,0,reply_len);
+  return(-1);
+ }
+ rv=BT_future_wait(f,reply,reply_len,BT_REPLY_TIMEOUT_MS);
+ BT_future_release(f);
+ return(rv);
+}
+
+static const char *BT_opcode_name(int op)
+{
+ // Names for the opcodes this library sends, anything else is printed in hex
+ switch(op)
+ {
+  case opOUTPUT_POWER: return("OUTPUT_POWER");
+  case opOUTPUT_SPEED: return("OUTPUT_SPEED");
+  case opOUTPUT_START: return("OUTPUT_START");
+  case opOUTPUT_STOP: return("OUTPUT_STOP");
+  case opOUTPUT_TIME_POWER: return("OUTPUT_TIME_POWER");
+  case opINPUT_DEVICE: return("INPUT_DEVICE");
+  case opINPUT_READEXT: return("INPUT_READEXT");
+  case opSOUND: return("SOUND");
+  case opCOM_SET: return("COM_SET");
+ }
+ return(NULL);
+}
+
+long long BT_round_trip_us(void)
+{
+ // Smoothed time (us) from writing a command to matching its reply, over recent replies. 0 if
+ // nothing has been answered yet. Always on, unlike the per-opcode statistics.
+ return(__atomic_load_n(&BT_rtt_avg,__ATOMIC_RELAXED));
+}
+
+void BT_stats_enable(int on)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Turn statistics collection on or off. The first time they are turned on the tables are
+ // allocated and the throughput clock starts. Turning them off keeps what was collected.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (on&&BT_stats==NULL)
+ {
+  BT_stats=(struct BT_op_stats *)calloc(256,sizeof(struct BT_op_stats));
+  if (BT_stats==NULL)
+  {
+   fprintf(stderr,"BT_stats_enable(): Out of memory\n");
+   return;
+  }
+  BT_stats_start=perf_time_us();
+ }
+ __atomic_store_n(&BT_stats_enabled,on?1:0,__ATOMIC_RELEASE);
+}
+
+void BT_stats_reset(void)
+{
+ // Clear all statistics. Commands in flight while this runs may be partially counted.
+ if (BT_stats==NULL) return;
+ memset(BT_stats,0,256*sizeof(struct BT_op_stats));
+ BT_stats_start=perf_time_us();
+}
+
+void BT_stats_dump(FILE *fp)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Print per-opcode counters and latency percentiles (in us). Can be called at any time from
+ // any thread, the pipeline keeps running while the tables are read.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_op_stats *s;
+ long long commands=0, bytes_out=0, bytes_in=0;
+ double secs;
+ const char *name;
+ char label[64];
+
+ if (BT_stats==NULL)
+ {
+  fprintf(fp,"BT stats: not enabled\n");
+  return;
+ }
+ for (int op=0; op<256; op++)
+ {
+  commands+=__atomic_load_n(&BT_stats[op].commands,__ATOMIC_RELAXED);
+  bytes_out+=__atomic_load_n(&BT_stats[op].bytes_out,__ATOMIC_RELAXED);
+  bytes_in+=__atomic_load_n(&BT_stats[op].bytes_in,__ATOMIC_RELAXED);
+ }
+ secs=(perf_time_us()-BT_stats_start)/1e6;
+ if (secs<=0) secs=1e-6;
+ fprintf(fp,"BT stats over %.1f s: %lld commands (%.1f/s), %lld bytes out (%.0f B/s), %lld bytes in (%.0f B/s)\n",
+         secs,commands,commands/secs,bytes_out,bytes_out/secs,bytes_in,bytes_in/secs);
+
+ for (int op=0; op<256; op++)
+ {
+  s=&BT_stats[op];
+  if (__atomic_load_n(&s->commands,__ATOMIC_RELAXED)==0&&perf_hist_count(&s->call)==0) continue;
+  name=BT_opcode_name(op);
+  if (name!=NULL) snprintf(label,64,"%s",name);
+  else snprintf(label,64,"op 0x%02X",op);
+  fprintf(fp," %s: %lld sent, %lld replies, %lld failed, %lld error replies, %lld timeouts\n",label,
+          __atomic_load_n(&s->commands,__ATOMIC_RELAXED),__atomic_load_n(&s->replies,__ATOMIC_RELAXED),
+          __atomic_load_n(&s->failures,__ATOMIC_RELAXED),__atomic_load_n(&s->errors,__ATOMIC_RELAXED),
+          __atomic_load_n(&s->timeouts,__ATOMIC_RELAXED));
+  if (perf_hist_count(&s->rtt)>0) perf_hist_print(fp,"   round trip (us)",&s->rtt);
+  perf_hist_print(fp,"   queued to done (us)",&s->call);
+ }
+}
+
+static void BT_stats_at_exit(void)
+{
+ BT_stats_dump(stderr);
+}
+
+static int BT_connect_rfcomm(const char *address)
+{
+ // Connect an RFCOMM socket to the EV3 with the given hex address (channel 1)
+ struct sockaddr_rc addr = { 0 };
+ int fd;
+
+ fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+ if (fd<0) return(-1);
+ // set the connection parameters (who to connect to)
+ addr.rc_family = AF_BLUETOOTH;
+ addr.rc_channel = (uint8_t) 1;
+ str2ba(address, &addr.rc_bdaddr );
+ if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))<0)
+ {
+  close(fd);
+  return(-1);
+ }
+ return(fd);
+}
+
+static int BT_connect_unix(const char *path)
+{
+ // Connect to a UNIX domain stream socket (e.g. an EV3 emulator on the same machine)
+ struct sockaddr_un addr;
+ int fd;
+
+ if (strlen(path)>=sizeof(addr.sun_path))
+ {
+  fprintf(stderr,"BT_open(): Socket path too long\n");
+  return(-1);
+ }
+ memset(&addr,0,sizeof(addr));
+ addr.sun_family=AF_UNIX;
+ strcpy(addr.sun_path,path);
+
+ fd=socket(AF_UNIX,SOCK_STREAM,0);
+ if (fd<0) return(-1);
+ if (connect(fd,(struct sockaddr *)&addr,sizeof(addr))<0)
+ {
+  close(fd);
+  return(-1);
+ }
+ return(fd);
+}
+
+static int BT_connect_tcp(const char *host_port)
+{
+ // Connect to host:port over TCP. Nagle is disabled, direct commands are small and latency matters.
+ struct addrinfo hints, *res, *ai;
+ char host[256];
+ const char *port;
+ int fd=-1, one=1;
+
+ port=strrchr(host_port,':');
+ if (port==NULL||port==host_port||port-host_port>=(int)sizeof(host))
+ {
+  fprintf(stderr,"BT_open(): TCP device must be tcp:host:port\n");
+  return(-1);
+ }
+ memcpy(&host[0],host_port,port-host_port);
+ host[port-host_port]='\0';
+ port++;
+
+ memset(&hints,0,sizeof(hints));
+ hints.ai_family=AF_UNSPEC;
+ hints.ai_socktype=SOCK_STREAM;
+ if (getaddrinfo(host,port,&hints,&res)!=0)
+ {
+  fprintf(stderr,"BT_open(): Unable to resolve %s\n",host_port);
+  return(-1);
+ }
+ for (ai=res; ai!=NULL; ai=ai->ai_next)
+ {
+  fd=socket(ai->ai_family,ai->ai_socktype,ai->ai_protocol);
+  if (fd<0) continue;
+  if (connect(fd,ai->ai_addr,ai->ai_addrlen)==0) break;
+  close(fd);
+  fd=-1;
+ }
+ freeaddrinfo(res);
+ if (fd>=0) setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+ return(fd);
+}
 
 int BT_open(const char *device_id)
 {
  //////////////////////////////////////////////////////////////////////////////////////////////////////
  // Open a socket to the specified Lego EV3 device specified by the provided hex ID string
  //
- // Input: The hex string identifier for the Lego EV3 block
+ // The device string selects the transport:
+ //   "00:16:53:56:56:03" or "rfcomm:00:16:53:56:56:03" - Bluetooth RFCOMM to a real EV3
+ //   "unix:/tmp/ev3.sock"                                - UNIX domain socket (e.g. tools/ev3emu)
+ //   "tcp:127.0.0.1:5555"                                - TCP connection (e.g. tools/ev3emu)
+ // All transports carry the same direct command byte stream, so the rest of the library doesn't
+ // care which one is in use.
+ //
+ // Input: The hex string identifier for the Lego EV3 block, or one of the transport strings above
  // Returns: 0 on success
  //          -1 otherwise 
  //
  // Derived from bluetooth.c by Don Neumann
  //////////////////////////////////////////////////////////////////////////////////////////////////////
   
- int rv;
- struct sockaddr_rc addr = { 0 };
- int s, status;
- char dest[18];
+ int fd;
  socket_id=(int*)malloc(sizeof(int));   
  fprintf(stderr,"Request to connect to device %s\n",device_id);
+ if (getenv("BT_STATS")!=NULL&&!BT_stats_enabled)
+ {
+  BT_stats_enable(1);
+  atexit(BT_stats_at_exit);
+ }
  
- *socket_id = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
- // set the connection parameters (who to connect to)
- addr.rc_family = AF_BLUETOOTH;
- addr.rc_channel = (uint8_t) 1;
- str2ba(device_id, &addr.rc_bdaddr );
+ if (strncmp(device_id,"unix:",5)==0) fd=BT_connect_unix(device_id+5);
+ else if (strncmp(device_id,"tcp:",4)==0) fd=BT_connect_tcp(device_id+4);
+ else if (strncmp(device_id,"rfcomm:",7)==0) fd=BT_connect_rfcomm(device_id+7);
+ else fd=BT_connect_rfcomm(device_id);
+ *socket_id=fd;
 
- status = connect(*socket_id, (struct sockaddr *)&addr, sizeof(addr));
- if( status == 0 ) {
-	printf("Connection to %s established at socket: %d.\n", device_id, *socket_id);
- }
- if( status < 0 ) {
+ if( fd < 0 ) {
        perror("Connection attempt failed ");
+       free(socket_id);
+       socket_id=NULL;
        return(-1);
  }
+ printf("Connection to %s established at socket: %d.\n", device_id, *socket_id);
+ if (BT_async_start()<0)
+ {
+  fprintf(stderr,"BT_open(): Unable to start the command pipeline threads\n");
+  close(fd);
+  free(socket_id);
+  socket_id=NULL;
+  return(-1);
+ }
  return 0;
 }
 
@@ -53,9 +869,13 @@ int BT_close()
  /////////////////////////////////////////////////////////////////////////////////////////////////////
  // Close the communication socket to the EV3
  /////////////////////////////////////////////////////////////////////////////////////////////////////  
+ if (socket_id==NULL) return(-1);		// Never opened, or BT_open() failed
  fprintf(stderr,"Request to close connection to device at socket id %d\n",*socket_id);
+ BT_async_stop();
  close(*socket_id);
  free(socket_id);
+ socket_id=NULL;
+ return(0);
 }
 
 int BT_setEV3name(const char *name)
@@ -93,11 +913,6 @@ int BT_setEV3name(const char *name)
  cmd_string[0]=*cp;
  cmd_string[1]=*(cp+1);
 
- lp=(void *)&message_id_counter;
- cp=(unsigned char *)lp;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
- 
 #ifdef __BT_debug 
  fprintf(stderr,"Set name command:\n");
  for(int i=0; i<len+2; i++)
@@ -107,8 +922,7 @@ int BT_setEV3name(const char *name)
  fprintf(stderr,"\n");
 #endif  
 
- write(*socket_id,&cmd_string[0],len+2);
- read(*socket_id,&reply[0],1023);
+ BT_send_command(&cmd_string[0],len+2,&reply[0],1023);
 
 #ifdef __BT_debug
  fprintf(stderr,"Set name reply:\n");
@@ -122,7 +936,6 @@ int BT_setEV3name(const char *name)
  else
   fprintf(stderr,"BT_setEV3name(): Command failed, name must not contain spaces or special characters\n");
  
- message_id_counter++;
 }
 
 int BT_play_tone_sequence(const int tone_data[50][3])
@@ -158,14 +971,9 @@ int BT_play_tone_sequence(const int tone_data[50][3])
  //                           |length-2|    | cnt_id |    |type|   | header |    
 
  memset(&cmd_string[0],0,1024);
- strcpy((char *)&cmd_string[0],(char *)&cmd_prefix[0]);
+ memcpy(&cmd_string[0],&cmd_prefix[0],7);		// Not strcpy(), the prefix starts with 0x00
  len=5;
  
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
  
  // Pre-check tone information
  for (int i=0; i<50; i++)
@@ -215,9 +1023,8 @@ int BT_play_tone_sequence(const int tone_data[50][3])
  fprintf(stderr,"\n");
 #endif  
 
- write(*socket_id,&cmd_string[0],len+2);
+ BT_send_command(&cmd_string[0],len+2,NULL,0);
 
- message_id_counter++; 
  return(0);
 }
 
@@ -247,8 +1054,6 @@ int BT_motor_port_start(char port_ids, char power)
  //          -1 otherwise  
  //////////////////////////////////////////////////////////////////////////////////////////////////
 
- void *p;
- unsigned char *cp;
  unsigned char cmd_string[15]={0x0D,0x00, 0x00,0x00, 0x80,  0x00,0x00,  0xA4,      0x00,    0x00,       0x81,0x00,   0xA6,    0x00,   0x00};
  //                          |length-2| | cnt_id | |type| | header |  |set power| |layer|  |port ids|  |power|      |start|  |layer| |port id|
 
@@ -263,12 +1068,6 @@ int BT_motor_port_start(char port_ids, char power)
   fprintf(stderr,"BT_motor_port_start: Invalid port id value\n");
   return(0);
  }
- 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
 
  cmd_string[9]=port_ids;
  cmd_string[11]=power;
@@ -283,9 +1082,8 @@ int BT_motor_port_start(char port_ids, char power)
  fprintf(stderr,"\n");
 #endif  
  
- write(*socket_id,&cmd_string[0],15);
+ BT_send_command(&cmd_string[0],15,NULL,0);
 
- message_id_counter++; 
  return(0); 
 }
 
@@ -317,8 +1115,6 @@ int BT_motor_port_speed(char port_ids, char speed) {
   //          -1 otherwise
   //////////////////////////////////////////////////////////////////////////////////////////////////
 
-  void *p;
-  unsigned char *cp;
   char reply[1024];
   unsigned char cmd_string[15] = {0x0D, 0x00, 0x00, 0x00, 0x00,
                                   0x00, 0x00, 0xA5, 0x00, 0x00,
@@ -337,12 +1133,6 @@ int BT_motor_port_speed(char port_ids, char speed) {
     return (0);
   }
 
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
-
   cmd_string[9] = port_ids;
   cmd_string[11] = speed;
   cmd_string[14] = port_ids;
@@ -355,10 +1145,7 @@ int BT_motor_port_speed(char port_ids, char speed) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
-
-  message_id_counter++;
+  BT_send_command(&cmd_string[0], 15, &reply[0], 1023);
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
@@ -384,8 +1171,6 @@ int BT_motor_port_stop(char port_ids, int brake_mode)
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////
- void *p;
- unsigned char *cp;
  unsigned char cmd_string[11]={0x09,0x00, 0x00,0x00, 0x80,  0x00,0x00,  0xA3,   0x00,    0x00,       0x00};
  //                           |length-2| | cnt_id | |type| | header |  |stop|   |layer|  |port ids|  |brake|
  
@@ -400,12 +1185,6 @@ int BT_motor_port_stop(char port_ids, int brake_mode)
   return(0);
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-  
  cmd_string[9]=port_ids;
  cmd_string[10]=brake_mode;
  
@@ -418,9 +1197,8 @@ int BT_motor_port_stop(char port_ids, int brake_mode)
  fprintf(stderr,"\n");
 #endif  
  
- write(*socket_id,&cmd_string[0],11);
+ BT_send_command(&cmd_string[0],11,NULL,0);
 
- message_id_counter++; 
  return(0);
 }
 
@@ -429,24 +1207,20 @@ int BT_all_stop(int brake_mode){
  //////////////////////////////////////////////////////////////////////////////////////////////////////
  // Applies breaks to all motors.
  //
+ // This is a safety command, it jumps ahead of anything waiting to be sent and cancels
+ // pending motor updates (so a stale power setting can not restart the motors).
+ //
  // Inputs: brake_mode: 0 -> roll to stop, 1 -> active brake (uses battery power)
  // Returns: 0 on success
  //          -1 otherwise
  //
  //////////////////////////////////////////////////////////////////////////////////////////////////////
 
- void *p;
- unsigned char *cp;
  char port_ids = MOTOR_A|MOTOR_B|MOTOR_C|MOTOR_D;
+ struct BT_future *f;
  unsigned char cmd_string[11]={0x09,0x00, 0x00,0x00, 0x80,  0x00,0x00,  0xA3,   0x00,    0x00,       0x00};
  //                  |length-2| | cnt_id | |type| | header |  |stop|   |layer|  |port ids|  |brake|
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-  
  cmd_string[9]=port_ids;
  cmd_string[10]=brake_mode;
 
@@ -459,9 +1233,11 @@ int BT_all_stop(int brake_mode){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],11);
+ f=BT_send_async_flags(&cmd_string[0],11,BT_SEND_URGENT,0);
+ if (f==NULL) return(-1);
+ BT_future_wait(f,NULL,0,BT_REPLY_TIMEOUT_MS);
+ BT_future_release(f);
 
- message_id_counter++;
  return(0);
 
 }
@@ -486,8 +1262,6 @@ int BT_drive(char lport, char rport, char power){
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
  
- void *p;
- unsigned char *cp;
  char ports;
  unsigned char cmd_string[15]={0x0D,0x00, 0x00,0x00, 0x80,  0x00,0x00,  0xA4,      0x00,    0x00,       0x81,0x00,   0xA6,    0x00,   0x00};
  //                           |length-2| | cnt_id | |type| | header |  |set power| |layer|  |port ids|  |power|      |start|  |layer| |port id|
@@ -505,12 +1279,6 @@ int BT_drive(char lport, char rport, char power){
  }
  ports = lport|rport;
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
  cmd_string[9]=ports;
  cmd_string[11]=power;
  cmd_string[14]=ports;
@@ -525,9 +1293,8 @@ int BT_drive(char lport, char rport, char power){
  fprintf(stderr,"\n");
 #endif  
 
- write(*socket_id,&cmd_string[0],15);
+ BT_send_command(&cmd_string[0],15,NULL,0);
 
- message_id_counter++; 
  return(0);
 
 }
@@ -552,8 +1319,6 @@ int BT_turn(char lport, char lpower, char rport, char rpower){
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
- unsigned char *cp;
  unsigned char cmd_string[20]={0x12,0x00, 0x00,0x00, 0x80,  0x00,0x00,  0xA4,      0x00,    0x00,      0x81,0x00,    0xA4,     0x00,     0x00, 0x81,0x00,  0xA6,    0x00,   0x00};
  //                          |length-2| | cnt_id | |type| | header |  |set power| |layer|  |lport id|  |power|  |set power| |layer| |rport id| |power|     |start|  |layer| |port ids|
 
@@ -569,12 +1334,6 @@ int BT_turn(char lport, char lpower, char rport, char rpower){
   return(-1);
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
  //set up power and port for left motor
  cmd_string[9]=lport;
  cmd_string[11]=lpower;
@@ -594,12 +1353,107 @@ int BT_turn(char lport, char lpower, char rport, char rpower){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],20);
+ BT_send_command(&cmd_string[0],20,NULL,0);
+
+
+ return(0);
+
+}
+
+int BT_steer_params(char lport, char rport, char lpower, char rpower, char *speed, int *turn){
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Converts a left/right power pair into the speed and turn ratio used by the EV3 synchronised
+ // output opcodes (opOUTPUT_TIME_SYNC, opOUTPUT_STEP_SYNC).
+ //
+ // The EV3 runs the motor on the lower numbered port at 'speed' and the other one at
+ // speed*(100-turn)/100 for turn>0. For turn<0 the roles are swapped. So turn 0 is straight,
+ // +/-100 stops one wheel and +/-200 spins the wheels in opposite directions.
+ //
+ // Inputs: port identifiers of the left and right motors (different, one port each)
+ //         power for each in [-100, 100]
+ //         speed, turn - where the results go
+ //
+ // Returns: 0 on success
+ //          -1 on invalid input
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ int lo, hi;
+
+ if (lpower>100||lpower<-100||rpower>100||rpower<-100)
+ {
+  fprintf(stderr,"BT_steer: Power must be in [-100, 100]\n");
+  return(-1);
+ }
+ if (lport>8||rport>8||lport<=0||rport<=0||lport==rport||(lport&(lport-1))||(rport&(rport-1)))
+ {
+  fprintf(stderr,"BT_steer: Invalid port id value\n");
+  return(-1);
+ }
 
- message_id_counter++;
+ // Power of the lower and higher numbered port
+ lo=(lport<rport)?lpower:rpower;
+ hi=(lport<rport)?rpower:lpower;
 
+ if (lo==0&&hi==0)
+ {
+  *speed=0;
+  *turn=0;
+ }
+ else if (abs(lo)>=abs(hi))
+ {
+  *speed=lo;
+  *turn=(int)lround(100.0-100.0*hi/lo);
+ }
+ else
+ {
+  *speed=hi;
+  *turn=-(int)lround(100.0-100.0*lo/hi);
+ }
  return(0);
+}
+
+int BT_steer(char lport, char rport, char lpower, char rpower){
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Drives a differential pair with the synchronised output opcode, so both wheels change
+ // together in a single command instead of one after the other (compare BT_turn()).
+ // The motors keep running until stopped or given a new command.
+ //
+ // Note that the synchronised opcodes are speed regulated, the EV3 adjusts the power to hold
+ // the requested wheel speeds.
+ //
+ // Inputs: port identifier of left port, port identifier of right port
+ //         power for left and right port in [-100, 100]
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char cmd_string[17]={0x0F,0x00, 0x00,0x00, 0x80,  0x00,0x00,  0xB1,     0x00,    0x00,      0x81,0x00,  0x82,0x00,0x00,  0x00,   0x00};
+ //                          |length-2| | cnt_id | |type| | header |  |time sync| |layer| |port ids| |speed|     |turn|           |time| |brake|
+ char speed;
+ int turn;
+
+ if (BT_steer_params(lport,rport,lpower,rpower,&speed,&turn)<0) return(-1);
 
+ cmd_string[7]=opOUTPUT_TIME_SYNC;
+ cmd_string[9]=lport|rport;
+ cmd_string[11]=speed;
+ cmd_string[13]=turn&0xFF;
+ cmd_string[14]=(turn>>8)&0xFF;
+ cmd_string[15]=LC0(0);		// Run until told otherwise
+
+#ifdef __BT_debug
+ fprintf(stderr,"BT_steer command string:\n");
+ for(int i=0; i<17; i++)
+ {
+  fprintf(stderr,"%X, ",cmd_string[i]&0xff);
+ }
+ fprintf(stderr,"\n");
+#endif
+
+ BT_send_command(&cmd_string[0],17,NULL,0);
+
+ return(0);
 }
 
 int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int run_time, int ramp_down_time){
@@ -620,8 +1474,6 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int ru
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
- unsigned char *cp;
  unsigned char cmd_string[22]={0x00,0x00, 0x00,0x00, 0x80,  0x00,0x00,  0x00,  0x00,   0x00,     0x81,0x00, 0x00,0x00,0x00, 0x00,0x00,0x00,  0x00,0x00,0x00,     0x00};
  //                          |length-2| | cnt_id | |type|   |header|    |cmd| |layer| |port ids|  |power|      |ramp up|      |run|           |ramp down|      |brake|
 
@@ -637,12 +1489,6 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int ru
   return(-1);
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
  cmd_string[0]=LC0(20);
  cmd_string[7]=opOUTPUT_TIME_POWER;
  cmd_string[9]=port_id;
@@ -667,9 +1513,8 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int ru
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],22);
+ BT_send_command(&cmd_string[0],22,NULL,0);
 
- message_id_counter++;
 
  return(0);
 }
@@ -682,6 +1527,10 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time){
  // Ports are identified as MOTOR_A, MOTOR_B, etc
  // Power must be in [-100, 100]
  //
+ // The timer runs on the EV3 and this call blocks until it expires and the reply arrives,
+ // so don't use it from the frame loop. BT_motor_timed() (btmotors.c) does the same
+ // without blocking.
+ //
  // Note that starting a motor at 0% power is *not the same* as stopping the motor.
  // to fully stop the motors you need to use the appropriate BT command.
  //
@@ -692,8 +1541,6 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time){
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
- unsigned char *cp;
  char reply[1024];
 
  unsigned char cmd[26]= {0x00,0x00, 0x00,0x00, 0x00, 0x00,0x00,  0xA4,   0x00,  0x00, 0x81,0x00, 0xA6,  0x00,   0x00,   0x00, 0x00, 0x00,0x00, 0x00,       0x00,   0x00,      0xA3, 0x00,     0x00,   0x00};
@@ -713,12 +1560,6 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time){
 
  //BT_motor_port_start(port_id, power);
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd[2]=*cp;
- cmd[3]=*(cp+1);
-
  cmd[0]=LC0(24);
  cmd[6]=LC0(10<<2); //size of local memory
  cmd[9]=port_id;
@@ -744,8 +1585,7 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd[0],26);
- read(*socket_id,&reply[0],1023);
+ BT_send_command(&cmd[0],26,&reply[0],1023);
 
  if (reply[4]==0x02){
   fprintf(stderr,"BT_wait(): Command successful\n");
@@ -756,7 +1596,6 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time){
   return(-1);
  }
 
- message_id_counter++;
 
  return(0);
 }
@@ -777,9 +1616,7 @@ int BT_read_touch_sensor(char sensor_port){
  //          0 if touch sensor is not pushed
  //          -1 if EV3 returned an error response
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
  char reply[1024];
- unsigned char *cp;
  unsigned char cmd_string[15]={0x0D,0x00, 0x00,0x00, 0x00,  0x01,0x00,  0x00,    0x00,       0x00,    0x00,  0x00,  0x00,   0x00,     0x00 };
  //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |type| |mode| |data set| |global var addr|
 
@@ -789,12 +1626,6 @@ int BT_read_touch_sensor(char sensor_port){
   return(-1);
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
  cmd_string[7]=opINPUT_DEVICE;
  cmd_string[8]=LC0(READY_PCT);
  cmd_string[10]=sensor_port;
@@ -811,10 +1642,7 @@ int BT_read_touch_sensor(char sensor_port){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],15);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_send_command(&cmd_string[0],15,&reply[0],1023);
 
  if (reply[4]==0x02){
   //fprintf(stderr,"BT_touch_sensor(): Command successful\n");
@@ -850,10 +1678,8 @@ int BT_read_colour_sensor(char sensor_port){
  //  7    Brown
  //          
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
  char reply[1024];
  memset(&reply[0],0,1024);
- unsigned char *cp;
  unsigned char cmd_string[15]={0x0D,0x00, 0x00,0x00, 0x00,  0x01,0x00,  0x00,    0x00,       0x00,    0x00,  0x00,  0x00,   0x00,     0x00 };
  //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |type| |mode| |data set| |global var addr|
 
@@ -863,12 +1689,6 @@ int BT_read_colour_sensor(char sensor_port){
   return(-1);
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
  cmd_string[7]=opINPUT_DEVICE;
  cmd_string[8]=LC0(READY_RAW);
  cmd_string[10]=sensor_port;
@@ -886,10 +1706,7 @@ int BT_read_colour_sensor(char sensor_port){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],15);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_send_command(&cmd_string[0],15,&reply[0],1023);
 
  if (reply[4]==0x02){
   //fprintf(stderr,"BT_colour_sensor(): Command successful\n");
@@ -915,16 +1732,13 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]){
  // Returns:
  //          -1 if EV3 returned an error response
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
  unsigned char reply[1024];
  memset(&reply[0],0,1024); 
- unsigned char *cp;
  uint32_t R=0, G=0, B=0;
 
  unsigned char cmd_string[17]={0x00,0x00, 0x00,0x00, 0x00,  0x0C,0x00,  0x00,    0x00,       0x00,    0x00,  0x00,  0x00,   0x00,     0x00, 0x00, 0x00 };
  //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |type| |mode| |data set| |global var addr|
 
-
  if (sensor_port>8)
  {
   fprintf(stderr,"BT_read_colour_sensor_RGB: Invalid port id value\n");
@@ -932,11 +1746,6 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]){
  }
 
  cmd_string[0]=LC0(15);
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
 
  cmd_string[7]=opINPUT_DEVICE;
  cmd_string[8]=LC0(READY_RAW);
@@ -957,10 +1766,7 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],17);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_send_command(&cmd_string[0],17,&reply[0],1023);
 
  if (reply[4]==0x02){
   //fprintf(stderr,"BT_colour_sensor_RGB(): Command successful\n");
@@ -1005,15 +1811,12 @@ int BT_read_ultrasonic_sensor(char sensor_port){
  // Returns: distance in mm
  //          -1 if EV3 returned an error response
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
  unsigned char reply[1024];
  memset(&reply[0],0,1024);
- unsigned char *cp;
 
  unsigned char cmd_string[15]={0x00,0x00, 0x00,0x00, 0x00,  0x01,0x00,  0x00,    0x00,       0x00,    0x00,  0x00,  0x00,   0x00,     0x00};
  //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |type| |mode| |data set| |global var addr|
 
-
  if (sensor_port>8)
  {
   fprintf(stderr,"BT_read_ultrasonic_sensor: Invalid port id value\n");
@@ -1021,11 +1824,6 @@ int BT_read_ultrasonic_sensor(char sensor_port){
  }
 
  cmd_string[0]=LC0(13);
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
 
  cmd_string[7]=opINPUT_DEVICE;
  cmd_string[8]=LC0(READY_RAW);
@@ -1043,10 +1841,8 @@ int BT_read_ultrasonic_sensor(char sensor_port){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],15);
- read(*socket_id,&reply[0],1023);
+ BT_send_command(&cmd_string[0],15,&reply[0],1023);
 
- message_id_counter++;
 if (reply[4]==0x02){
   fprintf(stderr,"BT_ultrasonic_sensor(): Command successful\n");
 }
@@ -1072,8 +1868,6 @@ int BT_clear_gyro_sensor(char sensor_port){
  unsigned char clr_string[10]={0x00,0x00, 0x00,0x00, 0x00,  0x01,0x00,  0x00,    0x00,       0x00};
  //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|
 
- void *p;
- unsigned char *cp;
  char reply[1024];
  memset(&reply[0],0,1024);
 
@@ -1083,11 +1877,7 @@ int BT_clear_gyro_sensor(char sensor_port){
   return(-1);
  }
 
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
  clr_string[0]=LC0(8);
- clr_string[2]=*cp;
- clr_string[3]=*(cp+1);
  clr_string[7]=opINPUT_DEVICE;
  clr_string[8]=LC0(CLR_ALL);
 
@@ -1100,10 +1890,7 @@ int BT_clear_gyro_sensor(char sensor_port){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&clr_string[0],10);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_send_command(&clr_string[0],10,&reply[0],1023);
 
  if (reply[4]==0x02){
   fprintf(stderr,"BT_clear_gyro_sensor(): Command successful\n");
@@ -1131,10 +1918,8 @@ int BT_read_gyro_sensor(char sensor_port) {
   // Returns: angle on success
   //          -1 if EV3 returned an error response
   //////////////////////////////////////////////////////////////////////////////////////////////////
-  void *p;
   unsigned char reply[1024];
   memset(&reply[0], 0, 1024);
-  unsigned char *cp;
   int angle = 0;
 
   unsigned char cmd_string[15] = {0x00, 0x00, 0x00, 0x00, 0x00,
@@ -1150,11 +1935,6 @@ int BT_read_gyro_sensor(char sensor_port) {
   }
 
   cmd_string[0] = LC0(13);
-  // Set message count id
-  p = (void *)&message_id_counter;
-  cp = (unsigned char *)p;
-  cmd_string[2] = *cp;
-  cmd_string[3] = *(cp + 1);
 
   cmd_string[7] = opINPUT_READEXT;
   cmd_string[9] = sensor_port;
@@ -1172,10 +1952,7 @@ int BT_read_gyro_sensor(char sensor_port) {
   fprintf(stderr, "\n");
 #endif
 
-  write(*socket_id, &cmd_string[0], 15);
-  read(*socket_id, &reply[0], 1023);
-
-  message_id_counter++;
+  BT_send_command(&cmd_string[0], 15, &reply[0], 1023);
 
   if (reply[4] == 0x02) {
 #ifdef __BT_debug
@@ -28,13 +28,24 @@
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/rfcomm.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
 #include "bytecodes.h"
+#include "../perf/perfhist.h"
+#include "../perf/perftrace.h"
 
 extern int message_id_counter;		// <-- Global message id counter
+#define BT_MAX_PENDING 256		// Max. number of commands awaiting a reply at any one time
+#define BT_REPLY_TIMEOUT_MS 3000		// How long the blocking BT_* calls wait for a reply
 //#define __BT_debug			// Uncomment to trigger printing of BT debug messages
 
 // Hex identifiers for the 4 motor ports
@@ -77,6 +88,28 @@ extern int message_id_counter;		// <-- Global message id counter
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 int BT_open(const char *device_id);
+int BT_send_command(void *cmd, int len, void *reply, int reply_len);
+
+// Asynchronous interface - commands are queued and replies matched to them by message counter
+struct BT_future;
+typedef void (*BT_reply_callback)(const unsigned char *reply, int reply_len, void *arg);
+#define BT_SEND_URGENT 0x01		// Jump the outbound queue, drop queued cancellable commands
+#define BT_SEND_CANCELLABLE 0x02	// May be dropped by a later urgent command
+struct BT_future *BT_send_async(void *cmd, int len);
+struct BT_future *BT_send_async_flags(void *cmd, int len, int flags, unsigned int epoch);
+unsigned int BT_urgent_epoch(void);
+int BT_send_callback(void *cmd, int len, BT_reply_callback callback, void *arg);
+int BT_future_ready(struct BT_future *f);
+int BT_future_wait(struct BT_future *f, void *reply, int reply_len, int timeout_ms);
+void BT_future_release(struct BT_future *f);
+
+// Per-opcode latency/throughput statistics. Off by default, costs one branch per command when off.
+// Set BT_STATS in the environment to enable them from BT_open() and print them at exit.
+extern int BT_stats_enabled;
+void BT_stats_enable(int on);
+void BT_stats_reset(void);
+void BT_stats_dump(FILE *fp);
+long long BT_round_trip_us(void);
 int BT_close();
 int BT_setEV3name(const char *name);
 int BT_play_tone_sequence(const int tone_data[50][3]);
@@ -86,6 +119,8 @@ int BT_motor_port_stop(char port_ids, int brake_mode);
 int BT_all_stop(int brake_mode);
 int BT_drive(char lport, char rport, char power);
 int BT_turn(char lport, char lpower,  char rport, char rpower);
+int BT_steer_params(char lport, char rport, char lpower, char rpower, char *speed, int *turn);
+int BT_steer(char lport, char rport, char lpower, char rpower);
 int BT_read_touch_sensor(char sensor_port);
 int BT_read_colour_sensor(char sensor_port);
 int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]); 
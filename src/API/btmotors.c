@@ -0,0 +1,625 @@
+/***********************************************************************************************************************
+ *
+ * 	Motor command sender for the EV3 BT library. See btmotors.h
+ *
+ * ********************************************************************************************************************/
+#include "btmotors.h"
+#include "btbatch.h"
+
+struct BT_motor_cmd{
+ int stop;			// 1 -> stop with brake_mode, 0 -> set power
+ char power;
+ int brake_mode;
+ int sync;			// Both ports of a synchronised pair, 0 if not part of one
+ char sync_speed;		// Speed and turn for the pair (see BT_steer_params())
+ int sync_turn;
+ long long origin;		// Capture time of the camera frame behind the request (us), 0 if none
+};
+
+struct BT_motor_slot{
+ int pending;			// 1 if there is a request not yet sent
+ struct BT_motor_cmd req;	// Latest request
+ unsigned int epoch;		// BT_urgent_epoch() at the time of the request
+ long long end_ms;		// End time of the manoeuvre holding this port, 0 if none
+ int start_pending;		// 1 if the manoeuvre's own command has not been sent yet
+ struct BT_motor_cmd start;	// What the port does during the manoeuvre
+ int end_brake;			// Brake mode for the stop at the end of the manoeuvre
+ unsigned int end_epoch;	// BT_urgent_epoch() when the manoeuvre started
+ int synced;			// 1 if the last thing sent for this port was a synchronised run
+};
+
+static struct BT_motor_slot motor_slots[4];		// One per port, MOTOR_A..MOTOR_D
+static pthread_mutex_t motor_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t motor_cond=PTHREAD_COND_INITIALIZER;
+static int motor_running=0;
+static long long motor_period_ms=20;
+static long long motor_dropped=0;			// Requests overwritten before they were sent
+static pthread_t motor_thread;
+static long long batch_origins[4];			// Distinct origins of the requests in the batch being built
+static int batch_n_origins;
+static struct perf_hist motor_latency;			// Frame capture to command written, see BT_motor_origin()
+static __thread long long motor_origin=0;		// Origin for requests made by this thread
+
+static long long motor_now_ms(void)
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000LL+ts.tv_nsec/1000000);
+}
+
+static void motor_wait_until(long long when_ms)
+{
+ // Wait on the sender condition until signaled or until the (monotonic) time given, lock must be held.
+ // A time of 0 waits until signaled.
+ struct timespec ts;
+ long long wait_ms;
+
+ if (when_ms==0)
+ {
+  pthread_cond_wait(&motor_cond,&motor_mutex);
+  return;
+ }
+ wait_ms=when_ms-motor_now_ms();
+ if (wait_ms<=0) return;
+ clock_gettime(CLOCK_REALTIME,&ts);
+ ts.tv_sec+=wait_ms/1000;
+ ts.tv_nsec+=(wait_ms%1000)*1000000;
+ if (ts.tv_nsec>=1000000000){ts.tv_sec++; ts.tv_nsec-=1000000000;}
+ pthread_cond_timedwait(&motor_cond,&motor_mutex,&ts);
+}
+
+static struct BT_motor_cmd *motor_next(struct BT_motor_slot *s)
+{
+ // What to send next for a port, NULL if nothing. Requests for a port held by a manoeuvre
+ // wait until it ends.
+ if (s->end_ms!=0) return(s->start_pending?&s->start:NULL);
+ return(s->pending?&s->req:NULL);
+}
+
+static int motor_same(struct BT_motor_cmd *a, struct BT_motor_cmd *b)
+{
+ if (a->stop!=b->stop) return(0);
+ if (a->stop) return(a->brake_mode==b->brake_mode);
+ if (a->sync!=b->sync) return(0);
+ if (a->sync) return(a->sync_speed==b->sync_speed&&a->sync_turn==b->sync_turn);
+ return(a->power==b->power);
+}
+
+static void motor_sent(int i)
+{
+ // Clear whatever was just sent for a port, noting the origin of the request for the latency
+ // histogram (each frame is counted once per batch)
+ long long origin=motor_next(&motor_slots[i])->origin;
+
+ if (origin!=0)
+ {
+  int k;
+  for (k=0; k<batch_n_origins&&batch_origins[k]!=origin; k++);
+  if (k==batch_n_origins&&k<4) batch_origins[batch_n_origins++]=origin;
+ }
+ if (motor_slots[i].end_ms!=0) motor_slots[i].start_pending=0;
+ else motor_slots[i].pending=0;
+}
+
+static void motor_record_latency(const long long *origins, int n)
+{
+ // Called once the commands are on the wire
+ long long now=perf_time_us();
+ for (int k=0; k<n; k++) perf_hist_record(&motor_latency,now-origins[k]);
+}
+
+static int motor_update(long long now, unsigned int epoch, long long *wake)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Bring the slots up to date (lock must be held). Requests and manoeuvres started before the
+ // latest urgent command (i.e. before a BT_all_stop()) are discarded, since the motors have
+ // already been stopped. Manoeuvres that have run their time release their port: a request
+ // made while it was held is sent now, otherwise the port is stopped.
+ //
+ // Returns the number of slots with something to send. wake is set to the end time of the
+ // earliest manoeuvre still running (0 if there is none).
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_motor_slot *s;
+ int n;
+
+ n=0;
+ *wake=0;
+ for (int i=0; i<4; i++)
+ {
+  s=&motor_slots[i];
+  if (s->pending&&s->epoch!=epoch) s->pending=0;
+  if (s->end_ms!=0&&s->end_epoch!=epoch)
+  {
+   s->end_ms=0;
+   s->start_pending=0;
+  }
+  if (s->end_ms!=0&&now>=s->end_ms)
+  {
+   s->end_ms=0;
+   s->start_pending=0;
+   if (!s->pending)
+   {
+    s->pending=1;
+    s->req.stop=1;
+    s->req.power=0;
+    s->req.brake_mode=s->end_brake;
+    s->req.origin=0;
+    s->epoch=epoch;
+   }
+  }
+  if (s->end_ms!=0&&(*wake==0||s->end_ms<*wake)) *wake=s->end_ms;
+  if (motor_next(s)!=NULL) n++;
+ }
+ return(n);
+}
+
+static int motor_collect(struct BT_batch *b)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Move every sendable request into a batch (lock must be held, motor_update() called first).
+ // Ports with identical requests share an opcode. A synchronised pair goes out as one sync
+ // opcode if both ports have it pending, if only one does (the other is held by a manoeuvre
+ // or got a newer request of its own) that port gets its plain power instead.
+ //
+ // Ports coming out of a synchronised run are stopped (coast) first in the same batch, the EV3
+ // keeps them in sync mode otherwise. Returns the number of opcodes added.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_motor_cmd cmd, *c;
+ int mask, unsync, n, j;
+
+ n=0;
+ for (int i=0; i<4; i++)
+ {
+  c=motor_next(&motor_slots[i]);
+  if (c==NULL) continue;
+  cmd=*c;
+  if (cmd.sync&&!cmd.stop)
+  {
+   j=__builtin_ctz(cmd.sync&~(1<<i));
+   c=motor_next(&motor_slots[j]);
+   if (c!=NULL&&motor_same(c,&cmd))
+   {
+    BT_batch_motor_sync(b,cmd.sync,cmd.sync_speed,cmd.sync_turn);
+    motor_sent(i);
+    motor_sent(j);
+    motor_slots[i].synced=motor_slots[j].synced=1;
+    n++;
+    continue;
+   }
+   // Send this port on its own, other plain requests for the same power may share it
+   cmd.sync=0;
+   motor_next(&motor_slots[i])->sync=0;
+  }
+
+  mask=0;
+  unsync=0;
+  for (j=i; j<4; j++)
+  {
+   c=motor_next(&motor_slots[j]);
+   if (c!=NULL&&motor_same(c,&cmd))
+   {
+    mask|=(1<<j);
+    if (motor_slots[j].synced) unsync|=(1<<j);
+    motor_slots[j].synced=0;
+    motor_sent(j);
+   }
+  }
+  if (cmd.stop) BT_batch_motor_stop(b,mask,cmd.brake_mode);
+  else
+  {
+   if (unsync) BT_batch_motor_stop(b,unsync,0);
+   BT_batch_motor_power(b,mask,cmd.power);
+  }
+  n++;
+ }
+ return(n);
+}
+
+static void *motor_loop(void *arg)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Sender thread. Waits for requests or for a manoeuvre to end, sends at most one batch per
+ // period and waits for each batch to be written before collecting the next one, so at most
+ // one motor update is ever queued on the link. Batches are cancellable so an urgent stop
+ // drops them. All timing is against the monotonic clock.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_batch batch;
+ struct BT_future *f;
+ long long last_send, now, wake;
+ long long origins[4];
+ int n_origins;
+ unsigned int epoch;
+
+ perf_trace_thread_name("BT motor sender");
+ last_send=0;
+ pthread_mutex_lock(&motor_mutex);
+ while (motor_running)
+ {
+  now=motor_now_ms();
+  epoch=BT_urgent_epoch();
+  if (motor_update(now,epoch,&wake)==0)
+  {
+   motor_wait_until(wake);
+   continue;
+  }
+
+  // Rate limit, more requests may come in (and overwrite the pending ones) while we wait
+  if (now<last_send+motor_period_ms)
+  {
+   motor_wait_until(last_send+motor_period_ms);
+   continue;
+  }
+
+  BT_batch_begin(&batch);
+  f=NULL;
+  batch_n_origins=0;
+  if (motor_collect(&batch)>0)
+  {
+   // Refused if a BT_all_stop() got in since we read the epoch, and dropped if one
+   // comes in before it is written, so a stale batch can never follow a stop
+   BT_batch_finish(&batch);
+   f=BT_send_async_flags(&batch.cmd[0],batch.len,BT_SEND_CANCELLABLE,epoch);
+  }
+  last_send=now;
+  n_origins=batch_n_origins;
+  memcpy(origins,batch_origins,sizeof(origins));
+  pthread_mutex_unlock(&motor_mutex);
+
+  if (f!=NULL)
+  {
+   if (BT_future_wait(f,NULL,0,BT_REPLY_TIMEOUT_MS)==0) motor_record_latency(origins,n_origins);
+   BT_future_release(f);
+  }
+  pthread_mutex_lock(&motor_mutex);
+ }
+ pthread_mutex_unlock(&motor_mutex);
+ return(NULL);
+}
+
+static int motor_request(char port_ids, int stop, char power, int brake_mode)
+{
+ // Store a request in the slot of each selected port, overwriting anything still pending.
+ // Requests for ports held by a manoeuvre wait until it is over.
+ struct BT_motor_slot *s;
+ struct BT_batch batch;
+ unsigned int epoch;
+
+ if (port_ids>15)
+ {
+  fprintf(stderr,"BT_motor_set: Invalid port id value\n");
+  return(-1);
+ }
+
+ pthread_mutex_lock(&motor_mutex);
+ if (!motor_running)
+ {
+  // No sender thread, just send it now
+  pthread_mutex_unlock(&motor_mutex);
+  BT_batch_begin(&batch);
+  if (stop) BT_batch_motor_stop(&batch,port_ids,brake_mode);
+  else BT_batch_motor_power(&batch,port_ids,power);
+  if (BT_batch_send(&batch)<0) return(-1);
+  if (motor_origin!=0) motor_record_latency(&motor_origin,1);
+  return(0);
+ }
+
+ epoch=BT_urgent_epoch();
+ for (int i=0; i<4; i++)
+  if (port_ids&(1<<i))
+  {
+   s=&motor_slots[i];
+   if (s->pending) motor_dropped++;
+   s->pending=1;
+   s->req.stop=stop;
+   s->req.power=power;
+   s->req.brake_mode=brake_mode;
+   s->req.sync=0;
+   s->req.origin=motor_origin;
+   s->epoch=epoch;
+  }
+ pthread_cond_signal(&motor_cond);
+ pthread_mutex_unlock(&motor_mutex);
+ return(0);
+}
+
+int BT_motor_set_steer(char lport, char rport, char lpower, char rpower)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Request new powers for a differential drive pair, sent as a single synchronised opcode
+ // (see BT_steer()) so both wheels change at the same instant. Like BT_motor_set_power()
+ // this never blocks on the BT link and replaces whatever was pending for the two ports.
+ //
+ // Inputs: port identifier of the left and right motor
+ //         power for each in [-100,100]
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_motor_slot *s;
+ unsigned int epoch;
+ char speed;
+ int turn;
+
+ if (BT_steer_params(lport,rport,lpower,rpower,&speed,&turn)<0) return(-1);
+
+ pthread_mutex_lock(&motor_mutex);
+ if (!motor_running)
+ {
+  pthread_mutex_unlock(&motor_mutex);
+  if (BT_steer(lport,rport,lpower,rpower)<0) return(-1);
+  if (motor_origin!=0) motor_record_latency(&motor_origin,1);
+  return(0);
+ }
+
+ epoch=BT_urgent_epoch();
+ for (int i=0; i<4; i++)
+  if ((lport|rport)&(1<<i))
+  {
+   s=&motor_slots[i];
+   if (s->pending) motor_dropped++;
+   s->pending=1;
+   s->req.stop=0;
+   s->req.power=((1<<i)==lport)?lpower:rpower;
+   s->req.brake_mode=0;
+   s->req.sync=lport|rport;
+   s->req.sync_speed=speed;
+   s->req.sync_turn=turn;
+   s->req.origin=motor_origin;
+   s->epoch=epoch;
+  }
+ pthread_cond_signal(&motor_cond);
+ pthread_mutex_unlock(&motor_mutex);
+ return(0);
+}
+
+static void motor_timed_slot(struct BT_motor_slot *s, char power, long long end_ms, int brake_mode, unsigned int epoch)
+{
+ // Hand a port over to a manoeuvre (lock must be held)
+ s->pending=0;			// Anything requested before the manoeuvre is stale
+ s->start_pending=1;
+ s->start.stop=(power==0);
+ s->start.power=power;
+ s->start.brake_mode=brake_mode;
+ s->start.sync=0;
+ s->start.origin=motor_origin;
+ s->end_ms=end_ms;
+ s->end_brake=brake_mode;
+ s->end_epoch=epoch;
+}
+
+int BT_motor_timed(char port_ids, char power, int duration_ms, int brake_mode)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start a timed manoeuvre: run the specified motor ports at the given power for duration_ms,
+ // then stop them with the given brake mode. Returns immediately, the sender thread ends the
+ // manoeuvre against the monotonic clock. A power of 0 holds the ports stopped for the duration.
+ //
+ // While a manoeuvre runs its ports are locked: BT_motor_set_power()/BT_motor_set_stop()
+ // requests for them are held back, and the latest one is sent when the manoeuvre ends
+ // (instead of the stop). Starting a new manoeuvre on a port replaces the old one, and
+ // BT_all_stop() cancels all of them.
+ //
+ // This replaces BT_timed_motor_port_start_v2(), which blocks for the whole duration.
+ //
+ // Inputs: The port identifiers (ORed MOTOR_A..MOTOR_D)
+ //         Power in [-100,100]
+ //         Duration in ms
+ //         brake_mode for the final stop: 0 -> roll to stop, 1 -> active brake
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_batch batch;
+ unsigned int epoch;
+ long long now;
+
+ if (power>100||power<-100)
+ {
+  fprintf(stderr,"BT_motor_timed: Power must be in [-100, 100]\n");
+  return(-1);
+ }
+ if (port_ids>15||duration_ms<0)
+ {
+  fprintf(stderr,"BT_motor_timed: Invalid port id or duration\n");
+  return(-1);
+ }
+
+ pthread_mutex_lock(&motor_mutex);
+ if (!motor_running)
+ {
+  // No sender thread, let the EV3 do the timing. Same as the sender: power 0 is a stop with
+  // brake_mode, otherwise the run ends with brake_mode
+  pthread_mutex_unlock(&motor_mutex);
+  BT_batch_begin(&batch);
+  if (power==0) BT_batch_motor_stop(&batch,port_ids,brake_mode);
+  else if (BT_batch_motor_timed(&batch,port_ids,power,duration_ms,brake_mode)<0) return(-1);
+  return(BT_batch_send(&batch));
+ }
+
+ epoch=BT_urgent_epoch();
+ now=motor_now_ms();
+ for (int i=0; i<4; i++)
+  if (port_ids&(1<<i)) motor_timed_slot(&motor_slots[i],power,now+duration_ms,brake_mode,epoch);
+ pthread_cond_signal(&motor_cond);
+ pthread_mutex_unlock(&motor_mutex);
+ return(0);
+}
+
+int BT_motor_timed_pair(char lport, char rport, char lpower, char rpower, int duration_ms, int lbrake, int rbrake)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Like BT_motor_timed(), but with a power and final brake mode for each of two ports (e.g. the
+ // two wheels of a spin). Both halves are stored under one lock with the same epoch and end
+ // time, so they go out in the same batch and end in the same batch. Without a sender thread
+ // both timed runs are sent as one batched command.
+ //
+ // Inputs: port identifier of the left and right motor (single ports, must differ)
+ //         power for each in [-100,100]
+ //         Duration in ms
+ //         brake_mode for each final stop: 0 -> roll to stop, 1 -> active brake
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_batch batch;
+ unsigned int epoch;
+ long long now;
+
+ if (lpower>100||lpower<-100||rpower>100||rpower<-100)
+ {
+  fprintf(stderr,"BT_motor_timed_pair: Power must be in [-100, 100]\n");
+  return(-1);
+ }
+ if (lport>15||rport>15||__builtin_popcount(lport)!=1||__builtin_popcount(rport)!=1||lport==rport||duration_ms<0)
+ {
+  fprintf(stderr,"BT_motor_timed_pair: Invalid port ids or duration\n");
+  return(-1);
+ }
+
+ pthread_mutex_lock(&motor_mutex);
+ if (!motor_running)
+ {
+  pthread_mutex_unlock(&motor_mutex);
+  BT_batch_begin(&batch);
+  if (lpower==0) BT_batch_motor_stop(&batch,lport,lbrake);
+  else if (BT_batch_motor_timed(&batch,lport,lpower,duration_ms,lbrake)<0) return(-1);
+  if (rpower==0) BT_batch_motor_stop(&batch,rport,rbrake);
+  else if (BT_batch_motor_timed(&batch,rport,rpower,duration_ms,rbrake)<0) return(-1);
+  return(BT_batch_send(&batch));
+ }
+
+ epoch=BT_urgent_epoch();
+ now=motor_now_ms();
+ motor_timed_slot(&motor_slots[__builtin_ctz(lport)],lpower,now+duration_ms,lbrake,epoch);
+ motor_timed_slot(&motor_slots[__builtin_ctz(rport)],rpower,now+duration_ms,rbrake,epoch);
+ pthread_cond_signal(&motor_cond);
+ pthread_mutex_unlock(&motor_mutex);
+ return(0);
+}
+
+int BT_motor_manoeuvre_active(char port_ids)
+{
+ // Returns 1 if any of the specified ports is held by a manoeuvre that hasn't ended yet
+ long long now;
+ int active=0;
+
+ pthread_mutex_lock(&motor_mutex);
+ now=motor_now_ms();
+ for (int i=0; i<4; i++)
+  if ((port_ids&(1<<i))&&motor_slots[i].end_ms!=0&&now<motor_slots[i].end_ms) active=1;
+ pthread_mutex_unlock(&motor_mutex);
+ return(active);
+}
+
+int BT_motor_set_power(char port_ids, char power)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Request a power setting for the specified motor ports (ORed MOTOR_A..MOTOR_D). Does not
+ // block on the BT link, the sender thread sends the latest request for each port.
+ //
+ // Inputs: The port identifiers
+ //         Desired power value in [-100,100]
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ if (power>100||power<-100)
+ {
+  fprintf(stderr,"BT_motor_set_power: Power must be in [-100, 100]\n");
+  return(-1);
+ }
+ return(motor_request(port_ids,0,power,0));
+}
+
+int BT_motor_set_stop(char port_ids, int brake_mode)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Request a stop for the specified motor ports. Like BT_motor_set_power() this replaces
+ // whatever was pending for those ports. For an immediate stop of everything use BT_all_stop().
+ //
+ // Inputs: The port identifiers
+ //         brake_mode: 0 -> roll to stop, 1 -> active brake
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ return(motor_request(port_ids,1,0,brake_mode));
+}
+
+void BT_motor_origin(long long capture_us)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Tag the motor requests made from now on by the calling thread with the capture time of the
+ // camera frame they were computed from (us, CLOCK_MONOTONIC, e.g. the V4L2 buffer timestamp).
+ // When a tagged request is written to the BT socket the capture-to-actuation delay goes into
+ // the latency histogram (BT_motor_latency_print()). 0 stops tagging.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ motor_origin=capture_us;
+}
+
+void BT_motor_latency_print(FILE *fp)
+{
+ // Print the capture-to-actuation delay percentiles (us)
+ perf_hist_print(fp,"frame capture -> motor cmd",&motor_latency);
+}
+
+void BT_motor_latency_reset(void)
+{
+ perf_hist_reset(&motor_latency);
+}
+
+long long BT_motor_sender_dropped(void)
+{
+ // Number of requests that were replaced by a newer one before being sent
+ long long n;
+ pthread_mutex_lock(&motor_mutex);
+ n=motor_dropped;
+ pthread_mutex_unlock(&motor_mutex);
+ return(n);
+}
+
+int BT_motor_sender_start(int rate_hz)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start the motor sender thread. Calling this while it's running only updates the rate.
+ //
+ // Inputs: Max. number of motor updates per second sent over the BT link
+ // Returns: 0 on success
+ //          -1 on invalid input or if the thread could not be created
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ if (rate_hz<=0||rate_hz>1000)
+ {
+  fprintf(stderr,"BT_motor_sender_start(): Invalid send rate %d\n",rate_hz);
+  return(-1);
+ }
+
+ pthread_mutex_lock(&motor_mutex);
+ motor_period_ms=1000/rate_hz;
+ if (motor_running)
+ {
+  pthread_mutex_unlock(&motor_mutex);
+  return(0);
+ }
+ memset(&motor_slots[0],0,sizeof(motor_slots));
+ motor_running=1;
+ if (pthread_create(&motor_thread,NULL,motor_loop,NULL)!=0)
+ {
+  fprintf(stderr,"BT_motor_sender_start(): Unable to create sender thread\n");
+  motor_running=0;
+  pthread_mutex_unlock(&motor_mutex);
+  return(-1);
+ }
+ pthread_mutex_unlock(&motor_mutex);
+ return(0);
+}
+
+int BT_motor_sender_stop(void)
+{
+ // Stop the sender thread. Requests still pending are discarded.
+ pthread_mutex_lock(&motor_mutex);
+ if (!motor_running)
+ {
+  pthread_mutex_unlock(&motor_mutex);
+  return(0);
+ }
+ motor_running=0;
+ pthread_cond_signal(&motor_cond);
+ pthread_mutex_unlock(&motor_mutex);
+ pthread_join(motor_thread,NULL);
+ return(0);
+}
@@ -0,0 +1,38 @@
+/***********************************************************************************************************************
+ *
+ * 	Motor command sender for the EV3 BT library - Motor power/stop requests are not written to the BT link by
+ * 	the caller. Each motor port has a single pending slot, a request overwrites whatever was pending for that
+ * 	port (latest wins), and a sender thread sends everything pending as one batched command at most once per
+ * 	period. If the link is slow intermediate values are simply dropped, so it never builds a backlog of stale
+ * 	motor commands. BT_motor_set_steer() requests both wheels of a differential drive as one synchronised
+ * 	opcode, so they never go out with one wheel updated and the other not.
+ *
+ * 	Timed manoeuvres ("reverse at -45 for 1500 ms") are run by the same thread against the monotonic clock, so
+ * 	the caller never blocks while the motors run. The ports involved are locked until the manoeuvre ends.
+ *
+ * 	BT_all_stop() jumps the outbound queue and invalidates any motor request or manoeuvre started before it.
+ *
+ * 	Requests can be tagged with the capture time of the camera frame they came from (BT_motor_origin()), the
+ * 	delay from capture to the command being written to the BT socket is kept in a latency histogram.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btmotors_header
+#define __btmotors_header
+
+#include "btcomm.h"
+
+int BT_motor_sender_start(int rate_hz);
+int BT_motor_sender_stop(void);
+int BT_motor_set_power(char port_ids, char power);
+int BT_motor_set_stop(char port_ids, int brake_mode);
+int BT_motor_set_steer(char lport, char rport, char lpower, char rpower);
+int BT_motor_timed(char port_ids, char power, int duration_ms, int brake_mode);
+int BT_motor_timed_pair(char lport, char rport, char lpower, char rpower, int duration_ms, int lbrake, int rbrake);
+int BT_motor_manoeuvre_active(char port_ids);
+long long BT_motor_sender_dropped(void);
+void BT_motor_origin(long long capture_us);
+void BT_motor_latency_print(FILE *fp);
+void BT_motor_latency_reset(void);
+
+#endif
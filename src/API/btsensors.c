@@ -0,0 +1,305 @@
+/***********************************************************************************************************************
+ *
+ * 	Background sensor poller for the EV3 BT library. See btsensors.h
+ *
+ * ********************************************************************************************************************/
+#include "btsensors.h"
+#include "btbatch.h"
+#include <time.h>
+
+struct BT_sensor_slot{
+ unsigned int seq;			// Odd while the poller is updating the reading
+ struct BT_sensor_reading r;
+};
+
+struct BT_sensor_request{
+ struct BT_batch batch;			// Poll command, and its reply once it arrives
+ int handle[BT_SENSOR_COUNT];		// Read handle in the batch for each sensor
+ long long sent;			// When the request was queued (us)
+};
+
+static struct BT_sensor_slot sensor_slots[BT_SENSOR_COUNT];
+static int sensor_ports[BT_SENSOR_COUNT]={BT_SENSOR_UNUSED,BT_SENSOR_UNUSED,BT_SENSOR_UNUSED,BT_SENSOR_UNUSED,
+                                         BT_SENSOR_UNUSED,BT_SENSOR_UNUSED};
+static long long poll_period_us=20000;
+static int poll_running=0;
+static int poll_in_flight=0;
+static long long poll_skipped=0;
+static pthread_t poll_thread;
+static pthread_mutex_t publish_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+long long BT_sensor_time_us(void)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Returns the current monotonic time in microseconds. Not affected by changes to the wall
+ // clock, so it is safe to compare and subtract timestamps.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000000LL+ts.tv_nsec/1000);
+}
+
+static void publish_reading(int sensor, const int value[3], int status, long long timestamp)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Writer side of the seqlock. Replies normally complete on the BT reader thread, but failures
+ // can be reported from elsewhere, so writers serialize on publish_mutex (readers never take it).
+ // The sequence number goes odd before the fields are touched and even (with release ordering)
+ // once they are all stored, so a reader that sees the same even value before and after its
+ // copy got a consistent reading.
+ //
+ // With several polls in flight, an old one can complete (or be failed by the reclaimer) after a
+ // newer one. Its reading is older than what the slot holds, so it is dropped rather than moving
+ // the timestamp backwards.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_sensor_slot *s=&sensor_slots[sensor];
+ unsigned int seq;
+
+ pthread_mutex_lock(&publish_mutex);
+ if (s->r.count>0&&timestamp<=s->r.timestamp)
+ {
+  pthread_mutex_unlock(&publish_mutex);
+  return;
+ }
+ seq=__atomic_load_n(&s->seq,__ATOMIC_RELAXED);
+ __atomic_store_n(&s->seq,seq+1,__ATOMIC_RELAXED);
+ __atomic_thread_fence(__ATOMIC_RELEASE);
+
+ for (int i=0; i<3; i++)
+  __atomic_store_n(&s->r.value[i],value[i],__ATOMIC_RELAXED);
+ __atomic_store_n(&s->r.status,status,__ATOMIC_RELAXED);
+ __atomic_store_n(&s->r.timestamp,timestamp,__ATOMIC_RELAXED);
+ __atomic_store_n(&s->r.count,s->r.count+1,__ATOMIC_RELAXED);
+
+ __atomic_store_n(&s->seq,seq+2,__ATOMIC_RELEASE);
+ pthread_mutex_unlock(&publish_mutex);
+}
+
+int BT_sensor_latest(int sensor, struct BT_sensor_reading *r)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Get the most recent reading published by the poller for the specified sensor. Never blocks,
+ // if the poller is in the middle of an update we just try again.
+ //
+ // Inputs: sensor - one of the BT_SENSOR_* identifiers
+ //         r - where the reading is returned
+ // Returns: 0 if a reading is available (check r->timestamp for its age)
+ //          -1 if the sensor is invalid or nothing has been read yet
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_sensor_slot *s;
+ unsigned int seq1, seq2;
+
+ if (sensor<0||sensor>=BT_SENSOR_COUNT) return(-1);
+ s=&sensor_slots[sensor];
+
+ do
+ {
+  seq1=__atomic_load_n(&s->seq,__ATOMIC_ACQUIRE);
+  if (seq1&1) continue;
+  for (int i=0; i<3; i++)
+   r->value[i]=__atomic_load_n(&s->r.value[i],__ATOMIC_RELAXED);
+  r->status=__atomic_load_n(&s->r.status,__ATOMIC_RELAXED);
+  r->timestamp=__atomic_load_n(&s->r.timestamp,__ATOMIC_RELAXED);
+  r->count=__atomic_load_n(&s->r.count,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  seq2=__atomic_load_n(&s->seq,__ATOMIC_RELAXED);
+ } while ((seq1&1)||seq1!=seq2);
+
+ if (r->count==0) return(-1);
+ return(0);
+}
+
+static void poll_reply(const unsigned char *reply, int reply_len, void *arg)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Callback for a poll request, runs when its reply arrives (or with reply_len -1 if it failed).
+ // The EV3 sampled the sensors somewhere between the request going out and the reply coming
+ // back, so readings are stamped with the midpoint, not the arrival time.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_sensor_request *q=(struct BT_sensor_request *)arg;
+ long long now=BT_sensor_time_us();
+ int value[3];
+ int status;
+
+ q->batch.status=-1;
+ if (reply_len>=5+q->batch.global_size&&reply_len<=(int)sizeof(q->batch.reply)&&reply[4]==0x02)
+ {
+  memcpy(&q->batch.reply[0],reply,reply_len);
+  q->batch.status=0;
+ }
+ for (int i=0; i<BT_SENSOR_COUNT; i++)
+ {
+  if (q->handle[i]<0) continue;
+  value[0]=value[1]=value[2]=0;
+  status=BT_batch_result(&q->batch,q->handle[i],value);
+  publish_reading(i,value,status,q->sent+(now-q->sent)/2);
+ }
+ __atomic_fetch_sub(&poll_in_flight,1,__ATOMIC_RELEASE);
+ free(q);
+}
+
+static void poll_sensors(void)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Read all the configured sensors with a single batched direct command (one round-trip
+ // per period regardless of how many sensors are connected). The request is pipelined: we
+ // don't wait for the reply, so the polling rate is not limited by the BT round-trip time.
+ // At most BT_SENSOR_MAX_IN_FLIGHT polls are outstanding, if the link can't keep up we skip
+ // a period rather than queue stale requests.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct BT_sensor_request *q;
+
+ if (__atomic_load_n(&poll_in_flight,__ATOMIC_ACQUIRE)>=BT_SENSOR_MAX_IN_FLIGHT)
+ {
+  poll_skipped++;
+  return;
+ }
+
+ q=(struct BT_sensor_request *)malloc(sizeof(struct BT_sensor_request));
+ if (q==NULL) return;
+ BT_batch_begin(&q->batch);
+ for (int i=0; i<BT_SENSOR_COUNT; i++)
+ {
+  q->handle[i]=-1;
+  if (sensor_ports[i]==BT_SENSOR_UNUSED) continue;
+  switch(i)
+  {
+   case BT_SENSOR_TOUCH: q->handle[i]=BT_batch_read_touch(&q->batch,sensor_ports[i]); break;
+   case BT_SENSOR_COLOUR_RGB: q->handle[i]=BT_batch_read_colour_RGB(&q->batch,sensor_ports[i]); break;
+   case BT_SENSOR_GYRO: q->handle[i]=BT_batch_read_gyro(&q->batch,sensor_ports[i]); break;
+   case BT_SENSOR_ULTRASONIC: q->handle[i]=BT_batch_read_ultrasonic(&q->batch,sensor_ports[i]); break;
+   case BT_SENSOR_TACHO_LEFT:
+   case BT_SENSOR_TACHO_RIGHT: q->handle[i]=BT_batch_read_tacho(&q->batch,sensor_ports[i]); break;
+  }
+ }
+ if (BT_batch_empty(&q->batch))
+ {
+  free(q);
+  return;
+ }
+ BT_batch_finish(&q->batch);
+
+ __atomic_fetch_add(&poll_in_flight,1,__ATOMIC_ACQ_REL);
+ q->sent=BT_sensor_time_us();
+ if (BT_send_callback(&q->batch.cmd[0],q->batch.len,poll_reply,q)<0)
+ {
+  __atomic_fetch_sub(&poll_in_flight,1,__ATOMIC_RELEASE);
+  free(q);
+ }
+}
+
+static void *poll_loop(void *arg)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Poller thread. Requests every configured sensor once per period. Wake-ups are scheduled against
+ // absolute monotonic deadlines so the rate doesn't drift. If we fall behind (e.g. the thread
+ // wasn't scheduled for a while) we skip ahead instead of trying to catch up.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct timespec next;
+ long long now, deadline;
+
+ perf_trace_thread_name("BT sensor poll");
+ deadline=BT_sensor_time_us();
+ while (__atomic_load_n(&poll_running,__ATOMIC_ACQUIRE))
+ {
+  poll_sensors();
+
+  deadline+=poll_period_us;
+  now=BT_sensor_time_us();
+  if (deadline<now) deadline=now;
+  next.tv_sec=deadline/1000000LL;
+  next.tv_nsec=(deadline%1000000LL)*1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&next,NULL)==EINTR);
+ }
+ return(NULL);
+}
+
+int BT_sensor_poll_tachos(int left_motor, int right_motor)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Also read the tacho counts of the two drive motors on every poll (for odometry). They come
+ // back in the same reply as the sensors, so both counts share one timestamp. Must be called
+ // before BT_sensor_poll_start().
+ //
+ // Inputs: left_motor, right_motor - single motor ports (MOTOR_A to MOTOR_D), or BT_SENSOR_UNUSED
+ // Returns: 0 on success
+ //          -1 if the poller is already running or a port is invalid
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ int ports[2]={left_motor,right_motor};
+
+ if (__atomic_load_n(&poll_running,__ATOMIC_ACQUIRE))
+ {
+  fprintf(stderr,"BT_sensor_poll_tachos(): The poller is already running\n");
+  return(-1);
+ }
+ for (int i=0; i<2; i++)
+  if (ports[i]!=BT_SENSOR_UNUSED&&ports[i]!=MOTOR_A&&ports[i]!=MOTOR_B&&ports[i]!=MOTOR_C&&ports[i]!=MOTOR_D)
+  {
+   fprintf(stderr,"BT_sensor_poll_tachos(): Invalid port id value\n");
+   return(-1);
+  }
+ sensor_ports[BT_SENSOR_TACHO_LEFT]=left_motor;
+ sensor_ports[BT_SENSOR_TACHO_RIGHT]=right_motor;
+ return(0);
+}
+
+int BT_sensor_poll_start(int touch_port, int colour_port, int gyro_port, int ultrasonic_port, int rate_hz)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start the sensor poller thread. Ports are identified as PORT_1, PORT_2, etc, use
+ // BT_SENSOR_UNUSED for any sensor that is not connected. Calling this while the poller
+ // is already running does nothing, so it's safe to call from setup code that runs more
+ // than once.
+ //
+ // Inputs: sensor ports, and the polling rate in Hz (all sensors are read once per period)
+ // Returns: 0 on success
+ //          -1 on invalid input or if the thread could not be created
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ if (__atomic_load_n(&poll_running,__ATOMIC_ACQUIRE)) return(0);
+
+ if (rate_hz<=0||rate_hz>1000)
+ {
+  fprintf(stderr,"BT_sensor_poll_start(): Invalid polling rate %d\n",rate_hz);
+  return(-1);
+ }
+
+ sensor_ports[BT_SENSOR_TOUCH]=touch_port;
+ sensor_ports[BT_SENSOR_COLOUR_RGB]=colour_port;
+ sensor_ports[BT_SENSOR_GYRO]=gyro_port;
+ sensor_ports[BT_SENSOR_ULTRASONIC]=ultrasonic_port;
+ for (int i=0; i<BT_SENSOR_TACHO_LEFT; i++)
+  if (sensor_ports[i]!=BT_SENSOR_UNUSED&&(sensor_ports[i]<PORT_1||sensor_ports[i]>PORT_4))
+  {
+   fprintf(stderr,"BT_sensor_poll_start(): Invalid port id value\n");
+   return(-1);
+  }
+ poll_period_us=1000000LL/rate_hz;
+
+ __atomic_store_n(&poll_running,1,__ATOMIC_RELEASE);
+ if (pthread_create(&poll_thread,NULL,poll_loop,NULL)!=0)
+ {
+  fprintf(stderr,"BT_sensor_poll_start(): Unable to create poller thread\n");
+  __atomic_store_n(&poll_running,0,__ATOMIC_RELEASE);
+  return(-1);
+ }
+ return(0);
+}
+
+long long BT_sensor_poll_skipped(void)
+{
+ // Number of poll periods skipped because too many polls were still waiting for a reply
+ return(poll_skipped);
+}
+
+int BT_sensor_poll_stop(void)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Stop the poller thread and wait for it to exit. Must be called before BT_close().
+ // Polls still in flight complete (or fail) normally. The last published readings
+ // remain available through BT_sensor_latest().
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ if (!__atomic_load_n(&poll_running,__ATOMIC_ACQUIRE)) return(0);
+ __atomic_store_n(&poll_running,0,__ATOMIC_RELEASE);
+ pthread_join(poll_thread,NULL);
+ return(0);
+}
@@ -0,0 +1,48 @@
+/***********************************************************************************************************************
+ *
+ * 	Background sensor poller for the EV3 BT library - A service thread polls the configured sensor ports at a
+ * 	fixed rate and publishes the latest timestamped reading for each sensor, and optionally the tacho counts of
+ * 	the drive motors. Readers get the most recent value with a couple of memory loads instead of a blocking
+ * 	round-trip over the BT link.
+ *
+ * 	Polls are pipelined (sent without waiting for the previous reply), so the rate is not bound by the BT
+ * 	round-trip time, which matters for the gyro. Each reading is stamped with the estimated time the EV3
+ * 	sampled it.
+ *
+ * 	Readings are published through a sequence lock (seqlock): readers never block the poller and simply retry
+ * 	if they raced with an update.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btsensors_header
+#define __btsensors_header
+
+#include "btcomm.h"
+
+// Sensor identifiers for BT_sensor_latest()
+#define BT_SENSOR_TOUCH 0
+#define BT_SENSOR_COLOUR_RGB 1
+#define BT_SENSOR_GYRO 2
+#define BT_SENSOR_ULTRASONIC 3
+#define BT_SENSOR_TACHO_LEFT 4		// Drive motor tacho counts, see BT_sensor_poll_tachos()
+#define BT_SENSOR_TACHO_RIGHT 5
+#define BT_SENSOR_COUNT 6
+
+#define BT_SENSOR_UNUSED -1		// Pass as the port for any sensor that is not connected
+#define BT_SENSOR_MAX_IN_FLIGHT 8	// Max. polls waiting for a reply before periods are skipped
+
+struct BT_sensor_reading{
+ int value[3];			// Touch/gyro/ultrasonic/tacho use value[0], colour uses R,G,B
+ int status;			// 0 if the last poll succeeded, -1 otherwise
+ long long timestamp;		// Monotonic time (us) the EV3 took the reading, estimated (see BT_sensor_time_us())
+ unsigned int count;		// Number of readings published so far, 0 means nothing read yet
+};
+
+int BT_sensor_poll_tachos(int left_motor, int right_motor);
+int BT_sensor_poll_start(int touch_port, int colour_port, int gyro_port, int ultrasonic_port, int rate_hz);
+int BT_sensor_poll_stop(void);
+int BT_sensor_latest(int sensor, struct BT_sensor_reading *r);
+long long BT_sensor_time_us(void);
+long long BT_sensor_poll_skipped(void);
+
+#endif
@@ -1,2 +1,2 @@
-gcc -O3 -g ./roboSoccer.c ./roboAI.c ./API/*.c ./imagecapture/*.c -lpthread -lm -lbluetooth -lglut -lSDL -lGLU -lGL -o roboSoccer
-#gcc -O3 -fopenmp -g ./roboSoccer.c ./roboAI.c ./API/*.c ./imagecapture/*.c -lpthread -lm -lbluetooth -lglut -lSDL -lGLU -lGL -o roboSoccer
+gcc -O3 -g ./roboSoccer.c ./roboAI.c ./estimator.c ./telemetry.c ./API/*.c ./perf/*.c ./imagecapture/*.c -lpthread -lm -lbluetooth -lglut -lSDL -lGLU -lGL -o roboSoccer
+#gcc -O3 -fopenmp -g ./roboSoccer.c ./roboAI.c ./estimator.c ./telemetry.c ./API/*.c ./perf/*.c ./imagecapture/*.c -lpthread -lm -lbluetooth -lglut -lSDL -lGLU -lGL -o roboSoccer
@@ -0,0 +1,553 @@
+/***************************************************
+ Pose estimator - gyro/odometry/vision fusion. See
+ estimator.h for how it works.
+
+ Threads: the sampler thread (or whoever steps a
+ stepped estimator) writes the gyro and odometry
+ histories, the AI thread feeds camera fixes
+ in, and any thread may ask for the current pose. Everything
+ shared is behind est_mutex, all the critical
+ sections are a few arithmetic operations.
+
+***************************************************/
+
+#include "roboAI.h"
+#include "estimator.h"
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+struct gyro_sample{
+  long long t;          // When the EV3 took the reading (us, BT_sensor_time_us() clock)
+  double angle;         // Gyro angle in radians, GYRO_SIGN applied
+};
+
+struct odom_sample{
+  long long t;          // Time of the tacho reading (us)
+  double x, y;          // Pose in image coordinates, corrected by vision
+  double theta;         // Heading angle (radians, not wrapped so it can be interpolated)
+  double rx, ry;        // Same track but never corrected, for estimating the wheel scale
+};
+
+static struct gyro_sample gyro_hist[ESTIMATOR_HISTORY];
+static int gyro_head = 0;               // Index of the newest sample
+static int gyro_n = 0;                  // Valid samples in the history
+static unsigned int gyro_last_count = 0;
+
+static struct odom_sample odom_hist[ESTIMATOR_HISTORY];
+static int odom_head = 0;
+static int odom_n = 0;
+static unsigned int tacho_last_count = 0;
+static int tacho_left, tacho_right;     // Counts at the newest odometry sample
+
+static int odom_enabled = 0;
+static int gyro_enabled = 0;            // 0 if there is no gyro port, anything in the gyro slot is ignored
+static int odom_init = 0;               // 1 once the pose has been placed by a camera fix
+static long long odom_last_fix = 0;     // When the last camera fix came in
+static double odom_scale = ODOM_DEG_TO_PX;
+static double odom_path = 0;            // Total wheel travel (pixels), drives the scale re-estimate
+static double scale_path;               // odom_path, raw odometry and vision positions at the
+static double scale_rx, scale_ry;       // start of the current scale re-estimate
+static double scale_vx, scale_vy;
+
+static int est_running = 0;
+static int est_threaded = 0;            // 1 if est_thread is running the sampler (not stepped)
+static pthread_t est_thread;
+static pthread_mutex_t est_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int heading_init = 0;            // 1 once the offset has been seeded from vision
+static double heading_offset = 0;       // Fused heading angle = gyro angle + offset
+static int heading_rejects = 0;         // Consecutive camera headings rejected by the gate
+static long long heading_rejects_total = 0;
+
+static double wrap_angle(double a){
+  // Wrap an angle to [-PI, PI)
+  a = fmod(a + PI, 2 * PI);
+  if (a < 0) a += 2 * PI;
+  return a - PI;
+}
+
+static int gyro_fresh(void){
+  // 1 if the gyro history is usable: we have samples and the newest is recent
+  if (gyro_n < 2) return 0;
+  return BT_sensor_time_us() - gyro_hist[gyro_head].t <= SENSOR_MAX_AGE_US;
+}
+
+static double gyro_angle_at(long long t){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Gyro angle at time t, interpolated between the two samples around it. Past the
+  // newest sample we extrapolate with the last measured rate (for at most
+  // SENSOR_MAX_AGE_US, beyond that the rate is not worth trusting). Needs gyro_n>=2,
+  // caller holds est_mutex.
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct gyro_sample *a, *b;
+  int i, j;
+
+  b = &gyro_hist[gyro_head];
+  a = &gyro_hist[(gyro_head + ESTIMATOR_HISTORY - 1) % ESTIMATOR_HISTORY];
+  if (t >= b->t){
+    if (t - b->t > SENSOR_MAX_AGE_US) t = b->t + SENSOR_MAX_AGE_US;
+    if (b->t <= a->t) return b->angle;
+    return b->angle + (b->angle - a->angle) * (double)(t - b->t) / (double)(b->t - a->t);
+  }
+
+  // Walk back from the newest sample until we find the pair around t
+  for (i = 1; i < gyro_n; i++){
+    j = (gyro_head + ESTIMATOR_HISTORY - i) % ESTIMATOR_HISTORY;
+    a = &gyro_hist[j];
+    if (a->t <= t){
+      if (b->t <= a->t) return a->angle;
+      return a->angle + (b->angle - a->angle) * (double)(t - a->t) / (double)(b->t - a->t);
+    }
+    b = a;
+  }
+  return b->angle;      // Older than anything we kept
+}
+
+static int odom_fresh(void){
+  // 1 if odometry is usable: we have tacho samples and the newest is recent
+  if (odom_n < 2) return 0;
+  return BT_sensor_time_us() - odom_hist[odom_head].t <= SENSOR_MAX_AGE_US;
+}
+
+static void odom_pose_at(long long t, struct odom_sample *p){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Odometry pose at time t, interpolated like gyro_angle_at() (and extrapolated with
+  // the last wheel velocity past the newest sample). Needs odom_n>=2, caller holds
+  // est_mutex.
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct odom_sample *a, *b;
+  double f;
+  int i;
+
+  b = &odom_hist[odom_head];
+  a = &odom_hist[(odom_head + ESTIMATOR_HISTORY - 1) % ESTIMATOR_HISTORY];
+  if (t < b->t){
+    for (i = 1; i < odom_n; i++){
+      a = &odom_hist[(odom_head + ESTIMATOR_HISTORY - i) % ESTIMATOR_HISTORY];
+      if (a->t <= t) break;
+      b = a;
+    }
+    if (i == odom_n){
+      *p = *b;          // Older than anything we kept
+      return;
+    }
+  }else if (t - b->t > SENSOR_MAX_AGE_US){
+    t = b->t + SENSOR_MAX_AGE_US;
+  }
+
+  if (b->t <= a->t){
+    *p = *b;
+    return;
+  }
+  f = (double)(t - a->t) / (double)(b->t - a->t);
+  p->t = t;
+  p->x = a->x + (b->x - a->x) * f;
+  p->y = a->y + (b->y - a->y) * f;
+  p->theta = a->theta + (b->theta - a->theta) * f;
+  p->rx = a->rx + (b->rx - a->rx) * f;
+  p->ry = a->ry + (b->ry - a->ry) * f;
+}
+
+static void odom_shift(double dx, double dy, double dtheta){
+  // Apply a correction to the whole odometry history, so interpolating across the
+  // time of a correction doesn't see a jump. Caller holds est_mutex.
+  for (int i = 0; i < odom_n; i++){
+    struct odom_sample *o = &odom_hist[(odom_head + ESTIMATOR_HISTORY - i) % ESTIMATOR_HISTORY];
+    o->x += dx;
+    o->y += dy;
+    o->theta += dtheta;
+  }
+}
+
+static void odom_step(long long t, int left, int right){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Advance the differential-drive model to a new pair of tacho counts. The distance
+  // is the mean wheel travel, the heading comes from the fused gyro heading when we
+  // have one and from the wheel difference otherwise. Positions are integrated along
+  // the mid-step heading. Caller holds est_mutex.
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct odom_sample *prev, *o;
+  double ds, theta, mid;
+  int dl, dr;
+
+  if (odom_n == 0){
+    odom_head = 0;
+    o = &odom_hist[0];
+    memset(o, 0, sizeof(struct odom_sample));
+    o->t = t;
+    tacho_left = left;
+    tacho_right = right;
+    odom_n = 1;
+    return;
+  }
+  if (t <= odom_hist[odom_head].t) return;
+
+  prev = &odom_hist[odom_head];
+  dl = left - tacho_left;
+  dr = right - tacho_right;
+  tacho_left = left;
+  tacho_right = right;
+  if (abs(dl) > ODOM_MAX_STEP || abs(dr) > ODOM_MAX_STEP) dl = dr = 0;    // Counts were cleared, not a real move
+
+  ds = (dl + dr) / 2.0 * odom_scale;
+  if (heading_init && gyro_fresh())
+    theta = prev->theta + wrap_angle(heading_offset + gyro_angle_at(t) - prev->theta);
+  else
+    theta = prev->theta + (dl - dr) * ODOM_TURN_RATIO * PI / 180.0;
+  mid = (prev->theta + theta) / 2;
+
+  odom_head = (odom_head + 1) % ESTIMATOR_HISTORY;
+  o = &odom_hist[odom_head];
+  *o = *prev;
+  o->t = t;
+  o->theta = theta;
+  o->x += ds * cos(mid);
+  o->y += ds * sin(mid);
+  o->rx += ds * cos(mid);
+  o->ry += ds * sin(mid);
+  if (odom_n < ESTIMATOR_HISTORY) odom_n++;
+  odom_path += fabs(ds);
+}
+
+void estimator_sample(void){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Copy every new gyro reading the poller published into the history, and advance
+  // the odometry with every new pair of tacho counts. Each sample keeps the poller's
+  // timestamp (when the EV3 took it), not the time we saw it. Called by the sampler
+  // thread, or by the owner of a stepped estimator (see estimator_start_stepped()).
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct BT_sensor_reading r, tl, tr;
+
+  if (gyro_enabled && BT_sensor_latest(BT_SENSOR_GYRO, &r) == 0 && r.count != gyro_last_count && r.status == 0){
+    pthread_mutex_lock(&est_mutex);
+    if (gyro_n == 0 || r.timestamp > gyro_hist[gyro_head].t){
+      gyro_head = (gyro_head + 1) % ESTIMATOR_HISTORY;
+      gyro_hist[gyro_head].t = r.timestamp;
+      gyro_hist[gyro_head].angle = GYRO_SIGN * r.value[0] * PI / 180.0;
+      if (gyro_n < ESTIMATOR_HISTORY) gyro_n++;
+    }
+    pthread_mutex_unlock(&est_mutex);
+    gyro_last_count = r.count;
+  }
+
+  // Both tacho counts come from the same poll reply, wait until both are published
+  if (odom_enabled && BT_sensor_latest(BT_SENSOR_TACHO_LEFT, &tl) == 0 && BT_sensor_latest(BT_SENSOR_TACHO_RIGHT, &tr) == 0 &&
+      tl.count != tacho_last_count && tl.timestamp == tr.timestamp){
+    if (tl.status == 0 && tr.status == 0){
+      pthread_mutex_lock(&est_mutex);
+      odom_step(tl.timestamp, tl.value[0], tr.value[0]);
+      pthread_mutex_unlock(&est_mutex);
+    }
+    tacho_last_count = tl.count;
+  }
+}
+
+static void *estimator_loop(void *arg){
+  // Sampler thread. Runs faster than the poller so no reading is missed
+  struct timespec next;
+  long long period_ns = 1000000000LL / ESTIMATOR_RATE;
+
+  perf_trace_thread_name("estimator");
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (__atomic_load_n(&est_running, __ATOMIC_ACQUIRE)){
+    estimator_sample();
+
+    next.tv_nsec += period_ns;
+    while (next.tv_nsec >= 1000000000L){
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
+
+static int estimator_reset(int gyro_port, int odometry){
+  // Clear any previous estimate, and the histories if the estimator isn't running yet.
+  // Returns 1 if the caller should start it.
+  pthread_mutex_lock(&est_mutex);
+  heading_init = 0;
+  heading_rejects = 0;
+  odom_init = 0;
+  pthread_mutex_unlock(&est_mutex);
+
+  if ((gyro_port == BT_SENSOR_UNUSED && !odometry) || est_running) return 0;
+
+  gyro_n = 0;
+  gyro_last_count = 0;
+  odom_n = 0;
+  tacho_last_count = 0;
+  odom_enabled = odometry;
+  gyro_enabled = (gyro_port != BT_SENSOR_UNUSED);
+  odom_scale = ODOM_DEG_TO_PX;
+  return 1;
+}
+
+int estimator_start(int gyro_port, int odometry){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Start the sampler. The sensor poller must be reading the gyro on gyro_port, and
+  // for odometry the drive tachos (BT_sensor_poll_tachos()). Clears any previous
+  // estimate (the AI is starting over).
+  //
+  // Inputs: gyro_port - the port the gyro is on, or BT_SENSOR_UNUSED (then
+  //                     estimator_fuse_heading() returns -1)
+  //         odometry - 1 if the tacho counts are being polled, 0 otherwise (then
+  //                    estimator_fuse_pose() returns -1)
+  // Returns: 0 on success, -1 if the thread could not be started
+  //////////////////////////////////////////////////////////////////////////////////////
+  if (!estimator_reset(gyro_port, odometry)) return 0;
+
+  est_running = 1;
+  est_threaded = 1;
+  if (pthread_create(&est_thread, NULL, estimator_loop, NULL) != 0){
+    fprintf(stderr, "estimator_start(): Unable to start the gyro sampler thread\n");
+    est_running = 0;
+    est_threaded = 0;
+    return -1;
+  }
+  return 0;
+}
+
+int estimator_start_stepped(int gyro_port, int odometry){
+  // Same as estimator_start(), but without the sampler thread: the caller feeds the
+  // readings in with estimator_sample(). For replaying recorded runs deterministically.
+  if (estimator_reset(gyro_port, odometry)) est_running = 1;
+  return 0;
+}
+
+int estimator_stop(void){
+  // Stop the sampler thread. Call before stopping the sensor poller.
+  if (!est_running) return 0;
+  __atomic_store_n(&est_running, 0, __ATOMIC_RELEASE);
+  if (est_threaded) pthread_join(est_thread, NULL);
+  est_threaded = 0;
+  if (heading_rejects_total > 0)
+    fprintf(stderr, "estimator: %lld camera headings rejected by the gyro gate\n", heading_rejects_total);
+  if (odom_enabled)
+    fprintf(stderr, "estimator: odometry scale %.4f pixels per wheel degree\n", odom_scale);
+  return 0;
+}
+
+int estimator_have_gyro(void){
+  // 1 if the gyro is being sampled and its readings are current
+  int ok;
+  if (!est_running) return 0;
+  pthread_mutex_lock(&est_mutex);
+  ok = gyro_fresh();
+  pthread_mutex_unlock(&est_mutex);
+  return ok;
+}
+
+int estimator_fuse_heading(double vdx, double vdy, long long frame_time, double *hx, double *hy){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Feed in the heading measured from the latest camera frame, get back the fused
+  // heading. The camera heading may be flipped 180 degrees, that is fine: of the two
+  // possible headings we use the one that agrees with the gyro. The first frame seeds
+  // the estimate as-is (see estimator_reset_heading() to fix it if it was flipped).
+  //
+  // Inputs: vdx, vdy - heading direction from the blob, need not be unit length
+  //         frame_time - capture time of the frame (us, monotonic), 0 if unknown
+  //         hx, hy - where the fused heading (unit vector, as of now) is returned
+  // Returns: 0 if the fused heading was returned
+  //          -1 if there is no usable gyro (hx, hy are left alone)
+  //////////////////////////////////////////////////////////////////////////////////////
+  long long t_frame;
+  double g, predicted, vision, err, err_flip, now_angle;
+
+  if (!est_running || (vdx == 0 && vdy == 0)) return -1;
+
+  pthread_mutex_lock(&est_mutex);
+  if (!gyro_fresh()){
+    pthread_mutex_unlock(&est_mutex);
+    return -1;
+  }
+
+  t_frame = frame_time > 0 ? frame_time : BT_sensor_time_us() - CAMERA_LATENCY_US;
+  g = gyro_angle_at(t_frame);
+  vision = atan2(vdy, vdx);
+
+  if (!heading_init){
+    heading_offset = wrap_angle(vision - g);
+    heading_init = 1;
+  }else{
+    predicted = heading_offset + g;
+    err = wrap_angle(vision - predicted);
+    err_flip = wrap_angle(vision + PI - predicted);
+    if (fabs(err_flip) < fabs(err)) err = err_flip;
+
+    if (fabs(err) <= HEADING_GATE){
+      heading_offset = wrap_angle(heading_offset + HEADING_VISION_GAIN * err);
+      heading_rejects = 0;
+    }else if (++heading_rejects >= HEADING_MAX_REJECTS){
+      // Vision has disagreed for a while, trust it (still taking the closer of the two)
+      heading_offset = wrap_angle(heading_offset + err);
+      heading_rejects = 0;
+    }else{
+      heading_rejects_total++;
+    }
+  }
+
+  now_angle = heading_offset + gyro_angle_at(BT_sensor_time_us());
+  pthread_mutex_unlock(&est_mutex);
+
+  *hx = cos(now_angle);
+  *hy = sin(now_angle);
+  return 0;
+}
+
+int estimator_get_heading(double *hx, double *hy){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Current fused heading, from the latest gyro reading (extrapolated to now). Cheap
+  // enough to call at the control rate, between camera frames.
+  //
+  // Returns: 0 if the heading was returned
+  //          -1 if there is no gyro or no camera heading has been fused yet
+  //////////////////////////////////////////////////////////////////////////////////////
+  double a;
+
+  if (!est_running) return -1;
+  pthread_mutex_lock(&est_mutex);
+  if (!heading_init || !gyro_fresh()){
+    pthread_mutex_unlock(&est_mutex);
+    return -1;
+  }
+  a = heading_offset + gyro_angle_at(BT_sensor_time_us());
+  pthread_mutex_unlock(&est_mutex);
+
+  *hx = cos(a);
+  *hy = sin(a);
+  return 0;
+}
+
+int estimator_reset_heading(double dx, double dy){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Force the current heading to (dx, dy), e.g. when the AI has decided the initial
+  // camera heading was flipped. The gyro keeps tracking from there.
+  //
+  // Returns: 0 on success, -1 if there is no gyro
+  //////////////////////////////////////////////////////////////////////////////////////
+  double old;
+
+  if (!est_running || (dx == 0 && dy == 0)) return -1;
+  pthread_mutex_lock(&est_mutex);
+  if (!gyro_fresh()){
+    pthread_mutex_unlock(&est_mutex);
+    return -1;
+  }
+  old = heading_offset;
+  heading_offset = wrap_angle(atan2(dy, dx) - gyro_angle_at(BT_sensor_time_us()));
+  if (heading_init && odom_n > 0) odom_shift(0, 0, wrap_angle(heading_offset - old));   // Turn the odometry with it
+  heading_init = 1;
+  heading_rejects = 0;
+  pthread_mutex_unlock(&est_mutex);
+  return 0;
+}
+
+int estimator_fuse_pose(double vx, double vy, double hx, double hy, long long frame_time, double *px, double *py){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Feed in the bot position (and the AI's heading) from the latest camera frame, get
+  // back the fused position. The first fix places the odometry. After that the
+  // camera corrects ODOM_VISION_GAIN of the disagreement with the odometry (as of
+  // frame time) per frame, or all of it if they are more than ODOM_RESET_DIST apart.
+  // Without a gyro the odometry heading is corrected towards (hx, hy) the same way
+  // the gyro offset is.
+  //
+  // Inputs: vx, vy - bot blob position, hx, hy - heading (need not be unit length)
+  //         frame_time - capture time of the frame (us, monotonic), 0 if unknown
+  //         px, py - where the fused position (as of now) is returned
+  // Returns: 0 if the fused position was returned
+  //          -1 if there is no usable odometry (px, py are left alone)
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct odom_sample o, cur;
+  double ex, ey, eth, k, od, vd, ratio;
+  long long now;
+  int have_heading = (hx != 0 || hy != 0);
+
+  if (!est_running || !odom_enabled) return -1;
+
+  pthread_mutex_lock(&est_mutex);
+  if (!odom_fresh()){
+    pthread_mutex_unlock(&est_mutex);
+    return -1;
+  }
+
+  now = BT_sensor_time_us();
+  odom_pose_at(frame_time > 0 ? frame_time : now - CAMERA_LATENCY_US, &o);
+  ex = vx - o.x;
+  ey = vy - o.y;
+  eth = have_heading ? wrap_angle(atan2(hy, hx) - o.theta) : 0;
+
+  if (!odom_init){
+    odom_shift(ex, ey, eth);
+    odom_init = 1;
+    scale_path = odom_path;
+    scale_rx = o.rx;
+    scale_ry = o.ry;
+    scale_vx = vx;
+    scale_vy = vy;
+  }else{
+    k = (sqrt(ex * ex + ey * ey) > ODOM_RESET_DIST) ? 1.0 : ODOM_VISION_GAIN;
+    odom_shift(k * ex, k * ey, (heading_init && gyro_fresh()) ? 0 : HEADING_VISION_GAIN * eth);
+
+    // Re-estimate the wheel scale: straight-line distance seen by the camera against
+    // the one the uncorrected odometry saw over the same stretch
+    if (odom_path - scale_path >= ODOM_SCALE_DIST){
+      od = sqrt((o.rx - scale_rx) * (o.rx - scale_rx) + (o.ry - scale_ry) * (o.ry - scale_ry));
+      vd = sqrt((vx - scale_vx) * (vx - scale_vx) + (vy - scale_vy) * (vy - scale_vy));
+      if (od > ODOM_SCALE_DIST / 2){
+        ratio = vd / od;
+        if (ratio < 0.5) ratio = 0.5;
+        if (ratio > 2) ratio = 2;
+        odom_scale *= 1 + ODOM_SCALE_GAIN * (ratio - 1);
+        if (odom_scale < ODOM_DEG_TO_PX / 5) odom_scale = ODOM_DEG_TO_PX / 5;
+        if (odom_scale > ODOM_DEG_TO_PX * 5) odom_scale = ODOM_DEG_TO_PX * 5;
+      }
+      scale_path = odom_path;
+      scale_rx = o.rx;
+      scale_ry = o.ry;
+      scale_vx = vx;
+      scale_vy = vy;
+    }
+  }
+  odom_last_fix = now;
+
+  odom_pose_at(now, &cur);
+  pthread_mutex_unlock(&est_mutex);
+
+  *px = cur.x;
+  *py = cur.y;
+  return 0;
+}
+
+int estimator_get_pose(double *px, double *py, double *hx, double *hy){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Current pose predicted from the wheels (and gyro) since the last camera fix, for
+  // use between frames or while the bot blob is lost. hx, hy may be NULL.
+  //
+  // Returns: 0 if the pose was returned
+  //          -1 if there is no odometry, no camera fix yet, or the last fix is older
+  //             than ODOM_MAX_COAST_US (dead reckoning has drifted too far by then)
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct odom_sample cur;
+  long long now;
+  double theta;
+
+  if (!est_running || !odom_enabled) return -1;
+  pthread_mutex_lock(&est_mutex);
+  now = BT_sensor_time_us();
+  if (!odom_init || !odom_fresh() || now - odom_last_fix > ODOM_MAX_COAST_US){
+    pthread_mutex_unlock(&est_mutex);
+    return -1;
+  }
+  odom_pose_at(now, &cur);
+  theta = cur.theta;
+  if (heading_init && gyro_fresh()) theta = heading_offset + gyro_angle_at(now);
+  pthread_mutex_unlock(&est_mutex);
+
+  *px = cur.x;
+  *py = cur.y;
+  if (hx != NULL) *hx = cos(theta);
+  if (hy != NULL) *hy = sin(theta);
+  return 0;
+}
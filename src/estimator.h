@@ -0,0 +1,69 @@
+/***************************************************
+ Pose estimator - fuses the EV3 gyro and the drive
+ motor tacho counts with the camera.
+
+ The blob shape only gives the heading up to a 180
+ degree flip, and only once per camera frame (and
+ late, by the camera latency). The gyro angle is
+ streamed by the sensor poller at SENSOR_POLL_RATE,
+ and a sampler thread keeps a short time-stamped
+ history of it.
+
+ The fused heading is  gyro angle + offset, where the
+ offset is corrected from every camera frame with a
+ complementary filter: the gyro gives the short term
+ changes (and resolves the flip, we take whichever of
+ the two vision headings is closest to the gyro
+ prediction), vision removes the gyro drift. Camera
+ headings are compared against the gyro at the time
+ the frame was taken, not when it was processed.
+
+ If there is no gyro (or it stops responding) the
+ estimator says so and the AI falls back on its
+ vision-only flip heuristics.
+
+ Position: the tacho counts of the drive wheels come
+ in with the same poll, and drive a differential-drive
+ odometry model (distance from the mean wheel travel,
+ heading from the fused heading, or from the wheel
+ difference if there is no gyro). Each camera fix is
+ compared with the odometry pose at frame time and
+ the difference is fed back into the pose, so between
+ frames, and while the bot blob is lost, the pose is
+ predicted from the wheels. The wheel-degrees to
+ pixels scale is refined from vision as we drive.
+
+***************************************************/
+
+#ifndef _ESTIMATOR_H
+#define _ESTIMATOR_H
+
+#define ESTIMATOR_RATE 200              // Rate (Hz) at which the sampler thread records gyro/tacho readings
+#define ESTIMATOR_HISTORY 256           // Gyro and odometry samples kept (>1s at SENSOR_POLL_RATE)
+#define CAMERA_LATENCY_US 60000         // Assumed capture-to-AI delay (us) for frames with no capture timestamp
+#define GYRO_SIGN 1                     // 1 if the gyro angle grows as the image heading angle grows, -1 if not
+#define HEADING_VISION_GAIN 0.15        // Fraction of the vision/gyro disagreement corrected per frame
+#define HEADING_GATE (PI/5)             // Vision headings further than this from the gyro prediction are rejected
+#define HEADING_MAX_REJECTS 15          // After this many rejected frames in a row, re-seed from vision
+
+#define ODOM_DEG_TO_PX 0.05             // Initial image pixels travelled per degree of wheel rotation
+#define ODOM_TURN_RATIO 0.25            // Heading change (deg) per degree of wheel difference, used without a gyro
+#define ODOM_VISION_GAIN 0.5            // Fraction of the vision/odometry position disagreement corrected per frame
+#define ODOM_RESET_DIST 80              // Disagreements larger than this (pixels) snap the pose to vision
+#define ODOM_SCALE_DIST 60              // Wheel travel (pixels) over which the scale is re-estimated from vision
+#define ODOM_SCALE_GAIN 0.3             // Fraction of the scale error corrected per re-estimate
+#define ODOM_MAX_STEP 720               // Wheel degrees between polls above which the counts were reset
+#define ODOM_MAX_COAST_US 2000000       // How long (us) the pose is trusted without a camera fix
+
+int estimator_start(int gyro_port, int odometry);
+int estimator_start_stepped(int gyro_port, int odometry);
+void estimator_sample(void);
+int estimator_stop(void);
+int estimator_have_gyro(void);
+int estimator_fuse_heading(double vdx, double vdy, long long frame_time, double *hx, double *hy);
+int estimator_get_heading(double *hx, double *hy);
+int estimator_reset_heading(double dx, double dy);
+int estimator_fuse_pose(double vx, double vy, double hx, double hy, long long frame_time, double *px, double *py);
+int estimator_get_pose(double *px, double *py, double *hx, double *hy);
+
+#endif
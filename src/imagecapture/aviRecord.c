@@ -0,0 +1,185 @@
+/***************************************************************
+ CSC C85 - UTSC RoboSoccer background AVI recorder
+
+ See aviRecord.h
+****************************************************************/
+
+#include "aviRecord.h"
+#include "avilib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct aviSlot{
+ unsigned char *rgb;			// Frame as handed in (RGB, top row first)
+ int dups;				// Frames dropped just before this one
+};
+
+static struct aviSlot aviQueue[AVI_QUEUE_LEN];
+static int aviHead=0, aviCount=0;	// Oldest queued slot, and number of queued slots
+static int aviSx, aviSy;
+static int aviPendingDups=0;		// Dropped since the last queued frame
+static long long aviDropped=0;
+static int aviRunning=0;
+static avi_t *aviFile=NULL;
+static unsigned char *aviScratch=NULL;	// Converted frame (BGR, bottom row first)
+static pthread_t aviThread;
+static pthread_mutex_t aviMutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aviCond=PTHREAD_COND_INITIALIZER;
+
+static void *aviWriterLoop(void *arg)
+{
+ ////////////////////////////////////////////////////////////////
+ // Writer thread. Uncompressed AVI frames are stored as bottom-up
+ // BGR, so each frame is flipped and swizzled here, off the vision
+ // loop. The slot is only handed back once it has been written.
+ ////////////////////////////////////////////////////////////////
+ struct aviSlot *s;
+ unsigned char *src, *dst;
+ int rowBytes=aviSx*3;
+
+ pthread_mutex_lock(&aviMutex);
+ while (1)
+ {
+  while (aviRunning&&aviCount==0) pthread_cond_wait(&aviCond,&aviMutex);
+  if (aviCount==0) break;		// Stopped, and the queue is drained
+  s=&aviQueue[aviHead];
+  pthread_mutex_unlock(&aviMutex);
+
+  for (int j=0;j<aviSy;j++)
+  {
+   src=s->rgb+(j*rowBytes);
+   dst=aviScratch+((aviSy-1-j)*rowBytes);
+   for (int i=0;i<aviSx;i++)
+   {
+    *(dst+(i*3)+0)=*(src+(i*3)+2);
+    *(dst+(i*3)+1)=*(src+(i*3)+1);
+    *(dst+(i*3)+2)=*(src+(i*3)+0);
+   }
+  }
+  for (int k=0;k<s->dups;k++) AVI_dup_frame(aviFile);
+  if (AVI_write_frame(aviFile,(char *)aviScratch,(long)rowBytes*aviSy,1)<0)
+   fprintf(stderr,"aviWriterLoop(): Unable to write frame\n");
+
+  pthread_mutex_lock(&aviMutex);
+  aviHead=(aviHead+1)%AVI_QUEUE_LEN;
+  aviCount--;
+ }
+ pthread_mutex_unlock(&aviMutex);
+ return(NULL);
+}
+
+int aviRecordStart(const char *filename, int sx, int sy, double fps)
+{
+ ////////////////////////////////////////////////////////////////
+ // Open an AVI file and start the writer thread. Frames handed
+ // to aviRecordFrame() must be sx x sy RGB.
+ //
+ // Returns 0 on success, -1 if already recording or if the file
+ // or buffers can not be set up.
+ ////////////////////////////////////////////////////////////////
+ int ok;
+
+ if (aviRunning) return(-1);
+ aviFile=AVI_open_output_file((char *)filename);
+ if (aviFile==NULL)
+ {
+  fprintf(stderr,"aviRecordStart(): Unable to open %s\n",filename);
+  return(-1);
+ }
+ AVI_set_video(aviFile,sx,sy,fps,(char *)"RGB");
+ aviSx=sx;
+ aviSy=sy;
+ ok=1;
+ aviScratch=(unsigned char *)calloc(sx*sy*3,sizeof(unsigned char));
+ if (aviScratch==NULL) ok=0;
+ for (int i=0;i<AVI_QUEUE_LEN;i++)
+ {
+  aviQueue[i].rgb=(unsigned char *)calloc(sx*sy*3,sizeof(unsigned char));
+  if (aviQueue[i].rgb==NULL) ok=0;
+ }
+ aviHead=aviCount=0;
+ aviPendingDups=0;
+ aviDropped=0;
+ aviRunning=1;
+ if (!ok||pthread_create(&aviThread,NULL,aviWriterLoop,NULL)!=0)
+ {
+  fprintf(stderr,"aviRecordStart(): Unable to set up the writer\n");
+  aviRunning=0;
+  AVI_close(aviFile);
+  aviFile=NULL;
+  for (int i=0;i<AVI_QUEUE_LEN;i++) {free(aviQueue[i].rgb); aviQueue[i].rgb=NULL;}
+  free(aviScratch);
+  aviScratch=NULL;
+  return(-1);
+ }
+ return(0);
+}
+
+int aviRecordFrame(unsigned char *rgb)
+{
+ ////////////////////////////////////////////////////////////////
+ // Queue a frame for recording. Never waits for the writer: if
+ // the queue is full the frame is dropped.
+ //
+ // Returns 0 if the frame was queued, 1 if it was dropped, -1 if
+ // not recording.
+ ////////////////////////////////////////////////////////////////
+ struct aviSlot *s;
+
+ if (!aviRunning) return(-1);
+ pthread_mutex_lock(&aviMutex);
+ if (aviCount==AVI_QUEUE_LEN)
+ {
+  aviPendingDups++;
+  aviDropped++;
+  pthread_mutex_unlock(&aviMutex);
+  return(1);
+ }
+ s=&aviQueue[(aviHead+aviCount)%AVI_QUEUE_LEN];
+ pthread_mutex_unlock(&aviMutex);
+
+ // The slot is ours until it is counted in, the writer only touches counted slots
+ memcpy(s->rgb,rgb,aviSx*aviSy*3*sizeof(unsigned char));
+
+ pthread_mutex_lock(&aviMutex);
+ s->dups=aviPendingDups;
+ aviPendingDups=0;
+ aviCount++;
+ pthread_cond_signal(&aviCond);
+ pthread_mutex_unlock(&aviMutex);
+ return(0);
+}
+
+int aviRecordStop(void)
+{
+ ////////////////////////////////////////////////////////////////
+ // Write out whatever is still queued, close the file and free
+ // the buffers. Returns -1 if not recording.
+ ////////////////////////////////////////////////////////////////
+ if (!aviRunning) return(-1);
+ pthread_mutex_lock(&aviMutex);
+ aviRunning=0;
+ pthread_cond_signal(&aviCond);
+ pthread_mutex_unlock(&aviMutex);
+ pthread_join(aviThread,NULL);
+
+ AVI_close(aviFile);
+ aviFile=NULL;
+ for (int i=0;i<AVI_QUEUE_LEN;i++) {free(aviQueue[i].rgb); aviQueue[i].rgb=NULL;}
+ free(aviScratch);
+ aviScratch=NULL;
+ return(0);
+}
+
+int aviRecording(void)
+{
+ return(aviRunning);
+}
+
+long long aviRecordDropped(void)
+{
+ // Frames dropped because the writer could not keep up, since recording started
+ return(aviDropped);
+}
@@ -0,0 +1,26 @@
+/***************************************************************
+ CSC C85 - UTSC RoboSoccer background AVI recorder
+
+ Records frames from the vision loop to an uncompressed AVI
+ without slowing the loop down. aviRecordFrame() copies the
+ frame into a free slot of a small bounded queue and returns,
+ a writer thread converts each queued frame to the AVI pixel
+ layout and appends it with AVI_write_frame(). If the writer
+ falls behind and the queue is full, frames are dropped (the
+ loop never waits for the disk), and the writer duplicates the
+ previous frame in their place so the video keeps real time.
+****************************************************************/
+
+#ifndef __aviRecord_header
+
+#define __aviRecord_header
+
+#define AVI_QUEUE_LEN 8			// Frames that can be waiting for the writer
+
+int aviRecordStart(const char *filename, int sx, int sy, double fps);
+int aviRecordFrame(unsigned char *rgb);
+int aviRecordStop(void);
+int aviRecording(void);
+long long aviRecordDropped(void);
+
+#endif
@@ -46,7 +46,14 @@
 #include "imageCapture.h"
 #include "svdDynamic.h"
 #include "../roboAI.h"
+#include "../perf/perfstage.h"
+#include "aviRecord.h"
+#include "synthCam.h"
 #include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 
 //#define __DEBUG
 #define MIN_BLOB_SIZE 500         // Minimum blob size allowed by blobDetect2()
@@ -85,8 +92,29 @@ struct blob *blobs=NULL;		      // Blob list for the current frame * DO NOT USE
 double *H = NULL;			          // Homography matrix for field rectification
 double *Hinv = NULL;                  // Inverse Homography matrix
 int frameNo=0;				          // Frame id
-time_t time1,time2;		    	      // timing variables
-int printFPS=0;				          // Flag that controls FPS printout
+int printFPS=0;				          // Flag that controls FPS and stage timing printout
+
+// Per-stage timing of FrameGrabLoop(), rolling stats over the last frames (see perf/perfstage.h)
+#define STAGE_CAPTURE 0                       // Waiting for and dequeuing the camera buffer
+#define STAGE_YUYV 1                          // YUYV to RGB conversion
+#define STAGE_BGSUB 2                         // Background subtraction
+#define STAGE_UNWARP 3                        // Field rectification
+#define STAGE_BLOBS 4                         // Blob detection
+#define STAGE_AI 5                            // AI_main() or AI_calibrate()
+#define STAGE_RENDER 6                        // Blob/display list rendering and scaling into bigIm
+#define STAGE_TEXTURE 7                       // Texture upload and quad draw
+#define STAGE_SWAP 8                          // glFlush() and buffer swap
+#define STAGE_FRAME 9                         // Whole FrameGrabLoop() call
+#define STAGE_INTERVAL 10                     // Start to start time between frames (gives the FPS)
+#define N_STAGES 11
+struct perf_stage frameStages[N_STAGES];
+long long lastFrameStart=0;                   // perf_time_us() at the start of the previous frame
+long long lastStagePrint=0;                   // When the stage table was last printed
+int showHUD=0;                                // Flag that controls the on-screen performance overlay
+int aviSource=2;                              // What 'v' records: 0 - camera frame, 1 - rectified field, 2 - display
+int headless=0;                               // No window, headlessLoop() drives FrameGrabLoop() (see imageCaptureStartup())
+int headlessFrames=0;                         // Frames to process before quitting in headless mode, 0 for no limit
+volatile sig_atomic_t quitRequested=0;        // SIGINT/SIGTERM arrived, headlessLoop() quits cleanly
 
 // Robot-control data
 struct RoboAI skynet;			                // Bot's AI structure
@@ -102,7 +130,7 @@ int got_Y=0;				                    // Got Y adjustment
 /*********************************************************************
 Image processing setup and frame processing loop
 **********************************************************************/
-int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode)
+int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode, const char *control)
 {
  ///////////////////////////////////////////////////////////////////////////////////
  //
@@ -114,15 +142,19 @@ int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode)
  //	- rx, ry: Requested image resolution, typically 720, 1280
  //	- own_col: Color of the bot controlled by this program (passed on from command line)
  //	- AI_mode: Penalties, Follow the Ball, or Robo-Soccer (passed on from command line)
+ //	- control: NULL to run in an OpenGL window. Otherwise run headless, with no
+ //	  window and no X display, and read keyboard commands from stdin ("" or "-"),
+ //	  a UNIX socket ("unix:/path") or a loopback TCP port ("tcp:port"), see
+ //	  headlessLoop()
  //
  // This function performs the following tasks:
  //  - Initializes the webcam and opens the video input device
- //  - Sets up and opens an OpenGL window for image display
+ //  - Sets up and opens an OpenGL window for image display (unless headless)
  //  - Initializes the AI data structure
  //  - Calls the image processing main loop
  //  
  // Returns:
- //     - Hopefully it doesn't! (glutMainLoop() exits without returning here)
+ //     - Hopefully it doesn't! (glutMainLoop() or headlessLoop() exit without returning here)
  //	    - But, -1 if there is a problem initializing the video capture device
  //	      or setting up OpenGL
  //
@@ -143,15 +175,43 @@ int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode)
  sx=webcam->width;
  sy=webcam->height;
  fprintf(stderr,"Camera initialized! grabbing frames at %d x %d\n",sx,sy);
+
+ // A synthetic camera knows where the field corners are and what the colours are, so take the
+ // calibration from it (H and the background are obtained on the first frame)
+ if (webcam->synth)
+ {
+  synthCamCalibration(webcam->synth,Mcorners,Mhues,Mrgb);
+  cornerIdx=4;
+  gotCol=1;
+  fprintf(stderr,"Calibrated from the synthetic camera\n");
+ }
  
  // Done, set up OpenGL and call particle filter loop
  fprintf(stderr,"Entering main loop...\n");
  Win[0]=800;
  Win[1]=800;
 
- // Get initial time for FPS
- time(&time1);
+ // Set up the frame stage timers, and start the event trace and telemetry log if they were asked for
+ initFrameStages();
+ perf_trace_thread_name("frame loop");
+ if (getenv("PERF_TRACE")!=NULL)
+ {
+  if (perf_trace_start(getenv("PERF_TRACE"))==0) fprintf(stderr,"Tracing events to %s\n",getenv("PERF_TRACE"));
+  else fprintf(stderr,"Unable to start the event trace to %s\n",getenv("PERF_TRACE"));
+ }
+ if (getenv("TELEMETRY")!=NULL)
+ {
+  if (telemetry_start(getenv("TELEMETRY"))==0) fprintf(stderr,"Logging telemetry to %s\n",getenv("TELEMETRY"));
+  else fprintf(stderr,"Unable to start the telemetry log to %s\n",getenv("TELEMETRY"));
+ }
  
+ // Tuned AI parameters (as written by tools/aitune) replace the defaults if given
+ if (getenv("AI_PARAMS")!=NULL)
+ {
+  if (AI_load_params(getenv("AI_PARAMS"))>=0) fprintf(stderr,"Loaded AI parameters from %s\n",getenv("AI_PARAMS"));
+  else fprintf(stderr,"Unable to load the AI parameters from %s\n",getenv("AI_PARAMS"));
+ }
+
  // Initialize the AI data structure with the requested mode
  setupAI(AIMode,botCol, &skynet);
  adj_Y[0][0]=-1e6;          
@@ -172,6 +232,11 @@ int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode)
   return 0;
  }
  
+ if (control!=NULL)
+ {
+  headless=1;
+  return headlessLoop(control);
+ }
  initGlut(version);
  glutMainLoop();
 
@@ -208,14 +273,23 @@ void FrameGrabLoop(void)
   struct image *t1, *t2, *t3;
   struct image *labIm, *blobIm;
   static int nblobs=0;
+  int display;
   double *U, *s, *V, *rv1;
   FILE *f;
   double R,G,B,Hu,Sa,Va;
+  long long now;
+
+  now=perf_time_us();
+  if (lastFrameStart!=0) perf_stage_record(&frameStages[STAGE_INTERVAL],now-lastFrameStart);
+  lastFrameStart=now;
+  perf_stage_begin(&frameStages[STAGE_FRAME]);
 
   /***************************************************
    Grab the current frame from the webcam
   ***************************************************/
   big=&bigIm[0];
+  // Without a window the display image is only needed if it is being recorded
+  display=!headless||(aviRecording()&&aviSource==2);
   getFrame(webcam,sx,sy);
   ox=420;
   oy=1;
@@ -311,6 +385,7 @@ void FrameGrabLoop(void)
     // values - it's necessary overhead because we are computing an average over frames, can't be done in
     // unsigned char. 
     t2=newImage(sx,sy,3);
+    if (webcam->synth) webcam->synth->showObjects=0;	// Empty field, as the user would clear it
     for (i=0;i<25;i++)
     {
      getFrame(webcam,sx,sy);
@@ -319,6 +394,7 @@ void FrameGrabLoop(void)
      deleteImage(t1);
     }
     image_scale(t2,1.0/25.0);
+    if (webcam->synth) webcam->synth->showObjects=1;
 
     for (int jj=0;jj<t2->sy;jj++)
      for (int ii=0;ii<t2->sx;ii++)
@@ -330,15 +406,18 @@ void FrameGrabLoop(void)
 
     deleteImage(t2);
     gotbg=1;
-    time(&time1);
     frameNo=0;
 
-    // Cache calibration data - Homography + background image
-    f=fopen("Homography.dat","w");
-    fwrite(H,9*sizeof(double),1,f);
-    fwrite(Hinv,9*sizeof(double),1,f);
-    fwrite(bgIm,sx*sy*3*sizeof(unsigned char),1,f);
-    fclose(f);
+    // Cache calibration data - Homography + background image. Not for a synthetic camera, it
+    // would overwrite the real one
+    if (webcam->synth==NULL)
+    {
+     f=fopen("Homography.dat","w");
+     fwrite(H,9*sizeof(double),1,f);
+     fwrite(Hinv,9*sizeof(double),1,f);
+     fwrite(bgIm,sx*sy*3*sizeof(unsigned char),1,f);
+     fclose(f);
+    }
         
     // Debug data - dump the background image to PPM:
 #ifdef __DEBUG
@@ -371,7 +450,9 @@ void FrameGrabLoop(void)
     deleteImage(t3);
 #endif      
 
+    perf_stage_begin(&frameStages[STAGE_BGSUB]);
     bgSubtract3();
+    perf_stage_end(&frameStages[STAGE_BGSUB]);
     
 // HERE: We may want to do a bit of filtering and denoising - 
 
@@ -381,7 +462,9 @@ void FrameGrabLoop(void)
     deleteImage(t3);
 #endif      
     
+   perf_stage_begin(&frameStages[STAGE_UNWARP]);
    fieldUnwarp2();
+   perf_stage_end(&frameStages[STAGE_UNWARP]);
 
 #ifdef __DEBUG
    t2=imageFromBuffer(fieldIm,sx,sy,3);
@@ -398,7 +481,10 @@ void FrameGrabLoop(void)
 //   deleteImage(t2);
 /////////  END TESTING CODE  ////////
 
+   perf_stage_begin(&frameStages[STAGE_BLOBS]);
    labIm=blobDetect2(&blobs,&nblobs);
+   perf_stage_end(&frameStages[STAGE_BLOBS]);
+   if (webcam->synth) scoreSynthBlobs(blobs);
 //   labIm=NULL;            // To test without blob detection
 //   blobs=NULL;
       
@@ -412,24 +498,31 @@ void FrameGrabLoop(void)
    //  the blob ids are also set.   
    if (blobs)
    {
+    skynet.st.frame_time=webcam->frame_time_us;	// Lets the AI measure capture-to-motor latency
+    perf_stage_begin(&frameStages[STAGE_AI]);
     if (doAI==1) skynet.runAI(&skynet,blobs,NULL);
     else if (doAI==2) skynet.calibrate(&skynet,blobs);
-    blobIm=renderBlobs(labIm,blobs);
-    // Render anything in the display list
-    dp=skynet.DPhead;
-    while (dp)
+    perf_stage_end(&frameStages[STAGE_AI]);
+    if (display)
     {
-      if (dp->type==0)
-      {
-        drawBox(dp->x1-2,dp->y1-2,dp->x1+2,dp->y1+2,dp->R,dp->G,dp->B,blobIm);
-        drawBox(dp->x1-1,dp->y1-1,dp->x1+1,dp->y1+1,dp->R,dp->G,dp->B,blobIm);
-        drawBox(dp->x1-0,dp->y1-0,dp->x1+0,dp->y1+0,dp->R,dp->G,dp->B,blobIm);
-      }
-      else
-      {
-        drawLine(dp->x1,dp->y1,dp->x2-dp->x1,dp->y2-dp->y1,1,dp->R,dp->G,dp->B,blobIm);
-      }
-      dp=dp->next;
+     perf_stage_begin(&frameStages[STAGE_RENDER]);
+     blobIm=renderBlobs(labIm,blobs);
+     // Render anything in the display list
+     dp=skynet.DPhead;
+     while (dp)
+     {
+       if (dp->type==0)
+       {
+         drawBox(dp->x1-2,dp->y1-2,dp->x1+2,dp->y1+2,dp->R,dp->G,dp->B,blobIm);
+         drawBox(dp->x1-1,dp->y1-1,dp->x1+1,dp->y1+1,dp->R,dp->G,dp->B,blobIm);
+         drawBox(dp->x1-0,dp->y1-0,dp->x1+0,dp->y1+0,dp->R,dp->G,dp->B,blobIm);
+       }
+       else
+       {
+         drawLine(dp->x1,dp->y1,dp->x2-dp->x1,dp->y2-dp->y1,1,dp->R,dp->G,dp->B,blobIm);
+       }
+       dp=dp->next;
+     }
     }
    }
    deleteImage(labIm);
@@ -439,22 +532,15 @@ void FrameGrabLoop(void)
   // Render whatever we are going to display onto the texture image
   // buffer used by OpenGL
   //////////////////////////////////////////////////////////////////// 
-  if (H==NULL||toggleProc>0||gotCol==0)
+  if (display&&frameStages[STAGE_RENDER].start==0) perf_stage_begin(&frameStages[STAGE_RENDER]);
+  if (!display)
+  {
+   // Nothing to show it on
+  }
+  else if (H==NULL||toggleProc>0||gotCol==0)
   {
    // We don't have corners, or colour reference values for blobs, display input image.
-   double ii,jj,dx,dy;
-   dx=(double)sx/1024.0;
-   dy=(double)sy/768.0;
-#pragma omp parallel for schedule(dynamic,16) private(ii,jj,i,j)
-   for (j=0;j<768;j++)
-    for (i=0;i<1024;i++)
-    {
-     ii=i*dx;
-     jj=j*dy;
-     *(big+((i+((j+128)*1024))*3)+0)=*(frame_buffer+(((int)ii+(((int)jj)*sx))*3)+0);
-     *(big+((i+((j+128)*1024))*3)+1)=*(frame_buffer+(((int)ii+(((int)jj)*sx))*3)+1);
-     *(big+((i+((j+128)*1024))*3)+2)=*(frame_buffer+(((int)ii+(((int)jj)*sx))*3)+2);
-    }
+   scaleToDisplay(frame_buffer,big);
   }
   else if (blobIm==NULL)
   {
@@ -462,89 +548,239 @@ void FrameGrabLoop(void)
    // agents are on the field at the moment or the image processing
    // thresholds are improperly set.
    // Copy the rectified, background subtracted field image for display
-   double ii,jj,dx,dy;
-   dx=(double)sx/1024.0;
-   dy=(double)sy/768.0;
-#pragma omp parallel for schedule(dynamic,16) private(ii,jj,i,j)
-    for (j=0;j<768;j++)
-     for (i=0;i<1024;i++)
-     {
-      ii=i*dx;
-      jj=j*dy;
-      *(big+(((i)+((j+128)*1024))*3)+0)=*(fieldIm+(((int)ii+(((int)jj)*sx))*3)+0);
-      *(big+(((i)+((j+128)*1024))*3)+1)=*(fieldIm+(((int)ii+(((int)jj)*sx))*3)+1);
-      *(big+(((i)+((j+128)*1024))*3)+2)=*(fieldIm+(((int)ii+(((int)jj)*sx))*3)+2);
-     }
+   scaleToDisplay(fieldIm,big);
   }
   else
   {
    // We have the H matrix and also detected blobs. Display the blob image
-   double ii,jj,dx,dy;
-   dx=(double)sx/1024.0;
-   dy=(double)sy/768.0;
-#pragma omp parallel for schedule(dynamic,16) private(ii,jj,i,j)
-    for (j=0;j<768;j++)
-     for (i=0;i<1024;i++)
-     {
-      ii=i*dx;
-      jj=j*dy;
-      *(big+(((i)+((j+128)*1024))*3)+0)=(unsigned char)((*(blobIm->layers[0]+(int)ii+((int)jj*blobIm->sx))));
-      *(big+(((i)+((j+128)*1024))*3)+1)=(unsigned char)((*(blobIm->layers[1]+(int)ii+((int)jj*blobIm->sx))));
-      *(big+(((i)+((j+128)*1024))*3)+2)=(unsigned char)((*(blobIm->layers[2]+(int)ii+((int)jj*blobIm->sx))));
-     }
-    deleteImage(blobIm);
+   scaleImageToDisplay(blobIm,big);
+   deleteImage(blobIm);
   }
 
   ///////////////////////////////////////////////////////////////////////////
   // Have OpenGL display our image for this frame
   ///////////////////////////////////////////////////////////////////////////
-  // Clear the screen and depth buffers
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
-  glEnable(GL_TEXTURE_2D);
-  glDisable(GL_LIGHTING);
-
-  if (frame==0)
+  if (display) perf_stage_end(&frameStages[STAGE_RENDER]);
+
+  // Hand the frame to the AVI recorder if it's on (only a copy, the writer thread does the rest)
+  if (aviRecording())
   {
-   glGenTextures( 1, &texture);
-   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-   glBindTexture( GL_TEXTURE_2D, texture);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-   glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-   glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, 1024, 1024, 0, GL_RGB, GL_UNSIGNED_BYTE, big);
+   if (aviSource==0) aviRecordFrame(frame_buffer);
+   else if (aviSource==1) aviRecordFrame(fieldIm);
+   else aviRecordFrame(big+(128*1024*3));
   }
-  else
+  if (!headless)
   {
-   glBindTexture(GL_TEXTURE_2D, texture);
-   glTexSubImage2D(GL_TEXTURE_2D,0,0,0,1024,1024,GL_RGB,GL_UNSIGNED_BYTE,big);
+   // The GL calls may be queued, so time spent in the driver can show up under either of the
+   // texture or swap stages
+   perf_stage_begin(&frameStages[STAGE_TEXTURE]);
+   // Clear the screen and depth buffers
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   glMatrixMode(GL_MODELVIEW);
+   glLoadIdentity();
+   glEnable(GL_TEXTURE_2D);
+   glDisable(GL_LIGHTING);
+
+   if (frame==0)
+   {
+    glGenTextures( 1, &texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture( GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, 1024, 1024, 0, GL_RGB, GL_UNSIGNED_BYTE, big);
+   }
+   else
+   {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexSubImage2D(GL_TEXTURE_2D,0,0,0,1024,1024,GL_RGB,GL_UNSIGNED_BYTE,big);
+   }
+   // Draw box bounding the viewing area
+   glBegin (GL_QUADS);
+   glTexCoord2f (0.0, 0.0);
+   glVertex3f (0.0, 60.0, 0.0);
+   glTexCoord2f (1.0, 0.0);
+   glVertex3f (800.0, 60.0, 0.0);
+   glTexCoord2f (1.0, 1.0);
+   glVertex3f (800.0, 740.0, 0.0);
+   glTexCoord2f (0.0, 1.0);
+   glVertex3f (0.0, 740.0, 0.0);
+   glEnd ();
+   if (showHUD) drawPerfHUD(blobs!=NULL?nblobs:0);
+   perf_stage_end(&frameStages[STAGE_TEXTURE]);
+
+   // Make sure all OpenGL commands are executed
+   perf_stage_begin(&frameStages[STAGE_SWAP]);
+   glFlush();
+   // Swap buffers to enable smooth animation
+   glutSwapBuffers();
+   perf_stage_end(&frameStages[STAGE_SWAP]);
+  }
+  perf_stage_end(&frameStages[STAGE_FRAME]);
+
+  // Print FPS and stage timings once a second if needed
+  if (printFPS&&now-lastStagePrint>=1000000)
+  {
+   printFrameStages(stderr);
+   lastStagePrint=now;
   }
-  // Draw box bounding the viewing area
-  glBegin (GL_QUADS);
-  glTexCoord2f (0.0, 0.0);
-  glVertex3f (0.0, 60.0, 0.0);
-  glTexCoord2f (1.0, 0.0);
-  glVertex3f (800.0, 60.0, 0.0);
-  glTexCoord2f (1.0, 1.0);
-  glVertex3f (800.0, 740.0, 0.0);
-  glTexCoord2f (0.0, 1.0);
-  glVertex3f (0.0, 740.0, 0.0);
-  glEnd ();
-
-  // Make sure all OpenGL commands are executed
-  glFlush();
-  // Swap buffers to enable smooth animation
-  glutSwapBuffers();
 
   // Clean Up - Do all the image processing, AI, and planning before this code
   frame++;
 
   // Tell glut window to update ls itself
-  glutSetWindow(windowID);
-  glutPostRedisplay();
+  if (!headless)
+  {
+   glutSetWindow(windowID);
+   glutPostRedisplay();
+  }
+}
+
+void initFrameStages(void)
+{
+ // Name and clear the FrameGrabLoop() stage timers
+ const char *names[N_STAGES]={"capture","yuyv->rgb","bg subtract","unwarp","blob detect","AI",
+                              "render","texture upload","swap","frame total","frame interval"};
+ for (int i=0; i<N_STAGES; i++) perf_stage_init(&frameStages[i],names[i]);
+ lastFrameStart=0;
+}
+
+void printFrameStages(FILE *fp)
+{
+ // FPS (from the mean frame interval) and the per-stage table, times in ms
+ long long min, p99, max;
+ double mean;
+
+ perf_stage_stats(&frameStages[STAGE_INTERVAL],&min,&mean,&p99,&max);
+ fprintf(fp,"FPS= %f  (frame %d)\n",mean>0?1e6/mean:0.0,frameNo);
+ perf_stage_print(fp,frameStages,N_STAGES);
+ if (webcam!=NULL&&webcam->synth) synthCamPrintScore(webcam->synth,fp);
+}
+
+void scoreSynthBlobs(struct blob *list)
+{
+ // Hand the blob centroids to the synthetic camera to compare with where it drew things
+ static double *cx=NULL, *cy=NULL;
+ static int cap=0;
+ int n=0;
+
+ for (struct blob *p=list; p!=NULL; p=p->next)
+ {
+  if (n==cap)
+  {
+   cap=cap?2*cap:64;
+   cx=(double *)realloc(cx,cap*sizeof(double));
+   cy=(double *)realloc(cy,cap*sizeof(double));
+   if (cx==NULL||cy==NULL) {fprintf(stderr,"scoreSynthBlobs(): Out of memory!\n"); cap=0; return;}
+  }
+  cx[n]=p->cx;
+  cy[n]=p->cy;
+  n++;
+ }
+ synthCamScore(webcam->synth,cx,cy,n,sx,sy);
+}
+
+void drawPerfHUD(int nblobs)
+{
+ ///////////////////////////////////////////////////////////////////////
+ //
+ // Draws the performance overlay over the top-left corner of the
+ // field view: FPS, per-stage times, dropped camera frames, blob
+ // count, BT round trip, AI state and display list size. The text is
+ // only rebuilt a few times per second (working out the percentiles
+ // means sorting every stage's window), in between the cached lines
+ // are redrawn, which costs a few hundred GL bitmap calls.
+ //
+ ///////////////////////////////////////////////////////////////////////
+ static char text[N_STAGES+4][64];
+ static int nlines=0;
+ static long long lastUpdate=0;
+ long long now, min, p99, max;
+ double mean;
+ struct displayList *dp;
+ int nDP;
+
+ now=perf_time_us();
+ if (now-lastUpdate>=250000)
+ {
+  lastUpdate=now;
+  nlines=0;
+  perf_stage_stats(&frameStages[STAGE_INTERVAL],&min,&mean,&p99,&max);
+  sprintf(text[nlines++],"FPS %5.1f  dropped %lld",mean>0?1e6/mean:0.0,webcam->frames_dropped);
+  for (int i=0; i<N_STAGES; i++)
+  {
+   if (i==STAGE_INTERVAL) continue;
+   perf_stage_stats(&frameStages[i],&min,&mean,&p99,&max);
+   sprintf(text[nlines++],"%-14s %6.2f ms  p99 %6.2f",frameStages[i].name,mean/1000.0,p99/1000.0);
+  }
+  nDP=0;
+  for (dp=skynet.DPhead; dp!=NULL; dp=dp->next) nDP++;
+  sprintf(text[nlines++],"blobs %d  AI state %d",nblobs,skynet.st.state);
+  sprintf(text[nlines++],"BT round trip %.1f ms",BT_round_trip_us()/1000.0);
+  sprintf(text[nlines++],"display list %d (%d bytes)",nDP,nDP*(int)sizeof(struct displayList));
+ }
+
+ // Dark translucent panel, then the text on top
+ glDisable(GL_TEXTURE_2D);
+ glEnable(GL_BLEND);
+ glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+ glColor4f(0.0,0.0,0.0,0.6);
+ glBegin(GL_QUADS);
+ glVertex3f(4.0,64.0,0.0);
+ glVertex3f(300.0,64.0,0.0);
+ glVertex3f(300.0,70.0+14.0*nlines,0.0);
+ glVertex3f(4.0,70.0+14.0*nlines,0.0);
+ glEnd();
+ glDisable(GL_BLEND);
+ glColor3f(0.3,1.0,0.3);
+ for (int i=0; i<nlines; i++)
+ {
+  glRasterPos2i(8,78+14*i);
+  for (char *c=text[i]; *c; c++) glutBitmapCharacter(GLUT_BITMAP_8_BY_13,*c);
+ }
+ glColor3f(1.0,1.0,1.0);
+}
+
+void scaleToDisplay(unsigned char *src, unsigned char *big)
+{
+ // Scale an sx x sy RGB buffer (the input frame or the rectified field) into the
+ // 1024x768 display area of the texture image, which starts 128 rows down.
+ int i,j;
+ double ii,jj,dx,dy;
+ dx=(double)sx/1024.0;
+ dy=(double)sy/768.0;
+#pragma omp parallel for schedule(dynamic,16) private(ii,jj,i,j)
+ for (j=0;j<768;j++)
+  for (i=0;i<1024;i++)
+  {
+   ii=i*dx;
+   jj=j*dy;
+   *(big+((i+((j+128)*1024))*3)+0)=*(src+(((int)ii+(((int)jj)*sx))*3)+0);
+   *(big+((i+((j+128)*1024))*3)+1)=*(src+(((int)ii+(((int)jj)*sx))*3)+1);
+   *(big+((i+((j+128)*1024))*3)+2)=*(src+(((int)ii+(((int)jj)*sx))*3)+2);
+  }
+}
+
+void scaleImageToDisplay(struct image *im, unsigned char *big)
+{
+ // Same for a 3-layer image (the blob image from renderBlobs())
+ int i,j;
+ double ii,jj,dx,dy;
+ dx=(double)sx/1024.0;
+ dy=(double)sy/768.0;
+#pragma omp parallel for schedule(dynamic,16) private(ii,jj,i,j)
+ for (j=0;j<768;j++)
+  for (i=0;i<1024;i++)
+  {
+   ii=i*dx;
+   jj=j*dy;
+   *(big+((i+((j+128)*1024))*3)+0)=(unsigned char)((*(im->layers[0]+(int)ii+((int)jj*im->sx))));
+   *(big+((i+((j+128)*1024))*3)+1)=(unsigned char)((*(im->layers[1]+(int)ii+((int)jj*im->sx))));
+   *(big+((i+((j+128)*1024))*3)+2)=(unsigned char)((*(im->layers[2]+(int)ii+((int)jj*im->sx))));
+  }
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
@@ -1617,6 +1853,143 @@ void drawCross_buf(int mcx, int mcy, double R, double G, double B, int len, unsi
 End of frame processing functions
 **********************************************************************/
 
+/*********************************************************************
+ Headless main loop - no window, keys from stdin or a control socket
+*********************************************************************/
+static const char *controlPath=NULL;
+
+static void headlessSignal(int sig)
+{
+ quitRequested=1;
+}
+
+static void removeControlSocket(void)
+{
+ // kbHandler() exits on 'q', the socket file has to go then too
+ if (controlPath!=NULL) unlink(controlPath);
+}
+
+static int openControlSocket(const char *control)
+{
+ // Listening socket for "unix:/path" or "tcp:port" (loopback only, anyone who can connect
+ // can drive the bot), -1 on error
+ struct sockaddr_un un;
+ struct sockaddr_in in;
+ int fd, one=1;
+
+ if (strncmp(control,"unix:",5)==0)
+ {
+  if (strlen(control+5)>=sizeof(un.sun_path)) {fprintf(stderr,"headlessLoop(): Socket path too long\n"); return -1;}
+  fd=socket(AF_UNIX,SOCK_STREAM,0);
+  memset(&un,0,sizeof(un));
+  un.sun_family=AF_UNIX;
+  strcpy(un.sun_path,control+5);
+  unlink(control+5);
+  if (fd<0||bind(fd,(struct sockaddr *)&un,sizeof(un))<0) {perror("headlessLoop(): bind"); return -1;}
+  controlPath=control+5;
+  atexit(removeControlSocket);
+ }
+ else if (strncmp(control,"tcp:",4)==0&&atoi(control+4)>0)
+ {
+  fd=socket(AF_INET,SOCK_STREAM,0);
+  setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+  memset(&in,0,sizeof(in));
+  in.sin_family=AF_INET;
+  in.sin_port=htons(atoi(control+4));
+  in.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if (fd<0||bind(fd,(struct sockaddr *)&in,sizeof(in))<0) {perror("headlessLoop(): bind"); return -1;}
+ }
+ else
+ {
+  fprintf(stderr,"headlessLoop(): Control must be - (stdin), unix:/path or tcp:port, not %s\n",control);
+  return -1;
+ }
+ listen(fd,1);
+ return fd;
+}
+
+int headlessLoop(const char *control)
+{
+ //////////////////////////////////////////////////////////////////////
+ //
+ // Main loop without a window. Calls FrameGrabLoop() back to back (the
+ // camera paces it, or a replay/synthetic source in fast mode doesn't)
+ // and, in between frames, hands kbHandler() whatever keys came in on
+ // stdin or on the control socket, one key per byte, so
+ //
+ //    echo t | nc -U /tmp/robo.sock
+ //
+ // toggles the AI. Newlines are ignored, so keys can be typed into a
+ // terminal a line at a time. The end of stdin just stops reading it,
+ // the socket takes one client at a time. 'q', SIGINT or SIGTERM quit
+ // cleanly, as does reaching HEADLESS_FRAMES frames if that is set (for
+ // benchmarks, the stage timings are printed first).
+ //
+ // Returns -1 if the control socket can't be opened, otherwise it
+ // doesn't return.
+ //
+ //////////////////////////////////////////////////////////////////////
+ struct pollfd pfd[2];
+ char keys[64];
+ int lfd=-1, cfd=-1, in=-1, n, np;
+ long long frames=0;
+
+ if (control[0]=='\0'||strcmp(control,"-")==0)
+ {
+  in=0;
+  fprintf(stderr,"Running headless, reading keys from stdin\n");
+ }
+ else
+ {
+  lfd=openControlSocket(control);
+  if (lfd<0) return -1;
+  fprintf(stderr,"Running headless, reading keys from %s\n",control);
+ }
+ if (getenv("HEADLESS_FRAMES")!=NULL) headlessFrames=atoi(getenv("HEADLESS_FRAMES"));
+ signal(SIGINT,headlessSignal);
+ signal(SIGTERM,headlessSignal);
+ signal(SIGPIPE,SIG_IGN);
+
+ while (1)
+ {
+  if (quitRequested||(headlessFrames>0&&frames>=headlessFrames))
+  {
+   if (!quitRequested) printFrameStages(stderr);
+   kbHandler('q',0,0);
+  }
+
+  // Keys that are waiting, without holding up the frame
+  np=0;
+  if (in>=0) {pfd[np].fd=in; pfd[np++].events=POLLIN;}
+  if (cfd>=0) {pfd[np].fd=cfd; pfd[np++].events=POLLIN;}
+  else if (lfd>=0) {pfd[np].fd=lfd; pfd[np++].events=POLLIN;}
+  if (np>0&&poll(pfd,np,0)>0)
+   for (int i=0; i<np; i++)
+   {
+    if (!(pfd[i].revents&(POLLIN|POLLHUP|POLLERR))) continue;
+    if (pfd[i].fd==lfd)
+    {
+     cfd=accept(lfd,NULL,NULL);
+     if (cfd>=0) fprintf(stderr,"Control client connected\n");
+     continue;
+    }
+    n=read(pfd[i].fd,keys,sizeof(keys));
+    if (n<=0)
+    {
+     if (pfd[i].fd==in) in=-1;
+     else {close(cfd); cfd=-1; fprintf(stderr,"Control client disconnected\n");}
+     continue;
+    }
+    for (int k=0; k<n; k++)
+     if (keys[k]!='\n'&&keys[k]!='\r') kbHandler((unsigned char)keys[k],0,0);
+   }
+
+  FrameGrabLoop();
+  frames++;
+ }
+ return 0;
+}
+
 /*********************************************************************
  OpenGL display setup.
 *********************************************************************/
@@ -1669,10 +2042,18 @@ void kbHandler(unsigned char key, int x, int y)
  // Exit!
  if (key=='q') 
  {
+  stop_control_thread();
+  estimator_stop();
+  BT_sensor_poll_stop();
+  BT_motor_sender_stop();
   BT_all_stop(0);
+  BT_motor_latency_print(stderr);
+  perf_trace_stop();
+  telemetry_stop();
+  aviRecordStop();
   releaseBlobs(blobs);
   deleteImage(proc_im);
-  glDeleteTextures(1,&texture);
+  if (!headless) glDeleteTextures(1,&texture);
   closeCam(webcam);
   while (skynet.DPhead!=NULL)
   {
@@ -1689,8 +2070,8 @@ void kbHandler(unsigned char key, int x, int y)
  }
 
  // Toggle AI processing on/off
- if (key=='t') if (doAI==1) doAI=0; else if (doAI==0) doAI=1;		// Ignores doAI=2 (calibration)
- if (key=='r') {setupAI(AIMode,botCol,&skynet); doAI=0;}		// Resets the state of the AI (may need full reset)
+ if (key=='t') if (doAI==1) {release_control_goal(); doAI=0;} else if (doAI==0) doAI=1;		// Ignores doAI=2 (calibration)
+ if (key=='r') {release_control_goal(); setupAI(AIMode,botCol,&skynet); doAI=0;}		// Resets the state of the AI (may need full reset)
 
  // Controls for recording the corners of the playing field
  if (key=='z')
@@ -1848,13 +2229,81 @@ void kbHandler(unsigned char key, int x, int y)
 
  
  if (key=='f') {if (printFPS==0) printFPS=1; else printFPS=0;}
+ if (key=='h') {if (showHUD==0) showHUD=1; else showHUD=0;}
+ if (key=='e')
+ {
+  // Start/stop an event trace, open it in chrome://tracing or ui.perfetto.dev
+  if (perf_trace_enabled) {perf_trace_stop(); fprintf(stderr,"Event trace stopped\n");}
+  else
+  {
+   sprintf(line,"trace_%ld.json",(long)time(NULL));
+   if (perf_trace_start(line)==0) fprintf(stderr,"Tracing events to %s, press 'e' again to stop\n",line);
+   else fprintf(stderr,"Unable to start the event trace\n");
+  }
+ }
+ if (key=='y')
+ {
+  // Start/stop the per-frame telemetry log, convert it with tools/telemetry2csv
+  if (telemetry_running()) telemetry_stop();
+  else
+  {
+   sprintf(line,"telemetry_%ld.tlm",(long)time(NULL));
+   if (telemetry_start(line)==0) fprintf(stderr,"Logging telemetry to %s, press 'y' again to stop\n",line);
+   else fprintf(stderr,"Unable to start the telemetry log\n");
+  }
+ }
+ if (key=='u')
+ {
+  // Start/stop recording raw camera frames, play them back with video device replay:<file>
+  if (webcam->captureFile!=NULL)
+  {
+   uvcRecordStop(webcam);
+   fprintf(stderr,"Raw recording stopped, %u frames written\n",webcam->framesWritten);
+  }
+  else
+  {
+   sprintf(line,"capture_%ld.raw",(long)time(NULL));
+   if (uvcRecordStart(webcam,line)==0) fprintf(stderr,"Recording raw frames to %s, press 'u' again to stop\n",line);
+   else fprintf(stderr,"Unable to start raw recording\n");
+  }
+ }
+ if (key=='v')
+ {
+  // Start/stop recording an AVI of whatever aviSource selects
+  if (aviRecording())
+  {
+   aviRecordStop();
+   fprintf(stderr,"AVI recording stopped, %lld frames dropped\n",aviRecordDropped());
+  }
+  else
+  {
+   int ok;
+   sprintf(line,"video_%ld.avi",(long)time(NULL));
+   if (aviSource==2) ok=aviRecordStart(line,1024,768,30);
+   else ok=aviRecordStart(line,sx,sy,30);
+   if (ok==0) fprintf(stderr,"Recording %s to %s, press 'v' again to stop\n",aviSource==0?"camera frames":(aviSource==1?"the rectified field":"the display"),line);
+   else fprintf(stderr,"Unable to start AVI recording\n");
+  }
+ }
+ if (key=='V'&&!aviRecording())
+ {
+  aviSource=(aviSource+1)%3;
+  fprintf(stderr,"'v' will record %s\n",aviSource==0?"camera frames":(aviSource==1?"the rectified field":"the display"));
+ }
+ if (key=='n') uvcReplayStep(webcam);		// Next frame when replaying a recording in step mode
+ if (key=='p')
+ {
+  if (perf_stage_write_csv("frame_stages.csv",frameStages,N_STAGES)==0) fprintf(stderr,"Appended frame stage timings to frame_stages.csv\n");
+  else fprintf(stderr,"Unable to write frame_stages.csv\n");
+ }
+ if (key=='b') {BT_motor_latency_print(stderr); if (BT_stats_enabled) BT_stats_dump(stderr); else {BT_stats_enable(1); fprintf(stderr,"BT stats enabled, press 'b' again to print them\n");}}
 
  // Robot robot manual override
  if (key=='i') {if (DIR_FWD==0) {DIR_FWD=1; DIR_L=0; DIR_R=0; DIR_BACK=0; BT_drive(LEFT_MOTOR, RIGHT_MOTOR,75);} else {DIR_FWD=0; BT_all_stop(0);}}
  if (key=='j') {if (DIR_L==0) {DIR_L=1; DIR_R=0; DIR_FWD=0; DIR_BACK=0; BT_turn(LEFT_MOTOR, 50, RIGHT_MOTOR, -50);} else {DIR_L=0; BT_all_stop(0);}}
  if (key=='l') {if (DIR_R==0) {DIR_R=1; DIR_L=0; DIR_FWD=0; DIR_BACK=0; BT_turn(LEFT_MOTOR, -50, RIGHT_MOTOR, 50);} else {DIR_R=0; BT_all_stop(0);}}
  if (key=='k') {if (DIR_BACK==0) {DIR_BACK=1; DIR_L=0; DIR_R=0; DIR_FWD=0; BT_drive(LEFT_MOTOR, RIGHT_MOTOR, -75);} else {DIR_BACK=0; BT_all_stop(0);}}
- if (key=='o') {BT_all_stop(0);doAI=0;}	// <-- Important!
+ if (key=='o') {release_control_goal(); BT_all_stop(0);doAI=0;}	// <-- Important! (the control thread lets go of the drive first)
 
  if (key=='1') {if (heightAdj==0) heightAdj=1; else heightAdj=0;}   
     
@@ -1969,6 +2418,22 @@ struct vdIn *initCam(const char *videodevice, int width, int height)
 
 	videoIn = (struct vdIn *) calloc(1, sizeof(struct vdIn));
 
+	// "replay:file[,mode]" plays back a raw recording instead of opening a camera
+	if (strncmp(videodevice,"replay:",7)==0)
+	{
+		if (init_replay(videoIn, videodevice+7) < 0)
+			return(NULL);
+		return(videoIn);
+	}
+
+	// "synth:[WxH][,option=value]..." renders a field instead (see synthCam.h)
+	if (strncmp(videodevice,"synth:",6)==0||strcmp(videodevice,"synth")==0)
+	{
+		if (synthCamInit(videoIn, videodevice[5]==':'?videodevice+6:"", width, height) < 0)
+			return(NULL);
+		return(videoIn);
+	}
+
 	if (init_videoIn
 			(videoIn, (char *) videodevice, width, height, fps, format,
 			 grabmethod, &avifilename[0]) < 0)
@@ -1981,21 +2446,19 @@ void getFrame(struct vdIn *videoIn, int sx, int sy)
  /*
    Grab a single frame from the camera into the frame_buffer (global pointer). Derived from uvccapture.c
  */
-    double dtime;
-
 	// Grab a frame from the video device
+    perf_stage_begin(&frameStages[STAGE_CAPTURE]);
 	if (uvcGrab(videoIn) < 0) {
 		fprintf(stderr,"getFrame(): There was an error grabbing the frame from the webcam.\n");
+		perf_stage_end(&frameStages[STAGE_CAPTURE]);
 		return;
 	}
+    perf_stage_end(&frameStages[STAGE_CAPTURE]);
+    perf_stage_begin(&frameStages[STAGE_YUYV]);
     yuyv_to_rgb(videoIn, sx, sy); 
+    perf_stage_end(&frameStages[STAGE_YUYV]);
     videoIn->getPict = 0;
-
-	// Print FPS if needed.
     frameNo++;
-    time(&time2);
-    dtime=difftime(time2,time1);
-    if (printFPS) fprintf(stderr,"FPS= %f\n",(double)frameNo/dtime);
 }
 
 void closeCam(struct vdIn *videoIn)
@@ -88,7 +88,8 @@ struct displayList{
 };
 
 // Startup
-int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int ai_mode);
+int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int ai_mode, const char *control);
+int headlessLoop(const char *control);
 
 // OpenGL, GLUT, and main loop
 void initGlut(char* winName);
@@ -96,6 +97,12 @@ void kbHandler(unsigned char key, int x, int y);
 void kbUpHandler(unsigned char key, int x, int y);
 void WindowReshape(int w, int h);
 void FrameGrabLoop(void);
+void initFrameStages(void);
+void printFrameStages(FILE *fp);
+void scoreSynthBlobs(struct blob *list);
+void drawPerfHUD(int nblobs);
+void scaleToDisplay(unsigned char *src, unsigned char *big);
+void scaleImageToDisplay(struct image *im, unsigned char *big);
 
 // Webcam setup and frame capture
 void yuyv_to_rgb (struct vdIn *vd, int sx, int sy);
@@ -0,0 +1,427 @@
+/***************************************************************
+ CSC C85 - UTSC RoboSoccer synthetic camera
+
+ See synthCam.h
+****************************************************************/
+
+#include "synthCam.h"
+#include "v4l2uvc.h"
+#include "../perf/perfhist.h"
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef PI
+#define PI 3.14159265354
+#endif
+
+#define SYNTH_NOISE_TAB 4096		// Precomputed noise samples, indexed at random per pixel
+#define SYNTH_LINE_W 0.012		// Width of the white field markings (m)
+
+// Reference hues (radians) and how the colours are painted: saturation, value. 3 is the field.
+static const double synthHue[4]={225*PI/180,6*PI/180,40*PI/180,120*PI/180};
+static const double synthSat[4]={.85,.85,.9,.15};
+static const double synthVal[4]={.8,.85,.95,.45};
+static const double synthSurround[3]={50,45,40};	// Floor around the field
+static const double synthLine[3]={215,215,210};
+
+static short synthNoiseTab[SYNTH_NOISE_TAB];
+
+static unsigned long long synthRand(unsigned long long *s)
+{
+ // xorshift64*
+ *s^=*s>>12;
+ *s^=*s<<25;
+ *s^=*s>>27;
+ return *s*2685821657736338717ULL;
+}
+
+static double synthUniform(unsigned long long *s)
+{
+ return (synthRand(s)>>11)*(1.0/9007199254740992.0);
+}
+
+static void synthColour(double H, double S, double V, double rgb[3])
+{
+ // HSV (H in radians, S and V in [0,1]) to RGB in [0,255]
+ double h=fmod(H*180/PI+360,360)/60, f, p, q, t;
+ int i=(int)h;
+ f=h-i;
+ p=V*(1-S);
+ q=V*(1-S*f);
+ t=V*(1-S*(1-f));
+ switch (i)
+ {
+  case 0: rgb[0]=V; rgb[1]=t; rgb[2]=p; break;
+  case 1: rgb[0]=q; rgb[1]=V; rgb[2]=p; break;
+  case 2: rgb[0]=p; rgb[1]=V; rgb[2]=t; break;
+  case 3: rgb[0]=p; rgb[1]=q; rgb[2]=V; break;
+  case 4: rgb[0]=t; rgb[1]=p; rgb[2]=V; break;
+  default: rgb[0]=V; rgb[1]=p; rgb[2]=q; break;
+ }
+ rgb[0]*=255;
+ rgb[1]*=255;
+ rgb[2]*=255;
+}
+
+static void synthProject(const double *H, double x, double y, double *u, double *v)
+{
+ double w=H[6]*x+H[7]*y+H[8];
+ *u=(H[0]*x+H[1]*y+H[2])/w;
+ *v=(H[3]*x+H[4]*y+H[5])/w;
+}
+
+static void synthGeometry(struct synthCam *sc)
+{
+ ////////////////////////////////////////////////////////////////
+ // Places the field in the image: the near (bottom) side spans
+ // most of the image width, the far side is narrower by persp.
+ // H maps field metres to image pixels (unit square to quad, as
+ // in Heckbert's "Fundamentals of Texture Mapping"), Hinv is its
+ // adjugate.
+ ////////////////////////////////////////////////////////////////
+ double mx=.05*sc->width, my=.06*sc->height, inset, *c;
+ double dx1, dx2, dx3, dy1, dy2, dy3, den, g, h, a, b, d, e, *H=sc->H, *I=sc->Hinv;
+
+ inset=sc->persp*(sc->width-2*mx)/2;
+ sc->corners[0][0]=mx+inset;		sc->corners[0][1]=my;
+ sc->corners[1][0]=sc->width-mx-inset;	sc->corners[1][1]=my;
+ sc->corners[2][0]=sc->width-mx;	sc->corners[2][1]=sc->height-my;
+ sc->corners[3][0]=mx;			sc->corners[3][1]=sc->height-my;
+
+ c=&sc->corners[0][0];
+ dx1=c[2]-c[4]; dx2=c[6]-c[4]; dx3=c[0]-c[2]+c[4]-c[6];
+ dy1=c[3]-c[5]; dy2=c[7]-c[5]; dy3=c[1]-c[3]+c[5]-c[7];
+ den=dx1*dy2-dx2*dy1;
+ g=(dx3*dy2-dx2*dy3)/den;
+ h=(dx1*dy3-dx3*dy1)/den;
+ a=c[2]-c[0]+g*c[2];
+ b=c[6]-c[0]+h*c[6];
+ d=c[3]-c[1]+g*c[3];
+ e=c[7]-c[1]+h*c[7];
+
+ // Unit square to image, with the field metres scaled to the unit square first
+ H[0]=a/SYNTH_FIELD_W; H[1]=b/SYNTH_FIELD_H; H[2]=c[0];
+ H[3]=d/SYNTH_FIELD_W; H[4]=e/SYNTH_FIELD_H; H[5]=c[1];
+ H[6]=g/SYNTH_FIELD_W; H[7]=h/SYNTH_FIELD_H; H[8]=1;
+
+ I[0]=H[4]*H[8]-H[5]*H[7]; I[1]=H[2]*H[7]-H[1]*H[8]; I[2]=H[1]*H[5]-H[2]*H[4];
+ I[3]=H[5]*H[6]-H[3]*H[8]; I[4]=H[0]*H[8]-H[2]*H[6]; I[5]=H[2]*H[3]-H[0]*H[5];
+ I[6]=H[3]*H[7]-H[4]*H[6]; I[7]=H[1]*H[6]-H[0]*H[7]; I[8]=H[0]*H[4]-H[1]*H[3];
+}
+
+static void synthPlace(struct synthCam *sc, int nBots, int nBalls)
+{
+ // Scatter the objects over the field without overlaps (if they fit), with random motion
+ unsigned long long s=sc->seed*0x9E3779B97F4A7C15ULL+1;
+ struct synthObject *o;
+ double r, ri, speed;
+ int tries, ok;
+
+ sc->nObjects=0;
+ for (int i=0; i<nBots+nBalls&&sc->nObjects<SYNTH_MAX_OBJECTS; i++)
+ {
+  o=&sc->obj[sc->nObjects];
+  if (i<nBots)
+  {
+   o->colour=i%2;
+   o->hl=.07;
+   o->hw=.05;
+   speed=.15;
+   o->omega=(synthUniform(&s)-.5)*1.5;
+  }
+  else
+  {
+   o->colour=2;
+   o->hl=o->hw=.025;
+   speed=.35;
+   o->omega=0;
+  }
+  r=o->hl>o->hw?o->hl:o->hw;
+  for (tries=0; tries<200; tries++)
+  {
+   o->x=r+synthUniform(&s)*(SYNTH_FIELD_W-2*r);
+   o->y=r+synthUniform(&s)*(SYNTH_FIELD_H-2*r);
+   ok=1;
+   for (int j=0; j<sc->nObjects&&ok; j++)
+   {
+    ri=sc->obj[j].hl>sc->obj[j].hw?sc->obj[j].hl:sc->obj[j].hw;
+    if (hypot(o->x-sc->obj[j].x,o->y-sc->obj[j].y)<1.5*(r+ri)) ok=0;
+   }
+   if (ok) break;
+  }
+  o->theta=synthUniform(&s)*2*PI;
+  r=synthUniform(&s)*2*PI;
+  o->vx=speed*cos(r);
+  o->vy=speed*sin(r);
+  sc->nObjects++;
+ }
+
+ // Noise samples, roughly Gaussian (sum of 4 uniforms) with the asked for deviation
+ for (int i=0; i<SYNTH_NOISE_TAB; i++)
+ {
+  double n=synthUniform(&s)+synthUniform(&s)+synthUniform(&s)+synthUniform(&s)-2;
+  synthNoiseTab[i]=(short)lround(n*sqrt(3.0)*sc->noise);
+ }
+}
+
+int synthCamInit(struct vdIn *vd, const char *spec, int width, int height)
+{
+ /////////////////////////////////////////////////////////////////
+ // Sets up vd as a synthetic camera. spec is what follows synth:
+ // in the device name, width and height are used if it gives no
+ // size. Returns 0 on success, -1 if the spec can't be parsed.
+ /////////////////////////////////////////////////////////////////
+ struct synthCam *sc;
+ char opts[1024], *tok, *save, *eq;
+ int nBots=2, nBalls=1, w, h;
+
+ sc=(struct synthCam *)calloc(1,sizeof(struct synthCam));
+ if (sc==NULL) return -1;
+ sc->light=1.0;
+ sc->grad=.3;
+ sc->persp=.25;
+ sc->noise=3;
+ sc->fps=30;
+ sc->move=1;
+ sc->seed=1;
+ sc->showObjects=1;
+
+ snprintf(opts,sizeof(opts),"%s",spec);
+ for (tok=strtok_r(opts,",",&save); tok!=NULL; tok=strtok_r(NULL,",",&save))
+ {
+  if (sscanf(tok,"%dx%d",&w,&h)==2) {width=w; height=h; continue;}
+  eq=strchr(tok,'=');
+  if (eq==NULL) {fprintf(stderr,"synthCamInit(): Expected option=value, got '%s'\n",tok); free(sc); return -1;}
+  *(eq++)='\0';
+  if (!strcmp(tok,"bots")) nBots=atoi(eq);
+  else if (!strcmp(tok,"balls")) nBalls=atoi(eq);
+  else if (!strcmp(tok,"light")) sc->light=atof(eq);
+  else if (!strcmp(tok,"grad")) sc->grad=atof(eq);
+  else if (!strcmp(tok,"persp")) sc->persp=atof(eq);
+  else if (!strcmp(tok,"noise")) sc->noise=atof(eq);
+  else if (!strcmp(tok,"fps")) sc->fps=atof(eq);
+  else if (!strcmp(tok,"move")) sc->move=atoi(eq);
+  else if (!strcmp(tok,"seed")) sc->seed=strtoull(eq,NULL,10);
+  else {fprintf(stderr,"synthCamInit(): Unknown option '%s'\n",tok); free(sc); return -1;}
+ }
+ width&=~1;				// YUYV comes in pixel pairs
+ if (width<64||height<48||nBots<0||nBalls<0||sc->persp<0||sc->persp>.9)
+ {
+  fprintf(stderr,"synthCamInit(): Bad size or options in '%s'\n",spec);
+  free(sc);
+  return -1;
+ }
+ sc->width=width;
+ sc->height=height;
+ synthGeometry(sc);
+ synthPlace(sc,nBots,nBalls);
+
+ memset(vd,0,sizeof(struct vdIn));
+ vd->fd=-1;
+ vd->last_sequence=-1;
+ vd->width=width;
+ vd->height=height;
+ vd->formatIn=V4L2_PIX_FMT_YUYV;
+ vd->framesizeIn=width*height*2;
+ vd->framebuffer=(unsigned char *)calloc(1,(size_t)vd->framesizeIn);
+ vd->videodevice=(char *)calloc(1,16*sizeof(char));
+ vd->status=(char *)calloc(1,100*sizeof(char));
+ vd->pictName=(char *)calloc(1,80*sizeof(char));
+ if (!vd->framebuffer||!vd->videodevice||!vd->status||!vd->pictName)
+ {
+  fprintf(stderr,"synthCamInit(): Out of memory\n");
+  free(sc);
+  return -1;
+ }
+ snprintf(vd->videodevice,16,"synth");
+ vd->signalquit=1;
+ vd->synth=sc;
+ fprintf(stderr,"Synthetic camera: %d x %d, %d bots, %d balls, %s\n",width,height,nBots,nBalls,
+         sc->fps>0?"paced":"as fast as possible");
+ return 0;
+}
+
+void synthCamStep(struct synthCam *sc, double dt)
+{
+ // Move the objects, bouncing off the field edges
+ for (int i=0; i<sc->nObjects; i++)
+ {
+  struct synthObject *o=&sc->obj[i];
+  double r=o->hl>o->hw?o->hl:o->hw;
+  o->x+=o->vx*dt;
+  o->y+=o->vy*dt;
+  o->theta=fmod(o->theta+o->omega*dt,2*PI);
+  if (o->x<r) {o->x=r; o->vx=fabs(o->vx);}
+  if (o->x>SYNTH_FIELD_W-r) {o->x=SYNTH_FIELD_W-r; o->vx=-fabs(o->vx);}
+  if (o->y<r) {o->y=r; o->vy=fabs(o->vy);}
+  if (o->y>SYNTH_FIELD_H-r) {o->y=SYNTH_FIELD_H-r; o->vy=-fabs(o->vy);}
+ }
+}
+
+void synthCamRender(struct synthCam *sc, unsigned char *yuyv)
+{
+ ////////////////////////////////////////////////////////////////
+ // Draws one frame. Each row is painted in RGB (background, then
+ // any objects crossing the row, found from their image bounding
+ // boxes), then lit, given noise, and packed as YUYV the way the
+ // camera sends it (and yuyv_to_rgb() undoes it).
+ ////////////////////////////////////////////////////////////////
+ int W=sc->width, Ht=sc->height, n=sc->nObjects;
+ int box[SYNTH_MAX_OBJECTS][4];
+ double col[4][3], cx=W/2.0, cy=Ht/2.0, rr=1.0/(cx*cx+cy*cy);
+ const double *I=sc->Hinv;
+
+ for (int k=0; k<4; k++) synthColour(synthHue[k],synthSat[k],synthVal[k],col[k]);
+
+ // Image bounding box of each object (corners of its bounding square on the field)
+ for (int k=0; k<n; k++)
+ {
+  struct synthObject *o=&sc->obj[k];
+  double r=(o->hl>o->hw?o->hl:o->hw)*1.5, u, v;
+  box[k][0]=W; box[k][1]=Ht; box[k][2]=-1; box[k][3]=-1;
+  if (!sc->showObjects) continue;
+  for (int c=0; c<4; c++)
+  {
+   synthProject(sc->H,o->x+(c&1?r:-r),o->y+(c&2?r:-r),&u,&v);
+   if (u<box[k][0]) box[k][0]=(int)u;
+   if (v<box[k][1]) box[k][1]=(int)v;
+   if (u+1>box[k][2]) box[k][2]=(int)(u+1);
+   if (v+1>box[k][3]) box[k][3]=(int)(v+1);
+  }
+  if (box[k][0]<0) box[k][0]=0;
+  if (box[k][1]<0) box[k][1]=0;
+  if (box[k][2]>W-1) box[k][2]=W-1;
+  if (box[k][3]>Ht-1) box[k][3]=Ht-1;
+ }
+
+#pragma omp parallel for schedule(dynamic,16)
+ for (int j=0; j<Ht; j++)
+ {
+  double row[W][3];
+  unsigned long long s=(sc->seed+1)*0x9E3779B97F4A7C15ULL^((unsigned long long)sc->frame*Ht+j+1)*0xBF58476D1CE4E5B9ULL;
+  unsigned char *p=yuyv+(size_t)j*W*2;
+
+  for (int i=0; i<W; i++)
+  {
+   double w=I[6]*i+I[7]*j+I[8], x=(I[0]*i+I[1]*j+I[2])/w, y=(I[3]*i+I[4]*j+I[5])/w;
+   const double *c;
+   if (x<0||x>SYNTH_FIELD_W||y<0||y>SYNTH_FIELD_H) c=synthSurround;
+   else if (x<SYNTH_LINE_W||x>SYNTH_FIELD_W-SYNTH_LINE_W||y<SYNTH_LINE_W||y>SYNTH_FIELD_H-SYNTH_LINE_W||
+            fabs(x-SYNTH_FIELD_W/2)<SYNTH_LINE_W/2) c=synthLine;
+   else c=col[3];
+   row[i][0]=c[0];
+   row[i][1]=c[1];
+   row[i][2]=c[2];
+  }
+
+  for (int k=0; k<n; k++)
+  {
+   struct synthObject *o=&sc->obj[k];
+   double ct=cos(o->theta), st=sin(o->theta);
+   if (j<box[k][1]||j>box[k][3]) continue;
+   for (int i=box[k][0]; i<=box[k][2]; i++)
+   {
+    double w=I[6]*i+I[7]*j+I[8], x=(I[0]*i+I[1]*j+I[2])/w-o->x, y=(I[3]*i+I[4]*j+I[5])/w-o->y;
+    int in;
+    if (o->colour==2) in=x*x+y*y<o->hl*o->hl;
+    else in=fabs(x*ct+y*st)<o->hl&&fabs(-x*st+y*ct)<o->hw;
+    if (in)
+    {
+     row[i][0]=col[o->colour][0];
+     row[i][1]=col[o->colour][1];
+     row[i][2]=col[o->colour][2];
+    }
+   }
+  }
+
+  for (int i=0; i<W; i+=2)
+  {
+   double Y[2], U=0, V=0;
+   for (int q=0; q<2; q++)
+   {
+    double dx=i+q-cx, dy=j-cy, L=sc->light*(1-sc->grad*(dx*dx+dy*dy)*rr);
+    double R=row[i+q][0]*L, G=row[i+q][1]*L, B=row[i+q][2]*L;
+    Y[q]=.299*R+.587*G+.114*B+synthNoiseTab[synthRand(&s)>>52];
+    U+=(B-Y[q])*(256.0/454);
+    V+=(R-Y[q])*(256.0/359);
+   }
+   U=U/2+128+synthNoiseTab[synthRand(&s)>>52]/2;
+   V=V/2+128+synthNoiseTab[synthRand(&s)>>52]/2;
+   p[0]=(unsigned char)(Y[0]<0?0:Y[0]>255?255:Y[0]);
+   p[1]=(unsigned char)(U<0?0:U>255?255:U);
+   p[2]=(unsigned char)(Y[1]<0?0:Y[1]>255?255:Y[1]);
+   p[3]=(unsigned char)(V<0?0:V>255?255:V);
+   p+=4;
+  }
+ }
+}
+
+int synthCamGrab(struct vdIn *vd)
+{
+ // uvcGrab() for a synthetic camera: advance the scene one frame and draw it
+ struct synthCam *sc=vd->synth;
+ long long now;
+
+ if (sc->frame>0&&sc->move) synthCamStep(sc,1.0/(sc->fps>0?sc->fps:30));
+ synthCamRender(sc,vd->framebuffer);
+ sc->frame++;
+
+ now=perf_time_us();
+ if (sc->fps>0)
+ {
+  if (sc->nextFrame==0||sc->nextFrame<now-1000000) sc->nextFrame=now;
+  if (sc->nextFrame>now) usleep(sc->nextFrame-now);
+  vd->frame_time_us=sc->nextFrame>now?sc->nextFrame:now;
+  sc->nextFrame+=(long long)(1e6/sc->fps);
+ }
+ else vd->frame_time_us=now;
+ vd->last_sequence=sc->frame;
+ return 0;
+}
+
+void synthCamCalibration(struct synthCam *sc, double corners[4][2], double hues[4], double rgb[4][3])
+{
+ // What the user would click on: the field corners, and the reference colours (pure, S=V=1)
+ memcpy(&corners[0][0],&sc->corners[0][0],8*sizeof(double));
+ for (int k=0; k<4; k++)
+ {
+  hues[k]=synthHue[k];
+  synthColour(synthHue[k],1,1,rgb[k]);
+ }
+}
+
+void synthCamScore(struct synthCam *sc, const double *cx, const double *cy, int n, int sx, int sy)
+{
+ ////////////////////////////////////////////////////////////////
+ // Matches each object drawn in the last frame with the nearest
+ // blob centroid in the rectified image (sx x sy, which the field
+ // corners are stretched to) and keeps the error. Objects with no
+ // blob within their own size count as missed.
+ ////////////////////////////////////////////////////////////////
+ if (!sc->showObjects) return;
+ for (int k=0; k<sc->nObjects; k++)
+ {
+  struct synthObject *o=&sc->obj[k];
+  double u=1+o->x/SYNTH_FIELD_W*(sx-2), v=1+o->y/SYNTH_FIELD_H*(sy-2);
+  double reach=(o->hl>o->hw?o->hl:o->hw)/SYNTH_FIELD_W*sx, best=reach, d;
+  for (int b=0; b<n; b++)
+  {
+   d=hypot(cx[b]-u,cy[b]-v);
+   if (d<best) best=d;
+  }
+  sc->scored++;
+  if (best<reach)
+  {
+   sc->found++;
+   sc->errSum+=best;
+   if (best>sc->errMax) sc->errMax=best;
+  }
+ }
+}
+
+void synthCamPrintScore(struct synthCam *sc, FILE *fp)
+{
+ if (sc->scored==0) return;
+ fprintf(fp,"Synthetic camera: found %lld of %lld objects (%.1f%%), centroid error mean %.2f, max %.2f pixels\n",
+         sc->found,sc->scored,100.0*sc->found/sc->scored,sc->found?sc->errSum/sc->found:0.0,sc->errMax);
+}
@@ -0,0 +1,78 @@
+/***************************************************************
+ CSC C85 - UTSC RoboSoccer synthetic camera
+
+ Renders YUYV frames of a field with bots and balls on it, at
+ any resolution, into the vdIn framebuffer in place of a camera
+ (video device "synth:..."), so the whole vision pipeline can be
+ run and timed without a camera, at resolutions the lab camera
+ doesn't do, and with a known ground truth for every blob.
+
+ The device spec is synth:[WxH][,option=value]... with options
+   bots=n     coloured bot uniforms, blue and red in turn (2)
+   balls=n    balls (1)
+   light=f    overall brightness (1.0)
+   grad=f     vignetting, how much darker the corners are (0.3)
+   persp=f    perspective, how much narrower the far side of
+              the field is than the near side (0.25)
+   noise=f    sensor noise, standard deviation in grey levels (3)
+   fps=f      frame rate to pace frames at, 0 for as fast as the
+              pipeline takes them (30)
+   move=0|1   objects move and bounce around the field (1)
+   seed=n     random seed for the noise and the object motion (1)
+ The size defaults to the one asked for on the command line.
+
+ Objects move by a fixed step per frame whatever the pacing, so
+ the same spec always gives the same frames. The corners of the
+ field and the reference colours are known, so imageCapture
+ calibrates itself from synthCamCalibration() instead of from
+ the user, and scores the detected blobs against where the
+ objects were drawn with synthCamScore().
+****************************************************************/
+
+#ifndef __synthCam_header
+
+#define __synthCam_header
+
+#include <stdio.h>
+
+#define SYNTH_MAX_OBJECTS 64
+#define SYNTH_FIELD_W 1.5		// Field size (m), the rectified image is this stretched to sx x sy
+#define SYNTH_FIELD_H 1.0
+
+struct vdIn;
+
+struct synthObject{
+ int colour;				// Reference colour index: 0 blue, 1 red, 2 ball
+ double x, y;				// Centre on the field (m)
+ double theta;				// Heading (radians), bots only
+ double vx, vy, omega;			// Motion per second
+ double hl, hw;				// Half length and half width (m), radius for a ball
+};
+
+struct synthCam{
+ int width, height;
+ double light, grad, persp, noise, fps;
+ int move;
+ unsigned long long seed;
+ int nObjects;
+ struct synthObject obj[SYNTH_MAX_OBJECTS];
+ int showObjects;			// Set to 0 to render the empty field
+ double H[9];				// Field (m) to image homography
+ double Hinv[9];			// Image to field
+ double corners[4][2];			// Field corners in the image: top-left, top-right, bottom-right, bottom-left
+ long long frame;
+ long long nextFrame;			// When the next frame is due (us, monotonic) when pacing
+ // Centroid accuracy, see synthCamScore()
+ long long scored, found;
+ double errSum, errMax;
+};
+
+int synthCamInit(struct vdIn *vd, const char *spec, int width, int height);
+int synthCamGrab(struct vdIn *vd);
+void synthCamRender(struct synthCam *sc, unsigned char *yuyv);
+void synthCamStep(struct synthCam *sc, double dt);
+void synthCamCalibration(struct synthCam *sc, double corners[4][2], double hues[4], double rgb[4][3]);
+void synthCamScore(struct synthCam *sc, const double *cx, const double *cy, int n, int sx, int sy);
+void synthCamPrintScore(struct synthCam *sc, FILE *fp);
+
+#endif
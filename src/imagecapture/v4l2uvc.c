@@ -24,7 +24,9 @@
 #include <stdlib.h>
 
 #include "v4l2uvc.h"
+#include "synthCam.h"
 #include "utils.h"
+#include "../perf/perfhist.h"
 
 #define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
 #define FOURCC_FORMAT		"%c%c%c%c"
@@ -36,6 +38,7 @@ static int debug = 0;
 
 
 static int init_v4l2(struct vdIn *vd);
+static int replay_grab(struct vdIn *vd);
 
 int check_videoIn(struct vdIn *vd, char *device)
 {
@@ -99,6 +102,10 @@ init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps,
     vd->avifilename = avifilename;
     vd->recordtime = 0;
     vd->framecount = 0;
+    vd->frame_time_us = 0;
+    vd->frames_dropped = 0;
+    vd->last_sequence = -1;
+    vd->replayFile = NULL;
     vd->recordstart = 0;
     vd->getPict = 0;
     vd->signalquit = 1;
@@ -535,6 +542,10 @@ int uvcGrab(struct vdIn *vd)
 #define HEADERFRAME1 0xaf
     int ret;
 
+    if (vd->replayFile)
+	return replay_grab(vd);
+    if (vd->synth)
+	return synthCamGrab(vd);
     if (!vd->isstreaming)
 	if (video_enable(vd))
 	    goto err;
@@ -547,6 +558,19 @@ int uvcGrab(struct vdIn *vd)
 	goto err;
     }
 
+    /* Use the driver's capture timestamp if it is on the monotonic clock (uvcvideo stamps
+       the start of the frame), otherwise the best we can do is the time we got the buffer */
+    if ((vd->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+	vd->frame_time_us = (long long) vd->buf.timestamp.tv_sec * 1000000LL + vd->buf.timestamp.tv_usec;
+    else
+	vd->frame_time_us = perf_time_us();
+
+    /* The sequence number counts every frame the driver captured, a gap means we were too
+       slow and frames were overwritten. It restarts when streaming is restarted. */
+    if (vd->last_sequence >= 0 && vd->buf.sequence > vd->last_sequence + 1)
+	vd->frames_dropped += vd->buf.sequence - vd->last_sequence - 1;
+    vd->last_sequence = vd->buf.sequence;
+
 	/* Capture a single raw frame */
 	if (vd->rawFrameCapture && vd->buf.bytesused > 0) {
 		FILE *frame = NULL;
@@ -586,10 +610,16 @@ end_capture:
 
    
 
-	/* Capture raw stream data */
+	/* Capture raw stream data, each frame preceded by its timestamp (see uvcRecordStart()) */
 	if (vd->captureFile && vd->buf.bytesused > 0) {
+		struct raw_frame_header fh;
 		int ret;
-		ret = fwrite(vd->mem[vd->buf.index], vd->buf.bytesused, 1, vd->captureFile);
+		fh.timestamp_us = vd->frame_time_us;
+		fh.sequence = vd->buf.sequence;
+		fh.bytesused = vd->buf.bytesused;
+		ret = fwrite(&fh, sizeof(fh), 1, vd->captureFile);
+		if (ret == 1)
+			ret = fwrite(vd->mem[vd->buf.index], vd->buf.bytesused, 1, vd->captureFile);
 		if (ret < 1) {
 			perror("Unable to write raw stream to file");
 			fprintf(stderr, "Stream capturing terminated.\n");
@@ -648,6 +678,13 @@ end_capture:
 }
 int close_v4l2(struct vdIn *vd)
 {
+    uvcRecordStop(vd);
+    if (vd->replayFile) {
+	fclose(vd->replayFile);
+	vd->replayFile = NULL;
+    }
+    free(vd->synth);
+    vd->synth = NULL;
     if (vd->isstreaming)
 	video_disable(vd);
     if (vd->tmpbuffer)
@@ -661,6 +698,176 @@ int close_v4l2(struct vdIn *vd)
     vd->videodevice = NULL;
     vd->status = NULL;
     vd->pictName = NULL;
+    return 0;
+}
+
+/****************************************************************************
+ Raw recording and replay. A recording is the raw camera buffers with their
+ capture timestamps and sequence numbers (format in v4l2uvc.h), written by
+ uvcGrab() while vd->captureFile is open. A recording can be opened in place
+ of the camera with init_replay(), uvcGrab() then hands out the recorded
+ frames, so the rest of the pipeline can't tell the difference.
+****************************************************************************/
+int uvcRecordStart(struct vdIn *vd, const char *filename)
+{
+    struct raw_file_header h;
+
+    if (vd->captureFile || vd->replayFile || vd->synth)
+	return -1;
+    vd->captureFile = fopen(filename, "wb");
+    if (vd->captureFile == NULL) {
+	perror("Unable to open raw stream file");
+	return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RAW_MAGIC, sizeof(h.magic));
+    h.width = vd->width;
+    h.height = vd->height;
+    h.pixelformat = vd->formatIn;
+    if (fwrite(&h, sizeof(h), 1, vd->captureFile) < 1) {
+	perror("Unable to write raw stream file");
+	fclose(vd->captureFile);
+	vd->captureFile = NULL;
+	return -1;
+    }
+    vd->framesWritten = 0;
+    vd->bytesWritten = 0;
+    return 0;
+}
+
+int uvcRecordStop(struct vdIn *vd)
+{
+    if (vd->captureFile == NULL)
+	return -1;
+    fclose(vd->captureFile);
+    vd->captureFile = NULL;
+    return 0;
+}
+
+int init_replay(struct vdIn *vd, const char *spec)
+{
+    /* Open a recording as the video source. spec is "path[,realtime|fast|step]":
+       realtime - frames are released on the recorded schedule (default)
+       fast     - as fast as the pipeline takes them, for benchmarking
+       step     - each frame is held until uvcReplayStep() is called */
+    struct raw_file_header h;
+    char path[1024];
+    const char *comma;
+
+    memset(vd, 0, sizeof(struct vdIn));
+    vd->fd = -1;
+    vd->last_sequence = -1;
+    vd->replayMode = REPLAY_REALTIME;
+    snprintf(path, sizeof(path), "%s", spec);
+    comma = strrchr(spec, ',');
+    if (comma) {
+	if (strcmp(comma + 1, "fast") == 0)
+	    vd->replayMode = REPLAY_FAST;
+	else if (strcmp(comma + 1, "step") == 0)
+	    vd->replayMode = REPLAY_STEP;
+	else if (strcmp(comma + 1, "realtime") != 0)
+	    comma = NULL;	/* not a mode, part of the file name */
+	if (comma && comma - spec < (int) sizeof(path))
+	    path[comma - spec] = '\0';
+    }
+
+    vd->replayFile = fopen(path, "rb");
+    if (vd->replayFile == NULL) {
+	perror("Unable to open replay file");
+	return -1;
+    }
+    if (fread(&h, sizeof(h), 1, vd->replayFile) < 1 ||
+	memcmp(h.magic, RAW_MAGIC, sizeof(h.magic)) != 0) {
+	printf("%s is not a raw recording\n", path);
+	goto error;
+    }
+    if (h.pixelformat != V4L2_PIX_FMT_YUYV || h.width <= 0 || h.height <= 0) {
+	printf("%s: only YUYV recordings can be replayed\n", path);
+	goto error;
+    }
+    vd->width = h.width;
+    vd->height = h.height;
+    vd->formatIn = h.pixelformat;
+    vd->framesizeIn = (vd->width * vd->height << 1);
+    vd->framebuffer = (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
+    if (!vd->framebuffer)
+	goto error;
+    vd->videodevice = (char *) calloc(1, 16 * sizeof(char));
+    vd->status = (char *) calloc(1, 100 * sizeof(char));
+    vd->pictName = (char *) calloc(1, 80 * sizeof(char));
+    snprintf(vd->videodevice, 16, "replay");
+    vd->signalquit = 1;
+    printf("Replaying %s: %d x %d, %s\n", path, vd->width, vd->height,
+	   vd->replayMode == REPLAY_FAST ? "as fast as possible" :
+	   vd->replayMode == REPLAY_STEP ? "single step" : "real time");
+    return 0;
+  error:
+    fclose(vd->replayFile);
+    vd->replayFile = NULL;
+    return -1;
+}
+
+void uvcReplayStep(struct vdIn *vd)
+{
+    /* Release the next frame in step mode */
+    __atomic_fetch_add(&vd->replaySteps, 1, __ATOMIC_RELAXED);
+}
+
+static int replay_grab(struct vdIn *vd)
+{
+    struct raw_frame_header fh;
+    long long now, target;
+    unsigned int n;
+
+    if (vd->replayMode == REPLAY_STEP && vd->replayHaveFrame) {
+	if (__atomic_load_n(&vd->replaySteps, __ATOMIC_RELAXED) == 0) {
+	    /* Hold the current frame, the pipeline processes it again */
+	    vd->frame_time_us = perf_time_us();
+	    return 0;
+	}
+	__atomic_fetch_sub(&vd->replaySteps, 1, __ATOMIC_RELAXED);
+    }
+
+    if (fread(&fh, sizeof(fh), 1, vd->replayFile) < 1) {
+	/* End of the recording, start over */
+	printf("Replay: end of recording, restarting\n");
+	fseek(vd->replayFile, sizeof(struct raw_file_header), SEEK_SET);
+	vd->last_sequence = -1;
+	vd->replayStart = 0;
+	if (fread(&fh, sizeof(fh), 1, vd->replayFile) < 1) {
+	    printf("Replay: recording has no frames\n");
+	    goto err;
+	}
+    }
+    n = fh.bytesused > (unsigned int) vd->framesizeIn ? vd->framesizeIn : fh.bytesused;
+    if (fread(vd->framebuffer, n, 1, vd->replayFile) < 1 ||
+	(n < fh.bytesused && fseek(vd->replayFile, fh.bytesused - n, SEEK_CUR) != 0)) {
+	printf("Replay: recording is truncated\n");
+	goto err;
+    }
+    vd->replayHaveFrame = 1;
+
+    now = perf_time_us();
+    if (vd->replayMode == REPLAY_REALTIME) {
+	/* Recorded frame times are replayed as offsets from the first frame shown */
+	if (vd->replayStart == 0 || fh.timestamp_us < vd->replayT0) {
+	    vd->replayStart = now;
+	    vd->replayT0 = fh.timestamp_us;
+	}
+	target = vd->replayStart + (fh.timestamp_us - vd->replayT0);
+	if (target > now)
+	    usleep(target - now);
+	vd->frame_time_us = target;
+    } else
+	vd->frame_time_us = now;
+
+    if (vd->last_sequence >= 0 && fh.sequence > vd->last_sequence + 1)
+	vd->frames_dropped += fh.sequence - vd->last_sequence - 1;
+    vd->last_sequence = fh.sequence;
+    return 0;
+  err:
+    vd->signalquit = 0;
+    return -1;
 }
 
 /* return >= 0 ok otherwhise -1 */
@@ -40,6 +40,29 @@
 #define NB_BUFFER 1		// <-- Mind this! this creates the buffering and was set to 4
 #define DHT_SIZE 432
 
+/* Raw recording format (see uvcRecordStart()): one file header, then for each frame a frame
+   header followed by bytesused bytes of raw camera data (YUYV), all in host byte order */
+#define RAW_MAGIC "RSRAW01"
+struct raw_file_header {
+    char magic[8];
+    int width;
+    int height;
+    unsigned int pixelformat;
+    int reserved;
+};
+struct raw_frame_header {
+    long long timestamp_us;	/* capture time, CLOCK_MONOTONIC */
+    unsigned int sequence;	/* V4L2 sequence number, gaps are frames the recorder missed */
+    unsigned int bytesused;
+};
+
+struct synthCam;
+
+/* Replay pacing, see init_replay() */
+#define REPLAY_REALTIME 0
+#define REPLAY_FAST 1
+#define REPLAY_STEP 2
+
 
 
 struct vdIn {
@@ -80,6 +103,20 @@ struct vdIn {
     int framecount;
     int recordstart;
     int recordtime;
+    /* capture time of the last grabbed frame (us, CLOCK_MONOTONIC) */
+    long long frame_time_us;
+    /* frames the driver captured but we never dequeued (gaps in the buffer sequence numbers) */
+    long long frames_dropped;
+    long long last_sequence;
+    /* file-backed replay source, NULL for a live camera */
+    FILE *replayFile;
+    int replayMode;
+    int replaySteps;		/* frames the user asked to advance in step mode */
+    int replayHaveFrame;
+    long long replayStart;	/* monotonic time the first replayed frame was shown */
+    long long replayT0;		/* its recorded timestamp */
+    /* synthetic camera, see synthCam.h, NULL for a real one */
+    struct synthCam *synth;
 };
 int
 init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps,
@@ -90,6 +127,10 @@ int load_controls(int vd);
 	     
 int uvcGrab(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
+int uvcRecordStart(struct vdIn *vd, const char *filename);
+int uvcRecordStop(struct vdIn *vd);
+int init_replay(struct vdIn *vd, const char *spec);
+void uvcReplayStep(struct vdIn *vd);
 
 int v4l2GetControl(struct vdIn *vd, int control);
 int v4l2SetControl(struct vdIn *vd, int control, int value);
@@ -0,0 +1,128 @@
+/***********************************************************************************************************************
+ *
+ * 	Lock-free latency histograms. See perfhist.h
+ *
+ * ********************************************************************************************************************/
+#include "perfhist.h"
+#include <string.h>
+#include <time.h>
+
+long long perf_time_us(void)
+{
+ // Monotonic time in microseconds, for measuring intervals
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000000LL+ts.tv_nsec/1000);
+}
+
+static int perf_hist_index(long long v)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Bucket for a value. Values below PERF_HIST_SUB get a bucket each, above that the top
+ // PERF_HIST_SUB_BITS+1 significant bits select the bucket (the leading 1 picks the power of
+ // two range, the next bits the linear sub-bucket within it).
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ int msb, shift;
+
+ if (v<0) v=0;
+ if (v>=(1LL<<PERF_HIST_MAX_BITS)) v=(1LL<<PERF_HIST_MAX_BITS)-1;
+ if (v<PERF_HIST_SUB) return((int)v);
+ msb=63-__builtin_clzll((unsigned long long)v);
+ shift=msb-PERF_HIST_SUB_BITS;
+ return((shift+1)*PERF_HIST_SUB+(int)((v>>shift)&(PERF_HIST_SUB-1)));
+}
+
+static long long perf_hist_bucket_high(int idx)
+{
+ // Largest value that falls in a bucket (what percentiles report, so they never understate)
+ int shift;
+
+ if (idx<PERF_HIST_SUB) return(idx);
+ shift=idx/PERF_HIST_SUB-1;
+ return((((long long)(PERF_HIST_SUB+idx%PERF_HIST_SUB)+1)<<shift)-1);
+}
+
+void perf_hist_reset(struct perf_hist *h)
+{
+ // Clear a histogram. Records made concurrently with a reset may be partially lost.
+ memset(h,0,sizeof(struct perf_hist));
+}
+
+void perf_hist_record(struct perf_hist *h, long long value)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Add a value (typically a latency in us) to the histogram. Safe to call from any thread.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ long long cur;
+
+ if (value<0) value=0;
+ __atomic_fetch_add(&h->count[perf_hist_index(value)],1,__ATOMIC_RELAXED);
+ __atomic_fetch_add(&h->sum,value,__ATOMIC_RELAXED);
+
+ // min/max are only updated when they change, which after warm-up is rare
+ cur=__atomic_load_n(&h->max,__ATOMIC_RELAXED);
+ while (value>cur&&!__atomic_compare_exchange_n(&h->max,&cur,value,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+ cur=__atomic_load_n(&h->min1,__ATOMIC_RELAXED);
+ while ((cur==0||value+1<cur)&&!__atomic_compare_exchange_n(&h->min1,&cur,value+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+
+ // n goes last so a reader that sees n records also sees their buckets (modulo concurrent writers)
+ __atomic_fetch_add(&h->n,1,__ATOMIC_RELEASE);
+}
+
+long long perf_hist_count(struct perf_hist *h)
+{
+ return(__atomic_load_n(&h->n,__ATOMIC_ACQUIRE));
+}
+
+double perf_hist_mean(struct perf_hist *h)
+{
+ long long n=perf_hist_count(h);
+ if (n==0) return(0);
+ return((double)__atomic_load_n(&h->sum,__ATOMIC_RELAXED)/n);
+}
+
+long long perf_hist_percentile(struct perf_hist *h, double pct)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Value at the given percentile (0-100), accurate to the bucket width. The top percentile
+ // returns the exact maximum.
+ //
+ // Returns: the percentile value, or 0 for an empty histogram
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ long long n=0, target, seen=0, max;
+
+ for (int i=0; i<PERF_HIST_BUCKETS; i++)
+  n+=__atomic_load_n(&h->count[i],__ATOMIC_RELAXED);
+ if (n==0) return(0);
+ max=__atomic_load_n(&h->max,__ATOMIC_RELAXED);
+ if (pct>=100) return(max);
+
+ target=(long long)(pct/100.0*n+0.5);
+ if (target<1) target=1;
+ for (int i=0; i<PERF_HIST_BUCKETS; i++)
+ {
+  seen+=__atomic_load_n(&h->count[i],__ATOMIC_RELAXED);
+  if (seen>=target)
+  {
+   if (perf_hist_bucket_high(i)>max) return(max);
+   return(perf_hist_bucket_high(i));
+  }
+ }
+ return(max);
+}
+
+void perf_hist_print(FILE *fp, const char *name, struct perf_hist *h)
+{
+ // One line summary: count, mean, min, p50, p90, p99, p99.9, max
+ long long n=perf_hist_count(h);
+
+ if (n==0)
+ {
+  fprintf(fp,"%-28s n=0\n",name);
+  return;
+ }
+ fprintf(fp,"%-28s n=%-7lld mean=%-8.0f min=%-7lld p50=%-7lld p90=%-7lld p99=%-7lld p99.9=%-7lld max=%lld\n",
+         name,n,perf_hist_mean(h),__atomic_load_n(&h->min1,__ATOMIC_RELAXED)-1,perf_hist_percentile(h,50),
+         perf_hist_percentile(h,90),perf_hist_percentile(h,99),perf_hist_percentile(h,99.9),
+         __atomic_load_n(&h->max,__ATOMIC_RELAXED));
+}
@@ -0,0 +1,39 @@
+/***********************************************************************************************************************
+ *
+ * 	Lock-free latency histograms - HDR style log-linear buckets: every power of two range is split into
+ * 	PERF_HIST_SUB linear sub-buckets, so any recorded value is known to within 1/PERF_HIST_SUB (~6%)
+ * 	from 1 us up to about 12 days, with a fixed 5 KB per histogram and no allocation on the record path.
+ *
+ * 	perf_hist_record() is a handful of relaxed atomic adds and can be called from any number of threads
+ * 	at once. Readers (percentiles, printing) never block the writers, they just see a snapshot that
+ * 	may be a few records behind.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __perfhist_header
+#define __perfhist_header
+
+#include <stdio.h>
+
+#define PERF_HIST_SUB_BITS 4
+#define PERF_HIST_SUB (1<<PERF_HIST_SUB_BITS)			// Linear sub-buckets per power of two
+#define PERF_HIST_MAX_BITS 40					// Values are clamped to 2^40-1
+#define PERF_HIST_BUCKETS ((PERF_HIST_MAX_BITS-PERF_HIST_SUB_BITS+1)*PERF_HIST_SUB)
+
+struct perf_hist{
+ long long count[PERF_HIST_BUCKETS];
+ long long n;
+ long long sum;
+ long long min1;					// Minimum+1, 0 while empty (so a zeroed histogram is valid)
+ long long max;
+};
+
+long long perf_time_us(void);
+void perf_hist_reset(struct perf_hist *h);
+void perf_hist_record(struct perf_hist *h, long long value);
+long long perf_hist_count(struct perf_hist *h);
+double perf_hist_mean(struct perf_hist *h);
+long long perf_hist_percentile(struct perf_hist *h, double pct);
+void perf_hist_print(FILE *fp, const char *name, struct perf_hist *h);
+
+#endif
@@ -0,0 +1,118 @@
+/***********************************************************************************************************************
+ *
+ * 	Rolling per-stage timings. See perfstage.h
+ *
+ * ********************************************************************************************************************/
+#include "perfstage.h"
+#include "perfhist.h"
+#include "perftrace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+void perf_stage_init(struct perf_stage *s, const char *name)
+{
+ memset(s,0,sizeof(struct perf_stage));
+ s->name=name;
+}
+
+void perf_stage_begin(struct perf_stage *s)
+{
+ // Stages also show up as durations in the event trace (see perftrace.h) while it is on
+ s->start=perf_time_us();
+ perf_trace_begin(s->name,"frame");
+}
+
+void perf_stage_end(struct perf_stage *s)
+{
+ // Record the time since perf_stage_begin(). Does nothing if the stage wasn't started.
+ if (s->start==0) return;
+ perf_trace_end(s->name,"frame");
+ perf_stage_record(s,perf_time_us()-s->start);
+ s->start=0;
+}
+
+void perf_stage_record(struct perf_stage *s, long long us)
+{
+ s->t[s->head]=us;
+ s->head=(s->head+1)%PERF_STAGE_WINDOW;
+ if (s->n<PERF_STAGE_WINDOW) s->n++;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+ long long x=*(const long long *)a, y=*(const long long *)b;
+ return((x>y)-(x<y));
+}
+
+void perf_stage_stats(struct perf_stage *s, long long *min, double *mean, long long *p99, long long *max)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Statistics over the current window. All zero if the stage hasn't run yet.
+ //
+ // Inputs: s - the stage, min, mean, p99, max - where the results go (us)
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ long long sorted[PERF_STAGE_WINDOW];
+ long long sum=0;
+ int k;
+
+ *min=*p99=*max=0;
+ *mean=0;
+ if (s->n==0) return;
+
+ memcpy(sorted,s->t,s->n*sizeof(long long));
+ qsort(sorted,s->n,sizeof(long long),cmp_ll);
+ for (int i=0; i<s->n; i++) sum+=sorted[i];
+
+ // Nearest rank: the smallest value with at least 99% of the window at or below it
+ k=(99*s->n+99)/100-1;
+ *min=sorted[0];
+ *max=sorted[s->n-1];
+ *p99=sorted[k];
+ *mean=(double)sum/s->n;
+}
+
+void perf_stage_print(FILE *fp, struct perf_stage *s, int n_stages)
+{
+ // Print a table of the stages, times in ms
+ long long min, p99, max;
+ double mean;
+
+ fprintf(fp,"%-16s %6s %8s %8s %8s %8s\n","stage","n","min","mean","p99","max");
+ for (int i=0; i<n_stages; i++)
+ {
+  perf_stage_stats(&s[i],&min,&mean,&p99,&max);
+  fprintf(fp,"%-16s %6d %8.2f %8.2f %8.2f %8.2f\n",s[i].name,s[i].n,min/1000.0,mean/1000.0,p99/1000.0,max/1000.0);
+ }
+}
+
+int perf_stage_write_csv(const char *filename, struct perf_stage *s, int n_stages)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Append one row per stage to a CSV file (created with a header line if it doesn't exist), so
+ // repeated dumps over a session build a time series. Times are in us, the first column is the
+ // monotonic time of the dump in seconds.
+ //
+ // Inputs: filename - CSV file, s - the stages, n_stages - how many
+ // Returns: 0 on success, -1 if the file can't be written
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct stat st;
+ FILE *f;
+ long long min, p99, max;
+ double mean, now;
+ int is_new;
+
+ is_new=(stat(filename,&st)!=0||st.st_size==0);
+ f=fopen(filename,"a");
+ if (f==NULL) return(-1);
+ if (is_new) fprintf(f,"time_s,stage,n,min_us,mean_us,p99_us,max_us\n");
+
+ now=perf_time_us()/1e6;
+ for (int i=0; i<n_stages; i++)
+ {
+  perf_stage_stats(&s[i],&min,&mean,&p99,&max);
+  fprintf(f,"%.3f,%s,%d,%lld,%.1f,%lld,%lld\n",now,s[i].name,s[i].n,min,mean,p99,max);
+ }
+ fclose(f);
+ return(0);
+}
@@ -0,0 +1,35 @@
+/***********************************************************************************************************************
+ *
+ * 	Rolling per-stage timings - Each stage of a loop (capture, conversion, detection, ...) keeps the durations of
+ * 	its last PERF_STAGE_WINDOW runs in a ring, and min/mean/p99 are computed over that window when printed. Unlike
+ * 	the histograms in perfhist.h these forget the past, so they show what the loop is doing now.
+ *
+ * 	A set of stages belongs to the thread that runs the loop, recording is a clock read and a store, with no
+ * 	locking. Printing and CSV dumps must happen on the same thread.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __perfstage_header
+#define __perfstage_header
+
+#include <stdio.h>
+
+#define PERF_STAGE_WINDOW 256				// Runs kept per stage (~8s at 30 fps)
+
+struct perf_stage{
+ const char *name;
+ long long t[PERF_STAGE_WINDOW];			// Durations (us), ring buffer
+ int n;							// Number of valid entries in t[]
+ int head;						// Where the next duration goes
+ long long start;					// Time the stage was last started (us), 0 if not running
+};
+
+void perf_stage_init(struct perf_stage *s, const char *name);
+void perf_stage_begin(struct perf_stage *s);
+void perf_stage_end(struct perf_stage *s);
+void perf_stage_record(struct perf_stage *s, long long us);
+void perf_stage_stats(struct perf_stage *s, long long *min, double *mean, long long *p99, long long *max);
+void perf_stage_print(FILE *fp, struct perf_stage *s, int n_stages);
+int perf_stage_write_csv(const char *filename, struct perf_stage *s, int n_stages);
+
+#endif
@@ -0,0 +1,252 @@
+/***********************************************************************************************************************
+ *
+ * 	Event tracing in Chrome Trace Event format. See perftrace.h
+ *
+ * ********************************************************************************************************************/
+#include "perftrace.h"
+#include "perfhist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+struct perf_trace_event{
+ long long ts;						// us
+ long long dur;						// us, complete events only
+ long long id;						// Async events only
+ long long arg;
+ const char *name;
+ const char *cat;
+ char ph;						// Chrome phase: B, E, X, i, b, e
+ char has_arg;
+};
+
+struct perf_trace_buf{
+ struct perf_trace_event ev[PERF_TRACE_EVENTS];
+ unsigned int head;					// Written by the owning thread only
+ unsigned int tail;					// Written by the flusher only
+ long long dropped;
+ int tid;
+ const char *thread_name;
+ struct perf_trace_buf *next;
+};
+
+int perf_trace_enabled=0;
+static struct perf_trace_buf *trace_bufs=NULL;		// Every thread that ever recorded, never freed
+static __thread struct perf_trace_buf *my_buf=NULL;
+static __thread const char *my_name=NULL;
+static FILE *trace_file=NULL;
+static int trace_first=1;				// No comma before the first event
+static pthread_t trace_thread;
+static pthread_mutex_t trace_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond=PTHREAD_COND_INITIALIZER;
+static int trace_running=0;
+
+static struct perf_trace_buf *trace_buf(void)
+{
+ // The calling thread's ring, registered (lock-free push) the first time it is needed
+ struct perf_trace_buf *b=my_buf;
+
+ if (b!=NULL) return(b);
+ b=(struct perf_trace_buf *)calloc(1,sizeof(struct perf_trace_buf));
+ if (b==NULL) return(NULL);
+ b->tid=(int)syscall(SYS_gettid);
+ b->thread_name=my_name;
+ b->next=__atomic_load_n(&trace_bufs,__ATOMIC_ACQUIRE);
+ while (!__atomic_compare_exchange_n(&trace_bufs,&b->next,b,1,__ATOMIC_RELEASE,__ATOMIC_ACQUIRE));
+ my_buf=b;
+ return(b);
+}
+
+static void trace_record(char ph, const char *name, const char *cat, long long ts, long long dur, long long id,
+                         long long arg, int has_arg)
+{
+ struct perf_trace_buf *b=trace_buf();
+ struct perf_trace_event *e;
+ unsigned int head;
+
+ if (b==NULL) return;
+ head=b->head;
+ if (head-__atomic_load_n(&b->tail,__ATOMIC_ACQUIRE)>=PERF_TRACE_EVENTS)
+ {
+  b->dropped++;
+  return;
+ }
+ e=&b->ev[head&(PERF_TRACE_EVENTS-1)];
+ e->ts=ts;
+ e->dur=dur;
+ e->id=id;
+ e->arg=arg;
+ e->name=name;
+ e->cat=cat;
+ e->ph=ph;
+ e->has_arg=has_arg;
+ __atomic_store_n(&b->head,head+1,__ATOMIC_RELEASE);
+}
+
+void perf_trace_thread_name(const char *name)
+{
+ // Name the calling thread in the trace. Cheap, can be called whether or not tracing is on.
+ my_name=name;
+ if (my_buf!=NULL) my_buf->thread_name=name;
+}
+
+void perf_trace_begin(const char *name, const char *cat)
+{
+ // Start of a duration on this thread, must be matched by perf_trace_end() (properly nested)
+ if (!__atomic_load_n(&perf_trace_enabled,__ATOMIC_RELAXED)) return;
+ trace_record('B',name,cat,perf_time_us(),0,0,0,0);
+}
+
+void perf_trace_end(const char *name, const char *cat)
+{
+ if (!__atomic_load_n(&perf_trace_enabled,__ATOMIC_RELAXED)) return;
+ trace_record('E',name,cat,perf_time_us(),0,0,0,0);
+}
+
+void perf_trace_instant(const char *name, const char *cat, long long arg)
+{
+ // A point event on this thread, with one integer argument
+ if (!__atomic_load_n(&perf_trace_enabled,__ATOMIC_RELAXED)) return;
+ trace_record('i',name,cat,perf_time_us(),0,0,arg,1);
+}
+
+void perf_trace_complete(const char *name, const char *cat, long long start_us, long long dur_us, long long arg)
+{
+ // A duration that has already ended, recorded in one go (must nest with the thread's other durations)
+ if (!__atomic_load_n(&perf_trace_enabled,__ATOMIC_RELAXED)) return;
+ trace_record('X',name,cat,start_us,dur_us,0,arg,1);
+}
+
+void perf_trace_async_begin(const char *name, const char *cat, long long id, long long ts_us)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Async spans can overlap, and may begin and end on different threads. They are matched by
+ // (cat, name, id) and drawn on their own track.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ if (!__atomic_load_n(&perf_trace_enabled,__ATOMIC_RELAXED)) return;
+ trace_record('b',name,cat,ts_us,0,id,0,0);
+}
+
+void perf_trace_async_end(const char *name, const char *cat, long long id, long long ts_us)
+{
+ if (!__atomic_load_n(&perf_trace_enabled,__ATOMIC_RELAXED)) return;
+ trace_record('e',name,cat,ts_us,0,id,0,0);
+}
+
+static void trace_write_event(struct perf_trace_event *e, int tid)
+{
+ fprintf(trace_file,"%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":%d,\"tid\":%d",
+         trace_first?"":",\n",e->name,e->cat,e->ph,e->ts,(int)getpid(),tid);
+ trace_first=0;
+ if (e->ph=='X') fprintf(trace_file,",\"dur\":%lld",e->dur);
+ if (e->ph=='i') fprintf(trace_file,",\"s\":\"t\"");
+ if (e->ph=='b'||e->ph=='e') fprintf(trace_file,",\"id\":%lld",e->id);
+ if (e->has_arg) fprintf(trace_file,",\"args\":{\"value\":%lld}",e->arg);
+ fprintf(trace_file,"}");
+}
+
+static void trace_drain(void)
+{
+ // Copy everything recorded so far into the file (flusher only)
+ struct perf_trace_buf *b;
+ unsigned int head, tail;
+
+ for (b=__atomic_load_n(&trace_bufs,__ATOMIC_ACQUIRE); b!=NULL; b=b->next)
+ {
+  head=__atomic_load_n(&b->head,__ATOMIC_ACQUIRE);
+  for (tail=b->tail; tail!=head; tail++) trace_write_event(&b->ev[tail&(PERF_TRACE_EVENTS-1)],b->tid);
+  __atomic_store_n(&b->tail,head,__ATOMIC_RELEASE);
+ }
+}
+
+static void *trace_loop(void *arg)
+{
+ struct timespec ts;
+
+ pthread_mutex_lock(&trace_mutex);
+ while (trace_running)
+ {
+  clock_gettime(CLOCK_REALTIME,&ts);
+  ts.tv_nsec+=PERF_TRACE_FLUSH_MS*1000000L;
+  if (ts.tv_nsec>=1000000000){ts.tv_sec++; ts.tv_nsec-=1000000000;}
+  pthread_cond_timedwait(&trace_cond,&trace_mutex,&ts);
+  pthread_mutex_unlock(&trace_mutex);
+  trace_drain();
+  pthread_mutex_lock(&trace_mutex);
+ }
+ pthread_mutex_unlock(&trace_mutex);
+ return(NULL);
+}
+
+int perf_trace_start(const char *filename)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start tracing into a new JSON file.
+ //
+ // Inputs: filename - output file (overwritten)
+ // Returns: 0 on success, -1 if tracing is already on or the file or thread can't be created
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct perf_trace_buf *b;
+
+ if (trace_running) return(-1);
+ trace_file=fopen(filename,"w");
+ if (trace_file==NULL) return(-1);
+ fprintf(trace_file,"{\"traceEvents\":[\n");
+ trace_first=1;
+
+ // Forget anything left over from an earlier trace
+ for (b=__atomic_load_n(&trace_bufs,__ATOMIC_ACQUIRE); b!=NULL; b=b->next)
+ {
+  __atomic_store_n(&b->tail,__atomic_load_n(&b->head,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+  b->dropped=0;
+ }
+
+ trace_running=1;
+ if (pthread_create(&trace_thread,NULL,trace_loop,NULL)!=0)
+ {
+  trace_running=0;
+  fclose(trace_file);
+  trace_file=NULL;
+  return(-1);
+ }
+ __atomic_store_n(&perf_trace_enabled,1,__ATOMIC_RELEASE);
+ return(0);
+}
+
+int perf_trace_stop(void)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Stop tracing, write out whatever is left plus the thread names, and close the file.
+ // Events recorded by other threads while this runs may be lost.
+ //
+ // Returns: 0 on success, -1 if tracing wasn't on
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct perf_trace_buf *b;
+ long long dropped=0;
+
+ if (!trace_running) return(-1);
+ __atomic_store_n(&perf_trace_enabled,0,__ATOMIC_RELEASE);
+ pthread_mutex_lock(&trace_mutex);
+ trace_running=0;
+ pthread_cond_signal(&trace_cond);
+ pthread_mutex_unlock(&trace_mutex);
+ pthread_join(trace_thread,NULL);
+ trace_drain();
+
+ for (b=__atomic_load_n(&trace_bufs,__ATOMIC_ACQUIRE); b!=NULL; b=b->next)
+ {
+  dropped+=b->dropped;
+  if (b->thread_name==NULL) continue;
+  fprintf(trace_file,"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+          trace_first?"":",\n",(int)getpid(),b->tid,b->thread_name);
+  trace_first=0;
+ }
+ fprintf(trace_file,"\n],\"displayTimeUnit\":\"ms\"}\n");
+ fclose(trace_file);
+ trace_file=NULL;
+ if (dropped>0) fprintf(stderr,"perf_trace_stop(): %lld events dropped, trace buffers were full\n",dropped);
+ return(0);
+}
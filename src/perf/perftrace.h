@@ -0,0 +1,34 @@
+/***********************************************************************************************************************
+ *
+ * 	Event tracing in Chrome Trace Event format - Load the output in chrome://tracing or ui.perfetto.dev to see
+ * 	every thread's frame stages, AI decisions and BT commands on one time line.
+ *
+ * 	Each thread records into its own ring buffer (allocated the first time it records while tracing is on),
+ * 	single producer / single consumer, so recording is a clock read, a few stores and one release store, with
+ * 	no locks and no I/O. A flusher thread drains all the rings into the JSON file every PERF_TRACE_FLUSH_MS.
+ * 	If a ring fills up before it is drained, new events from that thread are dropped (and counted).
+ *
+ * 	Event names and categories must be string literals (only the pointers are stored), and must not need
+ * 	JSON escaping. Times are CLOCK_MONOTONIC us, same as perf_time_us().
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __perftrace_header
+#define __perftrace_header
+
+#define PERF_TRACE_EVENTS 8192				// Ring size per thread, a power of two
+#define PERF_TRACE_FLUSH_MS 50				// How often the flusher drains the rings
+
+extern int perf_trace_enabled;				// Checked (relaxed) before every record
+
+int perf_trace_start(const char *filename);
+int perf_trace_stop(void);
+void perf_trace_thread_name(const char *name);
+void perf_trace_begin(const char *name, const char *cat);
+void perf_trace_end(const char *name, const char *cat);
+void perf_trace_instant(const char *name, const char *cat, long long arg);
+void perf_trace_complete(const char *name, const char *cat, long long start_us, long long dur_us, long long arg);
+void perf_trace_async_begin(const char *name, const char *cat, long long id, long long ts_us);
+void perf_trace_async_end(const char *name, const char *cat, long long id, long long ts_us);
+
+#endif
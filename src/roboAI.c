@@ -176,6 +176,15 @@ struct displayList *clearDP(struct displayList *head)
  * Blob identification and tracking
  * ***********************************************************/
 
+static double colourHues[4]={-1,-1,-1,-1};	// Reference hues for id_coloured_blob2(), see AI_set_hues()
+
+void AI_set_hues(const double hues[4])
+{
+ // Use these reference hues instead of reading colours.dat (for tools that run the AI
+ // without the U.I., so they don't have to leave a calibration file behind)
+ memcpy(colourHues,hues,4*sizeof(double));
+}
+
 struct blob *id_coloured_blob2(struct RoboAI *ai, struct blob *blobs, int col)
 {
  /////////////////////////////////////////////////////////////////////////////
@@ -202,8 +211,8 @@ struct blob *id_coloured_blob2(struct RoboAI *ai, struct blob *blobs, int col)
  double maxgray;
  int grayness;
  int i;
- static double Mh[4]={-1,-1,-1,-1};
- static double mx0,my0,mx1,my1,mx2,my2;
+ double *Mh=colourHues;
+ double mx0,my0,mx1,my1,mx2,my2;
  FILE *f;
  
  // Import calibration data from file - this will contain the colour values selected by
@@ -215,12 +224,6 @@ struct blob *id_coloured_blob2(struct RoboAI *ai, struct blob *blobs, int col)
   {
    fread(&Mh[0],4*sizeof(double),1,f);
    fclose(f);
-   mx0=cos(Mh[0]);
-   my0=sin(Mh[0]);
-   mx1=cos(Mh[1]);
-   my1=sin(Mh[1]);
-   mx2=cos(Mh[2]);
-   my2=sin(Mh[2]);
   }
  }
 
@@ -229,6 +232,12 @@ struct blob *id_coloured_blob2(struct RoboAI *ai, struct blob *blobs, int col)
      fprintf(stderr,"roboAI.c :: id_coloured_blob2(): No colour calibration data, can not ID blobs. Please capture colour calibration data on the U.I. first\n");
      return NULL;
  }
+ mx0=cos(Mh[0]);
+ my0=sin(Mh[0]);
+ mx1=cos(Mh[1]);
+ my1=sin(Mh[1]);
+ mx2=cos(Mh[2]);
+ my2=sin(Mh[2]);
  
  maxfit=.025;                                             // Minimum fitness threshold
  mincos=.90;                                              // Threshold on colour angle similarity
@@ -608,6 +617,15 @@ int setupAI(int mode, int own_col, struct RoboAI *ai)
  }
 
  fprintf(stderr,"FINISHED retracting pregame!\n");
+
+ // From here on the AI reads the sensors from the background poller's cache,
+ // and motor changes go out through the motor sender thread
+ if (USE_ODOMETRY) BT_sensor_poll_tachos(MOTOR_DRIVE_LEFT, MOTOR_DRIVE_RIGHT);
+ BT_sensor_poll_start(TOUCH_SENSOR_INPUT, COLOUR_SENSOR_INPUT, GYRO_SENSOR_INPUT, BT_SENSOR_UNUSED, SENSOR_POLL_RATE);
+ BT_motor_sender_start(MOTOR_SEND_RATE);
+ if (AI_stepped) estimator_start_stepped(GYRO_SENSOR_INPUT, USE_ODOMETRY);
+ else estimator_start(GYRO_SENSOR_INPUT, USE_ODOMETRY);
+ start_control_thread();
  return(1);
 }
 
@@ -630,7 +648,12 @@ void AI_calibrate(struct RoboAI *ai, struct blob *blobs)
 
 // ============== Variables ==============
 int TRANSITION_TABLE[300][NUMBER_OF_EVENTS * 2]; // %2==0 means we don't want event to happen, odd means we do
-char motor_powers[9];
+char motor_powers[9];       // Latest power requested for each motor port (indexed by MOTOR_A..MOTOR_D)
+char motor_powers_sent[9];  // Power last sent to the EV3 for each port
+int motor_powers_dirty;     // Ports with a power change not yet sent, see flush_motor_commands()
+// Both power caches are shared with the control thread (send_drive_powers()), only touch them
+// holding controlMutex. motor_powers_dirty belongs to the AI thread.
+pthread_mutex_t controlMutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Old values to remember: headings, self pos, ball pos, enemy pos
 struct coord oldValues[4][5]; 
@@ -656,12 +679,89 @@ int wanted_posY;
 int alreadyVerifiedHeading;
 double thresholdStrictness;
 int numVeryHugeTurn;
+int headingFused;           // 1 if this frame's heading came from the gyro/vision estimator
 int driftingInPouch;
 int wrong_path_beleif;
 int unableToMoveBelief;
 int unableToTurnBelief;
 int takeShot;
 
+// Tuned constants. Listed in AI_params[] so they can be loaded from a file (AI_PARAMS=<file>) and
+// searched over by the auto-tuner (tools/aitune.c), the defaults are the hand-tuned values
+double ALIGN_GAIN = 25;           // Turn power per unit of heading error when aligning
+double ALIGN_MIN_POWER = 8;       // Turn power clamps when aligning. Below the minimum means aligned (drive
+double ALIGN_MAX_POWER = 30;      // straight), at the maximum we face the wrong way and spin in place
+double ALIGN_OFFSET = -250;       // Distance behind the ball to line up the penalty shot from
+double OBSTACLE_RADIUS = 75;      // Radius of each bot for path planning around the opponent
+double OBSTACLE_BUFFER = 150;     // Extra clearance to keep from the opponent
+double ARRIVAL_DISTANCE = 40;     // How close to the wanted position counts as there
+double BALL_NEAR_DISTANCE = 75;   // Closer than this the ball is 'that close'
+double ROBUST_WEIGHTS[5] = {15, 6, 4, 2, 1};  // Weights of the last 5 readings in the robust values, newest first
+
+struct AI_param AI_params[] = {
+  {"align_gain", &ALIGN_GAIN, 10, 50},
+  {"align_min_power", &ALIGN_MIN_POWER, 8, 15},
+  {"align_max_power", &ALIGN_MAX_POWER, 20, 60},
+  {"align_offset", &ALIGN_OFFSET, -400, -120},
+  {"obstacle_radius", &OBSTACLE_RADIUS, 40, 120},
+  {"obstacle_buffer", &OBSTACLE_BUFFER, 50, 250},
+  {"arrival_distance", &ARRIVAL_DISTANCE, 15, 80},
+  {"ball_near_distance", &BALL_NEAR_DISTANCE, 40, 150},
+  {"robust_weight_0", &ROBUST_WEIGHTS[0], 1, 30},
+  {"robust_weight_1", &ROBUST_WEIGHTS[1], 0, 15},
+  {"robust_weight_2", &ROBUST_WEIGHTS[2], 0, 10},
+  {"robust_weight_3", &ROBUST_WEIGHTS[3], 0, 5},
+  {"robust_weight_4", &ROBUST_WEIGHTS[4], 0, 5},
+  {NULL, NULL, 0, 0}
+};
+
+int AI_set_param(const char *name, double value){
+  // Returns 0 if the parameter exists, -1 otherwise
+  for (int i = 0; AI_params[i].name != NULL; i++){
+    if (strcmp(AI_params[i].name, name) == 0){
+      *AI_params[i].value = value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int AI_load_params(const char *filename){
+  // Reads 'name value' lines ('#' starts a comment), parameters not in the file keep their
+  // value. Returns the number of parameters set, -1 if the file can't be read or has errors
+  FILE *f = fopen(filename, "r");
+  char line[256], name[128];
+  double value;
+  int n = 0, lineNo = 0, bad = 0;
+
+  if (f == NULL) return -1;
+  while (fgets(line, sizeof(line), f) != NULL){
+    lineNo++;
+    char *c = strchr(line, '#');
+    if (c != NULL) *c = '\0';
+    if (sscanf(line, "%127s", name) != 1) continue;
+    if (sscanf(line, "%127s %lf", name, &value) != 2 || AI_set_param(name, value) != 0){
+      fprintf(stderr, "AI_load_params(): %s:%d: unknown parameter or bad value\n", filename, lineNo);
+      bad = 1;
+      continue;
+    }
+    n++;
+  }
+  fclose(f);
+  return bad ? -1 : n;
+}
+
+int AI_save_params(const char *filename){
+  // Writes every parameter in the format AI_load_params() reads, filename "-" is stdout
+  FILE *f = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+  if (f == NULL) return -1;
+  for (int i = 0; AI_params[i].name != NULL; i++){
+    fprintf(f, "%s %.6g\n", AI_params[i].name, *AI_params[i].value);
+  }
+  if (f == stdout) return fflush(f);
+  return fclose(f);
+}
+
 void AI_main(struct RoboAI *ai, struct blob *blobs, void *state)
 {
  /*************************************************************************
@@ -758,6 +858,7 @@ void AI_main(struct RoboAI *ai, struct blob *blobs, void *state)
       
     if (ai->st.self->cx>=512) ai->st.side=1; else ai->st.side=0;         // This sets the side the bot thinks as its own side 0->left, 1->right
     BT_all_stop(0);
+    telemetry_motor(TLM_MOTOR_ALL_STOP, 0, 0, 0);
     
     fprintf(stderr,"Self-ID complete. Current position: (%f,%f), current heading: [%f, %f], blob direction=[%f, %f], AI state=%d\n",ai->st.self->cx,ai->st.self->cy,ai->st.smx,ai->st.smy,ai->st.sdx,ai->st.sdy,ai->st.state);
     
@@ -792,9 +893,14 @@ void AI_main(struct RoboAI *ai, struct blob *blobs, void *state)
 
     printf("Initializing variables\n");
     fflush(stdout);
+    release_control_goal();
+    pthread_mutex_lock(&controlMutex);
     for (int i = 0; i < 9; i++){
       motor_powers[i] = 0; 
+      motor_powers_sent[i] = 0;
     }
+    pthread_mutex_unlock(&controlMutex);
+    motor_powers_dirty = 0;
 
     for (int i = 0; i < 4; i++){
       for (int j = 0; j < 5; j++){
@@ -821,6 +927,7 @@ void AI_main(struct RoboAI *ai, struct blob *blobs, void *state)
     alreadyVerifiedHeading = 0;
     thresholdStrictness = PI/15;
     numVeryHugeTurn = 0;
+    headingFused = 0;
     driftingInPouch = 0;
     wrong_path_beleif = 0;
     unableToMoveBelief = 0;
@@ -921,6 +1028,9 @@ void AI_main(struct RoboAI *ai, struct blob *blobs, void *state)
     } 
 
   }
+
+  // The ID frames are logged too, so a replay from the first record goes through the same ID
+  telemetry_frame(ai, blobs);
  }
  else
  {
@@ -951,7 +1061,11 @@ void AI_main(struct RoboAI *ai, struct blob *blobs, void *state)
     // Update state based on transition
     for (int i = 0; i < NUMBER_OF_EVENTS * 2; i++){
         if (TRANSITION_TABLE[ai->st.state][i] > -1){
-            if (checkEventActive(ai, i)){
+            long long t0 = perf_time_us();
+            int active = checkEventActive(ai, i);
+            perf_trace_complete("checkEventActive", "ai", t0, perf_time_us() - t0, i);
+            telemetry_event(i, active);
+            if (active){
                 printf("ABOUT TO CHANGE FROM %d state due to %d event", ai->st.state, i);
                 changeMachineState(ai, TRANSITION_TABLE[ai->st.state][i]);
                 break;
@@ -965,6 +1079,14 @@ void AI_main(struct RoboAI *ai, struct blob *blobs, void *state)
 
     // Call function to retract shooting mechanism or release
     handleShootingMechanism(ai);
+
+    // Send all motor changes made this frame as a single command, tagged with the frame's
+    // capture time for the capture-to-motor latency histogram
+    BT_motor_origin(ai->st.frame_time);
+    flush_motor_commands();
+    BT_motor_origin(0);
+
+    telemetry_frame(ai, blobs);
   }
 }
 
@@ -984,6 +1106,16 @@ void AI_main(struct RoboAI *ai, struct blob *blobs, void *state)
 struct coord lastDrivingPosition;
 
 void fixAIHeadingDirection(struct RoboAI *ai){
+    // With a gyro the fused heading has no flip ambiguity, so the vision-only
+    // flip heuristics below are skipped (the stuck detection still runs)
+    double fusedX, fusedY;
+    headingFused = 0;
+    if (ai->st.self != NULL && estimator_fuse_heading(ai->st.sdx, ai->st.sdy, ai->st.frame_time, &fusedX, &fusedY) == 0){
+      ai->st.sdx = fusedX;
+      ai->st.sdy = fusedY;
+      headingFused = 1;
+    }
+
     if (ai->st.self != NULL && robustHeadingX!= -1000){
       int isDriving = get_curr_motor_power(MOTOR_DRIVE_LEFT) > 0 && get_curr_motor_power(MOTOR_DRIVE_RIGHT) > 0
                       || get_curr_motor_power(MOTOR_DRIVE_LEFT) < 0 && get_curr_motor_power(MOTOR_DRIVE_RIGHT) < 0;
@@ -991,7 +1123,7 @@ void fixAIHeadingDirection(struct RoboAI *ai){
       int isTurning = get_curr_motor_power(MOTOR_DRIVE_LEFT) > 0 && get_curr_motor_power(MOTOR_DRIVE_RIGHT) < 0 ||
                       get_curr_motor_power(MOTOR_DRIVE_LEFT) < 0 && get_curr_motor_power(MOTOR_DRIVE_RIGHT) > 0;
       
-      if (pow(pow(ai->st.sdx - robustHeadingX, 2) + pow(ai->st.sdy - robustHeadingY, 2), 0.5) > 
+      if (!headingFused && pow(pow(ai->st.sdx - robustHeadingX, 2) + pow(ai->st.sdy - robustHeadingY, 2), 0.5) > 
           getExpectedUnitCircleDistance(PI * 1.0 / 2.0)){ 
           // Too big of a jump, assume its a flip or rando jump and flip it
           ai->st.sdy *= -1;
@@ -999,7 +1131,7 @@ void fixAIHeadingDirection(struct RoboAI *ai){
         }
 
       // Detect outlier jump
-      if (!isTurning && pow(pow(ai->st.sdx - robustHeadingX, 2) + pow(ai->st.sdy - robustHeadingY, 2), 0.5) > 
+      if (!headingFused && !isTurning && pow(pow(ai->st.sdx - robustHeadingX, 2) + pow(ai->st.sdy - robustHeadingY, 2), 0.5) > 
           getExpectedUnitCircleDistance(PI * 1.0 / 4.0)){ 
         if (numVeryHugeTurn >= 3){ 
           // 3rd frame in a row we're reading far from heading, go back to trusting it
@@ -1023,11 +1155,7 @@ void fixAIHeadingDirection(struct RoboAI *ai){
 
       if (unableToMoveBelief > 5 && ai->st.state < 100){
         printf("REVERSING\n");
-        motor_power_async(MOTOR_DRIVE_LEFT, -45);
-        BT_timed_motor_port_start_v2(MOTOR_DRIVE_RIGHT, -45, 1500);
-        motor_power_async(MOTOR_DRIVE_LEFT, 0);
-        BT_motor_port_stop(MOTOR_DRIVE_RIGHT, 0);
-        motor_power_async(MOTOR_DRIVE_RIGHT, 0); 
+        start_drive_manoeuvre(-45, -45, 1500, 1, 0);
         unableToMoveBelief = 0;
         wrong_path_beleif = -2;
         //changeMachineState(ai, (int)(ai->st.state/100) + 1);
@@ -1042,11 +1170,7 @@ void fixAIHeadingDirection(struct RoboAI *ai){
 
         if (unableToTurnBelief > 25){
           printf("REVERSING\n");
-          motor_power_async(MOTOR_DRIVE_LEFT, -45);
-          BT_timed_motor_port_start_v2(MOTOR_DRIVE_RIGHT, -45, 1500);
-          motor_power_async(MOTOR_DRIVE_LEFT, 0);
-          BT_motor_port_stop(MOTOR_DRIVE_RIGHT, 0);
-          motor_power_async(MOTOR_DRIVE_RIGHT, 0); 
+          start_drive_manoeuvre(-45, -45, 1500, 1, 0);
           unableToTurnBelief = 0;
           wrong_path_beleif = -2;
           //changeMachineState(ai, (int)(ai->st.state/100) + 1);
@@ -1065,7 +1189,7 @@ void fixAIHeadingDirection(struct RoboAI *ai){
         struct coord expectedDirection = scale_coords(new_coords(ai->st.sdx, ai->st.sdy), driveDir);
 
         //printf("Readings %f,%f and %f,%f\n", ai->st.sdx, ai->st.sdy, velocityVector.x, velocityVector.y);
-        if (distance_between_points(velocityVector, expectedDirection) > getExpectedUnitCircleDistance(PI * 1.0 / 2.0)){
+        if (!headingFused && distance_between_points(velocityVector, expectedDirection) > getExpectedUnitCircleDistance(PI * 1.0 / 2.0)){
           wrong_path_beleif++;
 
           printf("Detecting m to d anamoly %d\n", wrong_path_beleif);
@@ -1098,6 +1222,7 @@ void fixAIHeadingDirection(struct RoboAI *ai){
           printf("FLIPPED INIT heading\n");
           ai->st.sdy *= -1;
           ai->st.sdx *= -1;
+          if (headingFused) estimator_reset_heading(ai->st.sdx, ai->st.sdy);
       }
 
       alreadyVerifiedHeading = 1;
@@ -1114,7 +1239,7 @@ int numValidValues[4] = {0, 0, 0, 0};
   int isTurning = get_curr_motor_power(MOTOR_DRIVE_LEFT) > 0 && get_curr_motor_power(MOTOR_DRIVE_RIGHT) < 0 ||
                   get_curr_motor_power(MOTOR_DRIVE_LEFT) < 0 && get_curr_motor_power(MOTOR_DRIVE_RIGHT) > 0;
 
-  int distributionMultipliers[5] = {15, 6, 4, 2, 1};
+  double fusedX, fusedY;
   /*if (isTurning || ai->st.state == STATE_S_KICKOFF){ // make current reading more valuable
     distributionMultipliers[0] = 15;
   }*/
@@ -1150,9 +1275,9 @@ int numValidValues[4] = {0, 0, 0, 0};
 
       // weighted average to help denoise 
       for (int j = 0; j < numValidValues[i]; j++){
-        totalAdded += distributionMultipliers[j];
-        averagedResult =  (struct coord){averagedResult.x + oldValues[i][j].x * distributionMultipliers[j], 
-                                        averagedResult.y + oldValues[i][j].y * distributionMultipliers[j]};
+        totalAdded += ROBUST_WEIGHTS[j];
+        averagedResult =  (struct coord){averagedResult.x + oldValues[i][j].x * ROBUST_WEIGHTS[j], 
+                                        averagedResult.y + oldValues[i][j].y * ROBUST_WEIGHTS[j]};
       }
 
       averagedResult.x = averagedResult.x/totalAdded;
@@ -1165,11 +1290,21 @@ int numValidValues[4] = {0, 0, 0, 0};
       }
 
       // set robust values
-      if (i == 0){ // headings
+      if (i == 0 && headingFused){ // fused heading is already filtered, averaging would only add lag
+        robustHeadingX = latestReading.x;
+        robustHeadingY = latestReading.y;
+
+      }else if (i == 0){ // headings
         averagedResult = normalize_vector(averagedResult);
         robustHeadingX = averagedResult.x;
         robustHeadingY = averagedResult.y;
 
+      }else if (i == 1 && estimator_fuse_pose(latestReading.x, latestReading.y, ai->st.sdx, ai->st.sdy, ai->st.frame_time, &fusedX, &fusedY) == 0){
+        // our pos, fused with odometry (already filtered, and predicted to now)
+        robustSelfCx = fusedX;
+        robustSelfCy = fusedY;
+        ai->DPhead = addPoint(ai->DPhead, robustSelfCx, robustSelfCy, 160, 32, 240);
+
       }else if (i == 1){ // our pos 
         robustSelfCx = averagedResult.x;
         robustSelfCy = averagedResult.y;
@@ -1194,6 +1329,11 @@ int numValidValues[4] = {0, 0, 0, 0};
     }
   }
 
+  // Bot blob lost (occluded, or out of frame): keep the pose going on odometry
+  if (ai->st.self == NULL && estimator_get_pose(&fusedX, &fusedY, &robustHeadingX, &robustHeadingY) == 0){
+    robustSelfCx = fusedX;
+    robustSelfCy = fusedY;
+  }
 
   struct coord curBalReadings = new_coords(robustBallCx, robustBallCy);
   struct coord curSelfReadings = new_coords(robustSelfCx, robustSelfCy);
@@ -1220,25 +1360,23 @@ int numValidValues[4] = {0, 0, 0, 0};
 void handleShootingMechanism(struct RoboAI *ai){
   
   int retraction = checkEventActive(ai, EVENT_shootingMechanismRetracted * 2 + 1);
+  if (BT_motor_manoeuvre_active(MOTOR_SHOOT_RETRACT)){
+    // Still pulling from the last shot, the touch sensor may not have caught up yet
+    takeShot = 0;
+    return;
+  }
   if (takeShot && retraction){
     printf("Taking shot\n");
     fflush(stdout);
 
-    BT_motor_port_stop(MOTOR_DRIVE_LEFT, 0);
-    BT_motor_port_stop(MOTOR_DRIVE_RIGHT, 0);
-
-    // Keep pulling until not retract
-    BT_timed_motor_port_start_v2(MOTOR_SHOOT_RETRACT, -100, 500);
-    BT_motor_port_stop(MOTOR_SHOOT_RETRACT, 0);
-
-    motor_power_async(MOTOR_DRIVE_LEFT, 0);
-    motor_power_async(MOTOR_DRIVE_RIGHT, 0);
+    // Keep pulling until not retract, with the drive motors held stopped. In chase mode
+    // keep pulling (and holding) a while longer before chasing again
+    int shot_time = (ai->st.state >= 200) ? 2000 : 500;
+    start_manoeuvre(MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT, 0, shot_time);
+    start_manoeuvre(MOTOR_SHOOT_RETRACT, -100, shot_time);
 
     if (ai->st.state >= 200){
-      // wait extra before chasing again
-      BT_timed_motor_port_start_v2(MOTOR_SHOOT_RETRACT, -100, 1500);
-      BT_motor_port_stop(MOTOR_SHOOT_RETRACT, 0);
-
+      // Chase mode stays in its state, it resumes chasing once the manoeuvre is over
     }else if (ai->st.state >= 100){
       changeMachineState(ai, STATE_P_done);
 
@@ -1256,39 +1394,47 @@ void handleShootingMechanism(struct RoboAI *ai){
 }
 
 double getPowerNeededToAlign(struct RoboAI *ai, double wanted_posX, double wanted_posY, int allowBackwardsFacing){
-    double dir1 = robustHeadingX;
-    double dir2 = robustHeadingY;
+    return getPowerNeededToAlignFrom(new_coords(robustSelfCx, robustSelfCy), new_coords(robustHeadingX, robustHeadingY),
+                                     wanted_posX, wanted_posY, allowBackwardsFacing, thresholdStrictness);
+}
 
-    double unit_diff = wanted_posX - robustSelfCx;
+double getPowerNeededToAlignFrom(struct coord self, struct coord heading, double wanted_posX, double wanted_posY,
+                                 int allowBackwardsFacing, double strictness){
+    // Same as getPowerNeededToAlign() for a given pose, so the control thread can use it
+    // with the estimated pose instead of the robust values
+    double dir1 = heading.x;
+    double dir2 = heading.y;
+
+    double unit_diff = wanted_posX - self.x;
     if (dir1 == 0) dir1= 0.001;
     if (unit_diff == 0) unit_diff = 0.001;
 
     double units_moved = unit_diff / dir1;
 
-    struct coord expectedVector = normalize_vector(new_coords(wanted_posX - robustSelfCx, wanted_posY - robustSelfCy));
+    struct coord expectedVector = normalize_vector(new_coords(wanted_posX - self.x, wanted_posY - self.y));
     double vectorOffsets =  distance_between_points(expectedVector, new_coords(dir1, dir2));
     double vectorFlippedOffset = distance_between_points(expectedVector, scale_coords(new_coords(dir1, dir2), -1));
     if (allowBackwardsFacing && vectorFlippedOffset < vectorOffsets){
       vectorOffsets = vectorFlippedOffset;
     }
-    double result_y = robustSelfCy + units_moved * dir2;
+    double result_y = self.y + units_moved * dir2;
     
     int dir = 1;
     if (result_y < wanted_posY) dir *= -1;
     if (units_moved < 0) dir *= -1;
-    if (robustSelfCx < wanted_posX) dir *= -1;
+    if (self.x < wanted_posX) dir *= -1;
 
-    double total_power = 25*vectorOffsets;
-    if (total_power < 8) total_power = 8;
-    if (total_power > 30) total_power = 30;
+    double total_power = ALIGN_GAIN*vectorOffsets;
+    if (total_power < ALIGN_MIN_POWER) total_power = ALIGN_MIN_POWER;
+    if (total_power > ALIGN_MAX_POWER) total_power = ALIGN_MAX_POWER;
     if (units_moved < 0){
       if (!allowBackwardsFacing){
-        total_power = 45 - (total_power*0.5);
+        total_power = ALIGN_MAX_POWER*1.5 - (total_power*0.5);   // Facing away, at least the max so we spin
       }
     }
 
-    if ((allowBackwardsFacing || units_moved > 0) && vectorOffsets < getExpectedUnitCircleDistance(thresholdStrictness)){
-      total_power = 7;
+    if ((allowBackwardsFacing || units_moved > 0) && vectorOffsets < getExpectedUnitCircleDistance(strictness)){
+      total_power = ALIGN_MIN_POWER - 1;
     }
 
     return total_power * dir;
@@ -1306,11 +1452,11 @@ int checkEventActive(struct RoboAI *ai, int event){
     }else if (checkingEvent == EVENT_atWantedPosition){
         // Add distance checker
         double dist = pow(pow(robustSelfCx - wanted_posX, 2) + pow(robustSelfCy - wanted_posY, 2), 0.5);
-        result = dist <= 40;
+        result = dist <= ARRIVAL_DISTANCE;
 
     }else if (checkingEvent == EVENT_allignedWithPosition){
         double neededPower = getPowerNeededToAlign(ai, wanted_posX, wanted_posY, 0);
-        result = fabs(neededPower) < 8.0;
+        result = fabs(neededPower) < ALIGN_MIN_POWER;
         if (ai->st.state == STATE_S_getBallInPouch && neededPower > 20 && 
             distance_between_points(new_coords(robustSelfCx, robustSelfCy), new_coords(robustBallCx, robustBallCy)) < 150 ){ // when we're close enough that it might get wonky
           result = 1;
@@ -1319,11 +1465,11 @@ int checkEventActive(struct RoboAI *ai, int event){
     }else if (checkingEvent == EVENT_ballIsInCage){
         // Read colour sensor reflectance
         int RGB[3];
-        BT_read_colour_sensor_RGB(COLOUR_SENSOR_INPUT, RGB);
+        get_colour_sensor_reading(RGB);
         result = RGB[2] > 20;
 
     }else if (checkingEvent == EVENT_shootingMechanismRetracted){
-        result = BT_read_touch_sensor(TOUCH_SENSOR_INPUT);
+        result = get_touch_sensor_reading();
 
     }else if (checkingEvent == EVENT_ballCagedAndCanShoot){
         result = checkEventActive(ai, EVENT_ballIsInCage * 2 + 1) && checkEventActive(ai, EVENT_shootingMechanismRetracted * 2 + 1);
@@ -1377,22 +1523,22 @@ int checkEventActive(struct RoboAI *ai, int event){
       result = fabs(result_y - net.y) < 60;
 
     }else if (checkingEvent == EVENT_ballIsNotThatClose){
-      result = pow(pow(robustSelfCx - robustBallCx, 2) + pow(robustSelfCy - robustBallCy, 2), 0.5) > 75;
+      result = pow(pow(robustSelfCx - robustBallCx, 2) + pow(robustSelfCy - robustBallCy, 2), 0.5) > BALL_NEAR_DISTANCE;
     
     }else if (checkingEvent == EVENT_noValidPath){
       result = calc_goal_with_obstacles(ai, new_coords(robustSelfCx, robustSelfCy), new_coords(robustBallCx, robustBallCy), 
-                              new_coords(robustEnemyCx, robustEnemyCy), 75, 75, 150).x == -1;
+                              new_coords(robustEnemyCx, robustEnemyCy), OBSTACLE_RADIUS, OBSTACLE_RADIUS, OBSTACLE_BUFFER).x == -1;
       
     }else if (checkingEvent == EVENT_pathObstructed){
       struct coord given = calc_goal_with_obstacles(ai, new_coords(robustSelfCx, robustSelfCy), new_coords(robustBallCx, robustBallCy), 
-                            new_coords(robustEnemyCx, robustEnemyCy), 75, 75, 150);
+                            new_coords(robustEnemyCx, robustEnemyCy), OBSTACLE_RADIUS, OBSTACLE_RADIUS, OBSTACLE_BUFFER);
       result = given.x != robustBallCx || given.y != robustBallCy;   
       //printf("ball %f %f suggested %f %f so result is %d\n", robustBallCx, robustBallCy, given.x, given.y, result);  
     }else if (checkingEvent == EVENT_ballIsProbablyOnSide){
       double dist = distance_between_points(new_coords(robustBallCx, robustBallCy), new_coords(robustSelfCx, robustSelfCy));
       double angle = getPowerNeededToAlign(ai, robustBallCx, robustBallCy, 0);
       int seen = checkEventActive(ai, EVENT_ballCagedAndCanShoot * 2 + 1);
-      result = dist <= 140 && fabs(angle) > 8 && !seen;
+      result = dist <= 140 && fabs(angle) > ALIGN_MIN_POWER && !seen;
       //printf("Dist to ball: %f, angle to ball: %f, seen: %d\n", dist, angle, seen);
 
     }else if (checkingEvent == EVENT_driftedAwayFromNet){
@@ -1407,6 +1553,8 @@ void changeMachineState(struct RoboAI *ai, int new_state){
     // Check for special conditions (stop motors etc)
     printf("SWICHING TO STATE %d\n", new_state);
     fflush(stdout);
+    perf_trace_instant("changeMachineState", "ai", new_state);
+    telemetry_transition(ai->st.state, new_state);
 
     ai->st.state = new_state;
     if (new_state == STATE_P_driveToOffset || new_state == STATE_P_driveCarefullyUntilShot || new_state == STATE_S_getBallInPouch || 
@@ -1485,11 +1633,40 @@ void handleAlignWithGivenOffset(struct RoboAI *ai, double offset){
 
 void handleCurveToGivenLocation(struct RoboAI* ai, int allow_backwards_into_wanted, double maxPushPower, int allow_straight){
   struct coord self = new_coords(robustSelfCx, robustSelfCy);
+  struct coord heading = new_coords(robustHeadingX, robustHeadingY);
   struct coord goal = new_coords(wanted_posX, wanted_posY);
+  double powerL, powerR;
+
+  // With the control thread running we only update its goal, it does the steering at CONTROL_RATE
+  if (set_control_goal(goal, allow_backwards_into_wanted, maxPushPower, allow_straight, self, heading,
+                       ai->st.frame_time)) return;
+
+  if (numValidValues[1] >= 2){
+    // Calculate d_err for forward power
+    double dist = distance_between_points(self, goal);
+    double old_dist = distance_between_points(oldValues[1][1], goal);
+    double d_err = dist - old_dist;
+    double effect = 0; //d_err;                 // DIR VALUE FOR DRIVE
+    printf("PUSH EFFECT IS %f, original push is %f \n", effect, maxPushPower);
+    //if (effect > 0) effect = 0;
+    //if (effect < -10) effect = -10;
+    maxPushPower += effect;
+  }
+
+  computeCurvePowers(self, heading, goal, allow_backwards_into_wanted, maxPushPower, allow_straight, thresholdStrictness,
+                     &oldCurvePower, &powerL, &powerR);
+  motor_power_async(MOTOR_DRIVE_LEFT, powerL);
+  motor_power_async(MOTOR_DRIVE_RIGHT, powerR); 
+}
 
-  // TODO: add backwards movement instead of
-  double curvePower = getPowerNeededToAlign(ai, goal.x, goal.y, allow_backwards_into_wanted);
-  double origCP = getPowerNeededToAlign(ai, goal.x, goal.y, 0);
+void computeCurvePowers(struct coord self, struct coord heading, struct coord goal, int allow_backwards_into_wanted,
+                        double maxPushPower, int allow_straight, double strictness, double *lastCurvePower,
+                        double *powerL, double *powerR){
+  // Steering law for curving towards goal: spin in place when facing far off, otherwise drive
+  // with a P+D differential on the wheels. lastCurvePower holds the curve power from the last
+  // update for the D term (-1000 = none), it is updated here.
+  double curvePower = getPowerNeededToAlignFrom(self, heading, goal.x, goal.y, allow_backwards_into_wanted, strictness);
+  double origCP = getPowerNeededToAlignFrom(self, heading, goal.x, goal.y, 0, strictness);
   int driveBackwards = origCP != curvePower;
 
   double dist = distance_between_points(self, goal);
@@ -1505,25 +1682,14 @@ void handleCurveToGivenLocation(struct RoboAI* ai, int allow_backwards_into_want
     //basePower *=0.75;
   }
 
-  if (numValidValues[1] >= 2){
-    // Calculate d_err for forward power
-    double old_dist = distance_between_points(oldValues[1][1], goal);
-    double d_err = dist - old_dist;
-    double effect = 0; //d_err;                 // DIR VALUE FOR DRIVE
-    printf("PUSH EFFECT IS %f, original push is %f \n", effect, pushPower);
-    //if (effect > 0) effect = 0;
-    //if (effect < -10) effect = -10;
-    pushPower += effect;
-  }
-
   double abs_curve = fabs(curvePower);
-  if (abs_curve <= 8 && allow_straight){
+  if (abs_curve <= ALIGN_MIN_POWER && allow_straight){
     abs_curve = 0;
   }
 
-  if (abs_curve >= 30){ // just spin, we face the wrong way
-    motor_power_async(MOTOR_DRIVE_LEFT, curvePower);
-    motor_power_async(MOTOR_DRIVE_RIGHT, -curvePower); 
+  if (abs_curve >= ALIGN_MAX_POWER){ // just spin, we face the wrong way
+    *powerL = curvePower;
+    *powerR = -curvePower;
 
   }else{
     double dir = (1 - driveBackwards)*2 - 1;
@@ -1534,29 +1700,27 @@ void handleCurveToGivenLocation(struct RoboAI* ai, int allow_backwards_into_want
     }
     //abs_curve = abs_curve * (pushPower/100);
 
-    if (oldCurvePower != -1000){
+    if (*lastCurvePower != -1000){
       // Calculate d_err for turning power
-      double rotate_err_d = curvePower - oldCurvePower;
+      double rotate_err_d = curvePower - *lastCurvePower;
       double effect = rotate_err_d;        // DER VALUE FOR ROTATION
-      printf("ROTATE EFFECT IS %f, original curve by %f \n", effect, abs_curve);
       abs_curve += effect;
     }
 
 
-    double powerL = pushPower;
-    double powerR = pushPower;
+    double outL = pushPower;
+    double outR = pushPower;
 
-    if (curvePower > 0) powerR = pushPower - abs_curve;
-    else if (curvePower < 0) powerL = pushPower - abs_curve;
+    if (curvePower > 0) outR = pushPower - abs_curve;
+    else if (curvePower < 0) outL = pushPower - abs_curve;
 
     //printf("Curving at %f \n", abs_curve);
-    motor_power_async(MOTOR_DRIVE_LEFT, dir*powerL);
-    motor_power_async(MOTOR_DRIVE_RIGHT, dir*powerR); 
-    oldCurvePower = curvePower;
+    *powerL = dir*outL;
+    *powerR = dir*outR;
+    *lastCurvePower = curvePower;
   }
 }
 
-double ALIGN_OFFSET = -250; // TODO: make it dynamic 
 void handleStateActions(struct RoboAI *ai, struct blob *blobs){
     // Returns 1 if we want to asynchronously shoot
     int state = ai->st.state;
@@ -1745,11 +1909,7 @@ void handleStateActions(struct RoboAI *ai, struct blob *blobs){
 
             if (checkEventActive(ai, EVENT_alignedToScore *2 + 1) || (oldCurvePower / fabs(oldCurvePower) != curvePower / fabs(curvePower))){
               // signs flipped, counter turn to catch ball
-              motor_power_async(MOTOR_DRIVE_LEFT, -oldCurvePower);
-              BT_timed_motor_port_start_v2(MOTOR_DRIVE_RIGHT, oldCurvePower, 100);
-              motor_power_async(MOTOR_DRIVE_LEFT, 0);
-              BT_motor_port_stop(MOTOR_DRIVE_RIGHT, 0);
-              motor_power_async(MOTOR_DRIVE_RIGHT, 0); 
+              start_drive_manoeuvre(-oldCurvePower, oldCurvePower, 100, 1, 0);
               oldCurvePower = -1000;
             }
           }
@@ -1810,19 +1970,133 @@ void handleStateActions(struct RoboAI *ai, struct blob *blobs){
 } 
 
 int get_curr_motor_power(int port_id) {
-  return motor_powers[port_id];
+  int power;
+  pthread_mutex_lock(&controlMutex);
+  power = motor_powers[port_id];
+  pthread_mutex_unlock(&controlMutex);
+  return power;
+}
+
+int get_touch_sensor_reading() {
+  // Latest touch sensor value from the poller, falls back to a blocking read if the cache is stale
+  struct BT_sensor_reading r;
+  if (BT_sensor_latest(BT_SENSOR_TOUCH, &r) == 0 && r.status == 0 &&
+      BT_sensor_time_us() - r.timestamp < SENSOR_MAX_AGE_US) {
+    return r.value[0];
+  }
+  return BT_read_touch_sensor(TOUCH_SENSOR_INPUT);
+}
+
+int get_colour_sensor_reading(int RGB[3]) {
+  // Latest colour sensor RGB from the poller, falls back to a blocking read if the cache is stale
+  struct BT_sensor_reading r;
+  if (BT_sensor_latest(BT_SENSOR_COLOUR_RGB, &r) == 0 && r.status == 0 &&
+      BT_sensor_time_us() - r.timestamp < SENSOR_MAX_AGE_US) {
+    RGB[0] = r.value[0];
+    RGB[1] = r.value[1];
+    RGB[2] = r.value[2];
+    return 0;
+  }
+  return BT_read_colour_sensor_RGB(COLOUR_SENSOR_INPUT, RGB);
 }
 
 int motor_power_async(char port_id, char power) {
-  if (get_curr_motor_power(port_id) == power) {
+  // Only records the new power, the change goes out with the rest of the frame's motor
+  // commands on the next flush_motor_commands(). Setting a drive motor directly takes the
+  // drive back from the control thread.
+  if (port_id & (MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT)) {
+    release_control_goal();
+  }
+  pthread_mutex_lock(&controlMutex);
+  if (motor_powers[port_id] == power) {
+    pthread_mutex_unlock(&controlMutex);
     return 0; // no need
   }
   motor_powers[port_id] = power;
-  if (power == 0) {
-    return BT_motor_port_stop(port_id, 1);
+  pthread_mutex_unlock(&controlMutex);
+  motor_powers_dirty |= port_id;
+  return 0;
+}
+
+static void hand_over_ports(char port_ids) {
+  // Ports about to run a manoeuvre end up stopped, so the power cache is updated to match
+  if (port_ids & (MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT)) {
+    release_control_goal();
   }
-  
-  return BT_motor_port_start(port_id, power);
+  pthread_mutex_lock(&controlMutex);
+  for (int p = MOTOR_A; p <= MOTOR_D; p <<= 1) {
+    if (port_ids & p) {
+      motor_powers[p] = 0;
+      motor_powers_sent[p] = 0;
+      motor_powers_dirty &= ~p;
+    }
+  }
+  pthread_mutex_unlock(&controlMutex);
+}
+
+int start_manoeuvre(char port_ids, char power, int duration_ms) {
+  // Run the given motors at power for duration_ms, then roll to a stop. Timed by the motor
+  // sender thread so the frame loop keeps running. Power changes made for these ports while
+  // the manoeuvre runs are held back and applied once it's over.
+  hand_over_ports(port_ids);
+  telemetry_motor(TLM_MOTOR_TIMED, port_ids, power, duration_ms);
+  return BT_motor_timed(port_ids, power, duration_ms, 0);
+}
+
+int start_drive_manoeuvre(char lpower, char rpower, int duration_ms, int lbrake, int rbrake) {
+  // Same as start_manoeuvre() for the two drive wheels, each with its own power and final
+  // brake mode. Both wheels start (and stop) in the same command.
+  hand_over_ports(MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT);
+  telemetry_motor(TLM_MOTOR_TIMED, MOTOR_DRIVE_LEFT, lpower, duration_ms);
+  telemetry_motor(TLM_MOTOR_TIMED, MOTOR_DRIVE_RIGHT, rpower, duration_ms);
+  return BT_motor_timed_pair(MOTOR_DRIVE_LEFT, MOTOR_DRIVE_RIGHT, lpower, rpower, duration_ms, lbrake, rbrake);
+}
+
+int flush_motor_commands() {
+  // Hand every pending motor power change to the motor sender thread (see API/btmotors.c),
+  // which sends them as one batched command. Motors going to the same power share a
+  // single request, the drive pair is sent synchronised. Never blocks on the BT link.
+  int ports = motor_powers_dirty;
+  int mask;
+  char power;
+
+  if (ports == 0) {
+    return 0;
+  }
+  motor_powers_dirty = 0;
+
+  pthread_mutex_lock(&controlMutex);
+  // Both drive wheels go out in one synchronised opcode, so the bot never runs with one wheel
+  // on the new power and the other on the old one. Stopping both still uses a braked stop.
+  if (SYNC_STEERING && (ports & (MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT)) &&
+      (motor_powers[MOTOR_DRIVE_LEFT] != 0 || motor_powers[MOTOR_DRIVE_RIGHT] != 0)) {
+    send_drive_powers(motor_powers[MOTOR_DRIVE_LEFT], motor_powers[MOTOR_DRIVE_RIGHT]);
+    ports &= ~(MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT);
+  }
+
+  for (int p = MOTOR_A; p <= MOTOR_D; p <<= 1) {
+    if (!(ports & p) || motor_powers[p] == motor_powers_sent[p]) {
+      continue;
+    }
+    power = motor_powers[p];
+    mask = 0;
+    for (int q = p; q <= MOTOR_D; q <<= 1) {
+      if ((ports & q) && motor_powers[q] == power && motor_powers_sent[q] != power) {
+        mask |= q;
+        ports &= ~q;
+        motor_powers_sent[q] = power;
+      }
+    }
+    if (power == 0) {
+      BT_motor_set_stop(mask, 1);
+      telemetry_motor(TLM_MOTOR_STOP, mask, 0, 0);
+    } else {
+      BT_motor_set_power(mask, power);
+      telemetry_motor(TLM_MOTOR_POWER, mask, power, 0);
+    }
+  }
+  pthread_mutex_unlock(&controlMutex);
+  return 0;
 }
 
 struct coord add_coords(struct coord a, struct coord b) {
@@ -1940,4 +2214,210 @@ double getExpectedUnitCircleDistance(double angleOffset){ // MAX half rotation (
 
 double distance_between_points(struct coord p1, struct coord p2){
   return pow(pow(p1.x - p2.x, 2) + pow (p1.y - p2.y, 2), 0.5);
-}
\ No newline at end of file
+}
+
+void send_drive_powers(char powerL, char powerR) {
+  // Send new drive wheel powers (if they changed) and update the power caches. Used by
+  // flush_motor_commands() and by the control thread, whichever owns the drive. Called
+  // with controlMutex held.
+  if (powerL == motor_powers_sent[MOTOR_DRIVE_LEFT] && powerR == motor_powers_sent[MOTOR_DRIVE_RIGHT]) {
+    return;
+  }
+  motor_powers[MOTOR_DRIVE_LEFT] = powerL;
+  motor_powers[MOTOR_DRIVE_RIGHT] = powerR;
+  telemetry_motor(TLM_MOTOR_STEER, MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT, powerL, powerR);
+
+  if (SYNC_STEERING && (powerL != 0 || powerR != 0)) {
+    BT_motor_set_steer(MOTOR_DRIVE_LEFT, MOTOR_DRIVE_RIGHT, powerL, powerR);
+  } else if (powerL == powerR) {
+    if (powerL == 0) BT_motor_set_stop(MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT, 1);
+    else BT_motor_set_power(MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT, powerL);
+  } else {
+    if (powerL == 0) BT_motor_set_stop(MOTOR_DRIVE_LEFT, 1);
+    else BT_motor_set_power(MOTOR_DRIVE_LEFT, powerL);
+    if (powerR == 0) BT_motor_set_stop(MOTOR_DRIVE_RIGHT, 1);
+    else BT_motor_set_power(MOTOR_DRIVE_RIGHT, powerR);
+  }
+  motor_powers_sent[MOTOR_DRIVE_LEFT] = powerL;
+  motor_powers_sent[MOTOR_DRIVE_RIGHT] = powerR;
+}
+
+/**************************************************************************
+ * Control thread - runs the curve steering law (computeCurvePowers()) at
+ * CONTROL_RATE against the estimated pose, so the control bandwidth does
+ * not depend on the camera frame rate. The AI only updates the goal
+ * through handleCurveToGivenLocation() once per frame.
+ *
+ * The drive motors belong either to the AI (motor_power_async()) or to
+ * the control thread (while a goal is active), never to both. Anything
+ * that sets the drive motors directly releases the goal first, and the
+ * control thread does all its work holding controlMutex, so once
+ * release_control_goal() returns the thread has let go of the drive.
+ * An urgent BT_all_stop() made without releasing the goal still wins,
+ * the thread drops a goal set before the stop (see BT_urgent_epoch()).
+ * ************************************************************************/
+struct control_goal {
+  int active;
+  struct coord goal;
+  int allow_backwards;
+  double maxPushPower;
+  int allow_straight;
+  double strictness;
+  struct coord self, heading;   // AI's robust pose at the last update, used when the estimator has none
+  long long updated;            // When the AI last refreshed the goal (us)
+  long long frame_time;         // Capture time of the frame the goal was computed from (us)
+  unsigned int epoch;           // BT_urgent_epoch() when the goal was set
+};
+
+struct control_goal controlGoal;
+pthread_t controlThread;
+int controlRunning = 0;
+int controlThreaded = 0;        // 1 if controlThread is running control_loop()
+int AI_stepped = 0;             // 1 -> no estimator/control threads, the caller steps them (see tools/aireplay.c)
+double controlLastCurve;        // Curve power for the D term, refreshed every CONTROL_D_INTERVAL_US
+long long controlLastCurveTime;
+
+int set_control_goal(struct coord goal, int allow_backwards, double maxPushPower, int allow_straight,
+                     struct coord self, struct coord heading, long long frame_time) {
+  // Hand a curve goal to the control thread. Returns 1 if the control thread took it,
+  // 0 if it isn't running (the caller then steers itself).
+  if (!__atomic_load_n(&controlRunning, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  pthread_mutex_lock(&controlMutex);
+  if (!controlGoal.active) {
+    controlLastCurve = -1000;   // Fresh start for the D term, as after a state change
+  }
+  controlGoal.goal = goal;
+  controlGoal.allow_backwards = allow_backwards;
+  controlGoal.maxPushPower = maxPushPower;
+  controlGoal.allow_straight = allow_straight;
+  controlGoal.strictness = thresholdStrictness;
+  controlGoal.self = self;
+  controlGoal.heading = heading;
+  controlGoal.updated = BT_sensor_time_us();
+  controlGoal.frame_time = frame_time;
+  controlGoal.epoch = BT_urgent_epoch();
+  controlGoal.active = 1;
+  pthread_mutex_unlock(&controlMutex);
+
+  // Any drive change recorded earlier this frame is superseded by the control thread
+  motor_powers_dirty &= ~(MOTOR_DRIVE_LEFT | MOTOR_DRIVE_RIGHT);
+  return 1;
+}
+
+void release_control_goal() {
+  // Take the drive motors back from the control thread (they keep their current power)
+  pthread_mutex_lock(&controlMutex);
+  controlGoal.active = 0;
+  pthread_mutex_unlock(&controlMutex);
+}
+
+void control_step() {
+  // One control update, called with controlMutex held
+  struct coord self = controlGoal.self;
+  struct coord heading = controlGoal.heading;
+  double x, y, hx, hy, powerL, powerR, lastCurve;
+  long long now = BT_sensor_time_us();
+
+  if (BT_urgent_epoch() != controlGoal.epoch) {
+    // Everything was stopped since the goal was set, don't start the drive again
+    controlGoal.active = 0;
+    return;
+  }
+  if (now - controlGoal.updated > CONTROL_GOAL_TIMEOUT_US) {
+    // The AI stopped updating the goal (stalled, or lost track of the bot), don't drive blind
+    controlGoal.active = 0;
+    BT_motor_origin(0);
+    send_drive_powers(0, 0);
+    return;
+  }
+
+  if (estimator_get_pose(&x, &y, &hx, &hy) == 0) {
+    self = new_coords(x, y);
+    heading = new_coords(hx, hy);
+  } else if (estimator_get_heading(&hx, &hy) == 0) {
+    heading = new_coords(hx, hy);
+  }
+
+  lastCurve = controlLastCurve;
+  computeCurvePowers(self, heading, controlGoal.goal, controlGoal.allow_backwards, controlGoal.maxPushPower,
+                     controlGoal.allow_straight, controlGoal.strictness, &lastCurve, &powerL, &powerR);
+  // The D gain was tuned per camera frame, so the reference is only moved on that time scale
+  if (controlLastCurve == -1000 || now - controlLastCurveTime >= CONTROL_D_INTERVAL_US) {
+    controlLastCurve = lastCurve;
+    controlLastCurveTime = now;
+  }
+
+  if (powerL > 100) powerL = 100;
+  if (powerL < -100) powerL = -100;
+  if (powerR > 100) powerR = 100;
+  if (powerR < -100) powerR = -100;
+  // Latency is counted from the frame behind the goal, the thread's later refinements of it
+  // don't have a fresher capture
+  BT_motor_origin(controlGoal.frame_time);
+  send_drive_powers((char)powerL, (char)powerR);
+}
+
+void control_tick() {
+  // One pass of the control loop. Called by the control thread, or at CONTROL_RATE by
+  // whoever runs the AI stepped
+  pthread_mutex_lock(&controlMutex);
+  if (controlGoal.active) {
+    control_step();
+  }
+  pthread_mutex_unlock(&controlMutex);
+}
+
+void *control_loop(void *arg) {
+  // Control thread main loop, wakes up against absolute deadlines so the rate doesn't drift
+  long long period_ns = 1000000000LL / CONTROL_RATE;
+  struct timespec next;
+
+  perf_trace_thread_name("control");
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (__atomic_load_n(&controlRunning, __ATOMIC_ACQUIRE)) {
+    control_tick();
+
+    next.tv_nsec += period_ns;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
+
+int start_control_thread() {
+  // Start the control thread (no-op if it's running, or if CONTROL_RATE is 0). With
+  // AI_stepped set the goal is taken but no thread is started, see control_tick().
+  if (CONTROL_RATE <= 0 || __atomic_load_n(&controlRunning, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  controlGoal.active = 0;
+  __atomic_store_n(&controlRunning, 1, __ATOMIC_RELEASE);
+  if (AI_stepped) {
+    return 0;
+  }
+  if (pthread_create(&controlThread, NULL, control_loop, NULL) != 0) {
+    fprintf(stderr, "start_control_thread(): Unable to create the control thread, steering at frame rate\n");
+    __atomic_store_n(&controlRunning, 0, __ATOMIC_RELEASE);
+    return -1;
+  }
+  controlThreaded = 1;
+  return 0;
+}
+
+void stop_control_thread() {
+  // Stop the control thread, the AI steers at frame rate again
+  if (!__atomic_load_n(&controlRunning, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  release_control_goal();
+  __atomic_store_n(&controlRunning, 0, __ATOMIC_RELEASE);
+  if (controlThreaded) {
+    pthread_join(controlThread, NULL);
+    controlThreaded = 0;
+  }
+}
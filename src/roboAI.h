@@ -23,6 +23,11 @@
 
 #include "imagecapture/imageCapture.h"
 #include "API/btcomm.h"
+#include "API/btsensors.h"
+#include "API/btbatch.h"
+#include "API/btmotors.h"
+#include "estimator.h"
+#include "telemetry.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -43,6 +48,16 @@
 
 #define TOUCH_SENSOR_INPUT PORT_1
 #define COLOUR_SENSOR_INPUT PORT_3
+#define GYRO_SENSOR_INPUT BT_SENSOR_UNUSED // Port of the EV3 gyro if one is fitted (e.g. PORT_2), nothing checks what is on it
+
+#define SENSOR_POLL_RATE 100            // Rate (Hz) at which the background poller reads the sensors
+#define SENSOR_MAX_AGE_US 100000        // Cached sensor readings older than this (in us) are not trusted
+#define MOTOR_SEND_RATE 100             // Max. motor updates per second sent by the motor sender thread
+#define CONTROL_RATE 100                // Rate (Hz) of the steering control thread, 0 -> steer at frame rate
+#define CONTROL_GOAL_TIMEOUT_US 250000  // Control thread stops the drive if the AI hasn't updated its goal for this long
+#define CONTROL_D_INTERVAL_US 33000     // Time base of the steering D term (one camera frame, what it was tuned for)
+#define SYNC_STEERING 1                 // 1 -> drive motors are updated together with the EV3 sync opcode
+#define USE_ODOMETRY 1                  // 1 -> track the pose from the drive tachos between camera frames
 
 // Soccer states
 #define STATE_S_start 0
@@ -149,6 +164,7 @@ struct AI_data{
 	double svx,svy;			       // Current self [vx vy]
 	double smx,smy;			       // Self motion vector
 	double sdx,sdy;                // Self heading direction (from blob shape)
+	long long frame_time;          // Capture time (us, monotonic) of the frame the blobs came from, 0 if unknown
 
 	// Opponent track data. Done separately each frame
     struct blob *opp;		       // Current opponent blob *NULL* if not visible/found
@@ -203,6 +219,7 @@ void AI_calibrate(struct RoboAI *ai, struct blob *blobs);
 /* PaCode - just the function headers - see the functions for descriptions */
 void id_bot(struct RoboAI *ai, struct blob *blobs);
 struct blob *id_coloured_blob2(struct RoboAI *ai, struct blob *blobs, int col);
+void AI_set_hues(const double hues[4]);
 void track_agents(struct RoboAI *ai, struct blob *blobs);
 
 // Display List functions
@@ -229,6 +246,8 @@ void changeMachineState(struct RoboAI *ai, int new_state);
 void handleStateActions(struct RoboAI *ai, struct blob *blobs); // Returns 1 if we want to asynchronously shoot
 void handleShootingMechanism(struct RoboAI *ai);
 int get_curr_motor_power(int port_id);
+int get_touch_sensor_reading();
+int get_colour_sensor_reading(int RGB[3]);
 
 struct coord {
   double x, y;
@@ -243,7 +262,35 @@ struct coord calc_goal_with_obstacles(struct RoboAI *ai, struct coord position,
 struct coord vector_intersect(struct coord ac, struct coord bc, struct coord s);
 double distance_between_points(struct coord p1, struct coord p2);
 int motor_power_async(char port_id, char power);
+int flush_motor_commands();
+int start_manoeuvre(char port_ids, char power, int duration_ms);
+int start_drive_manoeuvre(char lpower, char rpower, int duration_ms, int lbrake, int rbrake);
 double getExpectedUnitCircleDistance(double angleOffset);
 void fixAIHeadingDirection(struct RoboAI *ai);
 void updateRobustValues(struct RoboAI *ai);
+double getPowerNeededToAlign(struct RoboAI *ai, double wanted_posX, double wanted_posY, int allowBackwardsFacing);
+double getPowerNeededToAlignFrom(struct coord self, struct coord heading, double wanted_posX, double wanted_posY,
+                                 int allowBackwardsFacing, double strictness);
+void handleCurveToGivenLocation(struct RoboAI* ai, int allow_backwards_into_wanted, double maxPushPower, int allow_straight);
+void computeCurvePowers(struct coord self, struct coord heading, struct coord goal, int allow_backwards_into_wanted,
+                        double maxPushPower, int allow_straight, double strictness, double *lastCurvePower,
+                        double *powerL, double *powerR);
+void send_drive_powers(char powerL, char powerR);
+int set_control_goal(struct coord goal, int allow_backwards, double maxPushPower, int allow_straight,
+                     struct coord self, struct coord heading, long long frame_time);
+void release_control_goal();
+int start_control_thread();
+void stop_control_thread();
+void control_tick();
+int AI_set_param(const char *name, double value);
+int AI_load_params(const char *filename);
+int AI_save_params(const char *filename);
+
+struct AI_param{
+  const char *name;
+  double *value;
+  double min, max;              // Range the tuner searches
+};
+extern struct AI_param AI_params[];   // Terminated by a NULL name
+extern int AI_stepped;
 #endif
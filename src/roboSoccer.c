@@ -79,25 +79,46 @@
 
 int main(int argc, char **argv)
 {
+  const char *ev3_device=HEXKEY;
+  const char *control=NULL;
+
+  // --headless[=control] comes before the positional arguments
+  if (argc>1&&strncmp(argv[1],"--headless",10)==0&&(argv[1][10]=='\0'||argv[1][10]=='='))
+  {
+   control=argv[1][10]=='='?argv[1]+11:"";
+   argv[1]=argv[0];
+   argc--;
+   argv++;
+  }
 
   if (argc<4||(atoi(argv[2])>1||atoi(argv[2])<0)||(atoi(argv[3])>2||atoi(argv[3])<0))
   {
    fprintf(stderr,"roboSoccer: Incorrect number of parameters.\n");
-   fprintf(stderr,"USAGE: roboSoccer video_device own_colour mode\n");
-   fprintf(stderr,"  video_device - path to camera (typically /dev/video0 or /dev/video1)\n");
+   fprintf(stderr,"USAGE: roboSoccer [--headless[=control]] video_device own_colour mode [ev3_device]\n");
+   fprintf(stderr,"  --headless - run without a window (no X display needed), keys are read from stdin, or\n");
+   fprintf(stderr,"               from a control socket, --headless=unix:/path/to/socket or --headless=tcp:port\n");
+   fprintf(stderr,"               (e.g. echo t | nc -U /path/to/socket). HEADLESS_FRAMES=n quits after n frames\n");
+   fprintf(stderr,"  video_device - path to camera (typically /dev/video0 or /dev/video1), or replay:file[,realtime|fast|step]\n");
+   fprintf(stderr,"                 to play back a raw recording made with 'u' ('n' advances in step mode)\n");
+   fprintf(stderr,"                 or synth:[WxH][,option=value...] to render a field with bots and ball (see\n");
+   fprintf(stderr,"                 imagecapture/synthCam.h), e.g. synth:1920x1080,bots=4,fps=0\n");
    fprintf(stderr,"  own_colour - colour of the EV3 bot controlled by this program, 0 = BLUE, 1 = RED\n");
    fprintf(stderr,"  mode - AI mode: 0 = SOCCER, 1 = PENALTY, 2 = CHASE\n");
+   fprintf(stderr,"  ev3_device - (optional) EV3 to connect to, defaults to HEXKEY. Either a BT hex address,\n");
+   fprintf(stderr,"               unix:/path/to/socket or tcp:host:port (e.g. an EV3 emulator, see tools/ev3emu)\n");
    exit(0);
   }
 
+  if (argc>4) ev3_device=argv[4];
+
   //Connect to device
-  BT_open(HEXKEY);
+  BT_open(ev3_device);
 
   // Start GLUT
-  glutInit(&argc, argv);
+  if (control==NULL) glutInit(&argc, argv);
 
   // Launch imageCapture
-  if (imageCaptureStartup(argv[1], 1280, 720, atoi(argv[2]), atoi(argv[3]))) {
+  if (imageCaptureStartup(argv[1], 1280, 720, atoi(argv[2]), atoi(argv[3]), control)) {
     fprintf(stderr, "Couldn't start image capture, terminating...\n");
     exit(0);
   }
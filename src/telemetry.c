@@ -0,0 +1,324 @@
+/***************************************************
+ Per-frame binary telemetry log. See telemetry.h for
+ the format.
+
+ Threads: the AI thread is the only one that calls
+ telemetry_event(), telemetry_transition() and
+ telemetry_frame(), and the only producer on the record
+ ring. telemetry_motor() may be called from any thread.
+ The writer thread is the only consumer of the record
+ ring, the AI thread the only consumer of the motor
+ ring. Nothing here takes a lock of its own (the motor
+ powers are read through get_curr_motor_power()).
+
+***************************************************/
+
+#include "roboAI.h"
+#include "telemetry.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+// AI state kept as globals in roboAI.c
+extern int headingFused;
+extern double robustHeadingX, robustHeadingY;
+extern double robustBallCx, robustBallCy;
+extern double robustSelfCx, robustSelfCy;
+extern double robustEnemyCx, robustEnemyCy;
+
+struct motor_slot{
+  unsigned int seq;             // index + 1 once the entry is filled in
+  struct telemetry_motor m;
+};
+
+static struct telemetry_record tlm_ring[TELEMETRY_RING];
+static unsigned int tlm_head = 0;               // Next record the AI fills (AI thread only)
+static unsigned int tlm_tail = 0;               // Next record the writer takes (writer only)
+static struct motor_slot motor_ring[TELEMETRY_MOTOR_RING];
+static unsigned int motor_head = 0;             // Next slot a producer claims
+static unsigned int motor_tail = 0;             // Next slot the AI thread reads
+static struct telemetry_record tlm_pending;     // Events/transitions gathered during the current frame
+static int tlm_fd = -1;
+static int tlm_running = 0;
+static int tlm_frame = 0;
+static long long tlm_dropped = 0;
+static long long tlm_lost = 0;                  // Records not written after a write error (writer only)
+static long long tlm_written = 0;               // Records in the file (writer only)
+static pthread_t tlm_thread;
+
+static int telemetry_write(const void *buf, size_t len){
+  // Write all of buf, carrying on after short writes. Returns 0, or -1 on an error
+  const char *p = (const char *)buf;
+  ssize_t w;
+
+  while (len > 0){
+    w = write(tlm_fd, p, len);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    p += w;
+    len -= w;
+  }
+  return 0;
+}
+
+static void *telemetry_loop(void *arg){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Writer thread. Appends every record in the ring to the file, contiguous runs in
+  // one write(). The readers find record i at header + i * record_size, so a write
+  // error ends the log: whatever part of a record made it out is cut off again, and
+  // later records are only counted as lost.
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct timespec ts = {0, TELEMETRY_FLUSH_MS * 1000000L};
+  unsigned int head, n;
+  int running, failed = 0;
+
+  do {
+    running = __atomic_load_n(&tlm_running, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&tlm_head, __ATOMIC_ACQUIRE);
+    while (tlm_tail != head){
+      n = head - tlm_tail;
+      if (n > TELEMETRY_RING - tlm_tail % TELEMETRY_RING) n = TELEMETRY_RING - tlm_tail % TELEMETRY_RING;
+      if (failed){
+        tlm_lost += n;
+      } else if (telemetry_write(&tlm_ring[tlm_tail % TELEMETRY_RING], n * sizeof(struct telemetry_record)) < 0){
+        perror("telemetry_loop(): write failed, logging stopped");
+        if (ftruncate(tlm_fd, sizeof(struct telemetry_header) + tlm_written * sizeof(struct telemetry_record)) < 0){
+          perror("telemetry_loop(): Unable to cut off the partial record");
+        }
+        failed = 1;
+        tlm_lost += n;
+      } else {
+        tlm_written += n;
+      }
+      __atomic_store_n(&tlm_tail, tlm_tail + n, __ATOMIC_RELEASE);
+    }
+    if (running) nanosleep(&ts, NULL);
+  } while (running);
+  return NULL;
+}
+
+int telemetry_start(const char *filename){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Open a new log and start the writer thread.
+  //
+  // Inputs: filename - log file (overwritten)
+  // Returns: 0 on success, -1 if already logging or the file can't be written
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct telemetry_header h;
+
+  if (tlm_running) return -1;
+  tlm_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (tlm_fd < 0){
+    perror("telemetry_start(): Unable to open the log");
+    return -1;
+  }
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TELEMETRY_MAGIC, sizeof(h.magic));
+  h.version = 2;
+  h.header_size = sizeof(struct telemetry_header);
+  h.record_size = sizeof(struct telemetry_record);
+  h.max_blobs = TELEMETRY_MAX_BLOBS;
+  h.max_transitions = TELEMETRY_MAX_TRANSITIONS;
+  h.max_motor = TELEMETRY_MAX_MOTOR;
+  h.n_events = NUMBER_OF_EVENTS;
+  h.sensor_count = TELEMETRY_SENSORS;
+  if (telemetry_write(&h, sizeof(h)) < 0){
+    perror("telemetry_start(): Unable to write the log");
+    close(tlm_fd);
+    tlm_fd = -1;
+    return -1;
+  }
+
+  tlm_tail = tlm_head;
+  motor_tail = __atomic_load_n(&motor_head, __ATOMIC_ACQUIRE);
+  memset(&tlm_pending, 0, sizeof(tlm_pending));
+  tlm_frame = 0;
+  tlm_dropped = 0;
+  tlm_lost = 0;
+  tlm_written = 0;
+  tlm_running = 1;
+  if (pthread_create(&tlm_thread, NULL, telemetry_loop, NULL) != 0){
+    fprintf(stderr, "telemetry_start(): Unable to start the writer thread\n");
+    tlm_running = 0;
+    close(tlm_fd);
+    tlm_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int telemetry_stop(void){
+  // Write out what is left in the ring and close the log
+  if (!tlm_running) return -1;
+  __atomic_store_n(&tlm_running, 0, __ATOMIC_RELEASE);
+  pthread_join(tlm_thread, NULL);
+  close(tlm_fd);
+  tlm_fd = -1;
+  fprintf(stderr, "telemetry: %lld frames logged, %lld dropped, %lld lost to write errors\n", tlm_written, tlm_dropped, tlm_lost);
+  return 0;
+}
+
+int telemetry_running(void){
+  return __atomic_load_n(&tlm_running, __ATOMIC_RELAXED);
+}
+
+void telemetry_event(int event, int active){
+  // Note an event evaluation (event index as in the transition table, i.e. 2*EVENT_x + wanted)
+  int e = event / 2;
+  if (!tlm_running || e >= 32) return;
+  tlm_pending.events_checked |= 1u << e;
+  if (active) tlm_pending.events_active |= 1u << e;
+}
+
+void telemetry_transition(int from, int to){
+  int n = tlm_pending.n_transitions;
+  if (!tlm_running) return;
+  if (n < TELEMETRY_MAX_TRANSITIONS){
+    tlm_pending.transitions[n][0] = from;
+    tlm_pending.transitions[n][1] = to;
+  }
+  tlm_pending.n_transitions++;
+}
+
+void telemetry_motor(int kind, int ports, int a, int b){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Log a motor command. Any thread. Claims a slot with one atomic add, fills it in and
+  // publishes it by storing its sequence number. If the AI thread doesn't empty the
+  // ring for TELEMETRY_MOTOR_RING commands the oldest ones are overwritten.
+  //////////////////////////////////////////////////////////////////////////////////////
+  unsigned int i;
+  struct motor_slot *s;
+
+  if (!__atomic_load_n(&tlm_running, __ATOMIC_RELAXED)) return;
+  i = __atomic_fetch_add(&motor_head, 1, __ATOMIC_RELAXED);
+  s = &motor_ring[i % TELEMETRY_MOTOR_RING];
+  s->m.t = perf_time_us();
+  s->m.kind = kind;
+  s->m.ports = ports;
+  s->m.a = a;
+  s->m.b = b;
+  __atomic_store_n(&s->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+static void telemetry_take_motor(struct telemetry_record *r){
+  // Move the published motor commands into the record, stopping at the first slot that
+  // is still being filled in (it goes in the next record)
+  unsigned int head = __atomic_load_n(&motor_head, __ATOMIC_ACQUIRE);
+  unsigned int seq;
+
+  if (head - motor_tail > TELEMETRY_MOTOR_RING){
+    r->n_motor += head - motor_tail - TELEMETRY_MOTOR_RING;       // Overwritten before we got to them
+    motor_tail = head - TELEMETRY_MOTOR_RING;
+  }
+  while (motor_tail != head){
+    struct motor_slot *s = &motor_ring[motor_tail % TELEMETRY_MOTOR_RING];
+    seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (seq != motor_tail + 1) break;
+    if (r->n_motor < TELEMETRY_MAX_MOTOR) r->motor[r->n_motor] = s->m;
+    r->n_motor++;
+    motor_tail++;
+  }
+}
+
+static void telemetry_agent(struct telemetry_record *r, int k, struct blob *b, double vx, double vy,
+                            double mx, double my, double dx, double dy){
+  r->seen[k] = (b != NULL);
+  r->cx[k] = b != NULL ? b->cx : 0;
+  r->cy[k] = b != NULL ? b->cy : 0;
+  r->vx[k] = vx;
+  r->vy[k] = vy;
+  r->mx[k] = mx;
+  r->my[k] = my;
+  r->dx[k] = dx;
+  r->dy[k] = dy;
+}
+
+void telemetry_frame(struct RoboAI *ai, struct blob *blobs){
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Log the frame. Call once at the end of AI_main(), after the motor commands for the
+  // frame were handed over. Fills in the next ring slot and publishes it, or drops the
+  // record if the writer is a full ring behind.
+  //////////////////////////////////////////////////////////////////////////////////////
+  struct telemetry_record *r;
+  struct BT_sensor_reading s;
+  struct blob *b;
+  int n;
+
+  if (!tlm_running) return;
+  if (tlm_head - __atomic_load_n(&tlm_tail, __ATOMIC_ACQUIRE) >= TELEMETRY_RING){
+    tlm_dropped++;
+    tlm_frame++;
+    memset(&tlm_pending, 0, sizeof(tlm_pending));
+    return;
+  }
+  r = &tlm_ring[tlm_head % TELEMETRY_RING];
+  *r = tlm_pending;
+  memset(&tlm_pending, 0, sizeof(tlm_pending));
+
+  r->frame_time = ai->st.frame_time;
+  r->log_time = perf_time_us();
+  r->frame = tlm_frame++;
+  r->state = ai->st.state;
+  r->side = ai->st.side;
+  r->botCol = ai->st.botCol;
+  r->selfID = ai->st.selfID;
+  r->oppID = ai->st.oppID;
+  r->ballID = ai->st.ballID;
+  r->headingFused = headingFused;
+  telemetry_agent(r, 0, ai->st.self, ai->st.svx, ai->st.svy, ai->st.smx, ai->st.smy, ai->st.sdx, ai->st.sdy);
+  telemetry_agent(r, 1, ai->st.opp, ai->st.ovx, ai->st.ovy, ai->st.omx, ai->st.omy, ai->st.odx, ai->st.ody);
+  telemetry_agent(r, 2, ai->st.ball, ai->st.bvx, ai->st.bvy, ai->st.bmx, ai->st.bmy, ai->st.bdx, ai->st.bdy);
+
+  r->robustHeadingX = robustHeadingX;
+  r->robustHeadingY = robustHeadingY;
+  r->robustSelfCx = robustSelfCx;
+  r->robustSelfCy = robustSelfCy;
+  r->robustBallCx = robustBallCx;
+  r->robustBallCy = robustBallCy;
+  r->robustEnemyCx = robustEnemyCx;
+  r->robustEnemyCy = robustEnemyCy;
+
+  r->motor_powers[0] = get_curr_motor_power(MOTOR_A);
+  r->motor_powers[1] = get_curr_motor_power(MOTOR_B);
+  r->motor_powers[2] = get_curr_motor_power(MOTOR_C);
+  r->motor_powers[3] = get_curr_motor_power(MOTOR_D);
+  telemetry_take_motor(r);
+
+  for (int i = 0; i < TELEMETRY_SENSORS && i < BT_SENSOR_COUNT; i++){
+    if (BT_sensor_latest(i, &s) == 0 && s.count > 0){
+      r->sensor_time[i] = s.timestamp;
+      r->sensor_value[i][0] = s.value[0];
+      r->sensor_value[i][1] = s.value[1];
+      r->sensor_value[i][2] = s.value[2];
+      r->sensor_status[i] = s.status;
+    } else {
+      r->sensor_status[i] = -1;
+    }
+  }
+
+  n = 0;
+  for (b = blobs; b != NULL; b = b->next, n++){
+    if (n >= TELEMETRY_MAX_BLOBS) continue;
+    struct telemetry_blob *t = &r->blobs[n];
+    t->cx = b->cx;
+    t->cy = b->cy;
+    t->vx = b->vx;
+    t->vy = b->vy;
+    t->mx = b->mx;
+    t->my = b->my;
+    t->dx = b->dx;
+    t->dy = b->dy;
+    t->R = b->R;
+    t->G = b->G;
+    t->B = b->B;
+    t->H = b->H;
+    t->S = b->S;
+    t->V = b->V;
+    t->size = b->size;
+    t->idtype = b->idtype;
+    t->blobId = b->blobId;
+  }
+  r->n_blobs = n;
+
+  __atomic_store_n(&tlm_head, tlm_head + 1, __ATOMIC_RELEASE);
+}
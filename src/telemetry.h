@@ -0,0 +1,126 @@
+/***************************************************
+ Per-frame binary telemetry log.
+
+ One fixed-size record per AI frame: the blob table,
+ the AI_data fields, the robust estimates, which
+ events were evaluated and which fired, any state
+ transitions, the motor commands sent and the latest
+ sensor readings. Fixed-size records after a fixed
+ header make the file trivial to mmap and index
+ (record i is at sizeof(header) + i * record_size),
+ tools/telemetry2csv converts it to CSV, and
+ tools/aireplay runs the AI on it again.
+
+ The AI thread fills in a record and drops it into a
+ single-producer ring, a writer thread appends whatever
+ is in the ring to the file, so the AI never waits on
+ the disk (if the ring is full the record is dropped
+ and counted). Motor commands can be logged from any
+ thread (the control thread sends drive powers too),
+ they go through a small multi-producer ring that is
+ emptied into the record for the frame.
+
+ Everything is in host byte order.
+
+***************************************************/
+
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#define TELEMETRY_MAGIC "RSTLM01"
+#define TELEMETRY_MAX_BLOBS 16          // Blobs kept per frame (largest first as blobDetect2() lists them)
+#define TELEMETRY_MAX_TRANSITIONS 4     // State transitions kept per frame
+#define TELEMETRY_MAX_MOTOR 16          // Motor commands kept per frame
+#define TELEMETRY_RING 64               // Records waiting for the writer thread
+#define TELEMETRY_MOTOR_RING 256        // Motor commands waiting to be put in a record
+#define TELEMETRY_FLUSH_MS 20           // How often the writer thread looks at the ring
+#define TELEMETRY_SENSORS 6             // Sensor slots per record (BT_SENSOR_COUNT)
+
+#define TLM_MOTOR_POWER 0               // ports set to a power (a = power)
+#define TLM_MOTOR_STOP 1                // ports stopped
+#define TLM_MOTOR_STEER 2               // drive pair, a = left power, b = right power
+#define TLM_MOTOR_TIMED 3               // timed manoeuvre, a = power, b = duration (ms)
+#define TLM_MOTOR_ALL_STOP 4
+
+struct telemetry_header{
+  char magic[8];
+  int version;
+  int header_size;
+  int record_size;
+  int max_blobs;
+  int max_transitions;
+  int max_motor;
+  int n_events;                         // NUMBER_OF_EVENTS when the log was written
+  int sensor_count;                     // TELEMETRY_SENSORS
+  int reserved[6];
+};
+
+struct telemetry_blob{
+  float cx, cy;
+  float vx, vy;
+  float mx, my;
+  float dx, dy;
+  float R, G, B;
+  float H, S, V;
+  int size;
+  int idtype;
+  int blobId;
+};
+
+struct telemetry_motor{
+  long long t;                          // When the command was handed to the sender (us, monotonic)
+  int kind;                             // TLM_MOTOR_*
+  int ports;
+  int a, b;
+};
+
+struct telemetry_record{
+  long long frame_time;                 // Capture time of the frame (us, monotonic)
+  long long log_time;                   // When the record was filled in
+  int frame;                            // Record sequence number (gaps are dropped records)
+  int state, side, botCol;
+  int selfID, oppID, ballID;
+  int headingFused;
+
+  // AI_data agent tracks, [0] = self, [1] = opponent, [2] = ball
+  float cx[3], cy[3];                   // Blob position (0 if not seen this frame)
+  float vx[3], vy[3];
+  float mx[3], my[3];
+  float dx[3], dy[3];
+  int seen[3];
+
+  // Robust estimates from updateRobustValues()
+  float robustHeadingX, robustHeadingY;
+  float robustSelfCx, robustSelfCy;
+  float robustBallCx, robustBallCy;
+  float robustEnemyCx, robustEnemyCy;
+
+  unsigned int events_checked;          // Bit i set if event i was evaluated this frame
+  unsigned int events_active;           // Bit i set if it came out as wanted by the transition table
+  int n_transitions;
+  int transitions[TELEMETRY_MAX_TRANSITIONS][2];        // from, to
+
+  int motor_powers[4];                  // Cached power per port A..D after this frame
+  int n_motor;                          // Commands this frame (may exceed TELEMETRY_MAX_MOTOR)
+  struct telemetry_motor motor[TELEMETRY_MAX_MOTOR];
+
+  long long sensor_time[TELEMETRY_SENSORS];     // Latest reading per BT_SENSOR_*, as BT_sensor_latest() gave it
+  int sensor_value[TELEMETRY_SENSORS][3];
+  int sensor_status[TELEMETRY_SENSORS];         // -1 also if nothing was read yet
+
+  int n_blobs;                          // Blobs this frame (may exceed TELEMETRY_MAX_BLOBS)
+  int pad;
+  struct telemetry_blob blobs[TELEMETRY_MAX_BLOBS];
+};
+
+struct RoboAI;
+struct blob;
+int telemetry_start(const char *filename);
+int telemetry_stop(void);
+int telemetry_running(void);
+void telemetry_event(int event, int active);
+void telemetry_transition(int from, int to);
+void telemetry_motor(int kind, int ports, int a, int b);
+void telemetry_frame(struct RoboAI *ai, struct blob *blobs);
+
+#endif
@@ -0,0 +1,307 @@
+/***********************************************************************************************************************
+ *
+ * 	aireplay - Runs the AI (roboAI.c and the estimator, unmodified) on a telemetry log recorded by roboSoccer
+ * 	(TELEMETRY=<file>, or the 'y' key), without the camera, the robot or a display, as fast as the CPU allows.
+ *
+ * 	Each record gives the blobs and the sensor readings the AI saw in one frame. The BT library is replaced
+ * 	by btfake: the sensor poller cache returns the recorded readings, and motor commands are collected
+ * 	instead of sent. Time is virtual, the clock reads the time the record was logged at, and the
+ * 	AI runs stepped (AI_stepped): the estimator samples the readings once per frame and the steering control
+ * 	loop is ticked at CONTROL_RATE between frames. No threads, no wall clock, so the same log and the same
+ * 	AI code always give the same decisions.
+ *
+ * 	The decisions for each frame (state, transitions, events fired, motor powers and the commands issued)
+ * 	can be written as CSV (-o) and compared with a previous run (-b). Any frame where they differ is
+ * 	reported, which makes a quick regression test for changes to the transition table, the state handlers
+ * 	or the steering:
+ *
+ * 	   aireplay -o before.csv game.tlm        (with the old AI)
+ * 	   aireplay -b before.csv game.tlm        (with the new AI, exits with 2 if anything changed)
+ *
+ * 	The log starts with the frames the live AI spent on self-ID, so replaying from the first record runs
+ * 	id_bot() on the same frames and picks the same side. A replay started later (-f) runs ID on whatever
+ * 	frames it starts with instead.
+ *
+ * 	How often the replayed state matches the state the live AI logged is printed too. It won't be 100%:
+ * 	the log keeps at most TELEMETRY_MAX_BLOBS blobs, only the sensor readings current when each frame was
+ * 	logged (the live estimator sees every poll), and the live AI's timing was real.
+ *
+ * 	Usage: aireplay [-o decisions.csv] [-b baseline.csv] [-k max_reported] [-f first] [-n count] [-m mode] [-v] log.tlm
+ *
+ * ********************************************************************************************************************/
+#include "btfake.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REPLAY_LINE 4096
+
+static long long sensor_time[TELEMETRY_SENSORS];	// Timestamp of the last reading published per sensor
+static int sensor_have[TELEMETRY_SENSORS];
+
+/******************************************************************************************
+ * Replay
+ * ***************************************************************************************/
+
+static void load_sensors(const struct telemetry_record *r)
+{
+ // Publish the frame's readings as the poller would. A new timestamp counts as a new reading.
+ for (int i=0; i<TELEMETRY_SENSORS&&i<BT_SENSOR_COUNT; i++)
+ {
+  if (r->sensor_status[i]!=0&&!sensor_have[i]) continue;
+  if (r->sensor_status[i]==0&&sensor_have[i]&&r->sensor_time[i]==sensor_time[i]) continue;
+  fake_publish(i,r->sensor_value[i][0],r->sensor_value[i][1],r->sensor_value[i][2],r->sensor_status[i]==0?0:-1,
+               r->sensor_time[i]);
+  sensor_time[i]=r->sensor_time[i];
+  sensor_have[i]=1;
+ }
+}
+
+static struct blob *load_blobs(const struct telemetry_record *r)
+{
+ // Rebuild the blob list as blobDetect2() hands it to the AI (motion fields and ids cleared)
+ int n=r->n_blobs<TELEMETRY_MAX_BLOBS?r->n_blobs:TELEMETRY_MAX_BLOBS;
+ struct blob *blobs;
+
+ if (n<=0) return NULL;
+ blobs=(struct blob *)calloc(n,sizeof(struct blob));
+ if (blobs==NULL) return NULL;
+ for (int i=0; i<n; i++)
+ {
+  const struct telemetry_blob *t=&r->blobs[i];
+  blobs[i].label=i+1;
+  blobs[i].blobId=t->blobId;
+  blobs[i].cx=t->cx;
+  blobs[i].cy=t->cy;
+  blobs[i].dx=t->dx;
+  blobs[i].dy=t->dy;
+  blobs[i].size=t->size;
+  blobs[i].R=t->R;
+  blobs[i].G=t->G;
+  blobs[i].B=t->B;
+  blobs[i].H=t->H;
+  blobs[i].S=t->S;
+  blobs[i].V=t->V;
+  blobs[i].next=(i<n-1)?&blobs[i+1]:NULL;
+ }
+ return blobs;
+}
+
+static void format_decisions(char *line, int size, int frame, int state)
+{
+ // frame,state,transitions,events,motor_A,motor_B,motor_C,motor_D,commands
+ extern char motor_powers[9];
+ int len;
+
+ len=snprintf(line,size,"%d,%d,",frame,state);
+ for (int i=0; i<fake_n_transitions&&i<TELEMETRY_MAX_TRANSITIONS&&len<size; i++)
+  len+=snprintf(line+len,size-len,"%s%d>%d",i?" ":"",fake_transitions[2*i],fake_transitions[2*i+1]);
+ if (len<size)
+  len+=snprintf(line+len,size-len,",%x,%d,%d,%d,%d,",fake_events_active,motor_powers[MOTOR_A],motor_powers[MOTOR_B],
+                motor_powers[MOTOR_C],motor_powers[MOTOR_D]);
+ for (int i=0; i<fake_n_cmds&&i<FAKE_MAX_CMDS&&len<size; i++)
+  len+=snprintf(line+len,size-len,"%s%d:%x:%d:%d",i?" ":"",fake_cmds[i].kind,fake_cmds[i].ports,fake_cmds[i].a,
+                fake_cmds[i].b);
+}
+
+#define DECISION_FIELDS 9
+static const char *decision_field[DECISION_FIELDS]={"frame","state","transitions","events","motor_A","motor_B","motor_C",
+                                                   "motor_D","commands"};
+
+static int first_difference(const char *a, const char *b)
+{
+ // Index of the first CSV field that differs, -1 if the lines are the same
+ int f=0;
+ while (*a==*b)
+ {
+  if (*a=='\0') return -1;
+  if (*a==',') f++;
+  a++;
+  b++;
+ }
+ return f<DECISION_FIELDS?f:DECISION_FIELDS-1;
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"USAGE: aireplay [-o decisions.csv] [-b baseline.csv] [-k max_reported] [-f first] [-n count]\n");
+ fprintf(stderr,"                [-m mode] [-v] log.tlm\n");
+ fprintf(stderr,"  -o  write the decisions made in each frame as CSV\n");
+ fprintf(stderr,"  -b  compare the decisions with a CSV written by an earlier run, exit with 2 if they differ\n");
+ fprintf(stderr,"  -k  max. diverging frames to print (default 20)\n");
+ fprintf(stderr,"  -f  first record to replay (default 0), the AI starts from its initial state there\n");
+ fprintf(stderr,"  -n  number of records to replay (default all)\n");
+ fprintf(stderr,"  -m  AI mode, 0 - soccer, 1 - penalty, 2 - chase (default from the log)\n");
+ fprintf(stderr,"  -v  let the AI print its messages\n");
+ exit(1);
+}
+
+int main(int argc, char **argv)
+{
+ const char *out_name=NULL, *base_name=NULL;
+ long first=0, count=-1, n;
+ int fd, opt, mode=-1, verbose=0, max_report=20;
+ int diverged=0, base_missing=0, agree=0, replayed=0;
+ struct stat st;
+ unsigned char *map;
+ struct telemetry_header *h;
+ struct RoboAI ai;
+ struct blob *blobs, *prev_blobs=NULL;
+ FILE *out=NULL, *base=NULL, *report;
+ char line[REPLAY_LINE], base_line[REPLAY_LINE];
+ long long period_us, next_tick, t0;
+
+ while ((opt=getopt(argc,argv,"o:b:k:f:n:m:v"))!=-1)
+  switch (opt)
+  {
+   case 'o': out_name=optarg; break;
+   case 'b': base_name=optarg; break;
+   case 'k': max_report=atoi(optarg); break;
+   case 'f': first=atol(optarg); break;
+   case 'n': count=atol(optarg); break;
+   case 'm': mode=atoi(optarg); if (mode<AI_SOCCER||mode>AI_CHASE) usage(); break;
+   case 'v': verbose=1; break;
+   default: usage();
+  }
+ if (optind!=argc-1||first<0) usage();
+
+ fd=open(argv[optind],O_RDONLY);
+ if (fd<0||fstat(fd,&st)<0)
+ {
+  perror("aireplay: Unable to open the log");
+  return 1;
+ }
+ if (st.st_size<(off_t)sizeof(struct telemetry_header))
+ {
+  fprintf(stderr,"aireplay: %s is too short to be a telemetry log\n",argv[optind]);
+  return 1;
+ }
+ map=(unsigned char *)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+ if (map==MAP_FAILED)
+ {
+  perror("aireplay: mmap() failed");
+  return 1;
+ }
+ h=(struct telemetry_header *)map;
+ if (memcmp(h->magic,TELEMETRY_MAGIC,sizeof(h->magic))!=0||h->header_size!=sizeof(struct telemetry_header)||
+     h->record_size!=sizeof(struct telemetry_record))
+ {
+  fprintf(stderr,"aireplay: %s is not a telemetry log this build can read\n",argv[optind]);
+  return 1;
+ }
+ if (h->n_events!=NUMBER_OF_EVENTS)
+  fprintf(stderr,"aireplay: warning, the log was written by an AI with %d events, this one has %d\n",h->n_events,
+          NUMBER_OF_EVENTS);
+ n=(st.st_size-h->header_size)/h->record_size;
+ if (first>n) first=n;
+ if (count<0||first+count>n) count=n-first;
+ if (count==0)
+ {
+  fprintf(stderr,"aireplay: no records to replay\n");
+  return 1;
+ }
+
+ if (out_name!=NULL&&(out=fopen(out_name,"w"))==NULL)
+ {
+  perror("aireplay: Unable to create the decision file");
+  return 1;
+ }
+ if (base_name!=NULL)
+ {
+  if ((base=fopen(base_name,"r"))==NULL)
+  {
+   perror("aireplay: Unable to open the baseline");
+   return 1;
+  }
+  if (fgets(base_line,REPLAY_LINE,base)==NULL) base_missing=1;	// Header
+ }
+ if (out) fprintf(out,"frame,state,transitions,events,motor_A,motor_B,motor_C,motor_D,commands\n");
+
+ // The AI talks a lot on stdout/stderr, only the report goes out unless -v
+ report=fdopen(dup(2),"w");
+ if (!verbose)
+ {
+  freopen("/dev/null","w",stdout);
+  freopen("/dev/null","w",stderr);
+ }
+
+ // Start the AI the way roboSoccer does, from the mode and colour in the first record
+ const struct telemetry_record *r0=(const struct telemetry_record *)(map+h->header_size+first*h->record_size);
+ if (mode<0) mode=r0->state<100?AI_SOCCER:(r0->state<200?AI_PENALTY:AI_CHASE);
+ fake_reset();
+ fake_now=r0->log_time;
+ fake_publish(BT_SENSOR_TOUCH,1,0,0,0,fake_now);	// setupAI() waits for the shooter to be retracted
+ AI_stepped=1;
+ memset(&ai,0,sizeof(ai));
+ setupAI(mode,r0->botCol,&ai);
+ period_us=CONTROL_RATE>0?1000000/CONTROL_RATE:0;
+ next_tick=fake_now;
+
+ t0=perf_time_us();
+ for (long i=first; i<first+count&&!fake_ai_done; i++)
+ {
+  const struct telemetry_record *r=(const struct telemetry_record *)(map+h->header_size+i*h->record_size);
+
+  // Everything the control loop sent since the last frame goes with this frame, as in the live log
+  fake_frame_begin();
+  load_sensors(r);
+  estimator_sample();
+  while (period_us>0&&next_tick<=r->log_time)
+  {
+   fake_now=next_tick;
+   control_tick();
+   next_tick+=period_us;
+  }
+  fake_now=r->log_time;
+
+  blobs=load_blobs(r);
+  free(prev_blobs);
+  prev_blobs=blobs;
+  if (blobs==NULL) continue;
+
+  ai.st.frame_time=r->frame_time;
+  ai.runAI(&ai,blobs,NULL);
+  ai.DPhead=clearDP(ai.DPhead);
+  replayed++;
+  if (ai.st.state==r->state) agree++;
+
+  format_decisions(line,REPLAY_LINE,r->frame,ai.st.state);
+  if (out) fprintf(out,"%s\n",line);
+  if (base)
+  {
+   if (base_missing||fgets(base_line,REPLAY_LINE,base)==NULL)
+   {
+    base_missing=1;
+    diverged++;
+    continue;
+   }
+   base_line[strcspn(base_line,"\n")]='\0';
+   int f=first_difference(line,base_line);
+   if (f>=0)
+   {
+    if (diverged<max_report)
+     fprintf(report,"frame %d: %s differs\n  now:      %s\n  baseline: %s\n",r->frame,decision_field[f],line,base_line);
+    diverged++;
+   }
+  }
+ }
+ t0=perf_time_us()-t0;
+
+ fprintf(report,"Replayed %d frames in %.3f s (%.0f frames/s)%s\n",replayed,t0/1e6,t0>0?replayed*1e6/t0:0.0,
+         fake_ai_done?", the AI finished":"");
+ fprintf(report,"State matches the live run in %d of %d frames\n",agree,replayed);
+ if (base)
+ {
+  if (!base_missing&&fgets(base_line,REPLAY_LINE,base)!=NULL) base_missing=1;
+  if (base_missing) fprintf(report,"The baseline covers a different number of frames\n");
+  if (diverged>0||base_missing) fprintf(report,"%d frames diverge from %s\n",diverged,base_name);
+  else fprintf(report,"No divergence from %s\n",base_name);
+  fclose(base);
+ }
+ if (out) fclose(out);
+
+ free(prev_blobs);
+ munmap(map,st.st_size);
+ close(fd);
+ return (base&&(diverged>0||base_missing))?2:0;
+}
@@ -0,0 +1,372 @@
+/***********************************************************************************************************************
+ *
+ * 	aitune - Auto-tuner for the AI's hand-tuned constants (AI_params[] in roboAI.c: the alignment power
+ * 	clamps, ALIGN_OFFSET, the obstacle radii, the arrival distance, the robust value weights...).
+ *
+ * 	Candidate parameter sets are scored by playing simulated kickoffs with fieldsim. Every game batch is
+ * 	its own fieldsim process (the AI is all globals, a process each keeps the games apart), and up to one
+ * 	process per core runs at a time. All candidates play the same kickoffs (same seeds), so the scores
+ * 	compare the parameters and not the luck of the draw, and a run is repeatable.
+ *
+ * 	A goal scores 1, less 0.5% for each second it took (down to 0.5), a goal against scores -1, and the
+ * 	candidate's score is the mean over its kickoffs.
+ *
+ * 	The search is an adaptive random search: the first generation samples the whole range of each
+ * 	parameter, later ones sample around the best set so far, widening the search while it improves and
+ * 	narrowing it while it doesn't. At the end the best set and the starting one play a fresh set of kickoffs,
+ * 	to show how much of the improvement was fitting the training kickoffs, and the best set is written
+ * 	as a parameter file for roboSoccer (AI_PARAMS=<file>) or fieldsim -p.
+ *
+ * 	Arguments after -- are passed on to fieldsim (mode, opponent, noise, time limit...), e.g.
+ *
+ * 	   aitune -g 30 -k 200 -o penalty.params -- -m 1
+ *
+ * 	fieldsim is run from the directory aitune is in, unless -x says otherwise.
+ *
+ * 	Usage: aitune [-g generations] [-l candidates] [-k kickoffs] [-b kickoffs_per_process] [-j processes]
+ * 	              [-s seed] [-i initial.params] [-x fieldsim] [-o best.params] [-- fieldsim options]
+ *
+ * ********************************************************************************************************************/
+#include "btfake.h"
+#include <math.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define TUNE_MAX_PARAMS 32
+#define TUNE_TIME_WEIGHT 0.005			// Goal value lost per second it took to score
+#define TUNE_SIGMA_START 0.25			// Search spread around the best set, fraction of each range
+#define TUNE_SIGMA_MIN 0.02
+#define TUNE_SIGMA_MAX 0.5
+#define TUNE_VALIDATION_SEED 1000000		// Offset of the seeds for the final check
+
+struct candidate{
+ double v[TUNE_MAX_PARAMS];
+ int kickoffs, goals_for, goals_against;
+ double time_for;				// Total time to score, over the goals for
+ double score;
+};
+
+static int n_params;
+static char work_dir[64];
+static char fieldsim_path[1024];
+static char **sim_args;				// Passed on to fieldsim
+static int n_sim_args;
+static int kickoffs=100, per_process=10, max_procs=1;
+static unsigned long long rng;
+
+static double rand_u(void)
+{
+ // xorshift64*, uniform in [0,1)
+ rng^=rng>>12;
+ rng^=rng<<25;
+ rng^=rng>>27;
+ return ((rng*2685821657736338717ULL)>>11)*(1.0/9007199254740992.0);
+}
+
+static double rand_n(void)
+{
+ double u=rand_u();
+ if (u<1e-12) u=1e-12;
+ return sqrt(-2*log(u))*cos(2*PI*rand_u());
+}
+
+static void clamp(struct candidate *c)
+{
+ for (int i=0; i<n_params; i++)
+ {
+  if (c->v[i]<AI_params[i].min) c->v[i]=AI_params[i].min;
+  if (c->v[i]>AI_params[i].max) c->v[i]=AI_params[i].max;
+ }
+}
+
+static int save(const struct candidate *c, const char *filename)
+{
+ for (int i=0; i<n_params; i++) *AI_params[i].value=c->v[i];
+ return AI_save_params(filename);
+}
+
+/******************************************************************************************
+ * Evaluation
+ * ***************************************************************************************/
+
+static pid_t spawn(const char *params, long long first_seed, int n, const char *out)
+{
+ // fieldsim -k n -s first_seed -p params -o out <sim_args>, quietly
+ char k[32], s[32];
+ const char *argv[16+n_sim_args];
+ int argc=0, fd;
+ pid_t pid;
+
+ sprintf(k,"%d",n);
+ sprintf(s,"%lld",first_seed);
+ argv[argc++]=fieldsim_path;
+ argv[argc++]="-k"; argv[argc++]=k;
+ argv[argc++]="-s"; argv[argc++]=s;
+ argv[argc++]="-p"; argv[argc++]=params;
+ argv[argc++]="-o"; argv[argc++]=out;
+ for (int i=0; i<n_sim_args; i++) argv[argc++]=sim_args[i];
+ argv[argc]=NULL;
+
+ pid=fork();
+ if (pid==0)
+ {
+  fd=open("/dev/null",O_WRONLY);
+  if (fd>=0)
+  {
+   dup2(fd,1);
+   dup2(fd,2);
+   close(fd);
+  }
+  execv(fieldsim_path,(char * const *)argv);
+  _exit(127);
+ }
+ return pid;
+}
+
+static int read_results(struct candidate *c, const char *filename)
+{
+ // Adds up the per kickoff lines fieldsim wrote
+ char line[256], result[32];
+ double t;
+ FILE *f=fopen(filename,"r");
+ if (f==NULL) return -1;
+ if (fgets(line,sizeof(line),f)==NULL) {fclose(f); return -1;}		// Header
+ while (fgets(line,sizeof(line),f)!=NULL)
+ {
+  if (sscanf(line,"%*d,%*d,%31[^,],%lf",result,&t)!=2) continue;
+  c->kickoffs++;
+  if (!strcmp(result,"goal_for"))
+  {
+   c->goals_for++;
+   c->time_for+=t;
+   c->score+=fmax(0.5,1-TUNE_TIME_WEIGHT*t);
+  }
+  else if (!strcmp(result,"goal_against"))
+  {
+   c->goals_against++;
+   c->score-=1;
+  }
+ }
+ fclose(f);
+ return 0;
+}
+
+static int evaluate(struct candidate *c, int n, long long seed)
+{
+ // Plays the kickoffs for n candidates, batches spread over up to max_procs fieldsim processes
+ int batches=(kickoffs+per_process-1)/per_process, total=n*batches, next=0, running=0, failed=0, status;
+ char params[128], out[128];
+
+ for (int i=0; i<n; i++)
+ {
+  sprintf(params,"%s/c%d.params",work_dir,i);
+  if (save(&c[i],params)!=0)
+  {
+   fprintf(stderr,"aitune: Unable to write %s\n",params);
+   return -1;
+  }
+ }
+
+ while (next<total||running>0)
+ {
+  while (running<max_procs&&next<total)
+  {
+   int i=next/batches, b=next%batches, first=b*per_process;
+   sprintf(params,"%s/c%d.params",work_dir,i);
+   sprintf(out,"%s/c%d_%d.csv",work_dir,i,b);
+   if (spawn(params,seed+first,first+per_process>kickoffs?kickoffs-first:per_process,out)<0)
+   {
+    perror("aitune: fork() failed");
+    failed++;
+    total=next;				// Stop starting new ones
+    break;
+   }
+   running++;
+   next++;
+  }
+  if (running==0) break;
+  if (wait(&status)<0) break;
+  running--;
+  if (!WIFEXITED(status)||WEXITSTATUS(status)!=0) failed++;
+ }
+ if (failed)
+ {
+  fprintf(stderr,"aitune: %d fieldsim runs failed, check %s runs on its own\n",failed,fieldsim_path);
+  return -1;
+ }
+
+ for (int i=0; i<n; i++)
+ {
+  c[i].kickoffs=c[i].goals_for=c[i].goals_against=0;
+  c[i].time_for=c[i].score=0;
+  for (int b=0; b<batches; b++)
+  {
+   sprintf(out,"%s/c%d_%d.csv",work_dir,i,b);
+   if (read_results(&c[i],out)!=0)
+   {
+    fprintf(stderr,"aitune: Missing results in %s\n",out);
+    return -1;
+   }
+   unlink(out);
+  }
+  if (c[i].kickoffs>0) c[i].score/=c[i].kickoffs;
+  sprintf(params,"%s/c%d.params",work_dir,i);
+  unlink(params);
+ }
+ return 0;
+}
+
+static void report(FILE *f, const char *what, const struct candidate *c)
+{
+ fprintf(f,"%s: score %.4f, scored %.1f%%, conceded %.1f%%",what,c->score,100.0*c->goals_for/c->kickoffs,
+         100.0*c->goals_against/c->kickoffs);
+ if (c->goals_for>0) fprintf(f,", %.2f s to score",c->time_for/c->goals_for);
+ fprintf(f,"\n");
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"USAGE: aitune [-g generations] [-l candidates] [-k kickoffs] [-b kickoffs_per_process] [-j processes]\n");
+ fprintf(stderr,"              [-s seed] [-i initial.params] [-x fieldsim] [-o best.params] [-- fieldsim options]\n");
+ fprintf(stderr,"  -g  generations after the first (default 20)\n");
+ fprintf(stderr,"  -l  candidates per generation (default 16)\n");
+ fprintf(stderr,"  -k  kickoffs each candidate plays (default 100)\n");
+ fprintf(stderr,"  -b  kickoffs per fieldsim process (default 10)\n");
+ fprintf(stderr,"  -j  fieldsim processes at a time (default one per core)\n");
+ fprintf(stderr,"  -s  seed for the search and the kickoffs (default 1)\n");
+ fprintf(stderr,"  -i  start from these parameters (default the ones built into roboAI.c)\n");
+ fprintf(stderr,"  -x  fieldsim to run (default the one next to aitune)\n");
+ fprintf(stderr,"  -o  write the best parameters here (default stdout)\n");
+ exit(1);
+}
+
+int main(int argc, char **argv)
+{
+ const char *out_name="-", *init_name=NULL, *x_name=NULL;
+ int opt, generations=20, lambda=16;
+ long long seed=1;
+ double sigma=TUNE_SIGMA_START;
+ struct candidate *cand, best, initial, check[2];
+ char *slash;
+
+ max_procs=sysconf(_SC_NPROCESSORS_ONLN);
+ if (max_procs<1) max_procs=1;
+ while ((opt=getopt(argc,argv,"g:l:k:b:j:s:i:x:o:"))!=-1)
+  switch (opt)
+  {
+   case 'g': generations=atoi(optarg); break;
+   case 'l': lambda=atoi(optarg); break;
+   case 'k': kickoffs=atoi(optarg); break;
+   case 'b': per_process=atoi(optarg); break;
+   case 'j': max_procs=atoi(optarg); break;
+   case 's': seed=atoll(optarg); break;
+   case 'i': init_name=optarg; break;
+   case 'x': x_name=optarg; break;
+   case 'o': out_name=optarg; break;
+   default: usage();
+  }
+ if (generations<0||lambda<1||kickoffs<1||per_process<1||max_procs<1) usage();
+ sim_args=argv+optind;
+ n_sim_args=argc-optind;
+
+ for (n_params=0; AI_params[n_params].name!=NULL; n_params++);
+ if (n_params>TUNE_MAX_PARAMS)
+ {
+  fprintf(stderr,"aitune: roboAI.c has %d parameters, at most %d can be tuned\n",n_params,TUNE_MAX_PARAMS);
+  return 1;
+ }
+ if (init_name!=NULL&&AI_load_params(init_name)<0)
+ {
+  fprintf(stderr,"aitune: Unable to load the parameters in %s\n",init_name);
+  return 1;
+ }
+ memset(&initial,0,sizeof(initial));
+ for (int i=0; i<n_params; i++) initial.v[i]=*AI_params[i].value;
+
+ if (x_name!=NULL) snprintf(fieldsim_path,sizeof(fieldsim_path),"%s",x_name);
+ else
+ {
+  snprintf(fieldsim_path,sizeof(fieldsim_path),"%s",argv[0]);
+  slash=strrchr(fieldsim_path,'/');
+  if (slash!=NULL) snprintf(slash+1,sizeof(fieldsim_path)-(slash+1-fieldsim_path),"fieldsim");
+  else snprintf(fieldsim_path,sizeof(fieldsim_path),"./fieldsim");
+ }
+ if (access(fieldsim_path,X_OK)!=0)
+ {
+  fprintf(stderr,"aitune: Can't run %s, use -x to say where fieldsim is\n",fieldsim_path);
+  return 1;
+ }
+ snprintf(work_dir,sizeof(work_dir),"/tmp/aitune.XXXXXX");
+ if (mkdtemp(work_dir)==NULL)
+ {
+  perror("aitune: Unable to create a work directory");
+  return 1;
+ }
+
+ // One short run first, so a fieldsim that doesn't work fails here rather than in every batch
+ {
+  struct candidate one=initial;
+  int k=kickoffs;
+  kickoffs=1;
+  if (evaluate(&one,1,seed)!=0) return 1;
+  kickoffs=k;
+ }
+
+ cand=(struct candidate *)calloc(lambda,sizeof(struct candidate));
+ if (cand==NULL)
+ {
+  fprintf(stderr,"aitune: Out of memory\n");
+  return 1;
+ }
+ rng=(unsigned long long)seed*0x9E3779B97F4A7C15ULL+1;
+
+ fprintf(stderr,"Tuning %d parameters, %d candidates x %d kickoffs per generation, %d fieldsim processes at a time\n",
+         n_params,lambda,kickoffs,max_procs);
+ best=initial;
+ if (evaluate(&best,1,seed)!=0) return 1;
+ report(stderr,"start",&best);
+
+ for (int g=0; g<=generations; g++)
+ {
+  char what[64];
+  int improved=0;
+
+  for (int c=0; c<lambda; c++)
+  {
+   memset(&cand[c],0,sizeof(struct candidate));
+   for (int i=0; i<n_params; i++)
+   {
+    double range=AI_params[i].max-AI_params[i].min;
+    if (g==0) cand[c].v[i]=AI_params[i].min+rand_u()*range;
+    else cand[c].v[i]=best.v[i]+sigma*range*rand_n();
+   }
+   clamp(&cand[c]);
+  }
+  if (evaluate(cand,lambda,seed)!=0) return 1;
+  for (int c=0; c<lambda; c++)
+   if (cand[c].score>best.score)
+   {
+    best=cand[c];
+    improved=1;
+   }
+  if (g>0) sigma=improved?fmin(TUNE_SIGMA_MAX,sigma*1.3):fmax(TUNE_SIGMA_MIN,sigma*0.7);
+  sprintf(what,"generation %d%s",g,improved?" (better)":"");
+  report(stderr,what,&best);
+ }
+
+ // Fresh kickoffs, to see whether the improvement holds
+ check[0]=initial;
+ check[1]=best;
+ if (evaluate(check,2,seed+TUNE_VALIDATION_SEED)!=0) return 1;
+ report(stderr,"start on new kickoffs",&check[0]);
+ report(stderr,"best on new kickoffs",&check[1]);
+
+ rmdir(work_dir);
+ if (save(&best,out_name)!=0)
+ {
+  fprintf(stderr,"aitune: Unable to write the parameters to %s\n",out_name);
+  return 1;
+ }
+ free(cand);
+ return 0;
+}
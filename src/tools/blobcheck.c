@@ -0,0 +1,327 @@
+/***********************************************************************************************************************
+ *
+ * 	blobcheck - Golden output check for the vision kernels. Runs yuyv_to_rgb(), bgSubtract3(), fieldUnwarp2()
+ * 	and blobDetect2() on the frames of each fixture set (see fixture.h) and compares the blobs found with the
+ * 	ones in the blobs.golden kept with it: centroid, size, bounding box, orientation and colour, each within
+ * 	a tolerance. Anything that replaces one of those kernels (SIMD, threads, a different algorithm...) should
+ * 	leave blobcheck passing on the whole corpus (make vision-check, or make check).
+ *
+ * 	Detected blobs are matched to the golden ones by nearest centroid, so the order of the blob list doesn't
+ * 	matter. The orientation of a blob that's nearly round is down to noise, it's only compared for blobs
+ * 	whose long axis is clearly longer than the short one (the elongation kept in blobs.golden).
+ *
+ * 	-w writes blobs.golden from what the current code finds, use it on a tree you trust. -g makes a new
+ * 	fixture set from the synthetic camera and writes its blobs.golden. A fixture set that only has its
+ * 	fixture.txt and blobs.golden (how the synthetic ones are kept in vision-corpus/) gets its frames and
+ * 	calibration made again first, under the -d directory if given (make check uses one in the build
+ * 	directory, so the corpus is never written to), next to fixture.txt otherwise.
+ *
+ * 	Exit status is 0 if every fixture set matches, 1 if any doesn't.
+ *
+ * 	Usage: blobcheck [-w] [-v] [-d work_dir] [-m px] [-c px] [-z percent] [-x px] [-a degrees] [-r levels] [-l hsv]
+ * 	                 fixture_dir...
+ * 	       blobcheck -g fixture_dir [-s WxH] [-n frames] [-S synth_options]
+ *
+ * ********************************************************************************************************************/
+#include "fixture.h"
+#include <math.h>
+
+#define CHECK_MAX_BLOBS 256			// Per frame
+#define CHECK_MIN_ELONGATION 1.2		// Long over short axis (std. dev.) to compare orientations
+#define CHECK_SHOW_DIFFS 10			// Differences listed per fixture set without -v
+
+struct gblob{
+ double cx, cy;
+ int size;
+ int x1, y1, x2, y2;
+ double dx, dy, elong;
+ double R, G, B, H, S, V;
+};
+
+struct frame_blobs{
+ int n;
+ struct gblob b[CHECK_MAX_BLOBS];
+};
+
+static struct frame_blobs found[FIXTURE_MAX_FRAMES], golden[FIXTURE_MAX_FRAMES];
+
+// Tolerances
+static double tol_match=5, tol_centroid=0.5, tol_size=2, tol_bbox=1, tol_angle=2, tol_rgb=2, tol_hsv=0.02;
+static int verbose=0;
+static const char *work_dir=NULL;		// Where fixture sets kept as fixture.txt get their frames (-d)
+
+static double elongation(struct image *labIm, struct blob *bl)
+{
+ // sqrt of the ratio of the eigenvalues of the blob's pixel covariance, as blobDetect2() computes it
+ double c00=0, c01=0, c11=0, x, y, T, D, L1, L2;
+
+ for (int j=bl->y1; j<=bl->y2; j++)
+  for (int i=bl->x1; i<=bl->x2; i++)
+   if (*(labIm->layers[0]+i+(j*labIm->sx))==bl->label)
+   {
+    x=i-bl->cx;
+    y=j-bl->cy;
+    c00+=x*x;
+    c01+=x*y;
+    c11+=y*y;
+   }
+ T=(c00+c11)/bl->size;
+ D=(c00*c11-c01*c01)/((double)bl->size*bl->size);
+ L1=.5*T+sqrt(fmax(T*T/4-D,0));
+ L2=.5*T-sqrt(fmax(T*T/4-D,0));
+ return L2>1e-9?sqrt(L1/L2):1e6;
+}
+
+static int find_blobs(const char *dir)
+{
+ // The loop's vision stages on each frame of the fixture set, blobs into found[]. Returns the frame count
+ static unsigned char *frames[FIXTURE_MAX_FRAMES];
+ char set_dir[1024];
+ struct vdIn vd;
+ struct blob *blobs=NULL, *bl;
+ struct image *labIm;
+ int n, nblobs;
+
+ if (fixture_ensure(dir,work_dir,set_dir,sizeof(set_dir))<0) return -1;
+ n=fixture_load_frames(set_dir,FIXTURE_MAX_FRAMES,frames);
+ if (n<0||fixture_load_calibration(set_dir)<0) return -1;
+ memset(&vd,0,sizeof(vd));
+ vd.width=sx;
+ vd.height=sy;
+ for (int f=0; f<n; f++)
+ {
+  vd.framebuffer=frames[f];
+  yuyv_to_rgb(&vd,sx,sy);
+  bgSubtract3();
+  fieldUnwarp2();
+  labIm=blobDetect2(&blobs,&nblobs);
+  found[f].n=0;
+  for (bl=blobs; bl!=NULL&&found[f].n<CHECK_MAX_BLOBS; bl=bl->next)
+  {
+   struct gblob *g=&found[f].b[found[f].n++];
+   g->cx=bl->cx; g->cy=bl->cy;
+   g->size=bl->size;
+   g->x1=bl->x1; g->y1=bl->y1; g->x2=bl->x2; g->y2=bl->y2;
+   g->dx=bl->dx; g->dy=bl->dy;
+   g->elong=elongation(labIm,bl);
+   g->R=bl->R; g->G=bl->G; g->B=bl->B;
+   g->H=bl->H; g->S=bl->S; g->V=bl->V;
+  }
+  deleteImage(labIm);
+  free(frames[f]);
+ }
+ releaseBlobs(blobs);
+ return n;
+}
+
+static int write_golden(const char *dir, int n)
+{
+ char name[1024];
+ FILE *f;
+
+ snprintf(name,sizeof(name),"%s/blobs.golden",dir);
+ f=fopen(name,"w");
+ if (f==NULL) {fprintf(stderr,"blobcheck: Unable to write %s\n",name); return -1;}
+ fprintf(f,"# blobcheck golden blobs, %dx%d, %d frames\n",sx,sy,n);
+ fprintf(f,"# frame <n> <blobs>, then for each blob:\n");
+ fprintf(f,"# blob cx cy size x1 y1 x2 y2 dx dy elongation R G B H S V\n");
+ for (int i=0; i<n; i++)
+ {
+  fprintf(f,"frame %d %d\n",i,found[i].n);
+  for (int k=0; k<found[i].n; k++)
+  {
+   struct gblob *g=&found[i].b[k];
+   fprintf(f,"blob %.4f %.4f %d %d %d %d %d %.5f %.5f %.3f %.3f %.3f %.3f %.5f %.5f %.5f\n",g->cx,g->cy,g->size,
+	   g->x1,g->y1,g->x2,g->y2,g->dx,g->dy,g->elong,g->R,g->G,g->B,g->H,g->S,g->V);
+  }
+ }
+ fclose(f);
+ fprintf(stderr,"blobcheck: Wrote %s\n",name);
+ return 0;
+}
+
+static int read_golden(const char *dir)
+{
+ // Returns the number of frames in dir/blobs.golden, or -1
+ char name[1024], line[1024];
+ FILE *f;
+ int n=0, fr, nb;
+
+ snprintf(name,sizeof(name),"%s/blobs.golden",dir);
+ f=fopen(name,"r");
+ if (f==NULL) {fprintf(stderr,"blobcheck: Unable to open %s (make one with -w)\n",name); return -1;}
+ fr=-1;
+ while (fgets(line,sizeof(line),f))
+ {
+  if (line[0]=='#') continue;
+  if (sscanf(line,"frame %d %d",&fr,&nb)==2)
+  {
+   if (fr!=n||fr>=FIXTURE_MAX_FRAMES) break;
+   golden[fr].n=0;
+   n++;
+   continue;
+  }
+  struct gblob g;
+  if (fr<0||sscanf(line,"blob %lf %lf %d %d %d %d %d %lf %lf %lf %lf %lf %lf %lf %lf %lf",&g.cx,&g.cy,&g.size,
+		   &g.x1,&g.y1,&g.x2,&g.y2,&g.dx,&g.dy,&g.elong,&g.R,&g.G,&g.B,&g.H,&g.S,&g.V)!=16||golden[fr].n>=CHECK_MAX_BLOBS)
+  {
+   fprintf(stderr,"blobcheck: Can't make sense of %s: %s",name,line);
+   fclose(f);
+   return -1;
+  }
+  golden[fr].b[golden[fr].n++]=g;
+ }
+ fclose(f);
+ return n;
+}
+
+static int differ(const char *dir, int frame, struct gblob *g, const char *what, double want, double got, double tol, int *ndiff)
+{
+ // Counts (and maybe reports) a difference if |got-want|>tol
+ if (fabs(got-want)<=tol) return 0;
+ if (verbose||*ndiff<CHECK_SHOW_DIFFS)
+  printf("%s: frame %d, blob at (%.1f,%.1f): %s %.4f, expected %.4f (tolerance %.4f)\n",dir,frame,g->cx,g->cy,what,got,want,tol);
+ (*ndiff)++;
+ return 1;
+}
+
+static int compare(const char *dir, int n)
+{
+ // Matches found[] against golden[], returns the number of differences
+ int ndiff=0, nblobs=0;
+ int used[CHECK_MAX_BLOBS];
+
+ for (int f=0; f<n; f++)
+ {
+  memset(used,0,sizeof(used));
+  nblobs+=golden[f].n;
+  for (int k=0; k<golden[f].n; k++)
+  {
+   struct gblob *g=&golden[f].b[k], *d;
+   double best=tol_match*tol_match, dd, a;
+   int m=-1;
+   for (int j=0; j<found[f].n; j++)
+   {
+    dd=(found[f].b[j].cx-g->cx)*(found[f].b[j].cx-g->cx)+(found[f].b[j].cy-g->cy)*(found[f].b[j].cy-g->cy);
+    if (!used[j]&&dd<=best) {best=dd; m=j;}
+   }
+   if (m<0)
+   {
+    if (verbose||ndiff<CHECK_SHOW_DIFFS) printf("%s: frame %d, blob at (%.1f,%.1f) size %d is missing\n",dir,f,g->cx,g->cy,g->size);
+    ndiff++;
+    continue;
+   }
+   used[m]=1;
+   d=&found[f].b[m];
+   differ(dir,f,g,"cx",g->cx,d->cx,tol_centroid,&ndiff);
+   differ(dir,f,g,"cy",g->cy,d->cy,tol_centroid,&ndiff);
+   differ(dir,f,g,"size",g->size,d->size,fmax(1,g->size*tol_size/100),&ndiff);
+   differ(dir,f,g,"x1",g->x1,d->x1,tol_bbox,&ndiff);
+   differ(dir,f,g,"y1",g->y1,d->y1,tol_bbox,&ndiff);
+   differ(dir,f,g,"x2",g->x2,d->x2,tol_bbox,&ndiff);
+   differ(dir,f,g,"y2",g->y2,d->y2,tol_bbox,&ndiff);
+   if (g->elong>=CHECK_MIN_ELONGATION)
+   {
+    // The long axis has no sign, compare directions modulo 180 degrees
+    a=fabs(atan2(d->dy,d->dx)-atan2(g->dy,g->dx))*180/PI;
+    a=fmod(a,180);
+    if (a>90) a=180-a;
+    differ(dir,f,g,"orientation error (degrees)",0,a,tol_angle,&ndiff);
+   }
+   differ(dir,f,g,"R",g->R,d->R,tol_rgb,&ndiff);
+   differ(dir,f,g,"G",g->G,d->G,tol_rgb,&ndiff);
+   differ(dir,f,g,"B",g->B,d->B,tol_rgb,&ndiff);
+   differ(dir,f,g,"H",g->H,d->H,tol_hsv,&ndiff);
+   differ(dir,f,g,"S",g->S,d->S,tol_hsv,&ndiff);
+   differ(dir,f,g,"V",g->V,d->V,tol_hsv,&ndiff);
+  }
+  for (int j=0; j<found[f].n; j++)
+   if (!used[j])
+   {
+    if (verbose||ndiff<CHECK_SHOW_DIFFS)
+     printf("%s: frame %d, unexpected blob at (%.1f,%.1f) size %d\n",dir,f,found[f].b[j].cx,found[f].b[j].cy,found[f].b[j].size);
+    ndiff++;
+   }
+ }
+ if (ndiff>CHECK_SHOW_DIFFS&&!verbose) printf("%s: ... %d more (-v lists them all)\n",dir,ndiff-CHECK_SHOW_DIFFS);
+ printf("%s: %d frames, %d blobs, %s\n",dir,n,nblobs,ndiff?"FAILED":"OK");
+ return ndiff;
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"USAGE: blobcheck [-w] [-v] [-d work_dir] [-m px] [-c px] [-z percent] [-x px] [-a degrees] [-r levels] [-l hsv]\n");
+ fprintf(stderr,"                 fixture_dir...\n");
+ fprintf(stderr,"       blobcheck -g fixture_dir [-s WxH] [-n frames] [-S synth_options]\n");
+ fprintf(stderr,"  -w  write blobs.golden from what the current code finds, instead of checking\n");
+ fprintf(stderr,"  -v  list every difference\n");
+ fprintf(stderr,"  -d  make the frames of fixture sets kept as fixture.txt under this directory (default next to it)\n");
+ fprintf(stderr,"  -m  farthest a blob can be from the golden one and still be the same blob (default 5 px)\n");
+ fprintf(stderr,"  -c  centroid tolerance (default 0.5 px)\n");
+ fprintf(stderr,"  -z  size tolerance (default 2%%, at least 1 px)\n");
+ fprintf(stderr,"  -x  bounding box tolerance (default 1 px)\n");
+ fprintf(stderr,"  -a  orientation tolerance (default 2 degrees)\n");
+ fprintf(stderr,"  -r  average R,G,B tolerance (default 2 levels)\n");
+ fprintf(stderr,"  -l  average H (radians), S, V tolerance (default 0.02)\n");
+ fprintf(stderr,"  -g  make a fixture set from the synthetic camera in this directory, and its blobs.golden\n");
+ fprintf(stderr,"  -s  frame size for -g (default 1024x768)\n");
+ fprintf(stderr,"  -n  frames for -g (default 8)\n");
+ fprintf(stderr,"  -S  synthetic camera options for -g, e.g. bots=4,noise=5 (see synthCam.h)\n");
+ exit(1);
+}
+
+int main(int argc, char **argv)
+{
+ const char *gen_dir=NULL, *options="";
+ int opt, write_mode=0, n=8, width=1024, height=768, failed=0;
+
+ while ((opt=getopt(argc,argv,"wvd:m:c:z:x:a:r:l:g:s:n:S:"))!=-1)
+  switch (opt)
+  {
+   case 'w': write_mode=1; break;
+   case 'v': verbose=1; break;
+   case 'd': work_dir=optarg; break;
+   case 'm': tol_match=atof(optarg); break;
+   case 'c': tol_centroid=atof(optarg); break;
+   case 'z': tol_size=atof(optarg); break;
+   case 'x': tol_bbox=atof(optarg); break;
+   case 'a': tol_angle=atof(optarg); break;
+   case 'r': tol_rgb=atof(optarg); break;
+   case 'l': tol_hsv=atof(optarg); break;
+   case 'g': gen_dir=optarg; break;
+   case 's': if (sscanf(optarg,"%dx%d",&width,&height)!=2) usage(); break;
+   case 'n': n=atoi(optarg); break;
+   case 'S': options=optarg; break;
+   default: usage();
+  }
+ initFrameStages();
+ if (gen_dir!=NULL)
+ {
+  if (optind!=argc||n<1||n>FIXTURE_MAX_FRAMES||width<2||height<2) usage();
+  if (fixture_generate(gen_dir,width,height,n,options)<0||(n=find_blobs(gen_dir))<0) return 1;
+  return write_golden(gen_dir,n)<0;
+ }
+ if (optind>=argc) usage();
+
+ for (int i=optind; i<argc; i++)
+ {
+  const char *dir=argv[i];
+  int nf=find_blobs(dir), ng;
+  if (nf<0) {failed++; continue;}
+  if (write_mode)
+  {
+   if (write_golden(dir,nf)<0) failed++;
+   continue;
+  }
+  ng=read_golden(dir);
+  if (ng<0) {failed++; continue;}
+  if (ng!=nf)
+  {
+   printf("%s: %d frames, blobs.golden has %d, FAILED\n",dir,nf,ng);
+   failed++;
+   continue;
+  }
+  if (compare(dir,nf)) failed++;
+ }
+ return failed>0;
+}
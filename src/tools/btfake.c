@@ -0,0 +1,198 @@
+/***********************************************************************************************************************
+ *
+ * 	btfake - Stand-in for the BT library for tools that run the AI without a robot, see btfake.h
+ *
+ * ********************************************************************************************************************/
+#include "btfake.h"
+
+long long fake_now=0;
+struct fake_cmd fake_cmds[FAKE_MAX_CMDS];
+int fake_n_cmds=0;
+unsigned int fake_events_active=0;
+int fake_transitions[2*TELEMETRY_MAX_TRANSITIONS];
+int fake_n_transitions=0;
+int fake_ai_done=0;
+
+int sx=1024;					// Image size, normally from imageCapture.c
+int sy=768;
+
+struct fake_port{
+ int power;					// Last power requested
+ int timed_power;				// Power while a timed manoeuvre runs
+ long long timed_end;				// When it ends (fake_now clock), 0 if none
+};
+
+static struct BT_sensor_reading fake_sensor[BT_SENSOR_COUNT];
+static struct fake_port fake_port[4];		// A..D
+static unsigned int fake_urgent=0;		// All-stops so far, see BT_urgent_epoch()
+
+static void fake_cmd(int kind, int ports, int a, int b)
+{
+ if (fake_n_cmds<FAKE_MAX_CMDS) fake_cmds[fake_n_cmds]=(struct fake_cmd){kind,ports,a,b};
+ fake_n_cmds++;
+}
+
+static void fake_set(int ports, int power)
+{
+ for (int i=0; i<4; i++)
+  if (ports&(1<<i)) fake_port[i].power=power;
+}
+
+void fake_reset(void)
+{
+ // Everything back to power-on: motors off, no readings, nothing logged
+ memset(fake_sensor,0,sizeof(fake_sensor));
+ memset(fake_port,0,sizeof(fake_port));
+ fake_ai_done=0;
+ fake_frame_begin();
+}
+
+void fake_frame_begin(void)
+{
+ fake_n_cmds=0;
+ fake_events_active=0;
+ fake_n_transitions=0;
+}
+
+void fake_publish(int sensor, int v0, int v1, int v2, int status, long long timestamp)
+{
+ // Publish a reading, as the sensor poller does after each poll
+ if (sensor<0||sensor>=BT_SENSOR_COUNT) return;
+ fake_sensor[sensor].value[0]=v0;
+ fake_sensor[sensor].value[1]=v1;
+ fake_sensor[sensor].value[2]=v2;
+ fake_sensor[sensor].status=status;
+ fake_sensor[sensor].timestamp=timestamp;
+ fake_sensor[sensor].count++;
+}
+
+int fake_motor_power(int port)
+{
+ // Power the motor on port (MOTOR_A..MOTOR_D) is running at right now
+ for (int i=0; i<4; i++)
+  if (port==(1<<i))
+  {
+   if (fake_port[i].timed_end>fake_now) return fake_port[i].timed_power;
+   return fake_port[i].power;
+  }
+ return 0;
+}
+
+/******************************************************************************************
+ * BT library - only what roboAI.c and estimator.c use
+ * ***************************************************************************************/
+
+long long BT_sensor_time_us(void) {return fake_now;}
+int BT_sensor_poll_start(int touch_port, int colour_port, int gyro_port, int ultrasonic_port, int rate_hz) {return 0;}
+int BT_sensor_poll_tachos(int left_motor, int right_motor) {return 0;}
+int BT_motor_sender_start(int rate_hz) {return 0;}
+void BT_motor_origin(long long capture_us) {}
+
+int BT_sensor_latest(int sensor, struct BT_sensor_reading *r)
+{
+ if (sensor<0||sensor>=BT_SENSOR_COUNT) return -1;
+ *r=fake_sensor[sensor];
+ return 0;
+}
+
+int BT_read_touch_sensor(char sensor_port) {return fake_sensor[BT_SENSOR_TOUCH].value[0];}
+
+int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3])
+{
+ memcpy(RGB,fake_sensor[BT_SENSOR_COLOUR_RGB].value,3*sizeof(int));
+ return 0;
+}
+
+int BT_motor_set_power(char port_ids, char power)
+{
+ fake_set(port_ids,power);
+ fake_cmd(TLM_MOTOR_POWER,port_ids,power,0);
+ return 0;
+}
+
+int BT_motor_set_stop(char port_ids, int brake_mode)
+{
+ fake_set(port_ids,0);
+ fake_cmd(TLM_MOTOR_STOP,port_ids,0,0);
+ return 0;
+}
+
+int BT_motor_port_start(char port_ids, char power) {return BT_motor_set_power(port_ids,power);}
+int BT_motor_port_stop(char port_ids, int brake_mode) {return BT_motor_set_stop(port_ids,brake_mode);}
+int BT_drive(char lport, char rport, char power) {return BT_motor_set_power(lport|rport,power);}
+
+int BT_motor_set_steer(char lport, char rport, char lpower, char rpower)
+{
+ fake_set(lport,lpower);
+ fake_set(rport,rpower);
+ fake_cmd(TLM_MOTOR_STEER,lport|rport,lpower,rpower);
+ return 0;
+}
+
+int BT_motor_timed(char port_ids, char power, int duration_ms, int brake_mode)
+{
+ // The ports end up stopped, later requests apply once the manoeuvre is over
+ for (int i=0; i<4; i++)
+  if (port_ids&(1<<i))
+  {
+   fake_port[i].timed_power=power;
+   fake_port[i].timed_end=fake_now+duration_ms*1000LL;
+   fake_port[i].power=0;
+  }
+ fake_cmd(TLM_MOTOR_TIMED,port_ids,power,duration_ms);
+ return 0;
+}
+
+int BT_motor_timed_pair(char lport, char rport, char lpower, char rpower, int duration_ms, int lbrake, int rbrake)
+{
+ BT_motor_timed(lport,lpower,duration_ms,lbrake);
+ return BT_motor_timed(rport,rpower,duration_ms,rbrake);
+}
+
+int BT_motor_manoeuvre_active(char port_ids)
+{
+ for (int i=0; i<4; i++)
+  if ((port_ids&(1<<i))&&fake_port[i].timed_end>fake_now) return 1;
+ return 0;
+}
+
+int BT_all_stop(int brake_mode)
+{
+ memset(fake_port,0,sizeof(fake_port));
+ fake_urgent++;
+ fake_cmd(TLM_MOTOR_ALL_STOP,0,0,0);
+ return 0;
+}
+
+unsigned int BT_urgent_epoch(void) {return fake_urgent;}
+
+void kbHandler(unsigned char key, int x, int y)
+{
+ // The AI presses 'r' when it's finished (STATE_P_done), which stops it in roboSoccer too
+ if (key=='r') fake_ai_done=1;
+}
+
+/******************************************************************************************
+ * Telemetry hooks - the AI reports its events and transitions here instead of to a log
+ * ***************************************************************************************/
+
+int telemetry_start(const char *filename) {return -1;}
+int telemetry_stop(void) {return -1;}
+int telemetry_running(void) {return 0;}
+void telemetry_motor(int kind, int ports, int a, int b) {}
+void telemetry_frame(struct RoboAI *ai, struct blob *blobs) {}
+
+void telemetry_event(int event, int active)
+{
+ if (active&&event/2<32) fake_events_active|=1u<<(event/2);
+}
+
+void telemetry_transition(int from, int to)
+{
+ if (fake_n_transitions<TELEMETRY_MAX_TRANSITIONS)
+ {
+  fake_transitions[2*fake_n_transitions]=from;
+  fake_transitions[2*fake_n_transitions+1]=to;
+ }
+ fake_n_transitions++;
+}
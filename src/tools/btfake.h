@@ -0,0 +1,42 @@
+/***********************************************************************************************************************
+ *
+ * 	btfake - Stand-in for the BT library (btcomm/btsensors/btmotors) and the telemetry hooks, for tools that
+ * 	run roboAI.c without a robot (aireplay, fieldsim). Linked instead of the API sources and telemetry.c.
+ *
+ * 	Time is whatever the tool sets fake_now to. The sensor poller cache holds whatever the tool publishes
+ * 	with fake_publish(). Motor commands are collected in fake_cmds (cleared by fake_frame_begin()) and
+ * 	tracked per port, so a simulator can ask what power each motor is running at with fake_motor_power().
+ * 	Timed manoeuvres run against fake_now, power requests for ports in a manoeuvre are held back until it
+ * 	is over, as the motor sender does. The AI's telemetry_event()/telemetry_transition() calls end up in
+ * 	fake_events_active and fake_transitions.
+ *
+ * 	Single threaded, the AI must be run stepped (AI_stepped).
+ *
+ * ********************************************************************************************************************/
+#ifndef __btfake_header
+#define __btfake_header
+
+#include "../roboAI.h"
+
+#define FAKE_MAX_CMDS 64			// Motor commands kept per frame
+
+struct fake_cmd{
+ int kind;					// TLM_MOTOR_*
+ int ports, a, b;
+};
+
+extern long long fake_now;			// Virtual time (us), what BT_sensor_time_us() returns
+extern struct fake_cmd fake_cmds[FAKE_MAX_CMDS];
+extern int fake_n_cmds;				// Commands since fake_frame_begin() (may exceed FAKE_MAX_CMDS)
+extern unsigned int fake_events_active;		// Events that came out as wanted since fake_frame_begin()
+extern int fake_transitions[2*TELEMETRY_MAX_TRANSITIONS];	// from, to
+extern int fake_n_transitions;
+extern int fake_ai_done;			// The AI asked to be stopped (pressed 'r', see kbHandler())
+extern int sx, sy;				// Image size the AI works in
+
+void fake_reset(void);
+void fake_frame_begin(void);
+void fake_publish(int sensor, int v0, int v1, int v2, int status, long long timestamp);
+int fake_motor_power(int port);
+
+#endif
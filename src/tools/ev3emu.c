@@ -0,0 +1,687 @@
+/***********************************************************************************************************************
+ *
+ * 	ev3emu - Local EV3 stand-in for the BT library. Listens on a UNIX domain or TCP socket, accepts the same
+ * 	direct command byte stream BT_open() would send over RFCOMM (connect with "unix:/path" or
+ * 	"tcp:host:port"), decodes the opcodes from bytecodes.h that the library uses, and replies with the
+ * 	same framing the brick uses (length, counter, status, global memory).
+ *
+ * 	Simulated hardware:
+ * 	  - 4 motors (A-D) with power, start/stop, timed and synchronised runs and tacho counts (~10 deg/s
+ * 	    per % power)
+ * 	  - touch sensor, pressed while the shooter motor (-T, default D) is retracted (tacho <= 0)
+ * 	  - colour sensor, returns the raw RGB set with -c plus a little noise
+ * 	  - gyro, integrates the difference between the drive motors A and B
+ * 	  - ultrasonic, always reads 255
+ *
+ * 	Link impairment (applied to every command, replies are still delivered in order):
+ * 	  -l latency_ms   one way delay before a command executes
+ * 	  -j jitter_ms    extra uniformly distributed delay in [0, jitter]
+ * 	  -d drop_pct     percentage of commands lost (not executed, no reply)
+ * 	  -b bytes_per_s  link throughput limit (RFCOMM on the EV3 manages roughly 20-50 KB/s)
+ *
+ * 	Commands are executed one at a time in arrival order, same as the brick. opTIMER_READY blocks the
+ * 	emulator for the requested time, just like it blocks the brick's direct command slot.
+ *
+ * 	Usage: ev3emu [-u socket_path | -t tcp_port] [-l ms] [-j ms] [-d pct] [-b bytes/s] [-c r,g,b] [-T port] [-v]
+ *
+ * ********************************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../API/bytecodes.h"
+
+#define EMU_QUEUE 256				// Max. commands received but not yet executed
+#define EMU_DEG_PER_PCT 10.0			// Motor speed in deg/s per % power (EV3 large motor, no load)
+#define EMU_GYRO_RATIO 0.25			// Robot heading change per degree of wheel rotation difference
+#define EMU_STATUS_OK 0x02
+#define EMU_STATUS_ERROR 0x04
+
+struct emu_frame{
+ unsigned char data[1024];			// Full command string, including the length field
+ int len;
+ long long due;				// Time (us) at which the command executes
+};
+
+struct emu_motor{
+ int power;
+ int running;
+ double position;				// Tacho count in degrees
+ long long stop_at;				// Time (us) at which a timed run ends, 0 if none
+ int stop_brake;
+};
+
+struct emu_param{
+ int is_var;
+ int global;
+ int index;					// Memory offset for variables
+ int value;					// Value for constants
+ const char *str;				// Constant strings
+};
+
+// Link impairment settings
+static int latency_ms=0, jitter_ms=0, drop_pct=0, bytes_per_s=0, verbose=0;
+
+// Simulated brick
+static struct emu_motor motors[4];
+static long long sim_time=0;
+static double gyro_angle=0;
+static int colour_raw[3]={300,300,300};
+static int touch_motor=3;
+
+// Command queue between the socket reader and the executor
+static struct emu_frame queue[EMU_QUEUE];
+static int q_head=0, q_count=0, q_closed=0;
+static pthread_mutex_t q_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_cond=PTHREAD_COND_INITIALIZER;
+
+// Statistics
+static long long n_commands=0, n_replies=0, n_dropped=0, n_errors=0, n_bytes=0;
+static long long op_count[256];
+
+static long long now_us(void)
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000000LL+ts.tv_nsec/1000);
+}
+
+static void sleep_until(long long t)
+{
+ struct timespec ts;
+ ts.tv_sec=t/1000000LL;
+ ts.tv_nsec=(t%1000000LL)*1000;
+ while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR);
+}
+
+static void motor_apply_stop(int i)
+{
+ // Brake and coast are the same thing here, the simulated motors have no inertia
+ motors[i].running=0;
+ motors[i].stop_at=0;
+}
+
+static void simulate(long long t)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Advance the simulation to time t. Timed runs that end before t are integrated up to their
+ // end time so tacho counts come out right regardless of how often we're called.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ double dt, speed[4];
+ long long end;
+
+ if (sim_time==0) sim_time=t;
+ for (int i=0; i<4; i++)
+ {
+  speed[i]=0;
+  if (!motors[i].running) continue;
+  end=t;
+  if (motors[i].stop_at!=0&&motors[i].stop_at<t) end=motors[i].stop_at;
+  dt=(end-sim_time)/1e6;
+  if (dt<0) dt=0;
+  speed[i]=motors[i].power*EMU_DEG_PER_PCT;
+  motors[i].position+=speed[i]*dt;
+  if (i==touch_motor&&motors[i].position<0) motors[i].position=0;	// Mechanical stop of the shooter
+  if (motors[i].stop_at!=0&&motors[i].stop_at<=t) motor_apply_stop(i);
+ }
+ // Left drive is A, right drive is B. Left faster than right turns clockwise (positive on the gyro)
+ gyro_angle+=(speed[0]-speed[1])*EMU_GYRO_RATIO*((t-sim_time)/1e6);
+ sim_time=t;
+}
+
+static int get_param(const unsigned char *cmd, int len, int *pos, struct emu_param *p)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Decode one opcode parameter (see the PRIMPAR_* encoding in bytecodes.h). Short format is a
+ // single byte with a 6 bit signed constant or a 5 bit variable index, long format is a type
+ // byte followed by 1, 2 or 4 little endian bytes, or a zero terminated string.
+ // Returns 0 on success, -1 if the command string ends in the middle of the parameter.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char b;
+ int n, v;
+
+ if (*pos>=len) return(-1);
+ b=cmd[(*pos)++];
+ memset(p,0,sizeof(struct emu_param));
+
+ if (!(b&PRIMPAR_LONG))
+ {
+  if (b&PRIMPAR_VARIABEL)
+  {
+   p->is_var=1;
+   p->global=(b&PRIMPAR_GLOBAL)!=0;
+   p->index=b&PRIMPAR_INDEX;
+  }
+  else
+  {
+   v=b&PRIMPAR_VALUE;
+   if (v&PRIMPAR_CONST_SIGN) v-=64;
+   p->value=v;
+  }
+  return(0);
+ }
+
+ if ((b&PRIMPAR_BYTES)==PRIMPAR_STRING&&!(b&PRIMPAR_VARIABEL))
+ {
+  p->str=(const char *)&cmd[*pos];
+  while (*pos<len&&cmd[*pos]!=0) (*pos)++;
+  if (*pos>=len) return(-1);
+  (*pos)++;
+  return(0);
+ }
+
+ switch(b&PRIMPAR_BYTES)
+ {
+  case PRIMPAR_1_BYTE: n=1; break;
+  case PRIMPAR_2_BYTES: n=2; break;
+  case PRIMPAR_4_BYTES: n=4; break;
+  default: n=1; break;
+ }
+ if (*pos+n>len) return(-1);
+ if (n==1) v=(signed char)cmd[*pos];
+ else if (n==2) v=(short)(cmd[*pos]|(cmd[*pos+1]<<8));
+ else v=(int)((unsigned)cmd[*pos]|((unsigned)cmd[*pos+1]<<8)|((unsigned)cmd[*pos+2]<<16)|((unsigned)cmd[*pos+3]<<24));
+ *pos+=n;
+
+ if (b&PRIMPAR_VARIABEL)
+ {
+  p->is_var=1;
+  p->global=(b&PRIMPAR_GLOBAL)!=0;
+  p->index=(n==1)?(v&0xFF):(n==2)?(v&0xFFFF):v;
+ }
+ else p->value=v;
+ return(0);
+}
+
+static int store_var(struct emu_param *p, int value, int size, unsigned char *global, int global_size, unsigned char *local, int local_size)
+{
+ // Write a DATA8/DATA32 result into the global (reply) or local memory referenced by p
+ unsigned char *mem=p->global?global:local;
+ int mem_size=p->global?global_size:local_size;
+
+ if (!p->is_var) return(-1);
+ for (int i=0; i<size; i++)
+  if (p->index+i<mem_size) mem[p->index+i]=(value>>(8*i))&0xFF;
+ return(0);
+}
+
+static int load_var(struct emu_param *p, unsigned char *global, int global_size, unsigned char *local, int local_size)
+{
+ // Value of a parameter, constants are returned as-is, variables are read as DATA32
+ unsigned char *mem=p->global?global:local;
+ int mem_size=p->global?global_size:local_size;
+ unsigned int v=0;
+
+ if (!p->is_var) return(p->value);
+ for (int i=0; i<4; i++)
+  if (p->index+i<mem_size) v|=(unsigned int)mem[p->index+i]<<(8*i);
+ return((int)v);
+}
+
+static int sensor_value(int type, int mode, int n, double *v)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Simulated readings for a sensor of the given type. The emulator doesn't care which port a
+ // sensor is read on, the device type in the command decides what comes back.
+ // Returns the number of values written to v.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ switch(type)
+ {
+  case 16:					// Touch
+   v[0]=(motors[touch_motor].position<=0)?100:0;
+   return(1);
+  case 29:					// Colour, mode 4 is raw RGB
+   if (mode==4)
+   {
+    for (int i=0; i<3&&i<n; i++)
+     v[i]=colour_raw[i]+(rand()%21)-10;
+    return(n<3?n:3);
+   }
+   // Colour mode, a crude classification of the raw reading: 1 black, 2 blue, 3 green, 5 red, 6 white
+   if (colour_raw[0]<100&&colour_raw[1]<100&&colour_raw[2]<100) v[0]=1;
+   else if (colour_raw[0]>600&&colour_raw[1]>600&&colour_raw[2]>600) v[0]=6;
+   else if (colour_raw[0]>=colour_raw[1]&&colour_raw[0]>=colour_raw[2]) v[0]=5;
+   else if (colour_raw[1]>=colour_raw[2]) v[0]=3;
+   else v[0]=2;
+   return(1);
+  case 30:					// Ultrasonic
+   v[0]=255;
+   return(1);
+  default:					// Gyro (READEXT with type 0 = don't change)
+   v[0]=gyro_angle;
+   return(1);
+ }
+}
+
+static int execute(const unsigned char *cmd, int len, unsigned char *global, int global_size, unsigned char *local, int local_size)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Run the opcodes in a direct command against the simulated brick.
+ // Returns 0 on success, -1 on an unknown opcode or a malformed command (error reply).
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ struct emu_param p[8];
+ double v[8];
+ int pos=7, op, sub, nos, n, size, lo, hi;
+ long long t=now_us();
+
+ simulate(t);
+ while (pos<len)
+ {
+  op=cmd[pos++];
+  op_count[op]++;
+  switch(op)
+  {
+   case opOUTPUT_POWER:
+   case opOUTPUT_SPEED:
+    for (int i=0; i<3; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    nos=p[1].value;
+    for (int i=0; i<4; i++)
+     if (nos&(1<<i)) motors[i].power=p[2].value;
+    break;
+   case opOUTPUT_START:
+    for (int i=0; i<2; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    for (int i=0; i<4; i++)
+     if (p[1].value&(1<<i))
+     {
+      motors[i].running=1;
+      motors[i].stop_at=0;
+     }
+    break;
+   case opOUTPUT_STOP:
+    for (int i=0; i<3; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    for (int i=0; i<4; i++)
+     if (p[1].value&(1<<i)) motor_apply_stop(i);
+    break;
+   case opOUTPUT_TIME_POWER:
+   case opOUTPUT_TIME_SPEED:
+    // layer, ports, power, ramp up ms, run ms, ramp down ms, brake. Ramps are treated as full power.
+    for (int i=0; i<7; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    for (int i=0; i<4; i++)
+     if (p[1].value&(1<<i))
+     {
+      motors[i].power=p[2].value;
+      motors[i].running=1;
+      motors[i].stop_at=t+1000LL*(p[3].value+p[4].value+p[5].value);
+      motors[i].stop_brake=p[6].value;
+     }
+    break;
+   case opOUTPUT_TIME_SYNC:
+   case opOUTPUT_STEP_SYNC:
+    // layer, ports (two), speed, turn, time ms / step degrees (0 runs forever), brake. The lower
+    // numbered port runs at speed and the other at speed*(100-turn)/100, swapped for turn<0.
+    for (int i=0; i<6; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    nos=p[1].value&0x0F;
+    if (nos==0||(nos&(nos-1))==0) return(-1);
+    lo=__builtin_ctz(nos);
+    hi=31-__builtin_clz(nos);
+    if (p[3].value<-200||p[3].value>200) return(-1);
+    motors[lo].power=(p[3].value>=0)?p[2].value:p[2].value*(100+p[3].value)/100;
+    motors[hi].power=(p[3].value>=0)?p[2].value*(100-p[3].value)/100:p[2].value;
+    for (int i=0; i<4; i++)
+     if (nos&(1<<i))
+     {
+      motors[i].running=1;
+      motors[i].stop_at=0;
+      motors[i].stop_brake=p[5].value;
+      if (p[4].value>0&&op==opOUTPUT_TIME_SYNC) motors[i].stop_at=t+1000LL*p[4].value;
+      if (p[4].value>0&&op==opOUTPUT_STEP_SYNC&&p[2].value!=0)
+       motors[i].stop_at=t+(long long)(1e6*p[4].value/(abs(p[2].value)*EMU_DEG_PER_PCT));
+     }
+    break;
+   case opOUTPUT_RESET:
+   case opOUTPUT_CLR_COUNT:
+    for (int i=0; i<2; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    for (int i=0; i<4; i++)
+     if (p[1].value&(1<<i)) motors[i].position=0;
+    break;
+   case opOUTPUT_GET_COUNT:
+    // layer, port number (0-3), DATA32 tacho count
+    for (int i=0; i<3; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    if (p[1].value<0||p[1].value>3) return(-1);
+    store_var(&p[2],(int)motors[p[1].value].position,4,global,global_size,local,local_size);
+    break;
+   case opINPUT_DEVICE:
+    if (get_param(cmd,len,&pos,&p[0])<0) return(-1);
+    sub=p[0].value;
+    if (sub==CLR_ALL)
+    {
+     if (get_param(cmd,len,&pos,&p[1])<0) return(-1);
+     gyro_angle=0;
+    }
+    else if (sub==CLR_CHANGES)
+    {
+     for (int i=1; i<3; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    }
+    else if (sub==READY_PCT||sub==READY_RAW||sub==READY_SI)
+    {
+     // layer, port, type, mode, number of values, then one variable per value
+     for (int i=1; i<6; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+     n=p[5].value;
+     if (n<1||n>8) return(-1);
+     for (int i=0; i<8; i++) v[i]=0;
+     sensor_value(p[3].value,p[4].value,n,&v[0]);
+     size=(sub==READY_PCT)?1:4;			// PCT is DATA8, RAW is DATA32 (SI would be DATAF)
+     for (int i=0; i<n; i++)
+     {
+      if (get_param(cmd,len,&pos,&p[6])<0) return(-1);
+      store_var(&p[6],(int)v[i],size,global,global_size,local,local_size);
+     }
+    }
+    else
+    {
+     if (verbose) fprintf(stderr,"ev3emu: Unsupported opINPUT_DEVICE sub-command %d\n",sub);
+     return(-1);
+    }
+    break;
+   case opINPUT_READEXT:
+    // layer, port, type, mode, format, number of values, then one variable per value
+    for (int i=0; i<6; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    n=p[5].value;
+    if (n<1||n>8) return(-1);
+    for (int i=0; i<8; i++) v[i]=0;
+    sensor_value(p[2].value,p[3].value,n,&v[0]);
+    size=(p[4].value==DATA_PCT)?1:4;
+    for (int i=0; i<n; i++)
+    {
+     if (get_param(cmd,len,&pos,&p[6])<0) return(-1);
+     store_var(&p[6],(int)v[i],size,global,global_size,local,local_size);
+    }
+    break;
+   case opTIMER_WAIT:
+    // time in ms, timer variable (we store the absolute deadline in ms there)
+    for (int i=0; i<2; i++) if (get_param(cmd,len,&pos,&p[i])<0) return(-1);
+    store_var(&p[1],(int)((t/1000)+p[0].value),4,global,global_size,local,local_size);
+    break;
+   case opTIMER_READY:
+    // Blocks the brick until the timer variable's deadline, nothing else runs meanwhile
+    if (get_param(cmd,len,&pos,&p[0])<0) return(-1);
+    n=load_var(&p[0],global,global_size,local,local_size);
+    if ((long long)n*1000>t)
+    {
+     sleep_until((long long)n*1000);
+     t=now_us();
+     simulate(t);
+    }
+    break;
+   case opSOUND:
+    if (get_param(cmd,len,&pos,&p[0])<0) return(-1);
+    if (p[0].value==TONE) n=3;			// volume, frequency, duration
+    else if (p[0].value==PLAY) n=2;		// volume, file name
+    else n=0;					// BREAK
+    for (int i=0; i<n; i++) if (get_param(cmd,len,&pos,&p[1])<0) return(-1);
+    break;
+   case opSOUND_READY:
+    break;
+   case opCOM_SET:
+    if (get_param(cmd,len,&pos,&p[0])<0) return(-1);
+    if (p[0].value!=SET_BRICKNAME) return(-1);
+    if (get_param(cmd,len,&pos,&p[1])<0) return(-1);
+    if (verbose) fprintf(stderr,"ev3emu: Brick name set to %s\n",p[1].str?p[1].str:"");
+    break;
+   default:
+    if (verbose) fprintf(stderr,"ev3emu: Unsupported opcode 0x%02X at offset %d\n",op,pos-1);
+    return(-1);
+  }
+ }
+ return(0);
+}
+
+static int write_full(int fd, const unsigned char *buf, int len)
+{
+ int n;
+ while (len>0)
+ {
+  n=write(fd,buf,len);
+  if (n<0&&errno==EINTR) continue;
+  if (n<=0) return(-1);
+  buf+=n;
+  len-=n;
+ }
+ return(0);
+}
+
+static int read_full(int fd, unsigned char *buf, int len)
+{
+ int n;
+ while (len>0)
+ {
+  n=read(fd,buf,len);
+  if (n<0&&errno==EINTR) continue;
+  if (n<=0) return(-1);
+  buf+=n;
+  len-=n;
+ }
+ return(0);
+}
+
+static void *executor_loop(void *arg)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Executes queued commands in order once they are due and writes the replies.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ int fd=*(int *)arg;
+ struct emu_frame f;
+ unsigned char reply[1030], local[64];
+ int global_size, local_size, status;
+
+ while (1)
+ {
+  pthread_mutex_lock(&q_mutex);
+  while (q_count==0&&!q_closed) pthread_cond_wait(&q_cond,&q_mutex);
+  if (q_count==0)
+  {
+   pthread_mutex_unlock(&q_mutex);
+   break;
+  }
+  f=queue[q_head];
+  q_head=(q_head+1)%EMU_QUEUE;
+  q_count--;
+  pthread_cond_broadcast(&q_cond);
+  pthread_mutex_unlock(&q_mutex);
+
+  sleep_until(f.due);
+
+  global_size=f.data[5]|((f.data[6]&0x03)<<8);
+  local_size=f.data[6]>>2;
+  memset(&reply[0],0,sizeof(reply));
+  memset(&local[0],0,sizeof(local));
+
+  if ((f.data[4]&0x7F)!=0x00)
+  {
+   status=0x05;					// System commands are not supported
+   global_size=0;
+  }
+  else status=(execute(&f.data[0],f.len,&reply[5],global_size,&local[0],local_size)==0)?EMU_STATUS_OK:EMU_STATUS_ERROR;
+  if (status!=EMU_STATUS_OK) n_errors++;
+
+  if (f.data[4]&0x80) continue;			// No reply requested
+  reply[0]=(3+global_size)&0xFF;
+  reply[1]=((3+global_size)>>8)&0xFF;
+  reply[2]=f.data[2];
+  reply[3]=f.data[3];
+  reply[4]=status;
+  // If the client went away keep draining the queue so the reader never blocks on a full queue
+  if (write_full(fd,&reply[0],5+global_size)==0) n_replies++;
+ }
+ return(NULL);
+}
+
+static void serve(int fd)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ // Handle one client connection. This thread reads framed commands and timestamps them on
+ // arrival, the executor runs them once the simulated link delay has passed. Keeping the
+ // two apart means pipelined commands overlap their latency the way they would on a real link.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ pthread_t executor;
+ struct emu_frame f;
+ long long last_due=0, last_tx=0, due, t;
+ int len;
+
+ q_head=q_count=q_closed=0;
+ pthread_create(&executor,NULL,executor_loop,&fd);
+
+ while (1)
+ {
+  if (read_full(fd,&f.data[0],2)<0) break;
+  len=f.data[0]|(f.data[1]<<8);
+  if (len<5||len>1022)
+  {
+   fprintf(stderr,"ev3emu: Bad frame length %d, dropping connection\n",len);
+   break;
+  }
+  if (read_full(fd,&f.data[2],len)<0) break;
+  f.len=len+2;
+  n_commands++;
+  n_bytes+=f.len;
+
+  if (drop_pct>0&&rand()%100<drop_pct)
+  {
+   n_dropped++;
+   continue;
+  }
+
+  // Transmission time serializes commands on the link, latency and jitter overlap
+  t=now_us();
+  if (bytes_per_s>0)
+  {
+   if (last_tx>t) t=last_tx;
+   t+=1000000LL*f.len/bytes_per_s;
+   last_tx=t;
+  }
+  due=t+1000LL*latency_ms;
+  if (jitter_ms>0) due+=rand()%(1000*jitter_ms+1);
+  if (due<last_due) due=last_due;		// The link delivers in order
+  last_due=due;
+  f.due=due;
+
+  pthread_mutex_lock(&q_mutex);
+  while (q_count==EMU_QUEUE) pthread_cond_wait(&q_cond,&q_mutex);
+  queue[(q_head+q_count)%EMU_QUEUE]=f;
+  q_count++;
+  pthread_cond_broadcast(&q_cond);
+  pthread_mutex_unlock(&q_mutex);
+ }
+
+ pthread_mutex_lock(&q_mutex);
+ q_closed=1;
+ pthread_cond_broadcast(&q_cond);
+ pthread_mutex_unlock(&q_mutex);
+ shutdown(fd,SHUT_RDWR);
+ pthread_join(executor,NULL);
+ close(fd);
+
+ fprintf(stderr,"ev3emu: Connection closed. %lld commands (%lld bytes), %lld replies, %lld dropped, %lld errors\n",
+         n_commands,n_bytes,n_replies,n_dropped,n_errors);
+ if (verbose)
+  for (int i=0; i<256; i++)
+   if (op_count[i]>0) fprintf(stderr,"  opcode 0x%02X: %lld\n",i,op_count[i]);
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"USAGE: ev3emu [-u socket_path | -t tcp_port] [-l latency_ms] [-j jitter_ms] [-d drop_pct]\n");
+ fprintf(stderr,"              [-b bytes_per_s] [-c r,g,b] [-T shooter_port] [-v]\n");
+ fprintf(stderr,"  -u  UNIX socket to listen on (default /tmp/ev3emu.sock), connect with unix:<path>\n");
+ fprintf(stderr,"  -t  TCP port to listen on (loopback only), connect with tcp:127.0.0.1:<port>\n");
+ fprintf(stderr,"  -l  one way latency per command in ms\n");
+ fprintf(stderr,"  -j  extra random delay per command in [0, jitter] ms\n");
+ fprintf(stderr,"  -d  percentage of commands dropped\n");
+ fprintf(stderr,"  -b  link throughput limit in bytes/s\n");
+ fprintf(stderr,"  -c  raw colour sensor reading, each in [0, 1020]\n");
+ fprintf(stderr,"  -T  motor port (A-D) whose retracted position presses the touch sensor (default D)\n");
+ fprintf(stderr,"  -v  print unsupported opcodes and per-opcode counts\n");
+ exit(1);
+}
+
+int main(int argc, char **argv)
+{
+ const char *path="/tmp/ev3emu.sock";
+ int tcp_port=0, lfd, fd, opt, one=1;
+ struct sockaddr_un un;
+ struct sockaddr_in in;
+
+ while ((opt=getopt(argc,argv,"u:t:l:j:d:b:c:T:v"))!=-1)
+ {
+  switch(opt)
+  {
+   case 'u': path=optarg; break;
+   case 't': tcp_port=atoi(optarg); break;
+   case 'l': latency_ms=atoi(optarg); break;
+   case 'j': jitter_ms=atoi(optarg); break;
+   case 'd': drop_pct=atoi(optarg); break;
+   case 'b': bytes_per_s=atoi(optarg); break;
+   case 'c':
+    if (sscanf(optarg,"%d,%d,%d",&colour_raw[0],&colour_raw[1],&colour_raw[2])!=3) usage();
+    break;
+   case 'T':
+    if (optarg[0]<'A'||optarg[0]>'D') usage();
+    touch_motor=optarg[0]-'A';
+    break;
+   case 'v': verbose=1; break;
+   default: usage();
+  }
+ }
+ if (latency_ms<0||jitter_ms<0||drop_pct<0||drop_pct>100||bytes_per_s<0) usage();
+
+ signal(SIGPIPE,SIG_IGN);
+ srand(time(NULL));
+
+ if (tcp_port>0)
+ {
+  lfd=socket(AF_INET,SOCK_STREAM,0);
+  setsockopt(lfd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+  memset(&in,0,sizeof(in));
+  in.sin_family=AF_INET;
+  in.sin_port=htons(tcp_port);
+  in.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if (bind(lfd,(struct sockaddr *)&in,sizeof(in))<0)
+  {
+   perror("ev3emu: bind");
+   exit(1);
+  }
+  fprintf(stderr,"ev3emu: Listening on tcp:127.0.0.1:%d\n",tcp_port);
+ }
+ else
+ {
+  if (strlen(path)>=sizeof(un.sun_path)) usage();
+  lfd=socket(AF_UNIX,SOCK_STREAM,0);
+  memset(&un,0,sizeof(un));
+  un.sun_family=AF_UNIX;
+  strcpy(un.sun_path,path);
+  unlink(path);
+  if (bind(lfd,(struct sockaddr *)&un,sizeof(un))<0)
+  {
+   perror("ev3emu: bind");
+   exit(1);
+  }
+  fprintf(stderr,"ev3emu: Listening on unix:%s\n",path);
+ }
+ listen(lfd,1);
+
+ // One client at a time, the same as the brick. The simulated hardware keeps its state across
+ // connections.
+ while (1)
+ {
+  fd=accept(lfd,NULL,NULL);
+  if (fd<0)
+  {
+   if (errno==EINTR) continue;
+   perror("ev3emu: accept");
+   break;
+  }
+  if (tcp_port>0) setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+  fprintf(stderr,"ev3emu: Client connected\n");
+  serve(fd);
+ }
+ close(lfd);
+ return(0);
+}
@@ -0,0 +1,592 @@
+/***********************************************************************************************************************
+ *
+ * 	fieldsim - Headless 2D simulator of the field, our bot, a scripted opponent and the ball, for running
+ * 	the AI (roboAI.c and the estimator, unmodified) closed loop over many kickoffs, far faster than real time.
+ *
+ * 	Everything lives in rectified field image coordinates (sx x sy pixels, what the AI sees):
+ * 	  - bots are differential drives with a first order motor lag, drawn as circles for collisions, with
+ * 	    the pouch at the front: a ball that comes in straight and slow enough is caught and carried
+ * 	  - the shooter is a cam on MOTOR_SHOOT_RETRACT, the touch sensor is pressed while it is cocked, pulling
+ * 	    it past a full turn releases the kick (and the ball, if it is in the pouch)
+ * 	  - the ball rolls with friction and bounces off the walls and the bots, it is a goal once it crosses
+ * 	    a goal line inside the mouth
+ * 	  - the camera sees both bots and the ball (not while it is in the pouch) every SIM_FRAME_US, with
+ * 	    position noise and the blob direction sign ambiguity, and the AI gets the frame SIM_LATENCY_US later
+ * 	  - the sensor poller publishes touch, colour (the ball colour while it is in the pouch), gyro and
+ * 	    drive tachos at SENSOR_POLL_RATE, the control loop is ticked at CONTROL_RATE
+ *
+ * 	The BT library is replaced by btfake, the AI runs stepped (AI_stepped), and all the noise comes from a
+ * 	seeded generator, so a given seed always plays out the same way.
+ *
+ * 	The opponent (-O) is either absent, parked in front of its goal, or chases the ball and pushes it
+ * 	towards our goal. Each kickoff ends with a goal, when the AI says it is done (penalty mode) or after the
+ * 	time limit. Per kickoff results can be written as CSV (-o), and a summary is printed at the end.
+ * 	The AI's tuned constants can be set from a parameter file (-p, see AI_load_params()).
+ *
+ * 	id_coloured_blob2() needs colour calibration data, the blobs get the hues in ./colours.dat if there is
+ * 	one, made up hues otherwise, and the AI is handed the same hues (AI_set_hues()). Nothing is written, a
+ * 	colours.dat left behind would be picked up by roboSoccer on the robot.
+ *
+ * 	Usage: fieldsim [-k kickoffs] [-s seed] [-t seconds] [-m mode] [-c colour] [-O none|park|chase] [-P power]
+ * 	                [-n noise_px] [-R] [-p params] [-o results.csv] [-v]
+ *
+ * ********************************************************************************************************************/
+#include "btfake.h"
+#include <math.h>
+
+#define SIM_DT_US 2000				// Physics time step
+#define SIM_FRAME_US 33333			// Camera frame period
+#define SIM_LATENCY_US 50000			// Capture to AI delay
+#define SIM_FRAME_QUEUE 4			// Frames captured but not yet given to the AI (> latency / period)
+#define SIM_DEG_PER_PCT 10.0			// Wheel speed in deg/s per % power (EV3 large motor, as in ev3emu)
+#define SIM_MOTOR_TAU 0.08			// Motor time constant (s)
+#define SIM_PX_PER_DEG 0.6			// Ground travel (pixels) per degree of wheel rotation. The AI takes
+						// under 5 pixels a frame for being stuck, even creeping at 25%
+#define SIM_WHEEL_BASE 110.0			// Distance between the wheels (pixels)
+#define SIM_BOT_RADIUS 55.0
+#define SIM_BALL_RADIUS 18.0
+#define SIM_BALL_DECEL 150.0			// Rolling friction (pixels/s^2)
+#define SIM_WALL_BOUNCE 0.6			// Fraction of the ball speed kept bouncing off a wall
+#define SIM_BOT_BOUNCE 0.5			// Same for a bot
+#define SIM_GOAL_HALF 130.0			// Half the width of the goal mouth (pixels)
+#define SIM_POUCH_DIST 60.0			// Distance from the bot centre to a ball held in the pouch
+#define SIM_POUCH_WIDTH 22.0			// How far off the centre line the ball can enter the pouch
+#define SIM_POUCH_SPEED 250.0			// Max. speed (pixels/s) of the ball relative to the bot to be caught
+#define SIM_SHOT_SPEED 600.0			// Ball speed out of the kicker (pixels/s)
+#define SIM_CAM_COCKED 300.0			// Cam angle from which the touch sensor is pressed, it kicks at 360
+#define SIM_BOT_SIZE 1500			// Blob sizes
+#define SIM_BALL_SIZE 300
+#define SIM_END_SETTLE_US 3000000		// Time the ball gets to go in after the AI is done
+
+#define OPP_NONE 0
+#define OPP_PARK 1
+#define OPP_CHASE 2
+
+#define END_TIMEOUT 0
+#define END_GOAL_FOR 1
+#define END_GOAL_AGAINST 2
+#define END_DONE 3				// The AI finished (penalty shot taken) and the ball did not go in
+
+struct sim_bot{
+ double x, y;
+ double theta;					// Heading, image angle (atan2() of the heading vector)
+ double wl, wr;				// Wheel speeds (deg/s)
+ double tl, tr;				// Tacho counts (deg)
+ double vx, vy;				// Velocity (pixels/s)
+};
+
+struct sim_ball{
+ double x, y;
+ double vx, vy;
+ int caught;					// In our pouch
+};
+
+struct sim_frame{
+ long long t;					// Capture time
+ int n;
+ struct blob blobs[3];
+};
+
+static struct sim_bot bot[2];			// [0] the AI, [1] the opponent
+static struct sim_ball ball;
+static double cam;				// Shooter cam angle (deg)
+static int shots;
+static long long caught_us;			// Time the ball spent in the pouch this kickoff
+static int opp_mode=OPP_CHASE;
+static double opp_power=60;
+static double noise_px=1.0;
+static double hue[3];				// Blue bot, red bot, ball hues (radians) from colours.dat
+static unsigned long long rng;
+
+static double rand_u(void)
+{
+ // xorshift64*, uniform in [0,1)
+ rng^=rng>>12;
+ rng^=rng<<25;
+ rng^=rng>>27;
+ return ((rng*2685821657736338717ULL)>>11)*(1.0/9007199254740992.0);
+}
+
+static double rand_n(void)
+{
+ double u=rand_u();
+ if (u<1e-12) u=1e-12;
+ return sqrt(-2*log(u))*cos(2*PI*rand_u());
+}
+
+static double wrap(double a)
+{
+ while (a>PI) a-=2*PI;
+ while (a<-PI) a+=2*PI;
+ return a;
+}
+
+/******************************************************************************************
+ * Physics
+ * ***************************************************************************************/
+
+static void drive(struct sim_bot *b, double power_l, double power_r, double dt)
+{
+ // Differential drive. The AI's convention: the left wheel going faster turns the heading
+ // angle up (clockwise on screen)
+ double x0=b->x, y0=b->y, vl, vr, v;
+
+ b->wl+=(power_l*SIM_DEG_PER_PCT-b->wl)*dt/SIM_MOTOR_TAU;
+ b->wr+=(power_r*SIM_DEG_PER_PCT-b->wr)*dt/SIM_MOTOR_TAU;
+ b->tl+=b->wl*dt;
+ b->tr+=b->wr*dt;
+ vl=b->wl*SIM_PX_PER_DEG;
+ vr=b->wr*SIM_PX_PER_DEG;
+ v=(vl+vr)/2;
+ b->theta=wrap(b->theta+(vl-vr)/SIM_WHEEL_BASE*dt);
+ b->x+=v*cos(b->theta)*dt;
+ b->y+=v*sin(b->theta)*dt;
+
+ // Walls stop the bot, the wheels slip
+ if (b->x<SIM_BOT_RADIUS) b->x=SIM_BOT_RADIUS;
+ if (b->x>sx-SIM_BOT_RADIUS) b->x=sx-SIM_BOT_RADIUS;
+ if (b->y<SIM_BOT_RADIUS) b->y=SIM_BOT_RADIUS;
+ if (b->y>sy-SIM_BOT_RADIUS) b->y=sy-SIM_BOT_RADIUS;
+ b->vx=(b->x-x0)/dt;
+ b->vy=(b->y-y0)/dt;
+}
+
+static void bots_collide(void)
+{
+ double dx=bot[1].x-bot[0].x, dy=bot[1].y-bot[0].y, d=sqrt(dx*dx+dy*dy), push;
+ if (opp_mode==OPP_NONE||d>=2*SIM_BOT_RADIUS||d==0) return;
+ push=(2*SIM_BOT_RADIUS-d)/2;
+ bot[0].x-=dx/d*push;
+ bot[0].y-=dy/d*push;
+ bot[1].x+=dx/d*push;
+ bot[1].y+=dy/d*push;
+}
+
+static void ball_hits_bot(struct sim_bot *b, int ours)
+{
+ double dx=ball.x-b->x, dy=ball.y-b->y, d=sqrt(dx*dx+dy*dy), nx, ny, fwd, lat, rv;
+
+ if (d>=SIM_BOT_RADIUS+SIM_BALL_RADIUS||d==0) return;
+ fwd=dx*cos(b->theta)+dy*sin(b->theta);
+ lat=-dx*sin(b->theta)+dy*cos(b->theta);
+ if (ours&&fwd>0&&fabs(lat)<SIM_POUCH_WIDTH&&
+     hypot(ball.vx-b->vx,ball.vy-b->vy)<SIM_POUCH_SPEED)
+ {
+  ball.caught=1;				// Into the pouch
+  return;
+ }
+ nx=dx/d;
+ ny=dy/d;
+ ball.x=b->x+nx*(SIM_BOT_RADIUS+SIM_BALL_RADIUS);
+ ball.y=b->y+ny*(SIM_BOT_RADIUS+SIM_BALL_RADIUS);
+ rv=(ball.vx-b->vx)*nx+(ball.vy-b->vy)*ny;
+ if (rv<0)
+ {
+  ball.vx-=(1+SIM_BOT_BOUNCE)*rv*nx;
+  ball.vy-=(1+SIM_BOT_BOUNCE)*rv*ny;
+ }
+}
+
+static int ball_step(double dt)
+{
+ // Returns -1 / 1 once the ball is in the left / right goal, 0 otherwise
+ double v, fwd;
+
+ if (ball.caught)
+ {
+  // Carried in the pouch, it rolls out if the bot backs off
+  fwd=bot[0].vx*cos(bot[0].theta)+bot[0].vy*sin(bot[0].theta);
+  if (fwd<-30)
+  {
+   ball.caught=0;
+   ball.vx=0;
+   ball.vy=0;
+  }
+  else
+  {
+   ball.x=bot[0].x+SIM_POUCH_DIST*cos(bot[0].theta);
+   ball.y=bot[0].y+SIM_POUCH_DIST*sin(bot[0].theta);
+   ball.vx=bot[0].vx;
+   ball.vy=bot[0].vy;
+   return 0;
+  }
+ }
+
+ v=hypot(ball.vx,ball.vy);
+ if (v>0)
+ {
+  double nv=v-SIM_BALL_DECEL*dt;
+  if (nv<0) nv=0;
+  ball.vx*=nv/v;
+  ball.vy*=nv/v;
+ }
+ ball.x+=ball.vx*dt;
+ ball.y+=ball.vy*dt;
+
+ ball_hits_bot(&bot[0],1);
+ if (opp_mode!=OPP_NONE) ball_hits_bot(&bot[1],0);
+ if (ball.caught) return 0;
+
+ if (fabs(ball.y-sy/2)<SIM_GOAL_HALF)
+ {
+  if (ball.x<0) return -1;
+  if (ball.x>sx) return 1;
+ }
+ else
+ {
+  if (ball.x<SIM_BALL_RADIUS) {ball.x=SIM_BALL_RADIUS; ball.vx=-ball.vx*SIM_WALL_BOUNCE;}
+  if (ball.x>sx-SIM_BALL_RADIUS) {ball.x=sx-SIM_BALL_RADIUS; ball.vx=-ball.vx*SIM_WALL_BOUNCE;}
+ }
+ if (ball.y<SIM_BALL_RADIUS) {ball.y=SIM_BALL_RADIUS; ball.vy=-ball.vy*SIM_WALL_BOUNCE;}
+ if (ball.y>sy-SIM_BALL_RADIUS) {ball.y=sy-SIM_BALL_RADIUS; ball.vy=-ball.vy*SIM_WALL_BOUNCE;}
+ return 0;
+}
+
+static void shooter_step(double dt)
+{
+ // Negative power winds the cam, a full turn kicks
+ cam+=-fake_motor_power(MOTOR_SHOOT_RETRACT)*SIM_DEG_PER_PCT*dt;
+ if (cam<0) cam=0;
+ if (cam>=360)
+ {
+  cam-=360;
+  shots++;
+  if (ball.caught)
+  {
+   ball.caught=0;
+   ball.vx=bot[0].vx+SIM_SHOT_SPEED*cos(bot[0].theta);
+   ball.vy=bot[0].vy+SIM_SHOT_SPEED*sin(bot[0].theta);
+  }
+ }
+}
+
+static void opponent_powers(double goal_x, double *pl, double *pr)
+{
+ // Get behind the ball (as seen from the goal it attacks), then push it at the goal
+ double gx=goal_x, gy=sy/2, bx=ball.x-gx, by=ball.y-gy, d=hypot(bx,by), tx, ty, err, fwd, turn;
+ struct sim_bot *b=&bot[1];
+
+ if (opp_mode==OPP_PARK)
+ {
+  tx=(goal_x<sx/2)?sx-2*SIM_BOT_RADIUS:2*SIM_BOT_RADIUS;
+  ty=sy/2;
+  if (hypot(tx-b->x,ty-b->y)<20) {*pl=*pr=0; return;}
+ }
+ else
+ {
+  if (d<1) d=1;
+  tx=ball.x+bx/d*(SIM_BOT_RADIUS+SIM_BALL_RADIUS+30);
+  ty=ball.y+by/d*(SIM_BOT_RADIUS+SIM_BALL_RADIUS+30);
+  if (hypot(tx-b->x,ty-b->y)<40||hypot(ball.x-gx,ball.y-gy)+SIM_BOT_RADIUS<hypot(b->x-gx,b->y-gy)-SIM_BOT_RADIUS)
+  {
+   tx=ball.x-bx/d*50;				// Behind the ball, drive through it
+   ty=ball.y-by/d*50;
+  }
+ }
+ err=wrap(atan2(ty-b->y,tx-b->x)-b->theta);
+ fwd=opp_power*cos(err);
+ if (fwd<0) fwd=0;
+ turn=opp_power*err/PI*1.5;
+ *pl=fwd+turn;
+ *pr=fwd-turn;
+ if (*pl>100) *pl=100;
+ if (*pl<-100) *pl=-100;
+ if (*pr>100) *pr=100;
+ if (*pr<-100) *pr=-100;
+}
+
+/******************************************************************************************
+ * Camera and sensors
+ * ***************************************************************************************/
+
+static void blob_colour(struct blob *b, double h)
+{
+ // A saturated colour of hue h (radians), so id_coloured_blob2() doesn't take it for gray
+ double hd=fmod(h*180/PI+360,360)/60, f, v=200, p, q, t;
+ int i=(int)hd;
+ f=hd-i;
+ p=v*0.2;
+ q=v*(1-0.8*f);
+ t=v*(1-0.8*(1-f));
+ switch (i)
+ {
+  case 0: b->R=v; b->G=t; b->B=p; break;
+  case 1: b->R=q; b->G=v; b->B=p; break;
+  case 2: b->R=p; b->G=v; b->B=t; break;
+  case 3: b->R=p; b->G=q; b->B=v; break;
+  case 4: b->R=t; b->G=p; b->B=v; break;
+  default: b->R=v; b->G=p; b->B=q; break;
+ }
+ b->H=h;
+ b->S=0.8;
+ b->V=v;
+}
+
+static void add_blob(struct sim_frame *f, double x, double y, double theta, int size, double h)
+{
+ struct blob *b=&f->blobs[f->n];
+ memset(b,0,sizeof(struct blob));
+ b->label=f->n+1;
+ b->blobId=f->n+1;
+ b->cx=x+noise_px*rand_n();
+ b->cy=y+noise_px*rand_n();
+ b->dx=cos(theta+0.03*rand_n());
+ b->dy=sin(theta+0.03*rand_n());
+ if (b->dx<0) {b->dx=-b->dx; b->dy=-b->dy;}		// The long axis has no direction
+ b->size=size;
+ blob_colour(b,h);
+ f->n++;
+}
+
+static void capture(struct sim_frame *f, int bot_col)
+{
+ // Largest first, as blobDetect2() lists them
+ f->t=fake_now;
+ f->n=0;
+ add_blob(f,bot[0].x,bot[0].y,bot[0].theta,SIM_BOT_SIZE,hue[bot_col]);
+ if (opp_mode!=OPP_NONE) add_blob(f,bot[1].x,bot[1].y,bot[1].theta,SIM_BOT_SIZE,hue[1-bot_col]);
+ if (!ball.caught) add_blob(f,ball.x,ball.y,0,SIM_BALL_SIZE,hue[2]);
+ for (int i=0; i<f->n; i++) f->blobs[i].next=(i<f->n-1)?&f->blobs[i+1]:NULL;
+}
+
+static void publish_sensors(void)
+{
+ fake_publish(BT_SENSOR_TOUCH,cam>=SIM_CAM_COCKED,0,0,0,fake_now);
+ if (ball.caught) fake_publish(BT_SENSOR_COLOUR_RGB,60,50,40,0,fake_now);
+ else fake_publish(BT_SENSOR_COLOUR_RGB,8,8,8,0,fake_now);
+ fake_publish(BT_SENSOR_GYRO,(int)lround(bot[0].theta*180/PI),0,0,0,fake_now);
+ fake_publish(BT_SENSOR_TACHO_LEFT,(int)lround(bot[0].tl),0,0,0,fake_now);
+ fake_publish(BT_SENSOR_TACHO_RIGHT,(int)lround(bot[0].tr),0,0,0,fake_now);
+}
+
+static void load_hues(void)
+{
+ // Same file and layout id_coloured_blob2() reads, only read
+ double Mh[4]={4.0,0.0,1.0,0};
+ FILE *f=fopen("colours.dat","r");
+ if (f==NULL||fread(Mh,4*sizeof(double),1,f)!=1)
+ {
+  Mh[0]=4.0;
+  Mh[1]=0.0;
+  Mh[2]=1.0;
+  Mh[3]=0;
+ }
+ if (f!=NULL) fclose(f);
+ AI_set_hues(Mh);
+ hue[0]=Mh[0];
+ hue[1]=Mh[1];
+ hue[2]=Mh[2];
+}
+
+/******************************************************************************************
+ * Kickoffs
+ * ***************************************************************************************/
+
+static void place(int mode, int right)
+{
+ // Our bot on its half facing the other goal, the opponent mirrored, the ball near the centre
+ // (in front of the opponent's goal for a penalty)
+ double m=right?-1:1;
+ memset(bot,0,sizeof(bot));
+ bot[0].x=sx/2-m*(sx/2-150-50*rand_u());
+ bot[0].y=sy/2+(rand_u()-0.5)*300;
+ bot[0].theta=wrap((right?PI:0)+(rand_u()-0.5)*0.6);
+ bot[1].x=sx/2+m*(sx/2-150-50*rand_u());
+ bot[1].y=sy/2+(rand_u()-0.5)*300;
+ bot[1].theta=wrap((right?0:PI)+(rand_u()-0.5)*0.6);
+ memset(&ball,0,sizeof(ball));
+ if (mode==AI_PENALTY) ball.x=sx/2+m*sx/4+(rand_u()-0.5)*60;
+ else ball.x=sx/2+(rand_u()-0.5)*100;
+ ball.y=sy/2+(rand_u()-0.5)*200;
+ cam=SIM_CAM_COCKED+10;
+}
+
+static int kickoff(struct RoboAI *ai, int mode, int bot_col, int right, long long limit_us, int *frames)
+{
+ struct sim_frame queue[SIM_FRAME_QUEUE];
+ int qhead=0, qtail=0, goal, end=-1;
+ long long start, next_poll, next_tick, next_frame, settle=0;
+ long long poll_us=1000000/SENSOR_POLL_RATE, tick_us=CONTROL_RATE>0?1000000/CONTROL_RATE:0;
+ double dt=SIM_DT_US/1e6, pl, pr;
+
+ place(mode,right);
+ shots=0;
+ caught_us=0;
+ *frames=0;
+
+ // Start the AI afresh, as pressing 'r' then 't' would
+ stop_control_thread();
+ estimator_stop();
+ fake_reset();
+ publish_sensors();
+ setupAI(mode,bot_col,ai);
+ ai->DPhead=clearDP(ai->DPhead);
+
+ start=fake_now;
+ next_poll=next_tick=next_frame=fake_now;
+ while (end<0)
+ {
+  fake_now+=SIM_DT_US;
+  drive(&bot[0],fake_motor_power(MOTOR_DRIVE_LEFT),fake_motor_power(MOTOR_DRIVE_RIGHT),dt);
+  if (opp_mode!=OPP_NONE)
+  {
+   opponent_powers(right?sx:0,&pl,&pr);
+   drive(&bot[1],pl,pr,dt);
+   bots_collide();
+  }
+  shooter_step(dt);
+  goal=ball_step(dt);
+  if (ball.caught) caught_us+=SIM_DT_US;
+
+  // Which goal is ours is decided by where we start, as the AI's self-ID does
+  if (goal!=0) end=((goal>0)!=(right!=0))?END_GOAL_FOR:END_GOAL_AGAINST;
+  else if (fake_now-start>=limit_us) end=END_TIMEOUT;
+  else if (settle>0&&fake_now>=settle) end=END_DONE;
+  if (end>=0) break;
+
+  if (fake_now>=next_poll)
+  {
+   publish_sensors();
+   estimator_sample();
+   next_poll+=poll_us;
+  }
+  if (tick_us>0&&fake_now>=next_tick)
+  {
+   control_tick();
+   next_tick+=tick_us;
+  }
+  if (fake_now>=next_frame)
+  {
+   if (qhead-qtail<SIM_FRAME_QUEUE) capture(&queue[qhead++%SIM_FRAME_QUEUE],bot_col);
+   next_frame+=SIM_FRAME_US;
+  }
+  if (qtail<qhead&&fake_now>=queue[qtail%SIM_FRAME_QUEUE].t+SIM_LATENCY_US)
+  {
+   struct sim_frame *f=&queue[qtail%SIM_FRAME_QUEUE];
+   if (!fake_ai_done&&f->n>0)
+   {
+    fake_frame_begin();
+    ai->st.frame_time=f->t;
+    ai->runAI(ai,f->blobs,NULL);
+    ai->DPhead=clearDP(ai->DPhead);
+    (*frames)++;
+    if (fake_ai_done) settle=fake_now+SIM_END_SETTLE_US;
+   }
+   qtail++;
+  }
+ }
+ BT_all_stop(0);
+ return end;
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"USAGE: fieldsim [-k kickoffs] [-s seed] [-t seconds] [-m mode] [-c colour] [-O none|park|chase]\n");
+ fprintf(stderr,"                [-P power] [-n noise_px] [-R] [-p params] [-o results.csv] [-v]\n");
+ fprintf(stderr,"  -k  kickoffs to play (default 100)\n");
+ fprintf(stderr,"  -s  random seed (default 1), kickoff i uses seed+i\n");
+ fprintf(stderr,"  -t  time limit per kickoff in simulated seconds (default 60)\n");
+ fprintf(stderr,"  -m  AI mode, 0 - soccer, 1 - penalty, 2 - chase (default 0)\n");
+ fprintf(stderr,"  -c  our bot's colour, 0 - blue, 1 - red (default 0)\n");
+ fprintf(stderr,"  -O  opponent (default chase, none for penalties)\n");
+ fprintf(stderr,"  -P  opponent drive power (default 60)\n");
+ fprintf(stderr,"  -n  blob position noise, standard deviation in pixels (default 1)\n");
+ fprintf(stderr,"  -R  start on the right half\n");
+ fprintf(stderr,"  -p  load the AI parameters from a file\n");
+ fprintf(stderr,"  -o  write one line per kickoff as CSV\n");
+ fprintf(stderr,"  -v  let the AI print its messages\n");
+ exit(1);
+}
+
+int main(int argc, char **argv)
+{
+ static const char *end_name[4]={"timeout","goal_for","goal_against","done"};
+ const char *out_name=NULL;
+ int opt, kickoffs=100, mode=AI_SOCCER, bot_col=0, right=0, verbose=0, opp_set=0, frames, end;
+ int count[4]={0,0,0,0};
+ long long seed=1, t0, sim_us=0, limit_us=60000000LL, start;
+ double time_for=0;
+ long long total_frames=0;
+ struct RoboAI ai;
+ FILE *out=NULL, *report;
+
+ while ((opt=getopt(argc,argv,"k:s:t:m:c:O:P:n:Rp:o:v"))!=-1)
+  switch (opt)
+  {
+   case 'k': kickoffs=atoi(optarg); break;
+   case 's': seed=atoll(optarg); break;
+   case 't': limit_us=(long long)(atof(optarg)*1e6); break;
+   case 'm': mode=atoi(optarg); if (mode<AI_SOCCER||mode>AI_CHASE) usage(); break;
+   case 'c': bot_col=atoi(optarg); if (bot_col!=0&&bot_col!=1) usage(); break;
+   case 'O':
+    opp_set=1;
+    if (!strcmp(optarg,"none")) opp_mode=OPP_NONE;
+    else if (!strcmp(optarg,"park")) opp_mode=OPP_PARK;
+    else if (!strcmp(optarg,"chase")) opp_mode=OPP_CHASE;
+    else usage();
+    break;
+   case 'P': opp_power=atof(optarg); break;
+   case 'n': noise_px=atof(optarg); break;
+   case 'R': right=1; break;
+   case 'p':
+    if (AI_load_params(optarg)<0)
+    {
+     fprintf(stderr,"fieldsim: Unable to load the AI parameters from %s\n",optarg);
+     return 1;
+    }
+    break;
+   case 'o': out_name=optarg; break;
+   case 'v': verbose=1; break;
+   default: usage();
+  }
+ if (optind!=argc||kickoffs<1||limit_us<=0) usage();
+ if (!opp_set&&mode==AI_PENALTY) opp_mode=OPP_NONE;
+
+ if (out_name!=NULL)
+ {
+  if ((out=fopen(out_name,"w"))==NULL)
+  {
+   perror("fieldsim: Unable to create the results file");
+   return 1;
+  }
+  fprintf(out,"kickoff,seed,result,time_s,ai_frames,shots,possession_s,final_state\n");
+ }
+ load_hues();
+
+ // The AI talks a lot on stdout/stderr, only the results go out unless -v
+ report=fdopen(dup(1),"w");
+ if (!verbose)
+ {
+  freopen("/dev/null","w",stdout);
+  freopen("/dev/null","w",stderr);
+ }
+
+ AI_stepped=1;
+ memset(&ai,0,sizeof(ai));
+ fake_now=1000000;
+ t0=perf_time_us();
+ for (int k=0; k<kickoffs; k++)
+ {
+  rng=(unsigned long long)(seed+k)*0x9E3779B97F4A7C15ULL+1;
+  start=fake_now;
+  end=kickoff(&ai,mode,bot_col,right,limit_us,&frames);
+  sim_us+=fake_now-start;
+  total_frames+=frames;
+  count[end]++;
+  if (end==END_GOAL_FOR) time_for+=(fake_now-start)/1e6;
+  if (out) fprintf(out,"%d,%lld,%s,%.3f,%d,%d,%.3f,%d\n",k,seed+k,end_name[end],(fake_now-start)/1e6,frames,shots,
+                   caught_us/1e6,ai.st.state);
+ }
+ t0=perf_time_us()-t0;
+ stop_control_thread();
+ estimator_stop();
+ if (out) fclose(out);
+
+ fprintf(report,"%d kickoffs, %.0f simulated s in %.2f s (%.0fx real time, %.0f AI frames/s)\n",kickoffs,sim_us/1e6,
+         t0/1e6,t0>0?(double)sim_us/t0:0.0,t0>0?total_frames*1e6/t0:0.0);
+ fprintf(report,"scored %d (%.1f%%), conceded %d, timed out %d, done without scoring %d\n",count[END_GOAL_FOR],
+         100.0*count[END_GOAL_FOR]/kickoffs,count[END_GOAL_AGAINST],count[END_TIMEOUT],count[END_DONE]);
+ if (count[END_GOAL_FOR]>0) fprintf(report,"mean time to score %.2f s\n",time_for/count[END_GOAL_FOR]);
+ fclose(report);
+ return 0;
+}
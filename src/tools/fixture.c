@@ -0,0 +1,266 @@
+/***********************************************************************************************************************
+ *
+ * 	fixture - Fixture sets of camera frames for the vision tools, see fixture.h
+ *
+ * ********************************************************************************************************************/
+#include "fixture.h"
+#include "../imagecapture/svdDynamic.h"
+#include "../imagecapture/synthCam.h"
+
+static void alloc_buffers(void)
+{
+ // The frame buffers for the current sx,sy (a tool may go through fixture sets of different sizes)
+ free(frame_buffer);
+ free(fieldIm);
+ free(bgIm);
+ frame_buffer=(unsigned char *)calloc(sx*sy*3,sizeof(unsigned char));
+ fieldIm=(unsigned char *)calloc(sx*sy*3,sizeof(unsigned char));
+ bgIm=(unsigned char *)calloc(sx*sy*3,sizeof(unsigned char));
+}
+
+int fixture_load_frames(const char *dir, int max, unsigned char **frames)
+{
+ // Reads up to max frames of the recording into frames[], sets sx,sy from it and sizes the frame
+ // buffers to match. Returns the number of frames, or -1
+ char name[1024];
+ struct raw_file_header h;
+ struct raw_frame_header fh;
+ FILE *f;
+ int n=0;
+
+ snprintf(name,sizeof(name),"%s/frames.raw",dir);
+ f=fopen(name,"rb");
+ if (f==NULL) {fprintf(stderr,"fixture: Unable to open %s\n",name); return -1;}
+ if (fread(&h,sizeof(h),1,f)<1||memcmp(h.magic,RAW_MAGIC,sizeof(h.magic))!=0||h.pixelformat!=V4L2_PIX_FMT_YUYV)
+ {
+  fprintf(stderr,"fixture: %s is not a YUYV raw recording\n",name);
+  fclose(f);
+  return -1;
+ }
+ sx=h.width;
+ sy=h.height;
+ while (n<max&&fread(&fh,sizeof(fh),1,f)==1)
+ {
+  if (fh.bytesused<(unsigned int)(sx*sy*2))		// Short frame, the loop would skip it too
+  {
+   fseek(f,fh.bytesused,SEEK_CUR);
+   continue;
+  }
+  frames[n]=(unsigned char *)malloc(sx*sy*2);
+  if (fread(frames[n],sx*sy*2,1,f)<1) {free(frames[n]); break;}
+  fseek(f,fh.bytesused-sx*sy*2,SEEK_CUR);
+  n++;
+ }
+ fclose(f);
+ if (n==0) {fprintf(stderr,"fixture: No frames in %s\n",name); return -1;}
+ alloc_buffers();
+ return n;
+}
+
+int fixture_load_calibration(const char *dir)
+{
+ // Same files and layout as kbHandler() reads for 'g'. Needs the frames loaded first (for sx,sy)
+ char name[1024];
+ FILE *f;
+ long size;
+
+ snprintf(name,sizeof(name),"%s/Homography.dat",dir);
+ f=fopen(name,"r");
+ if (f==NULL) {fprintf(stderr,"fixture: Unable to open %s\n",name); return -1;}
+ fseek(f,0,SEEK_END);
+ size=ftell(f);
+ fseek(f,0,SEEK_SET);
+ if (size!=(long)(18*sizeof(double))+sx*sy*3)
+ {
+  fprintf(stderr,"fixture: %s is not for %dx%d frames\n",name,sx,sy);
+  fclose(f);
+  return -1;
+ }
+ free(H);
+ free(Hinv);
+ H=(double *)calloc(9,sizeof(double));
+ Hinv=(double *)calloc(9,sizeof(double));
+ fread(H,9*sizeof(double),1,f);
+ fread(Hinv,9*sizeof(double),1,f);
+ fread(bgIm,sx*sy*3*sizeof(unsigned char),1,f);
+ fclose(f);
+ gotbg=1;
+
+ snprintf(name,sizeof(name),"%s/colours.dat",dir);
+ f=fopen(name,"r");
+ if (f==NULL) {fprintf(stderr,"fixture: Unable to open %s\n",name); return -1;}
+ fread(&Mhues[0],4*sizeof(double),1,f);
+ fread(&Mrgb[0][0],4*3*sizeof(double),1,f);
+ fread(&bgThresh,sizeof(double),1,f);
+ fread(&colAngThresh,sizeof(double),1,f);
+ fread(&colThresh,sizeof(double),1,f);
+ fclose(f);
+ gotCol=1;
+
+ // No offsets is the same as imageCaptureStartup() before any height calibration
+ snprintf(name,sizeof(name),"%s/offsets.dat",dir);
+ f=fopen(name,"r");
+ if (f!=NULL)
+ {
+  fread(&adj_Y[0][0],4*sizeof(double),1,f);
+  fread(&ref_Y[0],2*sizeof(double),1,f);
+  fclose(f);
+  got_Y=3;
+ }
+ else
+ {
+  adj_Y[0][0]=adj_Y[0][1]=adj_Y[1][0]=adj_Y[1][1]=-1e6;
+  ref_Y[0]=ref_Y[1]=-1e6;
+  got_Y=0;
+ }
+ return 0;
+}
+
+int fixture_generate(const char *dir, int width, int height, int n, const char *options)
+{
+ // Fixture set from the synthetic camera: the frames, and the calibration roboSoccer would have
+ // saved for it (background averaged over 25 frames of the empty field, like the loop does). The
+ // synthetic bots are flat, the offsets are made up, a few pixels up, so the height adjustment in
+ // fieldUnwarp2() gets exercised.
+ char spec[1024], name[1024];
+ struct vdIn *cam;
+ struct raw_file_header h;
+ struct raw_frame_header fh;
+ double *U=NULL, *s=NULL, *V=NULL, *rv1=NULL;
+ unsigned int *acc;
+ FILE *f;
+
+ snprintf(spec,sizeof(spec),"synth:%dx%d,fps=0%s%s",width,height,options[0]?",":"",options);
+ cam=initCam(spec,width,height);
+ if (cam==NULL) return -1;
+ sx=cam->width;
+ sy=cam->height;
+ alloc_buffers();
+ if (mkdir(dir,0755)<0&&errno!=EEXIST)
+ {
+  fprintf(stderr,"fixture: Unable to create %s: %s\n",dir,strerror(errno));
+  return -1;
+ }
+
+ synthCamCalibration(cam->synth,Mcorners,Mhues,Mrgb);
+ free(H);
+ free(Hinv);
+ H=getH();
+ Hinv=(double *)calloc(9,sizeof(double));
+ SVD(H,3,3,&U,&s,&V,&rv1);
+ InvertMatrix(U,s,V,3,Hinv);
+ free(U);
+ free(s);
+ free(V);
+ acc=(unsigned int *)calloc(sx*sy*3,sizeof(unsigned int));
+ cam->synth->showObjects=0;
+ for (int i=0; i<25; i++)
+ {
+  getFrame(cam,sx,sy);
+  for (int j=0; j<sx*sy*3; j++) acc[j]+=frame_buffer[j];
+ }
+ cam->synth->showObjects=1;
+ for (int j=0; j<sx*sy*3; j++) bgIm[j]=(unsigned char)(acc[j]/25);
+ free(acc);
+
+ snprintf(name,sizeof(name),"%s/Homography.dat",dir);
+ f=fopen(name,"w");
+ if (f==NULL) {fprintf(stderr,"fixture: Unable to write %s\n",name); return -1;}
+ fwrite(H,9*sizeof(double),1,f);
+ fwrite(Hinv,9*sizeof(double),1,f);
+ fwrite(bgIm,sx*sy*3*sizeof(unsigned char),1,f);
+ fclose(f);
+
+ snprintf(name,sizeof(name),"%s/colours.dat",dir);
+ f=fopen(name,"w");
+ if (f==NULL) {fprintf(stderr,"fixture: Unable to write %s\n",name); return -1;}
+ fwrite(&Mhues[0],4*sizeof(double),1,f);
+ fwrite(&Mrgb[0][0],4*3*sizeof(double),1,f);
+ fwrite(&bgThresh,sizeof(double),1,f);
+ fwrite(&colAngThresh,sizeof(double),1,f);
+ fwrite(&colThresh,sizeof(double),1,f);
+ fclose(f);
+
+ ref_Y[0]=0.2*sy;
+ ref_Y[1]=0.8*sy;
+ adj_Y[0][0]=adj_Y[0][1]=ref_Y[0]-2;
+ adj_Y[1][0]=adj_Y[1][1]=ref_Y[1]-6;
+ snprintf(name,sizeof(name),"%s/offsets.dat",dir);
+ f=fopen(name,"w");
+ if (f==NULL) {fprintf(stderr,"fixture: Unable to write %s\n",name); return -1;}
+ fwrite(&adj_Y[0][0],4*sizeof(double),1,f);
+ fwrite(&ref_Y[0],2*sizeof(double),1,f);
+ fclose(f);
+ got_Y=3;
+
+ snprintf(name,sizeof(name),"%s/frames.raw",dir);
+ f=fopen(name,"wb");
+ if (f==NULL) {fprintf(stderr,"fixture: Unable to write %s\n",name); return -1;}
+ memset(&h,0,sizeof(h));
+ memcpy(h.magic,RAW_MAGIC,sizeof(h.magic));
+ h.width=sx;
+ h.height=sy;
+ h.pixelformat=V4L2_PIX_FMT_YUYV;
+ fwrite(&h,sizeof(h),1,f);
+ for (int i=0; i<n; i++)
+ {
+  uvcGrab(cam);
+  fh.timestamp_us=i*33333LL;
+  fh.sequence=i;
+  fh.bytesused=sx*sy*2;
+  fwrite(&fh,sizeof(fh),1,f);
+  fwrite(cam->framebuffer,sx*sy*2,1,f);
+ }
+ fclose(f);
+ closeCam(cam);
+
+ snprintf(name,sizeof(name),"%s/fixture.txt",dir);
+ f=fopen(name,"w");
+ if (f==NULL) {fprintf(stderr,"fixture: Unable to write %s\n",name); return -1;}
+ fprintf(f,"synth %dx%d %d %s\n",sx,sy,n,options[0]?options:"-");
+ fclose(f);
+ fprintf(stderr,"fixture: Wrote a %dx%d fixture set with %d frames to %s\n",sx,sy,n,dir);
+ return 0;
+}
+
+int fixture_ensure(const char *dir, const char *work, char *set_dir, int size)
+{
+ // Makes the fixture set in dir again from its fixture.txt if the frames aren't there. It goes in
+ // work/<name of dir> if work isn't NULL (so a source tree isn't written to), otherwise in dir.
+ // set_dir gets the directory to load the frames and calibration from.
+ char name[1024], options[1024], base[256];
+ const char *b;
+ int width, height, n, len;
+ FILE *f;
+
+ snprintf(set_dir,size,"%s",dir);
+ snprintf(name,sizeof(name),"%s/frames.raw",dir);
+ if (access(name,R_OK)==0) return 0;
+ if (work!=NULL)
+ {
+  // Name of dir, without any trailing slashes
+  len=strlen(dir);
+  while (len>1&&dir[len-1]=='/') len--;
+  for (b=dir+len; b>dir&&b[-1]!='/'; b--);
+  snprintf(base,sizeof(base),"%.*s",(int)(dir+len-b),b);
+  if (mkdir(work,0755)<0&&errno!=EEXIST)
+  {
+   fprintf(stderr,"fixture: Unable to create %s: %s\n",work,strerror(errno));
+   return -1;
+  }
+  snprintf(set_dir,size,"%s/%s",work,base);
+  snprintf(name,sizeof(name),"%s/frames.raw",set_dir);
+  if (access(name,R_OK)==0) return 0;	// Made on an earlier run
+ }
+ snprintf(name,sizeof(name),"%s/fixture.txt",dir);
+ f=fopen(name,"r");
+ if (f==NULL) {fprintf(stderr,"fixture: %s has no frames.raw, and no fixture.txt to make one from\n",dir); return -1;}
+ if (fscanf(f,"synth %dx%d %d %1023s",&width,&height,&n,options)!=4)
+ {
+  fprintf(stderr,"fixture: Can't make sense of %s\n",name);
+  fclose(f);
+  return -1;
+ }
+ fclose(f);
+ return fixture_generate(set_dir,width,height,n,strcmp(options,"-")?options:"");
+}
@@ -0,0 +1,40 @@
+/***********************************************************************************************************************
+ *
+ * 	fixture - Fixture sets of camera frames for the tools that run the vision code without a camera
+ * 	(kernbench, blobcheck). Linked with imageCapture.c, whose globals (sx, sy, frame_buffer, H, Mhues...)
+ * 	the calibration is loaded into.
+ *
+ * 	A fixture set is a directory with
+ * 	   frames.raw      a raw recording (press 'u' in roboSoccer, see uvcRecordStart())
+ * 	   Homography.dat  the H matrix and background image for the same camera and size
+ * 	   colours.dat     the colour calibration
+ * 	   offsets.dat     the bot height calibration (optional)
+ * 	i.e. a recording plus the calibration files roboSoccer wrote while it was made.
+ *
+ * 	fixture_generate() makes one from the synthetic camera instead, and notes how in fixture.txt
+ * 	("synth WxH frames options"), so fixture_ensure() can make the same set again when only fixture.txt
+ * 	(and whatever the tool keeps next to it) was kept, in a work directory of the caller's choosing.
+ *
+ * ********************************************************************************************************************/
+#ifndef __fixture_header
+#define __fixture_header
+
+#include "../imagecapture/imageCapture.h"
+
+#define FIXTURE_MAX_FRAMES 64
+
+// Vision globals from imageCapture.c
+extern int sx, sy;
+extern unsigned char *frame_buffer, *fieldIm, *bgIm;
+extern double *H, *Hinv;
+extern double Mcorners[4][2], Mhues[4], Mrgb[4][3];
+extern double bgThresh, colThresh, colAngThresh;
+extern double adj_Y[2][2], ref_Y[2];
+extern int gotbg, gotCol, got_Y;
+
+int fixture_load_frames(const char *dir, int max, unsigned char **frames);
+int fixture_load_calibration(const char *dir);
+int fixture_generate(const char *dir, int width, int height, int n, const char *options);
+int fixture_ensure(const char *dir, const char *work, char *set_dir, int size);
+
+#endif
@@ -0,0 +1,298 @@
+/***********************************************************************************************************************
+ *
+ * 	kernbench - Times each of the vision loop's hot kernels on its own, on a fixture set of recorded frames,
+ * 	and compares the results against a stored baseline, so a change to one kernel can be measured without
+ * 	the camera, the display or the rest of the loop getting in the way.
+ *
+ * 	The kernels are yuyv_to_rgb(), bgSubtract3(), fieldUnwarp2(), blobDetect2(), renderBlobs(), the
+ * 	convolve_x()/convolve_y() smoothing blobDetect2() does, rgb2hsv() over every pixel, and the display
+ * 	scaling of the frame and of the blob image (scaleToDisplay()/scaleImageToDisplay()). Each one gets
+ * 	the input it would get in the loop (prepared untimed from the fixture frames), and each call is timed
+ * 	separately. Results are the median over all calls, per call, per pixel and as throughput. Pixels are
+ * 	the frame's for all kernels except the display scaling, which writes a 1024x768 display.
+ *
+ * 	A fixture set is a raw recording and the calibration it was made with (see fixture.h). -g makes one
+ * 	from the synthetic camera, for when there are no recordings at hand.
+ *
+ * 	The results are written as JSON with -o. With -b they are compared against a baseline JSON of the
+ * 	same form, kernels more than -t percent slower per pixel than the baseline are flagged, and the exit
+ * 	status is 2 if any were. If the baseline file doesn't exist yet, the results are stored as the baseline.
+ * 	Baselines are only meaningful on the machine (and fixture set) they were made on.
+ *
+ * 	Usage: kernbench [-i iterations] [-n frames] [-b baseline.json] [-t percent] [-o results.json] fixture_dir
+ * 	       kernbench -g fixture_dir [-s WxH] [-n frames] [-S synth_options]
+ *
+ * ********************************************************************************************************************/
+#include "fixture.h"
+#include <math.h>
+
+#define BENCH_DISPLAY_PIXELS (1024*768)
+
+enum {K_YUYV, K_BGSUB, K_UNWARP, K_BLOBS, K_RENDER, K_CONVX, K_CONVY, K_HSV, K_SCALE_FRAME, K_SCALE_BLOBS, N_KERNELS};
+static const char *kernel_names[N_KERNELS]={"yuyv_to_rgb","bgSubtract3","fieldUnwarp2","blobDetect2","renderBlobs",
+					     "convolve_x","convolve_y","rgb2hsv","scaleToDisplay","scaleImageToDisplay"};
+
+struct result{
+ long long pixels;
+ int n;
+ double *ns;					// Time of each call
+ double median, ns_per_pixel, mpix_per_s;
+ double baseline;				// ns/pixel in the baseline, <0 if it has none
+};
+
+static struct result results[N_KERNELS];
+static int n_frames, iterations=10;
+static unsigned char *yuyv_frames[FIXTURE_MAX_FRAMES];
+
+static double now_ns(void)
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static void record(int k, double t0)
+{
+ results[k].ns[results[k].n++]=now_ns()-t0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+ double x=*(const double *)a, y=*(const double *)b;
+ return x<y?-1:x>y;
+}
+
+static void run(void)
+{
+ // Every kernel on every frame, iterations times, with its input set up as the loop would have it
+ struct vdIn vd;
+ unsigned char *rgb, *sub, *field, *big;
+ struct blob *blobs=NULL;
+ struct image *labIm, *blobIm, *im, *cx, *cy;
+ struct kernel *kern;
+ int nblobs;
+ double t0, sink=0;
+
+ for (int k=0; k<N_KERNELS; k++)
+ {
+  results[k].pixels=(k==K_SCALE_FRAME||k==K_SCALE_BLOBS)?BENCH_DISPLAY_PIXELS:(long long)sx*sy;
+  results[k].ns=(double *)calloc(n_frames*iterations,sizeof(double));
+  results[k].baseline=-1;
+ }
+ memset(&vd,0,sizeof(vd));
+ vd.width=sx;
+ vd.height=sy;
+ rgb=(unsigned char *)malloc(sx*sy*3);
+ sub=(unsigned char *)malloc(sx*sy*3);
+ field=(unsigned char *)malloc(sx*sy*3);
+ big=(unsigned char *)calloc(1024*1024*3,sizeof(unsigned char));
+ kern=GaussKernel(1.5);				// As in blobDetect2()
+
+ for (int f=0; f<n_frames; f++)
+ {
+  // One untimed pass to get each stage's input for this frame, and to warm the caches
+  vd.framebuffer=yuyv_frames[f];
+  yuyv_to_rgb(&vd,sx,sy);
+  memcpy(rgb,frame_buffer,sx*sy*3);
+  bgSubtract3();
+  memcpy(sub,frame_buffer,sx*sy*3);
+  fieldUnwarp2();
+  memcpy(field,fieldIm,sx*sy*3);
+  labIm=blobDetect2(&blobs,&nblobs);
+
+  for (int it=0; it<iterations; it++)
+  {
+   t0=now_ns();
+   yuyv_to_rgb(&vd,sx,sy);
+   record(K_YUYV,t0);
+
+   memcpy(frame_buffer,rgb,sx*sy*3);
+   t0=now_ns();
+   bgSubtract3();
+   record(K_BGSUB,t0);
+
+   memcpy(frame_buffer,sub,sx*sy*3);
+   t0=now_ns();
+   fieldUnwarp2();
+   record(K_UNWARP,t0);
+
+   // blobDetect2() builds a new blob list each call, keep the first one for renderBlobs()
+   struct blob *bl=NULL;
+   t0=now_ns();
+   im=blobDetect2(&bl,&nblobs);
+   record(K_BLOBS,t0);
+   deleteImage(im);
+   releaseBlobs(bl);
+
+   t0=now_ns();
+   blobIm=renderBlobs(labIm,blobs);
+   record(K_RENDER,t0);
+
+   im=imageFromBuffer(field,sx,sy,3);
+   t0=now_ns();
+   cx=convolve_x(im,kern);
+   record(K_CONVX,t0);
+   t0=now_ns();
+   cy=convolve_y(cx,kern);
+   record(K_CONVY,t0);
+   deleteImage(im);
+   deleteImage(cx);
+   deleteImage(cy);
+
+   t0=now_ns();
+   for (int p=0; p<sx*sy; p++)
+   {
+    double Hu,S,V;
+    rgb2hsv(rgb[3*p]/255.0,rgb[3*p+1]/255.0,rgb[3*p+2]/255.0,&Hu,&S,&V);
+    sink+=Hu;
+   }
+   record(K_HSV,t0);
+
+   t0=now_ns();
+   scaleToDisplay(rgb,big);
+   record(K_SCALE_FRAME,t0);
+
+   t0=now_ns();
+   scaleImageToDisplay(blobIm,big);
+   record(K_SCALE_BLOBS,t0);
+   deleteImage(blobIm);
+  }
+  deleteImage(labIm);
+ }
+ releaseBlobs(blobs);
+ if (sink==12345.678) fprintf(stderr," ");	// Keeps the rgb2hsv() loop from being optimized away
+
+ for (int k=0; k<N_KERNELS; k++)
+ {
+  struct result *r=&results[k];
+  qsort(r->ns,r->n,sizeof(double),cmp_double);
+  r->median=r->n%2?r->ns[r->n/2]:(r->ns[r->n/2-1]+r->ns[r->n/2])/2;
+  r->ns_per_pixel=r->median/r->pixels;
+  r->mpix_per_s=r->pixels/r->median*1e3;
+ }
+}
+
+static int read_baseline(const char *name)
+{
+ // Reads back what write_results() writes: one kernel per line. Returns -1 if there's no such file
+ char line[1024], kname[64];
+ char *p;
+ FILE *f;
+ int w=0, h=0;
+
+ f=fopen(name,"r");
+ if (f==NULL) return -1;
+ while (fgets(line,sizeof(line),f))
+ {
+  if ((p=strstr(line,"\"width\":"))!=NULL) w=atoi(p+8);
+  if ((p=strstr(line,"\"height\":"))!=NULL) h=atoi(p+9);
+  if (sscanf(line," \"%63[^\"]\": {",kname)!=1||(p=strstr(line,"\"ns_per_pixel\":"))==NULL) continue;
+  for (int k=0; k<N_KERNELS; k++)
+   if (!strcmp(kname,kernel_names[k])) results[k].baseline=atof(p+15);
+ }
+ fclose(f);
+ if (w!=sx||h!=sy) fprintf(stderr,"kernbench: The baseline is for %dx%d frames, these are %dx%d\n",w,h,sx,sy);
+ return 0;
+}
+
+static int write_results(const char *name, const char *fixture)
+{
+ FILE *f;
+
+ f=strcmp(name,"-")?fopen(name,"w"):stdout;
+ if (f==NULL) {fprintf(stderr,"kernbench: Unable to write %s\n",name); return -1;}
+ fprintf(f,"{\n");
+ fprintf(f," \"fixture\": \"%s\",\n",fixture);
+ fprintf(f," \"width\": %d,\n",sx);
+ fprintf(f," \"height\": %d,\n",sy);
+ fprintf(f," \"frames\": %d,\n",n_frames);
+ fprintf(f," \"iterations\": %d,\n",iterations);
+ fprintf(f," \"kernels\": {\n");
+ for (int k=0; k<N_KERNELS; k++)
+  fprintf(f,"  \"%s\": {\"pixels\": %lld, \"ns_per_call\": %.0f, \"ns_per_pixel\": %.3f, \"mpix_per_s\": %.2f}%s\n",
+	  kernel_names[k],results[k].pixels,results[k].median,results[k].ns_per_pixel,results[k].mpix_per_s,
+	  k<N_KERNELS-1?",":"");
+ fprintf(f," }\n");
+ fprintf(f,"}\n");
+ if (f!=stdout) fclose(f);
+ return 0;
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"USAGE: kernbench [-i iterations] [-n frames] [-b baseline.json] [-t percent] [-o results.json] fixture_dir\n");
+ fprintf(stderr,"       kernbench -g fixture_dir [-s WxH] [-n frames] [-S synth_options]\n");
+ fprintf(stderr,"  -i  times each kernel runs on each frame (default 10)\n");
+ fprintf(stderr,"  -n  frames to use from the recording, or to record with -g (default 8)\n");
+ fprintf(stderr,"  -b  compare against this baseline, or store the results there if it doesn't exist\n");
+ fprintf(stderr,"  -t  slowdown per pixel over the baseline that counts as a regression, percent (default 10)\n");
+ fprintf(stderr,"  -o  write the results as JSON here (- for stdout)\n");
+ fprintf(stderr,"  -g  make a fixture set from the synthetic camera in this directory\n");
+ fprintf(stderr,"  -s  frame size for -g (default 1024x768)\n");
+ fprintf(stderr,"  -S  synthetic camera options for -g, e.g. bots=4,noise=5 (see synthCam.h)\n");
+ exit(1);
+}
+
+int main(int argc, char **argv)
+{
+ const char *gen_dir=NULL, *base_name=NULL, *out_name=NULL, *options="";
+ int opt, n=8, width=1024, height=768, slower=0;
+ double tolerance=10;
+ const char *dir;
+
+ while ((opt=getopt(argc,argv,"i:n:b:t:o:g:s:S:"))!=-1)
+  switch (opt)
+  {
+   case 'i': iterations=atoi(optarg); break;
+   case 'n': n=atoi(optarg); break;
+   case 'b': base_name=optarg; break;
+   case 't': tolerance=atof(optarg); break;
+   case 'o': out_name=optarg; break;
+   case 'g': gen_dir=optarg; break;
+   case 's': if (sscanf(optarg,"%dx%d",&width,&height)!=2) usage(); break;
+   case 'S': options=optarg; break;
+   default: usage();
+  }
+ if (iterations<1||n<1||n>FIXTURE_MAX_FRAMES||width<2||height<2) usage();
+ initFrameStages();
+ if (gen_dir!=NULL) return fixture_generate(gen_dir,width,height,n,options)<0;
+ if (optind!=argc-1) usage();
+ dir=argv[optind];
+
+ n_frames=fixture_load_frames(dir,n,yuyv_frames);
+ if (n_frames<0||fixture_load_calibration(dir)<0) return 1;
+
+ fprintf(stderr,"kernbench: %d frames of %dx%d from %s, %d iterations each\n",n_frames,sx,sy,dir,iterations);
+ run();
+
+ if (base_name!=NULL&&read_baseline(base_name)<0)
+ {
+  if (write_results(base_name,dir)<0) return 1;
+  fprintf(stderr,"kernbench: No baseline yet, stored these results in %s\n",base_name);
+  base_name=NULL;
+ }
+ if (out_name!=NULL&&write_results(out_name,dir)<0) return 1;
+
+ printf("%-20s %9s %12s %9s %9s","kernel","pixels","ns/call","ns/pixel","Mpix/s");
+ if (base_name) printf(" %9s %8s","baseline","change");
+ printf("\n");
+ for (int k=0; k<N_KERNELS; k++)
+ {
+  struct result *r=&results[k];
+  printf("%-20s %9lld %12.0f %9.3f %9.2f",kernel_names[k],r->pixels,r->median,r->ns_per_pixel,r->mpix_per_s);
+  if (base_name&&r->baseline>0)
+  {
+   double change=(r->ns_per_pixel/r->baseline-1)*100;
+   printf(" %9.3f %+7.1f%%",r->baseline,change);
+   if (change>tolerance) {printf("  SLOWER"); slower++;}
+  }
+  else if (base_name) printf(" %9s","-");
+  printf("\n");
+ }
+ if (slower)
+ {
+  printf("%d kernel%s more than %.0f%% slower than the baseline\n",slower,slower>1?"s":"",tolerance);
+  return 2;
+ }
+ return 0;
+}
@@ -0,0 +1,166 @@
+/***********************************************************************************************************************
+ *
+ * 	telemetry2csv - Converts a telemetry log written by roboSoccer (TELEMETRY=<file>, or the 'y' key) to CSV
+ * 	on stdout, for a spreadsheet, gnuplot, pandas...
+ *
+ * 	Tables (-t):
+ * 	  frames  one row per frame: AI state, agent tracks, robust estimates, event bitmasks, transitions,
+ * 	          motor powers and sensor readings (default)
+ * 	  blobs   one row per blob per frame
+ * 	  motor   one row per motor command
+ *
+ * 	The log is mmap()ed, records are fixed size so -f/-n pick a range of frames without reading the rest.
+ *
+ * 	Usage: telemetry2csv [-t frames|blobs|motor] [-f first_record] [-n count] log.tlm
+ *
+ * ********************************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../telemetry.h"
+
+static const char *agent_name[3]={"self","opp","ball"};
+static const char *motor_kind[5]={"power","stop","steer","timed","all_stop"};
+
+static void print_frame(const struct telemetry_record *r)
+{
+ printf("%d,%lld,%lld,%d,%d,%d,%d,%d,%d,%d",r->frame,r->frame_time,r->log_time,r->state,r->side,r->botCol,
+        r->selfID,r->oppID,r->ballID,r->headingFused);
+ for (int k=0; k<3; k++)
+  printf(",%d,%.2f,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f",r->seen[k],r->cx[k],r->cy[k],r->vx[k],r->vy[k],
+         r->mx[k],r->my[k],r->dx[k],r->dy[k]);
+ printf(",%.3f,%.3f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f",r->robustHeadingX,r->robustHeadingY,r->robustSelfCx,
+        r->robustSelfCy,r->robustBallCx,r->robustBallCy,r->robustEnemyCx,r->robustEnemyCy);
+ printf(",0x%x,0x%x,%d,",r->events_checked,r->events_active,r->n_transitions);
+ for (int i=0; i<r->n_transitions&&i<TELEMETRY_MAX_TRANSITIONS; i++)
+  printf("%s%d>%d",i?" ":"",r->transitions[i][0],r->transitions[i][1]);
+ printf(",%d,%d,%d,%d,%d",r->motor_powers[0],r->motor_powers[1],r->motor_powers[2],r->motor_powers[3],r->n_motor);
+ for (int i=0; i<TELEMETRY_SENSORS; i++)
+ {
+  int n=(i==1)?3:1;				// The colour sensor gives R,G,B
+  for (int j=0; j<n; j++)
+   if (r->sensor_status[i]==0) printf(",%d",r->sensor_value[i][j]);
+   else printf(",");
+ }
+ printf(",%d\n",r->n_blobs);
+}
+
+static void print_blobs(const struct telemetry_record *r)
+{
+ for (int i=0; i<r->n_blobs&&i<TELEMETRY_MAX_BLOBS; i++)
+ {
+  const struct telemetry_blob *b=&r->blobs[i];
+  printf("%d,%lld,%d,%d,%d,%.2f,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%.3f,%.3f\n",r->frame,
+         r->frame_time,i,b->blobId,b->size,b->cx,b->cy,b->vx,b->vy,b->mx,b->my,b->dx,b->dy,b->R,b->G,b->B,b->H,b->S,b->V);
+ }
+}
+
+static void print_motor(const struct telemetry_record *r)
+{
+ for (int i=0; i<r->n_motor&&i<TELEMETRY_MAX_MOTOR; i++)
+ {
+  const struct telemetry_motor *m=&r->motor[i];
+  printf("%d,%lld,%lld,%s,0x%x,%d,%d\n",r->frame,r->frame_time,m->t,
+         m->kind>=0&&m->kind<5?motor_kind[m->kind]:"?",m->ports,m->a,m->b);
+ }
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"USAGE: telemetry2csv [-t frames|blobs|motor] [-f first_record] [-n count] log.tlm\n");
+ fprintf(stderr,"  -t  table to write (default frames)\n");
+ fprintf(stderr,"  -f  first record to convert (default 0)\n");
+ fprintf(stderr,"  -n  number of records to convert (default all)\n");
+ exit(1);
+}
+
+int main(int argc, char **argv)
+{
+ const char *table="frames";
+ long first=0, count=-1, n;
+ int fd, opt;
+ struct stat st;
+ unsigned char *map;
+ struct telemetry_header *h;
+
+ while ((opt=getopt(argc,argv,"t:f:n:"))!=-1)
+  switch (opt)
+  {
+   case 't': table=optarg; break;
+   case 'f': first=atol(optarg); break;
+   case 'n': count=atol(optarg); break;
+   default: usage();
+  }
+ if (optind!=argc-1||first<0) usage();
+ if (strcmp(table,"frames")&&strcmp(table,"blobs")&&strcmp(table,"motor")) usage();
+
+ fd=open(argv[optind],O_RDONLY);
+ if (fd<0||fstat(fd,&st)<0)
+ {
+  perror("telemetry2csv: Unable to open the log");
+  return 1;
+ }
+ if (st.st_size<(off_t)sizeof(struct telemetry_header))
+ {
+  fprintf(stderr,"telemetry2csv: %s is too short to be a telemetry log\n",argv[optind]);
+  return 1;
+ }
+ map=(unsigned char *)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+ if (map==MAP_FAILED)
+ {
+  perror("telemetry2csv: mmap() failed");
+  return 1;
+ }
+
+ // Only logs written with the same record layout can be read, check before trusting any offsets
+ h=(struct telemetry_header *)map;
+ if (memcmp(h->magic,TELEMETRY_MAGIC,sizeof(h->magic))!=0)
+ {
+  fprintf(stderr,"telemetry2csv: %s is not a telemetry log\n",argv[optind]);
+  return 1;
+ }
+ if (h->header_size!=sizeof(struct telemetry_header)||h->record_size!=sizeof(struct telemetry_record)||
+     h->max_blobs!=TELEMETRY_MAX_BLOBS||h->max_transitions!=TELEMETRY_MAX_TRANSITIONS||
+     h->max_motor!=TELEMETRY_MAX_MOTOR||h->sensor_count!=TELEMETRY_SENSORS)
+ {
+  fprintf(stderr,"telemetry2csv: %s was written with a different record layout (version %d, %d byte records)\n",
+          argv[optind],h->version,h->record_size);
+  return 1;
+ }
+
+ // A log cut short by a crash may end in a partial record, it is ignored
+ n=(st.st_size-h->header_size)/h->record_size;
+ if (first>n) first=n;
+ if (count<0||first+count>n) count=n-first;
+
+ if (!strcmp(table,"frames"))
+ {
+  printf("frame,frame_time_us,log_time_us,state,side,botCol,selfID,oppID,ballID,headingFused");
+  for (int k=0; k<3; k++)
+   printf(",%s_seen,%s_cx,%s_cy,%s_vx,%s_vy,%s_mx,%s_my,%s_dx,%s_dy",agent_name[k],agent_name[k],agent_name[k],
+          agent_name[k],agent_name[k],agent_name[k],agent_name[k],agent_name[k],agent_name[k]);
+  printf(",robustHeadingX,robustHeadingY,robustSelfCx,robustSelfCy,robustBallCx,robustBallCy,robustEnemyCx,robustEnemyCy");
+  printf(",events_checked,events_active,n_transitions,transitions,motor_A,motor_B,motor_C,motor_D,n_motor");
+  printf(",touch,colour_R,colour_G,colour_B,gyro,ultrasonic,tacho_left,tacho_right,n_blobs\n");
+ }
+ else if (!strcmp(table,"blobs"))
+  printf("frame,frame_time_us,index,blobId,size,cx,cy,vx,vy,mx,my,dx,dy,R,G,B,H,S,V\n");
+ else
+  printf("frame,frame_time_us,t_us,kind,ports,a,b\n");
+
+ for (long i=first; i<first+count; i++)
+ {
+  const struct telemetry_record *r=(const struct telemetry_record *)(map+h->header_size+i*h->record_size);
+  if (table[0]=='f') print_frame(r);
+  else if (table[0]=='b') print_blobs(r);
+  else print_motor(r);
+ }
+
+ munmap(map,st.st_size);
+ close(fd);
+ return 0;
+}